@@ -251,6 +251,8 @@ XLMain (int argc, char **argv)
   XLInitXdgActivation ();
   XLInitTearingControl ();
   XLInitTest ();
+  XLInitRoundTrips ();
+  XLInitLatencyTraces ();
 
   /* This has to come after the rest of the initialization.  */
   DetermineServerTime ();
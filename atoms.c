@@ -113,6 +113,7 @@ static const char *names[] =
     "_NET_WM_PING",
     "libinput Scrolling Pixel Distance",
     "_NET_ACTIVE_WINDOW",
+    "_XL_ERROR_TRAP",
 
     /* These are automatically generated from mime.txt.  */
     DirectTransferAtomNames
@@ -136,7 +137,7 @@ Atom _NET_WM_OPAQUE_REGION, _XL_BUFFER_RELEASE, _NET_WM_SYNC_REQUEST_COUNTER,
   _NET_WM_FRAME_TIMINGS, _NET_WM_BYPASS_COMPOSITOR, WM_STATE,
   _NET_WM_WINDOW_TYPE, _NET_WM_WINDOW_TYPE_MENU, _NET_WM_WINDOW_TYPE_DND,
   CONNECTOR_ID, _NET_WM_PID, _NET_WM_PING, libinput_Scrolling_Pixel_Distance,
-  _NET_ACTIVE_WINDOW;
+  _NET_ACTIVE_WINDOW, _XL_ERROR_TRAP;
 
 XrmQuark resource_quark, app_quark, QString;
 
@@ -175,7 +176,9 @@ InternAtom (const char *name)
 	return atom_table.atoms[hash][i];
     }
 
+  BeginRoundTrip ();
   atom = XInternAtom (compositor.display, name, False);
+  EndRoundTrip ("InternAtom");
 
   atom_table.atoms_length[hash] = ++bucket_length;
   atom_table.names[hash]
@@ -295,9 +298,10 @@ XLInitAtoms (void)
   _NET_WM_PING = atoms[63];
   libinput_Scrolling_Pixel_Distance = atoms[64];
   _NET_ACTIVE_WINDOW = atoms[65];
+  _XL_ERROR_TRAP = atoms[66];
 
   /* This is automatically generated.  */
-  DirectTransferAtomInit (atoms, 66);
+  DirectTransferAtomInit (atoms, 67);
 
   /* Now, initialize quarks.  */
   resource_quark = XrmPermStringToQuark (compositor.resource_name);
@@ -75,7 +75,9 @@ FreeBufferReleaseHelper (BufferReleaseHelper *helper)
   ReleaseLaterRecord *next, *last;
 
   /* Do an XSync, and then release all the records.  */
+  BeginRoundTrip ();
   XSync (compositor.display, False);
+  EndRoundTrip ("Sync");
 
   next = helper->records.next;
   while (next != &helper->records)
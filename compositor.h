@@ -22,6 +22,7 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
 
 #include <limits.h>
 
@@ -244,6 +245,10 @@ struct _SharedMemoryAttributes
 
   /* Size of the pool.  */
   size_t pool_size;
+
+  /* Pointer to data the renderer associates with the pool.  It is
+     initially NULL, and is released with RenderFreeShmPoolData.  */
+  void **pool_data;
 };
 
 struct _DmaBufAttributes
@@ -386,10 +391,21 @@ struct _RenderFuncs
   void (*composite) (RenderBuffer, RenderTarget, Operation, int, int,
 		     int, int, int, int, DrawParams *);
 
+  /* Composite each of the given boxes from the given buffer onto the
+     given target.  The arguments are: buffer, target, operation,
+     boxes, nboxes, src_x, src_y, x, y, params.  Each box is read from
+     the buffer at its position minus src_x, src_y, and drawn onto the
+     target at its position minus x, y.  This can be NULL, in which
+     case composite is called for each box.  */
+  void (*composite_boxes) (RenderBuffer, RenderTarget, Operation,
+			   pixman_box32_t *, int, int, int, int, int,
+			   DrawParams *);
+
   /* Finish rendering, and swap changes in given damage to display.
      May be NULL.  If a callback is passed and a non-NULL key is
      returned, then the rendering will not actually have finished
-     until the callback is run.  */
+     until the callback is run.  The callback is given an msc of -1
+     if the time of presentation is unknown.  */
   RenderCompletionKey (*finish_render) (RenderTarget, pixman_region32_t *,
 					RenderCompletionFunc, void *);
 
@@ -449,6 +465,11 @@ struct _RenderFuncs
   /* Cancel the given presentation callback.  */
   void (*cancel_presentation_callback) (PresentCompletionKey);
 
+  /* The estimated cost of each drawing request, and of drawing each
+     pixel, in arbitrary units.  Used to decide how damage should be
+     simplified before it is drawn.  */
+  int request_cost, pixel_cost;
+
   /* Some flags.  NeverAges means targets always preserve contents
      that were previously drawn.  */
   int flags;
@@ -508,6 +529,11 @@ struct _BufferFuncs
   /* Free a buffer created from shared memory.  */
   void (*free_shm_buffer) (RenderBuffer);
 
+  /* Free data associated with a shared memory pool by
+     buffer_from_shm.  This is called when the pool is destroyed or
+     resized.  May be NULL.  */
+  void (*free_shm_pool_data) (void *);
+
   /* Free a dma-buf buffer.  */
   void (*free_dmabuf_buffer) (RenderBuffer);
 
@@ -578,6 +604,9 @@ extern void RenderFillBoxesWithTransparency (RenderTarget, pixman_box32_t *,
 extern void RenderClearRectangle (RenderTarget, int, int, int, int);
 extern void RenderComposite (RenderBuffer, RenderTarget, Operation, int,
 			     int, int, int, int, int, DrawParams *);
+extern void RenderCompositeBoxes (RenderBuffer, RenderTarget, Operation,
+				  pixman_box32_t *, int, int, int, int,
+				  int, DrawParams *);
 extern RenderCompletionKey RenderFinishRender (RenderTarget,
 					       pixman_region32_t *,
 					       RenderCompletionFunc,
@@ -595,6 +624,7 @@ extern PresentCompletionKey RenderPresentToWindow (RenderTarget, RenderBuffer,
 extern RenderCompletionKey RenderNotifyMsc (RenderTarget, RenderCompletionFunc,
 					    void *);
 extern void RenderCancelPresentationCallback (PresentCompletionKey);
+extern void RenderGetDamageCosts (int *, int *);
 
 extern DrmFormat *RenderGetDrmFormats (int *);
 extern dev_t *RenderGetRenderDevices (int *);
@@ -608,6 +638,7 @@ extern Bool RenderValidateShmParams (uint32_t, uint32_t, uint32_t, int32_t,
 extern RenderBuffer RenderBufferFromSinglePixel (uint32_t, uint32_t, uint32_t,
 						 uint32_t, Bool *);
 extern void RenderFreeShmBuffer (RenderBuffer);
+extern void RenderFreeShmPoolData (void *);
 extern void RenderFreeDmabufBuffer (RenderBuffer);
 extern void RenderFreeSinglePixelBuffer (RenderBuffer);
 extern void RenderUpdateBufferForDamage (RenderBuffer, pixman_region32_t *,
@@ -620,6 +651,8 @@ extern Bool RenderIsBufferIdle (RenderBuffer, RenderTarget);
 extern void RenderWaitForIdle (RenderBuffer, RenderTarget);
 extern void RenderSetNeedWaitForIdle (RenderTarget);
 extern Bool RenderIsBufferOpaque (RenderBuffer);
+extern void RenderNoteUpload (uint64_t);
+extern uint64_t RenderGetUploadCount (void);
 
 /* Defined in run.c.  */
 
@@ -631,6 +664,7 @@ extern WriteFd *XLAddWriteFd (int, void *, void (*) (int, void *, ReadFd *));
 extern ReadFd *XLAddReadFd (int, void *, void (*) (int, void *, ReadFd *));
 extern void XLRemoveWriteFd (WriteFd *);
 extern void XLRemoveReadFd (ReadFd *);
+extern void XLSetFdEnabled (ReadFd *, Bool);
 
 /* Defined in alloc.c.  */
 
@@ -675,29 +709,30 @@ extern XIDList *XIDListPrepend (XIDList *, XID);
 
 struct _XLAssoc
 {
-  /* Next object in this bucket.  */
-  XLAssoc *next;
-
-  /* Last object in this bucket.  */
-  XLAssoc *prev;
-
   /* XID of the object.  */
   XID x_id;
 
-  /* Untyped data.  */
+  /* Untyped data, or NULL if this slot is empty.  */
   void *data;
 };
 
-/* Map between XID and untyped data.  Implemented the same way as the
-   old XAssocTable.  */
+/* Map between XID and untyped data.  Implemented as an open
+   addressing hash table with linear probing.  */
 
 struct _XLAssocTable
 {
-  /* Pointer to first pucket in bucket array.  */
-  XLAssoc *buckets;
+  /* Pointer to the first slot in the slot array.  */
+  XLAssoc *slots;
 
-  /* Table size (number of buckets).  */
+  /* Table size (number of slots).  Always a power of two.  */
   int size;
+
+  /* How far to shift the hash of a key to the right to obtain its
+     slot.  */
+  int shift;
+
+  /* Number of slots in use.  */
+  int count;
 };
 
 extern XLAssocTable *XLCreateAssocTable (int);
@@ -712,6 +747,8 @@ extern void XLScaleRegion (pixman_region32_t *, pixman_region32_t *,
 			   float, float);
 extern void XLExtendRegion (pixman_region32_t *, pixman_region32_t *,
 			    int, int);
+extern void XLOffsetRegion (pixman_region32_t *, pixman_region32_t *,
+			    double, double);
 extern void XLTransformRegion (pixman_region32_t *, pixman_region32_t *,
 			       BufferTransform, int, int);
 extern Time XLGetServerTimeRoundtrip (void);
@@ -780,6 +817,8 @@ extern void ExtBufferDestroy (ExtBuffer *);
 extern int render_first_error;
 
 extern void XLInitShm (void);
+extern Bool XLGetShmBufferContents (ExtBuffer *, void **, int32_t *,
+				    uint32_t *);
 
 /* Defined in subcompositor.c.  */
 
@@ -1025,6 +1064,7 @@ enum _ClientDataType
     MaxClientData,
     XdgActivationData,
     TearingControlData,
+    LatencyTraceData,
   };
 
 struct _DestroyCallback
@@ -1282,7 +1322,7 @@ extern Atom _NET_WM_OPAQUE_REGION, _XL_BUFFER_RELEASE,
   XdndFinished, _NET_WM_FRAME_TIMINGS, _NET_WM_BYPASS_COMPOSITOR, WM_STATE,
   _NET_WM_WINDOW_TYPE, _NET_WM_WINDOW_TYPE_MENU, _NET_WM_WINDOW_TYPE_DND,
   CONNECTOR_ID, _NET_WM_PID, _NET_WM_PING, libinput_Scrolling_Pixel_Distance,
-  _NET_ACTIVE_WINDOW;
+  _NET_ACTIVE_WINDOW, _XL_ERROR_TRAP;
 
 extern XrmQuark resource_quark, app_quark, QString;
 
@@ -1505,9 +1545,44 @@ extern ClientErrorData *ErrorDataForClient (struct wl_client *);
 extern void ReleaseClientData (ClientErrorData *);
 extern void ProcessPendingDisconnectClients (void);
 
+typedef struct _XErrorTrap XErrorTrap;
+
 extern void InitXErrors (void);
 extern void CatchXErrors (void);
-extern Bool UncatchXErrors (XErrorEvent *);
+extern Bool UncatchXErrorsAt (const char *, XErrorEvent *);
+extern XErrorTrap *UncatchXErrorsAsync (void (*) (XErrorEvent *, void *),
+					void *);
+extern void CancelXErrorTrap (XErrorTrap *);
+extern void ProcessXErrorTraps (void);
+extern Bool HandleOneXEventForXErrors (XEvent *);
+
+/* UncatchXErrors may sync; attribute that round trip to the function
+   that was catching errors, not to UncatchXErrors itself.  */
+#define UncatchXErrors(event)	UncatchXErrorsAt (__func__, event)
+
+/* Defined in round_trip.c.  */
+
+extern void XLInitRoundTrips (void);
+extern void XLBeginRoundTrip (void);
+extern void XLEndRoundTrip (const char *, const char *);
+extern void XLMaybeDumpRoundTrips (void);
+
+/* Record the time taken by a synchronous request made between
+   BeginRoundTrip and EndRoundTrip, attributing it to the calling
+   function.  */
+#define BeginRoundTrip()	XLBeginRoundTrip ()
+#define EndRoundTrip(request)	XLEndRoundTrip (__func__, request)
+
+/* Defined in latency.c.  */
+
+extern void XLInitLatencyTraces (void);
+extern void XLTraceCommit (Surface *);
+extern void XLTraceComposite (Surface *);
+extern void XLTraceFlush (void);
+extern void XLTracePresent (Surface *);
+extern void XLDumpSurfaceLatencies (void);
+extern void XLSendSurfaceLatencies (struct wl_resource *);
+extern void XLResetSurfaceLatencies (void);
 
 /* Defined in ewmh.c.  */
 
@@ -1666,6 +1741,8 @@ extern void XLSeatDispatchCoreKeyEvent (Seat *, Surface *, XEvent *);
 extern Seat *XLPointerGetSeat (Pointer *);
 extern void XLSeatGetMouseData (Seat *, Surface **, double *, double *,
 				double *, double *);
+extern void XLGetCursorCacheStatistics (uint64_t *, uint64_t *,
+					uint64_t *);
 extern void XLSeatLockPointer (Seat *);
 extern void XLSeatUnlockPointer (Seat *);
 extern RelativePointer *XLSeatGetRelativePointer (Seat *, struct wl_resource *);
@@ -1754,6 +1831,7 @@ extern void XLDndWriteAwarenessProperty (Window);
 extern Bool XLDndFilterClientMessage (Surface *, XEvent *);
 
 extern void XLHandleOneXEventForDnd (XEvent *);
+extern Bool XLDndProcessReplies (void);
 
 extern void XLDoDragLeave (Seat *);
 extern void XLDoDragMotion (Seat *, double, double);
@@ -1823,6 +1901,10 @@ extern void ApplyInverseTransform (int, int, Matrix *,
 				   BufferTransform);
 extern void TransformBox (pixman_box32_t *, BufferTransform, int, int);
 extern BufferTransform InvertTransform (BufferTransform);
+extern void TransformDamageRegion (pixman_region32_t *, pixman_region32_t *,
+				   DrawParams *, int, int);
+extern void ReverseTransformRegion (pixman_region32_t *, pixman_region32_t *,
+				    DrawParams *, int, int);
 
 /* Defined in wp_viewporter.c.  */
 
@@ -1878,6 +1960,7 @@ extern void ParseProcessString (const char *, char ***, size_t *);
 extern void RunProcess (ProcessQueue *, char **);
 extern ProcessQueue *MakeProcessQueue (void);
 extern int ProcessPoll (struct pollfd *, nfds_t, struct timespec *);
+extern int ProcessEpoll (int, struct epoll_event *, int, struct timespec *);
 
 /* Defined in fence_ring.c.  */
 
@@ -24,6 +24,7 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 #include "compositor.h"
 
 #include <xcb/shape.h>
+#include <xcb/xcbext.h>
 
 /* This module implements the Xdnd protocol.
 
@@ -40,15 +41,25 @@ typedef struct _DragState DragState;
 typedef struct _WindowCache WindowCache;
 typedef struct _WindowCacheEntry WindowCacheEntry;
 typedef struct _WindowCacheEntryHeader WindowCacheEntryHeader;
+typedef struct _WindowFetch WindowFetch;
+typedef struct _WindowFetchQueue WindowFetchQueue;
 
 enum
   {
-    IsMapped	   = 1,
-    IsDestroyed	   = (1 << 2),
-    IsToplevel	   = (1 << 3),
-    IsNotToplevel  = (1 << 4),
-    IsPropertyRead = (1 << 5),
-    IsShapeDirtied = (1 << 6),
+    IsMapped	      = 1,
+    IsDestroyed	      = (1 << 2),
+    IsToplevel	      = (1 << 3),
+    IsNotToplevel     = (1 << 4),
+    IsPropertyRead    = (1 << 5),
+    IsShapeDirtied    = (1 << 6),
+    IsShapePending    = (1 << 7),
+    IsPropertyPending = (1 << 8),
+    IsPropertyDirtied = (1 << 9),
+    IsMaskPending     = (1 << 10),
+    IsStatePending    = (1 << 11),
+    IsStateDirtied    = (1 << 12),
+    IsWmStatePending  = (1 << 13),
+    IsWmStateDirtied  = (1 << 14),
   };
 
 struct _DndState
@@ -137,6 +148,7 @@ enum
     SelectionFailed	 = (1 << 8),
     SelectionSet	 = (1 << 9),
     ActionListSet	 = (1 << 10),
+    TargetPending	 = (1 << 11),
   };
 
 struct _DragState
@@ -150,9 +162,6 @@ struct _DragState
   /* The seat modifier callback.  */
   void *mods_key;
 
-  /* The window cache.  */
-  WindowCache *window_cache;
-
   /* The time at which ownership of the selection was obtained.  */
   Time timestamp;
 
@@ -236,6 +245,75 @@ struct _WindowCacheEntry
 
   /* The region describing its shape.  */
   pixman_region32_t shape;
+
+  /* The next and last entries waiting for replies from the X
+     server.  */
+  WindowCacheEntry *pending_next, *pending_last;
+
+  /* Requests for the shape of the window that have not yet been
+     answered, if IsShapePending.  */
+  xcb_shape_get_rectangles_cookie_t bounding_cookie, input_cookie;
+
+  /* Requests for the XDND properties of the window, if
+     IsPropertyPending.  */
+  xcb_get_property_cookie_t proto_cookie, proxy_cookie;
+
+  /* Request for the event mask selected by the compositor on the
+     window, if IsMaskPending, or for its attributes, if
+     IsStatePending.  */
+  xcb_get_window_attributes_cookie_t attributes_cookie;
+
+  /* Requests for the geometry and children of the window, if
+     IsStatePending.  */
+  xcb_get_geometry_cookie_t geometry_cookie;
+  xcb_query_tree_cookie_t tree_cookie;
+
+  /* Request for the WM_STATE property of the window, if
+     IsWmStatePending.  */
+  xcb_get_property_cookie_t wm_state_cookie;
+};
+
+struct _WindowFetch
+{
+  /* The entry of the parent of the window.  */
+  WindowCacheEntry *parent;
+
+  /* The window being fetched.  */
+  xcb_window_t window;
+
+  /* The event mask previously selected by the compositor on the
+     window, and whether or not input has been selected on it.  */
+  unsigned long old_event_mask;
+  Bool selected;
+
+  /* Requests for the geometry, children and attributes of the
+     window.  The attributes are first requested to find
+     old_event_mask.  Once input has been selected on the window, they
+     are requested again with the rest, so that no change made after
+     its state was read can be missed.  */
+  xcb_get_geometry_cookie_t geometry;
+  xcb_query_tree_cookie_t tree;
+  xcb_get_window_attributes_cookie_t attributes;
+
+  /* Requests for its bounding and input shapes.  */
+  xcb_shape_get_rectangles_cookie_t bounding, input;
+
+  /* Request for its WM_STATE property.  */
+  xcb_get_property_cookie_t wm_state;
+};
+
+struct _WindowFetchQueue
+{
+  /* Array of windows whose information has been requested.  */
+  WindowFetch *fetches;
+
+  /* The number of fetches in that array, and its allocated
+     size.  */
+  int n_fetches, size;
+
+  /* The number of fetches that have been passed to
+     SelectWindowInput.  */
+  int n_selected;
 };
 
 /* The global drop state.  */
@@ -244,6 +322,18 @@ static DndState dnd_state;
 /* The global drag state.  */
 static DragState drag_state;
 
+/* The window cache.  It is created when the first drag starts, and
+   then kept up to date with events from the X server, so that later
+   drags do not have to walk the window tree again.  */
+static WindowCache *window_cache;
+
+/* List of window cache entries waiting for replies to requests for
+   their state, shapes or XDND properties.  Those requests are made
+   ahead of time, and their replies are read as they arrive, so that
+   neither drag motion nor windows created while the cache exists
+   make the compositor wait for the X server.  */
+static WindowCacheEntry pending_entries;
+
 /* The DataSource to which XdndFinish events will be set.  */
 static DataSource *finish_source;
 
@@ -448,7 +538,7 @@ SendStatus (void)
   CatchXErrors ();
   XSendEvent (compositor.display, dnd_state.source_window,
 	      False, NoEventMask, &event);
-  UncatchXErrors (NULL);
+  UncatchXErrorsAsync (NULL, NULL);
 }
 
 static void
@@ -697,7 +787,7 @@ RespondToDndDrop (void)
   CatchXErrors ();
   XSendEvent (compositor.display, dnd_state.source_window,
 	      False, NoEventMask, &event);
-  UncatchXErrors (NULL);
+  UncatchXErrorsAsync (NULL, NULL);
 
   /* Now that XdndFinished has been sent, the drag and drop operation
      is complete.  */
@@ -734,8 +824,10 @@ HandleDndEntry (Surface *target, Window source, Atom *targets,
   /* Retrieve the atoms inside the targets list.  */
   names = XLCalloc (ntargets, sizeof *names);
 
+  BeginRoundTrip ();
   XGetAtomNames (compositor.display, targets,
 		 ntargets, names);
+  EndRoundTrip ("GetAtomNames");
 
   /* Enter the names of the targets into the atom table so that they
      can be interned without roundtrips in the future.  */
@@ -785,11 +877,13 @@ ReadXdndTypeList (Window window, int *nitems_return)
   tmp_data = NULL;
 
   CatchXErrors ();
+  BeginRoundTrip ();
   rc = XGetWindowProperty (compositor.display, window,
 			   XdndTypeList, 0, LONG_MAX,
 			   False, XA_ATOM, &actual_type,
 			   &actual_format, &nitems,
 			   &bytes_remaining, &tmp_data);
+  EndRoundTrip ("GetWindowProperty");
   if (UncatchXErrors (NULL) || rc != Success || actual_format != 32
       || !tmp_data || actual_type != XA_ATOM || nitems < 1)
     {
@@ -970,11 +1064,13 @@ ReadDndActionList (Window window)
   tmp_data = NULL;
 
   CatchXErrors ();
+  BeginRoundTrip ();
   rc = XGetWindowProperty (compositor.display, window,
 			   XdndActionList, 0, LONG_MAX,
 			   False, XA_ATOM, &actual_type,
 			   &actual_format, &nitems,
 			   &bytes_remaining, &tmp_data);
+  EndRoundTrip ("GetWindowProperty");
   if (UncatchXErrors (NULL) || rc != Success || actual_format != 32
       || !tmp_data || actual_type != XA_ATOM || nitems < 1)
     {
@@ -1015,10 +1111,12 @@ HandleXdndPositionEvent (Surface *surface, XEvent *event)
   root_y = event->xclient.data.l[2] & 0xffff;
 
   /* Translate the coordinates to the surface's window.  */
+  BeginRoundTrip ();
   XTranslateCoordinates (compositor.display,
 			 DefaultRootWindow (compositor.display),
 			 XLWindowFromSurface (surface),
 			 root_x, root_y, &x, &y, &child);
+  EndRoundTrip ("TranslateCoordinates");
 
   action = TranslateAction (event->xclient.data.l[4]);
 
@@ -1164,8 +1262,12 @@ AddAfter (WindowCacheEntry *entry, WindowCacheEntry *after)
   after->next = entry;
 }
 
-/* Forward declaration.  */
-static void AddChildren (WindowCacheEntry *, xcb_query_tree_reply_t *);
+static void
+UnlinkWindowCacheEntry (WindowCacheEntry *entry)
+{
+  entry->last->next = entry->next;
+  entry->next->last = entry->last;
+}
 
 static void
 InitRegionWithRects (pixman_region32_t *region,
@@ -1249,15 +1351,29 @@ IntersectRegionWith (pixman_region32_t *region,
 }
 
 static void
+SetToplevelFlags (WindowCacheEntry *entry,
+		  xcb_get_property_reply_t *wm_state)
+{
+  entry->flags &= ~(IsToplevel | IsNotToplevel);
+
+  /* The window is a toplevel if WM_STATE is set on it.  */
+  if (wm_state && wm_state->type == WM_STATE
+      && wm_state->format == 32 && !wm_state->bytes_after)
+    entry->flags |= IsToplevel;
+  else
+    entry->flags |= IsNotToplevel;
+}
+
+static WindowCacheEntry *
 AddChild (WindowCacheEntry *parent, Window window,
+	  unsigned long old_event_mask,
 	  xcb_get_geometry_reply_t *geometry,
-	  xcb_query_tree_reply_t *children,
 	  xcb_get_window_attributes_reply_t *attributes,
 	  xcb_shape_get_rectangles_reply_t *bounding,
-	  xcb_shape_get_rectangles_reply_t *input)
+	  xcb_shape_get_rectangles_reply_t *input,
+	  xcb_get_property_reply_t *wm_state)
 {
   WindowCacheEntry *entry;
-  unsigned long mask;
 
   entry = XLCalloc (1, sizeof *entry);
 
@@ -1275,117 +1391,201 @@ AddChild (WindowCacheEntry *parent, Window window,
   IntersectRegionWith (&entry->shape, input);
 
   entry->cache = parent->cache;
-  entry->old_event_mask = attributes->your_event_mask;
+  entry->old_event_mask = old_event_mask;
 
   if (attributes->map_state != XCB_MAP_STATE_UNMAPPED)
     entry->flags |= IsMapped;
 
-  mask = (entry->old_event_mask
-	  | SubstructureNotifyMask
-	  | PropertyChangeMask);
+  SetToplevelFlags (entry, wm_state);
+
+  /* Insert the child in front of the window list.  */
+  AddAfter (entry, parent->children);
+
+  /* Add this child to the assoc table.  */
+  XLMakeAssoc (parent->cache->entries, window,
+	       entry);
+
+  return entry;
+}
+
+static void
+QueueWindowFetch (WindowFetchQueue *queue, WindowCacheEntry *parent,
+		  xcb_window_t window)
+{
+  WindowFetch *fetch;
+
+  if (queue->n_fetches == queue->size)
+    {
+      queue->size *= 2;
+      queue->fetches = XLRealloc (queue->fetches,
+				  sizeof *queue->fetches * queue->size);
+    }
+
+  /* Ask for the event mask currently selected on WINDOW.  The rest
+     of its state is requested by SelectWindowInput, once that reply
+     arrives.  */
+  fetch = &queue->fetches[queue->n_fetches++];
+  fetch->parent = parent;
+  fetch->window = window;
+  fetch->selected = False;
+  fetch->attributes = xcb_get_window_attributes (compositor.conn,
+						 window);
+}
+
+static void
+SelectWindowInput (WindowFetch *fetch)
+{
+  xcb_get_window_attributes_reply_t *attributes;
+  xcb_generic_error_t *error;
+
+  error = NULL;
+  attributes = xcb_get_window_attributes_reply (compositor.conn,
+						fetch->attributes,
+						&error);
+
+  if (error)
+    free (error);
+
+  if (!attributes)
+    /* The window was probably destroyed.  */
+    return;
+
+  fetch->old_event_mask = attributes->your_event_mask;
+  fetch->selected = True;
+  free (attributes);
 
   /* Select for SubstructureNotifyMask, so hierarchy events can be
      received for it and its children.  X errors should be caught
      around here.  In addition, we also ask for PropertyNotifyMask, so
      that IsToplevel/IsNotToplevel can be cleared correctly in
      response to changes of the WM_STATE property.  */
-  XSelectInput (compositor.display, window, mask);
+  XSelectInput (compositor.display, fetch->window,
+		(fetch->old_event_mask | SubstructureNotifyMask
+		 | PropertyChangeMask));
 
   /* Select for ShapeNotify events as well.  This allows us to update
      the shapes of each toplevel window along the way.  */
-  xcb_shape_select_input (compositor.conn, window, 1);
-
-  /* Insert the child in front of the window list.  */
-  AddAfter (entry, parent->children);
-
-  /* Add this child to the assoc table.  */
-  XLMakeAssoc (parent->cache->entries, window,
-	       entry);
-
-  /* Add this child's children.  */
-  AddChildren (entry, children);
+  xcb_shape_select_input (compositor.conn, fetch->window, 1);
+
+  /* Now that any later change to the window will generate an event,
+     request its state.  The replies are not read until every request
+     made before them has been issued.  */
+  fetch->geometry = xcb_get_geometry (compositor.conn, fetch->window);
+  fetch->tree = xcb_query_tree (compositor.conn, fetch->window);
+  fetch->attributes = xcb_get_window_attributes (compositor.conn,
+						 fetch->window);
+  fetch->bounding = xcb_shape_get_rectangles (compositor.conn,
+					      fetch->window,
+					      XCB_SHAPE_SK_BOUNDING);
+  fetch->input = xcb_shape_get_rectangles (compositor.conn,
+					   fetch->window,
+					   XCB_SHAPE_SK_INPUT);
+  fetch->wm_state = xcb_get_property (compositor.conn, 0, fetch->window,
+				      WM_STATE, WM_STATE, 0, 2);
 }
 
+/* Add the N_WINDOWS windows in WINDOWS, and all of their
+   descendants, as children of ENTRY.  The window tree is walked
+   breadth-first: the requests for the children of each window are
+   made as soon as its reply arrives, and before the replies for its
+   siblings and cousins are read, so the X server always has the
+   requests for an entire level of the tree and more to work on.
+   Selecting input on each level before reading its state takes one
+   more round trip, so two are made per level, instead of one per
+   window.  */
+
 static void
-AddChildren (WindowCacheEntry *entry, xcb_query_tree_reply_t *reply)
+AddWindows (WindowCacheEntry *entry, xcb_window_t *windows,
+	    int n_windows)
 {
-  xcb_window_t *windows;
-  int n_children, i;
-  xcb_get_geometry_cookie_t *geometries;
-  xcb_query_tree_cookie_t *children;
-  xcb_get_window_attributes_cookie_t *attributes;
-  xcb_shape_get_rectangles_cookie_t *boundings;
-  xcb_shape_get_rectangles_cookie_t *inputs;
+  WindowFetchQueue queue;
+  WindowFetch fetch;
+  WindowCacheEntry *child;
+  xcb_window_t *children;
+  int i, j, n_children;
   xcb_get_geometry_reply_t *geometry;
   xcb_query_tree_reply_t *tree;
   xcb_get_window_attributes_reply_t *attribute;
   xcb_shape_get_rectangles_reply_t *bounding;
   xcb_shape_get_rectangles_reply_t *input;
+  xcb_get_property_reply_t *wm_state;
   xcb_generic_error_t *error, *error1, *error2, *error3, *error4;
-  xcb_get_geometry_reply_t **all_geometries;
-  xcb_query_tree_reply_t **all_trees;
-  xcb_get_window_attributes_reply_t **all_attributes;
-  xcb_shape_get_rectangles_reply_t **all_boundings;
-  xcb_shape_get_rectangles_reply_t **all_inputs;
+  xcb_generic_error_t *error5;
+  Bool waited;
+
+  queue.size = MAX (n_windows, 64);
+  queue.n_fetches = 0;
+  queue.n_selected = 0;
+  queue.fetches = XLMalloc (sizeof *queue.fetches * queue.size);
+  waited = False;
+
+  /* First, issue all the requests for the windows themselves.  */
+  for (i = 0; i < n_windows; ++i)
+    QueueWindowFetch (&queue, entry, windows[i]);
+
+  /* Next, retrieve the replies in the order in which the requests
+     were made.  */
+  for (i = 0; i < queue.n_fetches; ++i)
+    {
+      if (i == queue.n_selected)
+	{
+	  /* Select input on every window queued since input was last
+	     selected, and request the rest of their state.  Their
+	     attributes were requested together, so this only waits
+	     for a single round trip.  */
+	  BeginRoundTrip ();
+	  while (queue.n_selected < queue.n_fetches)
+	    SelectWindowInput (&queue.fetches[queue.n_selected++]);
+	  EndRoundTrip ("GetWindowAttributes");
+
+	  /* Only the first state reply of this batch has to be
+	     waited for.  */
+	  waited = False;
+	}
 
-  error = NULL;
-  error1 = NULL;
-  error2 = NULL;
-  error3 = NULL;
-  error4 = NULL;
-
-  windows = xcb_query_tree_children (reply);
-  n_children = xcb_query_tree_children_length (reply);
-
-  /* First, issue all the requests for necessary information.  */
-  geometries = XLMalloc (sizeof *geometries * n_children);
-  children = XLMalloc (sizeof *children * n_children);
-  attributes = XLMalloc (sizeof *attributes * n_children);
-  boundings = XLMalloc (sizeof *boundings * n_children);
-  inputs = XLMalloc (sizeof *inputs * n_children);
-  all_geometries = XLCalloc (n_children, sizeof *all_geometries);
-  all_trees = XLCalloc (n_children, sizeof *all_trees);
-  all_attributes = XLCalloc (n_children, sizeof *all_attributes);
-  all_boundings = XLCalloc (n_children, sizeof *all_boundings);
-  all_inputs = XLCalloc (n_children, sizeof *all_inputs);
+      /* Copy the fetch, since adding more fetches can move the
+	 array.  */
+      fetch = queue.fetches[i];
+
+      if (!fetch.selected)
+	/* The window's attributes could not be obtained, so nothing
+	   else was requested.  */
+	continue;
+
+      error = NULL;
+      error1 = NULL;
+      error2 = NULL;
+      error3 = NULL;
+      error4 = NULL;
+      error5 = NULL;
+
+      if (!waited)
+	BeginRoundTrip ();
 
-  for (i = 0; i < n_children; ++i)
-    {
-      geometries[i] = xcb_get_geometry (compositor.conn,
-					windows[i]);
-      children[i] = xcb_query_tree (compositor.conn,
-				    windows[i]);
-      attributes[i] = xcb_get_window_attributes (compositor.conn,
-						 windows[i]);
-      boundings[i] = xcb_shape_get_rectangles (compositor.conn,
-					       windows[i],
-					       XCB_SHAPE_SK_BOUNDING);
-      inputs[i] = xcb_shape_get_rectangles (compositor.conn,
-					    windows[i],
-					    XCB_SHAPE_SK_INPUT);
-    }
-
-  /* Next, retrieve selection replies.  */
-  for (i = 0; i < n_children; ++i)
-    {
       geometry = xcb_get_geometry_reply (compositor.conn,
-					 geometries[i],
-					 &error);
-      tree = xcb_query_tree_reply (compositor.conn,
-				   children[i],
+					 fetch.geometry, &error);
+      tree = xcb_query_tree_reply (compositor.conn, fetch.tree,
 				   &error1);
       attribute = xcb_get_window_attributes_reply (compositor.conn,
-						   attributes[i],
+						   fetch.attributes,
 						   &error2);
       bounding = xcb_shape_get_rectangles_reply (compositor.conn,
-						 boundings[i],
+						 fetch.bounding,
 						 &error3);
       input = xcb_shape_get_rectangles_reply (compositor.conn,
-					      inputs[i],
-					      &error4);
+					      fetch.input, &error4);
+      wm_state = xcb_get_property_reply (compositor.conn,
+					 fetch.wm_state, &error5);
+
+      if (!waited)
+	{
+	  EndRoundTrip ("GetGeometry");
+	  waited = True;
+	}
 
-      if (error || error1 || error2 || error3 || error4
-	  || !geometry || !tree || !attribute || !bounding || !input)
+      if (error || error1 || error2 || error3 || error4 || error5
+	  || !geometry || !tree || !attribute || !bounding || !input
+	  || !wm_state)
 	{
 	  if (error)
 	    free (error);
@@ -1402,6 +1602,9 @@ AddChildren (WindowCacheEntry *entry, xcb_query_tree_reply_t *reply)
 	  if (error4)
 	    free (error4);
 
+	  if (error5)
+	    free (error5);
+
 	  if (geometry)
 	    free (geometry);
 
@@ -1417,47 +1620,38 @@ AddChildren (WindowCacheEntry *entry, xcb_query_tree_reply_t *reply)
 	  if (input)
 	    free (input);
 
-	  /* If an error occured, don't save the window.  */
+	  if (wm_state)
+	    free (wm_state);
+
+	  /* If an error occured, don't save the window.  Its children
+	     were never requested either.  */
 	  continue;
 	}
 
-      /* Save the geometry and tree replies.  */
-      all_geometries[i] = geometry;
-      all_trees[i] = tree;
-      all_attributes[i] = attribute;
-      all_boundings[i] = bounding;
-      all_inputs[i] = input;
-    }
-
-  /* And prepend all of the windows for which we got valid
-     replies.  */
-  for (i = 0; i < n_children; ++i)
-    {
-      if (!all_geometries[i])
-	continue;
-
-      AddChild (entry, windows[i], all_geometries[i],
-		all_trees[i], all_attributes[i],
-		all_boundings[i], all_inputs[i]);
-
-      free (all_geometries[i]);
-      free (all_trees[i]);
-      free (all_attributes[i]);
-      free (all_boundings[i]);
-      free (all_inputs[i]);
+      /* Prepend the window to its parent's list of children.  The
+	 windows of each parent are processed in the order they were
+	 returned by QueryTree, which is bottom-to-top, so the list
+	 ends up in top-to-bottom stacking order.  */
+      child = AddChild (fetch.parent, fetch.window,
+			fetch.old_event_mask, geometry, attribute,
+			bounding, input, wm_state);
+
+      /* Request information about the window's children.  */
+      children = xcb_query_tree_children (tree);
+      n_children = xcb_query_tree_children_length (tree);
+
+      for (j = 0; j < n_children; ++j)
+	QueueWindowFetch (&queue, child, children[j]);
+
+      free (geometry);
+      free (tree);
+      free (attribute);
+      free (bounding);
+      free (input);
+      free (wm_state);
     }
 
-  /* Free all the allocated temporary data.  */
-  XLFree (geometries);
-  XLFree (children);
-  XLFree (attributes);
-  XLFree (boundings);
-  XLFree (inputs);
-  XLFree (all_geometries);
-  XLFree (all_trees);
-  XLFree (all_attributes);
-  XLFree (all_boundings);
-  XLFree (all_inputs);
+  XLFree (queue.fetches);
 }
 
 static void
@@ -1485,9 +1679,11 @@ MakeRootWindowEntry (WindowCache *cache)
   tree_cookie = xcb_query_tree (compositor.conn, root);
 
   /* Get the replies from those requests.  */
+  BeginRoundTrip ();
   geometry = xcb_get_geometry_reply (compositor.conn, geometry_cookie,
 				     NULL);
   tree = xcb_query_tree_reply (compositor.conn, tree_cookie, NULL);
+  EndRoundTrip ("GetGeometry");
 
   if (!geometry || !tree)
     {
@@ -1519,8 +1715,9 @@ MakeRootWindowEntry (WindowCache *cache)
 
   /* Add children to this window cache.  */
   CatchXErrors ();
-  AddChildren (entry, tree);
-  UncatchXErrors (NULL);
+  AddWindows (entry, xcb_query_tree_children (tree),
+	      xcb_query_tree_children_length (tree));
+  UncatchXErrorsAsync (NULL, NULL);
 
   free (geometry);
   free (tree);
@@ -1533,260 +1730,461 @@ AllocWindowCache (void)
 
   cache = XLMalloc (sizeof *cache);
   cache->entries = XLCreateAssocTable (2048);
+
+  pending_entries.pending_next = &pending_entries;
+  pending_entries.pending_last = &pending_entries;
+
   MakeRootWindowEntry (cache);
 
   return cache;
 }
 
 static void
-FreeWindowCacheEntry (WindowCacheEntry *entry)
+LinkPendingEntry (WindowCacheEntry *entry)
 {
-  WindowCacheEntry *next, *last;
-
-  /* First, free all the children of the entry.  */
-  next = entry->children->next;
-  while (next != entry->children)
-    {
-      last = next;
-      next = next->next;
-
-      FreeWindowCacheEntry (last);
-    }
-
-  /* Remove the association.  */
-  XLDeleteAssoc (entry->cache->entries,
-		 entry->window);
-
-  /* Free the sentinel node.  */
-  XLFree (entry->children);
-
-  if (entry->last)
-    {
-      /* Unlink the entry, unless it is the root window.  */
-      entry->last->next = entry->next;
-      entry->next->last = entry->last;
-
-      if (!(entry->flags & IsDestroyed))
-	{
-	  /* Revert back to the old event mask.  */
-	  XSelectInput (compositor.display, entry->window,
-			entry->old_event_mask);
-
-	  /* Also stop selecting for ShapeNotify events.  */
-	  xcb_shape_select_input (compositor.conn,
-				  entry->window, 0);
-	}
-    }
-  else
-    /* This is the root window; stop selecting for
-       SubstructureNotifyMask.  */
-    XLDeselectInputFromRootWindow (entry->input_key);
-
-  /* Free the region.  */
-  pixman_region32_fini (&entry->shape);
+  if (entry->pending_next)
+    /* The entry is already waiting for replies.  */
+    return;
 
-  /* Free the entry itself.  */
-  XLFree (entry);
+  entry->pending_next = &pending_entries;
+  entry->pending_last = pending_entries.pending_last;
+  pending_entries.pending_last->pending_next = entry;
+  pending_entries.pending_last = entry;
 }
 
 static void
-FreeWindowCache (WindowCache *cache)
+UnlinkPendingEntry (WindowCacheEntry *entry)
 {
-  /* This prevents BadWindow errors from trying to destroy a deleted
-     entry.  */
-  CatchXErrors ();
+  if (!entry->pending_next)
+    return;
 
-  /* Free the root window.  */
-  FreeWindowCacheEntry (cache->root_window);
+  entry->pending_next->pending_last = entry->pending_last;
+  entry->pending_last->pending_next = entry->pending_next;
+  entry->pending_next = NULL;
+  entry->pending_last = NULL;
+}
 
-  UncatchXErrors (NULL);
+static void
+RequestShape (WindowCacheEntry *entry)
+{
+  if (entry->flags & IsShapePending)
+    /* A request is already in progress.  If the shape was dirtied
+       after it was made, another request will be made once the
+       reply arrives.  */
+    return;
 
-  /* And the assoc table.  */
-  XLDestroyAssocTable (cache->entries);
+  entry->bounding_cookie
+    = xcb_shape_get_rectangles (compositor.conn, entry->window,
+				XCB_SHAPE_SK_BOUNDING);
+  entry->input_cookie
+    = xcb_shape_get_rectangles (compositor.conn, entry->window,
+				XCB_SHAPE_SK_INPUT);
 
-  /* Free the cache.  */
-  XLFree (cache);
+  entry->flags &= ~IsShapeDirtied;
+  entry->flags |= IsShapePending;
+  LinkPendingEntry (entry);
 }
 
 static void
-UnlinkWindowCacheEntry (WindowCacheEntry *entry)
+RequestProtocolProperties (WindowCacheEntry *entry)
 {
-  entry->last->next = entry->next;
-  entry->next->last = entry->last;
+  if (entry->flags & (IsPropertyRead | IsPropertyPending))
+    return;
+
+  entry->proto_cookie
+    = xcb_get_property (compositor.conn, 0, entry->window, XdndAware,
+			XCB_ATOM_ATOM, 0, 1);
+  entry->proxy_cookie
+    = xcb_get_property (compositor.conn, 0, entry->window, XdndProxy,
+			XCB_ATOM_WINDOW, 0, 1);
+
+  entry->flags |= IsPropertyPending;
+  LinkPendingEntry (entry);
 }
 
 static void
-HandleCirculateNotify (WindowCache *cache, XEvent *event)
+RequestWmState (WindowCacheEntry *entry)
 {
-  WindowCacheEntry *parent, *window;
-
-  if (event->xcirculate.event == event->xcirculate.window)
-    /* This is the result of StructureNotifyMask, and the parent
-       window cannot be accessed through the event.  */
+  if (entry->flags & IsWmStatePending)
     return;
 
-  parent = XLLookUpAssoc (cache->entries, event->xcirculate.event);
+  entry->wm_state_cookie
+    = xcb_get_property (compositor.conn, 0, entry->window, WM_STATE,
+			WM_STATE, 0, 2);
 
-  if (!parent)
-    return;
+  entry->flags |= IsWmStatePending;
+  LinkPendingEntry (entry);
+}
 
-  window = XLLookUpAssoc (cache->entries, event->xcirculate.window);
+static void
+DiscardPendingReplies (WindowCacheEntry *entry)
+{
+  if (entry->flags & IsShapePending)
+    {
+      xcb_discard_reply (compositor.conn,
+			 entry->bounding_cookie.sequence);
+      xcb_discard_reply (compositor.conn,
+			 entry->input_cookie.sequence);
+    }
 
-  if (!window)
-    return;
+  if (entry->flags & IsPropertyPending)
+    {
+      xcb_discard_reply (compositor.conn,
+			 entry->proto_cookie.sequence);
+      xcb_discard_reply (compositor.conn,
+			 entry->proxy_cookie.sequence);
+    }
 
-  XLAssert (window->parent == event->xcirculate.event);
+  if (entry->flags & IsMaskPending)
+    xcb_discard_reply (compositor.conn,
+		       entry->attributes_cookie.sequence);
 
-  /* If the window has been recirculated to the top, relink it
-     immediately after the list.  Otherwise, it has been recirculated
-     to the bottom, so place it before the first element of the
-     list.  */
+  if (entry->flags & IsStatePending)
+    {
+      xcb_discard_reply (compositor.conn,
+			 entry->geometry_cookie.sequence);
+      xcb_discard_reply (compositor.conn,
+			 entry->tree_cookie.sequence);
+      xcb_discard_reply (compositor.conn,
+			 entry->attributes_cookie.sequence);
+    }
 
-  UnlinkWindowCacheEntry (window);
+  if (entry->flags & IsWmStatePending)
+    xcb_discard_reply (compositor.conn,
+		       entry->wm_state_cookie.sequence);
 
-  if (event->xcirculate.place == PlaceOnTop)
-    AddAfter (window->next, parent->children);
-  else
-    AddAfter (window->next, parent->children->last);
+  entry->flags &= ~(IsShapePending | IsPropertyPending
+		    | IsMaskPending | IsStatePending
+		    | IsWmStatePending);
+  UnlinkPendingEntry (entry);
 }
 
 static void
-HandleConfigureNotify (WindowCache *cache, XEvent *event)
+ReadShapeReplies (WindowCacheEntry *entry)
 {
-  WindowCacheEntry *window, *parent, *next;
+  xcb_shape_get_rectangles_reply_t *bounding;
+  xcb_shape_get_rectangles_reply_t *input;
+  xcb_generic_error_t *error, *error1;
+  void *reply;
 
-  if (event->xconfigure.event == event->xconfigure.window)
-    /* This is the result of StructureNotifyMask, and the parent
-       window cannot be accessed through the event.  */
+  error = NULL;
+  error1 = NULL;
+
+  /* Replies arrive in the order in which the requests were made, so
+     if the reply to the second request has arrived, so has the reply
+     to the first.  */
+  if (!xcb_poll_for_reply (compositor.conn, entry->input_cookie.sequence,
+			   &reply, &error1))
     return;
 
-  window = XLLookUpAssoc (cache->entries, event->xconfigure.window);
-  parent = XLLookUpAssoc (cache->entries, event->xconfigure.event);
+  input = reply;
+  bounding = xcb_shape_get_rectangles_reply (compositor.conn,
+					     entry->bounding_cookie,
+					     &error);
+  entry->flags &= ~IsShapePending;
 
-  /* Reinitialize the contents of the window with the new
-     information.  */
-  if (event->xconfigure.x != window->x
-      || event->xconfigure.y != window->y
-      || event->xconfigure.width != window->width
-      || event->xconfigure.height != window->height)
+  if (error || error1 || !bounding || !input)
     {
-      window->x = event->xconfigure.x;
-      window->y = event->xconfigure.y;
-      window->width = event->xconfigure.width;
-      window->height = event->xconfigure.height;
-
-      /* If the window is unshaped, then the ConfigureNotify could've
-	 changed the actual shape of the window.  Mark the shape as
-	 dirty.  */
-      pixman_region32_clear (&window->shape);
-      window->flags |= IsShapeDirtied;
-    }
+      if (error)
+	free (error);
 
-  if (!parent)
-    /* This is the root window or something like it.  */
-    return;
+      if (error1)
+	free (error1);
 
-  /* Move the window to the right place in the stacking order.  If
-     event->xconfigure.above is None, this window is at the bottom.
-     If it is anywhere else, move it there.  */
-  if (event->xconfigure.above == None)
-    {
-      if (window->last == parent->children)
-	/* This window is already at the bottom... */
-	return;
+      if (bounding)
+	free (bounding);
 
-      /* Unlink the window and relink it at the end of the parent.  */
-      UnlinkWindowCacheEntry (window);
+      if (input)
+	free (input);
 
-      /* Move the child to the end of the window list.  */
-      AddAfter (window, parent->children->last);
+      /* An error occured; the window has probably been destroyed, in
+	 which case a DestroyNotify event will arrive shortly.  Keep
+	 the last known shape until then.  */
+      return;
     }
-  else if (window->next == parent->children
-	   || window->next->window != event->xconfigure.above)
-    {
-      /* Find the item corresponding to the sibling.  */
-      next = parent->children->next;
 
-      while (next != parent->children)
-	{
-	  if (next->window == event->xconfigure.above)
-	    {
-	      /* Move the item on top of next by placing it before
-		 next.  */
-	      UnlinkWindowCacheEntry (window);
-	      AddAfter (window, next->last);
-	      break;
-	    }
+  /* Clear the region.  */
+  pixman_region32_fini (&entry->shape);
 
-	  next = next->next;
-	}
+  /* Repopulate window->shape with the new shape.  */
+  InitRegionWithRects (&entry->shape, bounding);
+  IntersectRegionWith (&entry->shape, input);
 
-      /* This shouldn't be reached if no entry was found.  I don't
-	 know what to do in this case.  */
+  /* Free the replies from the X server.  */
+  free (bounding);
+  free (input);
+
+  if (entry->flags & IsShapeDirtied)
+    /* The shape changed again after the request was made.  */
+    RequestShape (entry);
+}
+
+static Bool
+ReadPropertyReplies (WindowCacheEntry *entry)
+{
+  xcb_get_property_reply_t *proto, *proxy;
+  xcb_generic_error_t *error, *error1;
+  WindowCacheEntry *proxy_entry;
+  uint32_t *values;
+  void *reply;
+
+  error = NULL;
+  error1 = NULL;
+
+  if (!xcb_poll_for_reply (compositor.conn, entry->proxy_cookie.sequence,
+			   &reply, &error1))
+    return False;
+
+  proxy = reply;
+  proto = xcb_get_property_reply (compositor.conn, entry->proto_cookie,
+				  &error);
+  entry->flags &= ~IsPropertyPending;
+
+  /* Discard the last known values.  */
+  entry->flags &= ~(0xff << 16);
+  entry->dnd_proxy = None;
+
+  if (error || error1 || !proto || !proxy)
+    {
+      if (error)
+	free (error);
+
+      if (error1)
+	free (error1);
+
+      if (proto)
+	free (proto);
+
+      if (proxy)
+	free (proxy);
+
+      /* The window has probably been destroyed.  Treat it as not
+	 supporting XDND.  */
+      entry->flags |= IsPropertyRead;
+      return True;
     }
+
+  /* Determine if the properties are valid.  */
+  if (proto->format == 32 && proto->type == XCB_ATOM_ATOM
+      && xcb_get_property_value_length (proto) == 4)
+    {
+      /* Save the protocol version into the window flags.  Truncate
+	 values above 255.  */
+      values = xcb_get_property_value (proto);
+      entry->flags |= (values[0] & 0xff) << 16;
+    }
+
+  if (proxy->format == 32 && proxy->type == XCB_ATOM_WINDOW
+      && xcb_get_property_value_length (proxy) == 4)
+    {
+      /* Save the proxy window ID into the window cache entry.  */
+      values = xcb_get_property_value (proxy);
+      entry->dnd_proxy = values[0];
+    }
+
+  free (proto);
+  free (proxy);
+
+  if (entry->flags & IsPropertyDirtied)
+    {
+      /* The properties changed after the request was made.  Keep
+	 the values as the last known state, but ask again.  */
+      entry->flags &= ~IsPropertyDirtied;
+      RequestProtocolProperties (entry);
+    }
+  else
+    /* Mark properties as having been read.  */
+    entry->flags |= IsPropertyRead;
+
+  if (entry->dnd_proxy != None)
+    {
+      /* The properties of the proxy will be needed next.  Ask for
+	 them now.  */
+      proxy_entry = XLLookUpAssoc (entry->cache->entries,
+				   entry->dnd_proxy);
+
+      if (proxy_entry)
+	RequestProtocolProperties (proxy_entry);
+    }
+
+  return True;
+}
+
+static Bool
+ReadWmStateReply (WindowCacheEntry *entry)
+{
+  xcb_get_property_reply_t *wm_state;
+  xcb_generic_error_t *error;
+  void *reply;
+
+  error = NULL;
+
+  if (!xcb_poll_for_reply (compositor.conn,
+			   entry->wm_state_cookie.sequence,
+			   &reply, &error))
+    return False;
+
+  wm_state = reply;
+  entry->flags &= ~IsWmStatePending;
+
+  if (error)
+    /* The window has probably been destroyed.  SetToplevelFlags
+       treats it as not being a toplevel.  */
+    free (error);
+
+  if (entry->flags & IsWmStateDirtied)
+    {
+      /* WM_STATE changed after the request was made.  Ask again.  */
+      entry->flags &= ~IsWmStateDirtied;
+
+      if (wm_state)
+	free (wm_state);
+
+      RequestWmState (entry);
+      return False;
+    }
+
+  SetToplevelFlags (entry, wm_state);
+
+  if (wm_state)
+    free (wm_state);
+
+  return True;
 }
 
 static void
-HandleCreateNotify (WindowCache *cache, XEvent *event)
+RequestState (WindowCacheEntry *entry)
+{
+  entry->geometry_cookie = xcb_get_geometry (compositor.conn,
+					     entry->window);
+  entry->tree_cookie = xcb_query_tree (compositor.conn, entry->window);
+  entry->attributes_cookie
+    = xcb_get_window_attributes (compositor.conn, entry->window);
+
+  entry->flags &= ~IsStateDirtied;
+  entry->flags |= IsStatePending;
+  LinkPendingEntry (entry);
+
+  /* WM_STATE is needed to know whether or not the window is a
+     toplevel.  Ask for it now too, unless it is already known.  */
+  if (!(entry->flags & (IsToplevel | IsNotToplevel)))
+    RequestWmState (entry);
+}
+
+/* Add WINDOW as the topmost child of PARENT, without waiting for its
+   state.  The entry is linked into the stacking order immediately,
+   so that events for its siblings can be applied to it, but it is
+   only looked at once XLDndProcessReplies has read its state.  */
+
+static void
+AddPendingChild (WindowCacheEntry *parent, Window window)
+{
+  WindowCacheEntry *entry;
+
+  entry = XLCalloc (1, sizeof *entry);
+
+  entry->window = window;
+  entry->parent = parent->window;
+  entry->children = XLMalloc (sizeof (WindowCacheEntryHeader));
+  entry->children->next = entry->children;
+  entry->children->last = entry->children;
+  entry->cache = parent->cache;
+  pixman_region32_init (&entry->shape);
+
+  AddAfter (entry, parent->children);
+  XLMakeAssoc (parent->cache->entries, window, entry);
+
+  /* Ask for the event mask currently selected on the window.  Input
+     is selected once that arrives, and only then is the rest of its
+     state requested, as in SelectWindowInput.  */
+  entry->attributes_cookie
+    = xcb_get_window_attributes (compositor.conn, window);
+  entry->flags |= IsMaskPending;
+  LinkPendingEntry (entry);
+}
+
+static void
+ReadMaskReply (WindowCacheEntry *entry)
+{
+  xcb_get_window_attributes_reply_t *attributes;
+  xcb_generic_error_t *error;
+  void *reply;
+
+  error = NULL;
+
+  if (!xcb_poll_for_reply (compositor.conn,
+			   entry->attributes_cookie.sequence,
+			   &reply, &error))
+    return;
+
+  attributes = reply;
+  entry->flags &= ~IsMaskPending;
+
+  if (error || !attributes)
+    {
+      if (error)
+	free (error);
+
+      if (attributes)
+	free (attributes);
+
+      /* The window was probably destroyed, in which case a
+	 DestroyNotify event will free the entry shortly.  Input was
+	 not selected on it, so don't restore its event mask.  */
+      entry->flags |= IsDestroyed;
+      return;
+    }
+
+  entry->old_event_mask = attributes->your_event_mask;
+  free (attributes);
+
+  /* Select for the same events as SelectWindowInput.  */
+  CatchXErrors ();
+  XSelectInput (compositor.display, entry->window,
+		(entry->old_event_mask | SubstructureNotifyMask
+		 | PropertyChangeMask));
+  xcb_shape_select_input (compositor.conn, entry->window, 1);
+  UncatchXErrorsAsync (NULL, NULL);
+
+  /* Now request the state of the window.  A shape requested before
+     ShapeNotify was selected might be out of date, so request it
+     again after any such request completes.  */
+  RequestState (entry);
+  entry->flags |= IsShapeDirtied;
+  RequestShape (entry);
+}
+
+static Bool
+ReadStateReplies (WindowCacheEntry *entry)
 {
-  WindowCacheEntry *parent;
-  xcb_get_geometry_cookie_t geometry_cookie;
-  xcb_query_tree_cookie_t tree_cookie;
-  xcb_get_window_attributes_cookie_t attributes_cookie;
-  xcb_shape_get_rectangles_cookie_t bounding_cookie;
-  xcb_shape_get_rectangles_cookie_t input_cookie;
   xcb_get_geometry_reply_t *geometry;
   xcb_query_tree_reply_t *tree;
   xcb_get_window_attributes_reply_t *attributes;
-  xcb_shape_get_rectangles_reply_t *bounding;
-  xcb_shape_get_rectangles_reply_t *input;
-  xcb_generic_error_t *error, *error1, *error2, *error3, *error4;
+  xcb_generic_error_t *error, *error1, *error2;
+  WindowCacheEntry *child;
+  xcb_window_t *children;
+  int i, n_children;
+  void *reply;
 
   error = NULL;
   error1 = NULL;
   error2 = NULL;
-  error3 = NULL;
-  error4 = NULL;
-
-  parent = XLLookUpAssoc (cache->entries, event->xcreatewindow.parent);
-
-  if (!parent)
-    return;
-
-  /* If the window already exists (this can happen if AddWindow adds
-     children before we get the CreateNotify event), just return.  */
-  if (XLLookUpAssoc (cache->entries, event->xcreatewindow.window))
-    return;
 
-  /* Add the window in front of the parent.  */
-  geometry_cookie = xcb_get_geometry (compositor.conn,
-				      event->xcreatewindow.window);
-  tree_cookie = xcb_query_tree (compositor.conn,
-				event->xcreatewindow.window);
-  attributes_cookie = xcb_get_window_attributes (compositor.conn,
-						 event->xcreatewindow.window);
-  bounding_cookie = xcb_shape_get_rectangles (compositor.conn,
-					      event->xcreatewindow.window,
-					      XCB_SHAPE_SK_BOUNDING);
-  input_cookie = xcb_shape_get_rectangles (compositor.conn,
-					   event->xcreatewindow.window,
-					   XCB_SHAPE_SK_INPUT);
+  /* The attributes were requested last, so once their reply has
+     arrived, so have the others.  */
+  if (!xcb_poll_for_reply (compositor.conn,
+			   entry->attributes_cookie.sequence,
+			   &reply, &error2))
+    return False;
 
-  /* Ask for replies from the X server.  */
-  geometry = xcb_get_geometry_reply (compositor.conn, geometry_cookie,
-				     &error);
-  tree = xcb_query_tree_reply (compositor.conn, tree_cookie, &error1);
-  attributes = xcb_get_window_attributes_reply (compositor.conn,
-						attributes_cookie,
-						&error2);
-  bounding = xcb_shape_get_rectangles_reply (compositor.conn,
-					     bounding_cookie,
-					     &error3);
-  input = xcb_shape_get_rectangles_reply (compositor.conn,
-					  input_cookie, &error4);
+  attributes = reply;
+  geometry = xcb_get_geometry_reply (compositor.conn,
+				     entry->geometry_cookie, &error);
+  tree = xcb_query_tree_reply (compositor.conn, entry->tree_cookie,
+			       &error1);
+  entry->flags &= ~IsStatePending;
 
-  if (error || error1 || error2 || error3 || error4
-      || !geometry || !tree || !attributes || !bounding || !input)
+  if (error || error1 || error2 || !geometry || !tree || !attributes)
     {
       if (error)
 	free (error);
@@ -1797,12 +2195,6 @@ HandleCreateNotify (WindowCache *cache, XEvent *event)
       if (error2)
 	free (error2);
 
-      if (error3)
-	free (error3);
-
-      if (error4)
-	free (error4);
-
       if (geometry)
 	free (geometry);
 
@@ -1812,27 +2204,268 @@ HandleCreateNotify (WindowCache *cache, XEvent *event)
       if (attributes)
 	free (attributes);
 
-      if (bounding)
-	free (bounding);
-
-      if (input)
-	free (input);
+      /* The window has probably been destroyed, in which case a
+	 DestroyNotify event will free the entry shortly.  */
+      entry->flags |= IsDestroyed;
+      return False;
+    }
 
-      return;
+  if (entry->flags & IsStateDirtied)
+    {
+      /* An event for the window or its children was handled after
+	 the requests were made, so the replies might predate it.  Ask
+	 again.  */
+      free (geometry);
+      free (tree);
+      free (attributes);
+
+      RequestState (entry);
+      return False;
     }
 
-  /* Now, really add the window.  */
-  CatchXErrors ();
-  AddChild (parent, event->xcreatewindow.window, geometry,
-	    tree, attributes, bounding, input);
-  UncatchXErrors (NULL);
+  entry->x = geometry->x;
+  entry->y = geometry->y;
+  entry->width = geometry->width;
+  entry->height = geometry->height;
+
+  if (attributes->map_state != XCB_MAP_STATE_UNMAPPED)
+    entry->flags |= IsMapped;
+  else
+    entry->flags &= ~IsMapped;
+
+  /* Put the children of the window in the order returned by
+     QueryTree, which is bottom-to-top, by moving each of them to the
+     top in turn.  Children not yet in the cache are added.  */
+  children = xcb_query_tree_children (tree);
+  n_children = xcb_query_tree_children_length (tree);
+
+  for (i = 0; i < n_children; ++i)
+    {
+      child = XLLookUpAssoc (entry->cache->entries, children[i]);
+
+      if (!child)
+	AddPendingChild (entry, children[i]);
+      else if (child->parent == entry->window)
+	{
+	  UnlinkWindowCacheEntry (child);
+	  AddAfter (child, entry->children);
+	}
+    }
 
-  /* And free the reply data.  */
   free (geometry);
   free (tree);
   free (attributes);
-  free (bounding);
-  free (input);
+
+  return True;
+}
+
+/* Mark the state of WINDOW as out of date if it is being read.  */
+
+static void
+DirtyPendingState (WindowCache *cache, Window window)
+{
+  WindowCacheEntry *entry;
+
+  entry = XLLookUpAssoc (cache->entries, window);
+
+  if (entry && entry->flags & IsStatePending)
+    entry->flags |= IsStateDirtied;
+}
+
+static void
+FreeWindowCacheEntry (WindowCacheEntry *entry)
+{
+  WindowCacheEntry *next, *last;
+
+  /* First, free all the children of the entry.  */
+  next = entry->children->next;
+  while (next != entry->children)
+    {
+      last = next;
+      next = next->next;
+
+      FreeWindowCacheEntry (last);
+    }
+
+  /* Remove the association.  */
+  XLDeleteAssoc (entry->cache->entries,
+		 entry->window);
+
+  if (entry->flags & IsMaskPending)
+    /* Input has not yet been selected on the window, so there is no
+       event mask to restore.  */
+    entry->flags |= IsDestroyed;
+
+  /* Stop waiting for replies to requests made for the entry.  */
+  DiscardPendingReplies (entry);
+
+  /* Free the sentinel node.  */
+  XLFree (entry->children);
+
+  if (entry->last)
+    {
+      /* Unlink the entry, unless it is the root window.  */
+      entry->last->next = entry->next;
+      entry->next->last = entry->last;
+
+      if (!(entry->flags & IsDestroyed))
+	{
+	  /* Revert back to the old event mask.  */
+	  XSelectInput (compositor.display, entry->window,
+			entry->old_event_mask);
+
+	  /* Also stop selecting for ShapeNotify events.  */
+	  xcb_shape_select_input (compositor.conn,
+				  entry->window, 0);
+	}
+    }
+  else
+    /* This is the root window; stop selecting for
+       SubstructureNotifyMask.  */
+    XLDeselectInputFromRootWindow (entry->input_key);
+
+  /* Free the region.  */
+  pixman_region32_fini (&entry->shape);
+
+  /* Free the entry itself.  */
+  XLFree (entry);
+}
+
+static void
+HandleCirculateNotify (WindowCache *cache, XEvent *event)
+{
+  WindowCacheEntry *parent, *window;
+
+  if (event->xcirculate.event == event->xcirculate.window)
+    /* This is the result of StructureNotifyMask, and the parent
+       window cannot be accessed through the event.  */
+    return;
+
+  parent = XLLookUpAssoc (cache->entries, event->xcirculate.event);
+
+  if (!parent)
+    return;
+
+  window = XLLookUpAssoc (cache->entries, event->xcirculate.window);
+
+  if (!window)
+    return;
+
+  XLAssert (window->parent == event->xcirculate.event);
+
+  /* If the window has been recirculated to the top, relink it
+     immediately after the list.  Otherwise, it has been recirculated
+     to the bottom, so place it before the first element of the
+     list.  */
+
+  UnlinkWindowCacheEntry (window);
+
+  if (event->xcirculate.place == PlaceOnTop)
+    AddAfter (window, parent->children);
+  else
+    AddAfter (window, parent->children->last);
+}
+
+static void
+HandleConfigureNotify (WindowCache *cache, XEvent *event)
+{
+  WindowCacheEntry *window, *parent, *next;
+
+  if (event->xconfigure.event == event->xconfigure.window)
+    /* This is the result of StructureNotifyMask, and the parent
+       window cannot be accessed through the event.  */
+    return;
+
+  window = XLLookUpAssoc (cache->entries, event->xconfigure.window);
+  parent = XLLookUpAssoc (cache->entries, event->xconfigure.event);
+
+  if (!window)
+    return;
+
+  /* Reinitialize the contents of the window with the new
+     information.  */
+  window->x = event->xconfigure.x;
+  window->y = event->xconfigure.y;
+
+  if (event->xconfigure.width != window->width
+      || event->xconfigure.height != window->height)
+    {
+      window->width = event->xconfigure.width;
+      window->height = event->xconfigure.height;
+
+      /* If the window is unshaped, then the ConfigureNotify could've
+	 changed the actual shape of the window.  Mark the shape as
+	 dirty, and ask for the new shape now if a drag is in
+	 progress.  The last known shape is used until it arrives.  */
+      window->flags |= IsShapeDirtied;
+
+      if (drag_state.seat)
+	RequestShape (window);
+    }
+
+  if (!parent)
+    /* This is the root window or something like it.  */
+    return;
+
+  /* Move the window to the right place in the stacking order.  If
+     event->xconfigure.above is None, this window is at the bottom.
+     If it is anywhere else, move it there.  */
+  if (event->xconfigure.above == None)
+    {
+      if (window->last == parent->children)
+	/* This window is already at the bottom... */
+	return;
+
+      /* Unlink the window and relink it at the end of the parent.  */
+      UnlinkWindowCacheEntry (window);
+
+      /* Move the child to the end of the window list.  */
+      AddAfter (window, parent->children->last);
+    }
+  else if (window->next == parent->children
+	   || window->next->window != event->xconfigure.above)
+    {
+      /* Find the item corresponding to the sibling.  */
+      next = parent->children->next;
+
+      while (next != parent->children)
+	{
+	  if (next->window == event->xconfigure.above)
+	    {
+	      /* Move the item on top of next by placing it before
+		 next.  */
+	      UnlinkWindowCacheEntry (window);
+	      AddAfter (window, next->last);
+	      break;
+	    }
+
+	  next = next->next;
+	}
+
+      /* This shouldn't be reached if no entry was found.  I don't
+	 know what to do in this case.  */
+    }
+}
+
+static void
+HandleCreateNotify (WindowCache *cache, XEvent *event)
+{
+  WindowCacheEntry *parent;
+
+  parent = XLLookUpAssoc (cache->entries, event->xcreatewindow.parent);
+
+  if (!parent)
+    return;
+
+  /* If the window already exists (this can happen if the children of
+     its parent were read before we get the CreateNotify event), just
+     return.  */
+  if (XLLookUpAssoc (cache->entries, event->xcreatewindow.window))
+    return;
+
+  /* Add the window in front of the parent.  Its state is read
+     asynchronously.  */
+  AddPendingChild (parent, event->xcreatewindow.window);
 }
 
 static void
@@ -1863,14 +2496,25 @@ HandleReparentNotify (WindowCache *cache, XEvent *event)
     return;
 
   parent = XLLookUpAssoc (cache->entries, event->xreparent.parent);
+  window = XLLookUpAssoc (cache->entries, event->xreparent.window);
 
   if (!parent)
-    return;
+    {
+      /* The window was moved to a parent that is not in the cache,
+	 so its entry would only go stale.  Remove it.  */
+      if (window)
+	FreeWindowCacheEntry (window);
 
-  window = XLLookUpAssoc (cache->entries, event->xreparent.window);
+      return;
+    }
 
   if (!window)
-    return;
+    {
+      /* The window was moved into the cache from outside.  Add it,
+	 and then its children once its state arrives.  */
+      AddPendingChild (parent, event->xreparent.window);
+      return;
+    }
 
   /* First, unlink window.  */
   UnlinkWindowCacheEntry (window);
@@ -1878,8 +2522,9 @@ HandleReparentNotify (WindowCache *cache, XEvent *event)
   /* Next, change its parent.  */
   window->parent = event->xreparent.parent;
 
-  /* Link it onto the new parent.  */
-  AddAfter (window, parent->last);
+  /* Link it onto the top of the new parent's children, where
+     reparented windows are placed.  */
+  AddAfter (window, parent->children);
 }
 
 static void
@@ -1921,7 +2566,9 @@ HandlePropertyNotify (WindowCache *cache, XEvent *event)
 {
   WindowCacheEntry *window;
 
-  if (event->xproperty.atom != WM_STATE)
+  if (event->xproperty.atom != WM_STATE
+      && event->xproperty.atom != XdndAware
+      && event->xproperty.atom != XdndProxy)
     return;
 
   window = XLLookUpAssoc (cache->entries, event->xproperty.window);
@@ -1929,76 +2576,36 @@ HandlePropertyNotify (WindowCache *cache, XEvent *event)
   if (!window)
     return;
 
-  /* WM_STATE has changed.  Clear both IsToplevel and IsNotToplevel;
-     don't set either of those flags based on event->xproperty.state,
-     since it's not okay to read the property here.  */
-
-  window->flags &= ~(IsToplevel | IsNotToplevel);
-}
-
-static void
-EnsureShape (WindowCacheEntry *entry, Bool force)
-{
-  xcb_shape_get_rectangles_reply_t *bounding;
-  xcb_shape_get_rectangles_reply_t *input;
-  xcb_shape_get_rectangles_cookie_t bounding_cookie;
-  xcb_shape_get_rectangles_cookie_t input_cookie;
-  xcb_generic_error_t *error, *error1;
-
-  error = NULL;
-  error1 = NULL;
-
-  if (!force && !(entry->flags & IsShapeDirtied))
-    /* The shape is not dirty.  */
-    return;
-
-  /* Reinitialize the window shape.  */
-  bounding_cookie = xcb_shape_get_rectangles (compositor.conn,
-					      entry->window,
-					      XCB_SHAPE_SK_BOUNDING);
-  input_cookie = xcb_shape_get_rectangles (compositor.conn,
-					   entry->window,
-					   XCB_SHAPE_SK_INPUT);
-
-  /* Ask for replies from the X server.  */
-  bounding = xcb_shape_get_rectangles_reply (compositor.conn,
-					     bounding_cookie,
-					     &error);
-  input = xcb_shape_get_rectangles_reply (compositor.conn,
-					  input_cookie, &error1);
-
-  if (error || error1 || !bounding || !input)
+  if (event->xproperty.atom != WM_STATE)
     {
-      if (error)
-	free (error);
-
-      if (error1)
-	free (error1);
-
-      if (bounding)
-	free (bounding);
+      /* The XDND protocol version or proxy window changed.  Read them
+	 again, but keep the last known values until the replies
+	 arrive.  */
+      if (window->flags & IsPropertyPending)
+	window->flags |= IsPropertyDirtied;
+      else
+	{
+	  window->flags &= ~IsPropertyRead;
 
-      if (input)
-	free (input);
+	  if (drag_state.seat)
+	    RequestProtocolProperties (window);
+	}
 
-      /* An error occured; the window has probably been destroyed, in
-	 which case a DestroyNotify event will arrive shortly.  */
       return;
     }
 
-  /* Clear the region.  */
-  pixman_region32_fini (&entry->shape);
-
-  /* Repopulate window->shape with the new shape.  */
-  InitRegionWithRects (&entry->shape, bounding);
-  IntersectRegionWith (&entry->shape, input);
-
-  /* Free the replies from the X server.  */
-  free (bounding);
-  free (input);
+  /* WM_STATE has changed.  Clear both IsToplevel and IsNotToplevel;
+     don't set either of those flags based on event->xproperty.state,
+     since it's not okay to read the property here.  Instead, ask for
+     it again if a drag is in progress, or once the window is looked
+     at otherwise.  */
+
+  window->flags &= ~(IsToplevel | IsNotToplevel);
 
-  /* Clear the shape dirtied flag.  */
-  entry->flags &= ~IsShapeDirtied;  
+  if (window->flags & IsWmStatePending)
+    window->flags |= IsWmStateDirtied;
+  else if (drag_state.seat)
+    RequestWmState (window);
 }
 
 static void
@@ -2015,13 +2622,68 @@ HandleShapeNotify (WindowCache *cache, XEvent *event)
   if (!window)
     return;
 
-  /* Obtain the new shape from the X server.  */
-  EnsureShape (window, True);
+  /* Obtain the new shape from the X server.  Outside a drag, wait
+     until the window is looked at, since the cache outlives each
+     drag.  */
+  window->flags |= IsShapeDirtied;
+
+  if (drag_state.seat)
+    RequestShape (window);
+}
+
+static void
+DirtyPendingStates (WindowCache *cache, XEvent *event)
+{
+  Window subject;
+
+  switch (event->type)
+    {
+    case CreateNotify:
+      subject = None;
+      break;
+
+    case CirculateNotify:
+      subject = event->xcirculate.window;
+      break;
+
+    case ConfigureNotify:
+      subject = event->xconfigure.window;
+      break;
+
+    case DestroyNotify:
+      subject = event->xdestroywindow.window;
+      break;
+
+    case MapNotify:
+      subject = event->xmap.window;
+      break;
+
+    case ReparentNotify:
+      subject = event->xreparent.window;
+      break;
+
+    case UnmapNotify:
+      subject = event->xunmap.window;
+      break;
+
+    default:
+      return;
+    }
+
+  /* If the state of the window on which the event was selected, or
+     the window it describes, is being read, the replies might
+     predate the event.  Read it again once they arrive.  */
+  DirtyPendingState (cache, event->xany.window);
+
+  if (subject != None)
+    DirtyPendingState (cache, subject);
 }
 
 static void
 ProcessEventForWindowCache (WindowCache *cache, XEvent *event)
 {
+  DirtyPendingStates (cache, event);
+
   switch (event->type)
     {
     case CirculateNotify:
@@ -2062,14 +2724,8 @@ ProcessEventForWindowCache (WindowCache *cache, XEvent *event)
 }
 
 static Bool
-IsToplevelWindow (WindowCacheEntry *entry)
+IsToplevelWindow (WindowCacheEntry *entry, Bool *pending)
 {
-  unsigned long actual_size;
-  unsigned long bytes_remaining;
-  int rc, actual_format;
-  Atom actual_type;
-  unsigned char *tmp_data;
-
   if (entry->flags & IsNotToplevel)
     /* We know this isn't a toplevel window.   */
     return False;
@@ -2079,34 +2735,17 @@ IsToplevelWindow (WindowCacheEntry *entry)
     return True;
 
   /* We have not yet determined whether or not this is a toplevel
-     window.  Read the WM_STATE property to find out.  */
-  tmp_data = NULL;
-
-  CatchXErrors ();
-  rc = XGetWindowProperty (compositor.display, entry->window, WM_STATE,
-			   0, 2, False, WM_STATE, &actual_type,
-			   &actual_format, &actual_size, &bytes_remaining,
-			   &tmp_data);
-  if (UncatchXErrors (NULL) || rc != Success
-      || actual_type != WM_STATE || actual_format != 32
-      || bytes_remaining)
-    {
-      /* This means the window is not a toplevel.  */
-      entry->flags |= IsNotToplevel;
-
-      if (tmp_data)
-	XFree (tmp_data);
-      return False;
-    }
-
-  entry->flags |= IsToplevel;
-  if (tmp_data)
-    XFree (tmp_data);
-  return True;
+     window.  Ask for the WM_STATE property, and treat the window as
+     not being a toplevel until XLDndProcessReplies reads it, after
+     which the caller should look again.  */
+  RequestWmState (entry);
+  *pending = True;
+  return False;
 }
 
 static Window
-FindToplevelWindow1 (WindowCacheEntry *entry, int x, int y)
+FindToplevelWindow1 (WindowCacheEntry *entry, int x, int y,
+		     Bool *pending)
 {
   WindowCacheEntry *child;
   pixman_box32_t temp;
@@ -2115,12 +2754,23 @@ FindToplevelWindow1 (WindowCacheEntry *entry, int x, int y)
 
   while (child != entry->children)
     {
+      if (child->flags & (IsMaskPending | IsStatePending))
+	{
+	  /* The state of this window is not yet known, so it might
+	     be above the window that is found.  Skip it, but tell the
+	     caller to look again once it is known.  */
+	  *pending = True;
+	  goto next;
+	}
+
       if (XLIsWindowIconSurface (child->window)
 	  || !(child->flags & IsMapped))
 	goto next;
 
-      /* If the shape is dirtied, fetch the new shape.  */
-      EnsureShape (child, False);
+      /* If the shape is dirtied, ask for the new shape, but use the
+	 last known shape until it arrives.  */
+      if (child->flags & IsShapeDirtied)
+	RequestShape (child);
 
       /* Check if X and Y are contained by the child and its input
 	 region.  */
@@ -2130,12 +2780,12 @@ FindToplevelWindow1 (WindowCacheEntry *entry, int x, int y)
 					     y - child->y, &temp))
 	{
 	  /* If this child is already a toplevel, return it.  */
-	  if (IsToplevelWindow (child))
+	  if (IsToplevelWindow (child, pending))
 	    return child->window;
 
 	  /* Otherwise, keep looking.  */
 	  return FindToplevelWindow1 (child, x - child->x,
-				      y - child->y);
+				      y - child->y, pending);
 	}
 
     next:
@@ -2146,11 +2796,16 @@ FindToplevelWindow1 (WindowCacheEntry *entry, int x, int y)
   return None;
 }
 
+/* Find the mapped toplevel window at ROOT_X, ROOT_Y.  Set *PENDING
+   if a window that might be there is not yet known.  */
+
 static Window
-FindToplevelWindow (WindowCache *cache, int root_x, int root_y)
+FindToplevelWindow (WindowCache *cache, int root_x, int root_y,
+		    Bool *pending)
 {
   /* Find a mapped toplevel window.  */
-  return FindToplevelWindow1 (cache->root_window, root_x, root_y);
+  return FindToplevelWindow1 (cache->root_window, root_x, root_y,
+			      pending);
 }
 
 /* Drag-and-drop between Wayland and X.  */
@@ -2176,12 +2831,6 @@ FinishDrag (void)
   drag_state.seat = NULL;
   drag_state.seat_key = NULL;
 
-  if (drag_state.window_cache)
-    {
-      FreeWindowCache (drag_state.window_cache);
-      drag_state.window_cache = NULL;
-    }
-
   /* Delete the XdndTypeList property.  */
   XDeleteProperty (compositor.display, selection_transfer_window,
 		   XdndTypeList);
@@ -2210,23 +2859,20 @@ HandleDragSeatDestroy (void *data)
   FinishDrag ();
 }
 
-static void
+/* Return the XDND protocol version and proxy window of WINDOW in
+   *VERSION_RETURN and *PROXY_RETURN.  If they have not yet been
+   read, ask for them, return the last known values, and return
+   False.  */
+
+static Bool
 ReadProtocolProperties (Window window, int *version_return,
 			Window *proxy_return)
 {
   WindowCacheEntry *entry;
-  xcb_get_property_cookie_t xdnd_proto_cookie;
-  xcb_get_property_cookie_t xdnd_proxy_cookie;
-  xcb_generic_error_t *error, *error1;
-  xcb_get_property_reply_t *proto, *proxy;
-  uint32_t *values;
-
-  error = NULL;
-  error1 = NULL;
 
   /* Get the window entry corresponding to window in the window
      cache.  */
-  entry = XLLookUpAssoc (drag_state.window_cache->entries, window);
+  entry = XLLookUpAssoc (window_cache->entries, window);
 
   if (!entry)
     {
@@ -2236,88 +2882,20 @@ ReadProtocolProperties (Window window, int *version_return,
       *proxy_return = None;
 
       /* The entry is not in the window cache... */
-      return;
-    }
-
-  if (entry->flags & IsPropertyRead)
-    {
-      /* The version and proxy window were already obtained.  */
-
-      *version_return = (entry->flags >> 16) & 0xff;
-      *proxy_return = entry->dnd_proxy;
-      return;
-    }
-
-  xdnd_proto_cookie = xcb_get_property (compositor.conn, 0,
-					window, XdndAware,
-					XCB_ATOM_ATOM, 0, 1);
-  xdnd_proxy_cookie = xcb_get_property (compositor.conn, 0,
-					window, XdndProxy,
-					XCB_ATOM_WINDOW, 0, 1);
-
-  /* Ask for replies from the X server.  */
-  proto = xcb_get_property_reply (compositor.conn, xdnd_proto_cookie,
-				  &error);
-  proxy = xcb_get_property_reply (compositor.conn, xdnd_proxy_cookie,
-				  &error1);
-
-  /* If any errors occured, bail out, while freeing any data
-     allocated.  */
-  if (error || error1 || !proto || !proxy)
-    {
-      if (error)
-	free (error);
-
-      if (error1)
-	free (error1);
-
-      if (proto)
-	free (proto);
-
-      if (proxy)
-	free (proxy);
-
-      /* Store some default values before returning.  */
-      *proxy_return = None;
-      *version_return = 0;
-      return;
-    }
-
-  /* Otherwise, the properties were read.  Determine if they are
-     valid.  */
-  if (proto->format == 32 && proto->type == XCB_ATOM_ATOM
-      && xcb_get_property_value_length (proto) == 4)
-    {
-      /* Save the protocol version into the window flags.  Truncate
-	 values above 255.  */
-      values = xcb_get_property_value (proto);
-      entry->flags |= (values[0] & 0xff) << 16;
-
-      /* Return the version to the caller.  */
-      *version_return = values[0];
+      return True;
     }
-  else
-    *version_return = 0;
-
-  free (proto);
-
-  if (proxy->format == 32 && proxy->type == XCB_ATOM_WINDOW
-      && xcb_get_property_value_length (proxy) == 4)
-    {
-      /* Save the proxy window ID into the window cache entry.  */
-      values = xcb_get_property_value (proxy);
-      entry->dnd_proxy = values[0];
 
-      /* Return the proxy to the caller.  */
-      *proxy_return = values[0];
-    }
-  else
-    *proxy_return = None;
+  *version_return = (entry->flags >> 16) & 0xff;
+  *proxy_return = entry->dnd_proxy;
 
-  free (proxy);
+  if (entry->flags & IsPropertyRead)
+    /* The version and proxy window were already obtained.  */
+    return True;
 
-  /* Mark properties as having been read.  */
-  entry->flags |= IsPropertyRead;
+  /* Otherwise, ask for them.  The drag target is updated once the
+     replies arrive.  */
+  RequestProtocolProperties (entry);
+  return False;
 }
 
 static void
@@ -2484,7 +3062,7 @@ SendEnter (void)
   CatchXErrors ();
   XSendEvent (compositor.display, drag_state.target,
 	      False, NoEventMask, &message);
-  UncatchXErrors (NULL);
+  UncatchXErrorsAsync (NULL, NULL);
 }
 
 static Atom
@@ -2611,7 +3189,7 @@ SendPosition (short root_x, short root_y)
   CatchXErrors ();
   XSendEvent (compositor.display, drag_state.target,
 	      False, NoEventMask, &message);
-  UncatchXErrors (NULL);
+  UncatchXErrorsAsync (NULL, NULL);
 
   /* Now wait for an XdndStatus to be sent in reply.  */
   drag_state.flags |= WaitingForStatus;
@@ -2647,7 +3225,7 @@ SendLeave (void)
   CatchXErrors ();
   XSendEvent (compositor.display, drag_state.target,
 	      False, NoEventMask, &message);
-  UncatchXErrors (NULL);
+  UncatchXErrorsAsync (NULL, NULL);
 }
 
 static const char *
@@ -2862,7 +3440,7 @@ SendDrop (void)
   CatchXErrors ();
   XSendEvent (compositor.display, drag_state.target,
 	      False, NoEventMask, &message);
-  UncatchXErrors (NULL);
+  UncatchXErrorsAsync (NULL, NULL);
 
   /* Tell the source to start waiting for finish.  */
   XLDataSourceSendDropPerformed (finish_source);
@@ -2889,9 +3467,8 @@ HandleModifiersChanged (unsigned int effective, void *data)
 void
 XLHandleOneXEventForDnd (XEvent *event)
 {
-  if (drag_state.window_cache)
-    ProcessEventForWindowCache (drag_state.window_cache,
-				event);
+  if (window_cache)
+    ProcessEventForWindowCache (window_cache, event);
 
   if (drag_state.seat && event->type == ClientMessage)
     ProcessClientMessage (event);
@@ -2915,17 +3492,113 @@ XLDoDragLeave (Seat *seat)
       drag_state.flags &= ~PendingPosition;
       drag_state.flags &= ~PendingDrop;
       drag_state.flags &= ~WaitingForStatus;
+      drag_state.flags &= ~TargetPending;
 
       /* Report the changed state to the source.  */
       ReportStateToSource ();
     }
 }
 
-void
-XLDoDragMotion (Seat *seat, double root_x, double root_y)
+static void
+UpdateDragTarget (int root_x, int root_y, Bool force)
 {
   Window toplevel, proxy, self;
   int version, proxy_version;
+  Bool pending;
+
+  version = 0;
+  proxy = None;
+  pending = False;
+  toplevel = FindToplevelWindow (window_cache, root_x, root_y,
+				 &pending);
+
+  if (XLIsXdgToplevel (toplevel))
+    /* If this one of our own surfaces, ignore it.  */
+    toplevel = None;
+
+  if (toplevel && (force || toplevel != drag_state.toplevel))
+    {
+      /* Try to determine whether or not the given toplevel supports
+	 XDND, and whether or not a proxy is set.  If that is not yet
+	 known, the last known values are used, and the target is
+	 updated again once they arrive.  */
+      drag_state.flags &= ~TargetPending;
+
+      if (!ReadProtocolProperties (toplevel, &version, &proxy))
+	drag_state.flags |= TargetPending;
+
+      if (proxy != None)
+	{
+	  /* A proxy is set.  Read properties off the proxy.  */
+	  if (!ReadProtocolProperties (proxy, &proxy_version, &self))
+	    drag_state.flags |= TargetPending;
+
+	  /* Check the proxy to make sure its XdndProxy property
+	     points to itself.  If it does not, the proxy property is
+	     left over from a crash.  */
+	  if (self != proxy)
+	    proxy = None;
+	  else
+	    /* Otherwise, set the version to the value of XdndAware on
+	       the proxy window.  */
+	    version = proxy_version;
+	}
+    }
+  else if (!toplevel)
+    drag_state.flags &= ~TargetPending;
+
+  if (pending)
+    /* Update the target again once every window that might be under
+       the pointer is known.  */
+    drag_state.flags |= TargetPending;
+
+  /* Now, toplevel is the toplevel itself, version is the version of
+     the target, and the target is proxy, if set, or toplevel, if
+     not.  Send XdndLeave to any previous target.  */
+  if (toplevel != drag_state.toplevel
+      || (force && toplevel
+	  && (version != drag_state.version
+	      || (proxy != None ? proxy : toplevel) != drag_state.target)))
+    {
+      SendLeave ();
+
+      drag_state.toplevel = None;
+      drag_state.target = None;
+      drag_state.version = 0;
+      drag_state.action = None;
+
+      /* Clear flags that are specific to each toplevel.  */
+      drag_state.flags &= ~WillAcceptDrop;
+      drag_state.flags &= ~NeedMouseRect;
+      drag_state.flags &= ~PendingPosition;
+      drag_state.flags &= ~PendingDrop;
+      drag_state.flags &= ~WaitingForStatus;
+
+      /* Report the changed state to the source.  */
+      ReportStateToSource ();
+
+      /* Set the toplevel and target accordingly.  */
+      if (toplevel)
+	{
+	  drag_state.toplevel = toplevel;
+	  drag_state.target = (proxy != None
+			       ? proxy : toplevel);
+	  drag_state.version = version;
+
+	  /* Then, send XdndEnter followed by XdndPosition, and wait
+	     for an XdndStatus event.  */
+	  SendEnter ();
+	}
+    }
+
+  /* Send the position to any attached toplevel, then wait for
+     XdndStatus.  */
+  SendPosition (root_x, root_y);
+}
+
+void
+XLDoDragMotion (Seat *seat, double root_x, double root_y)
+{
   Timestamp timestamp;
 
   if (finish_source || drag_state.flags & PendingDrop)
@@ -2981,79 +3654,74 @@ XLDoDragMotion (Seat *seat, double root_x, double root_y)
 	drag_state.flags |= SelectionSet;
     }
 
-  /* Also initialize the window cache.  */
-  if (!drag_state.window_cache)
-    drag_state.window_cache = AllocWindowCache ();
+  /* Also initialize the window cache, if this is the first drag.  */
+  if (!window_cache)
+    window_cache = AllocWindowCache ();
 
-  toplevel = FindToplevelWindow (drag_state.window_cache,
-				 root_x, root_y);
+  UpdateDragTarget (root_x, root_y, False);
+}
 
-  if (XLIsXdgToplevel (toplevel))
-    /* If this one of our own surfaces, ignore it.  */
-    toplevel = None;
+/* Read the replies to requests for the state, shapes and XDND
+   properties of windows in the window cache that have arrived.  Return whether or
+   not any replies were being waited for, in which case the caller
+   should check for new events, since events that arrived along with
+   the replies may have been read.  */
 
-  if (toplevel && toplevel != drag_state.toplevel)
-    {
-      /* Try to determine whether or not the given toplevel supports
-	 XDND, and whether or not a proxy is set.  */
-      ReadProtocolProperties (toplevel, &version, &proxy);
+Bool
+XLDndProcessReplies (void)
+{
+  WindowCacheEntry *entry, *next;
+  Bool updated;
 
-      if (proxy != None)
-	{
-	  /* A proxy is set.  Read properties off the proxy.  */
-	  ReadProtocolProperties (proxy, &proxy_version, &self);
+  if (!window_cache
+      || pending_entries.pending_next == &pending_entries)
+    return False;
 
-	  /* Check the proxy to make sure its XdndProxy property
-	     points to itself.  If it does not, the proxy property is
-	     left over from a crash.  */
-	  if (self != proxy)
-	    proxy = None;
-	  else
-	    /* Otherwise, set the version to the value of XdndAware on
-	       the proxy window.  */
-	    version = proxy_version;
-	}
-    }
+  updated = False;
+  entry = pending_entries.pending_next;
 
-  /* Now, toplevel is the toplevel itself, version is the version of
-     the target, and the target is proxy, if set, or toplevel, if
-     not.  Send XdndLeave to any previous target.  */
-  if (toplevel != drag_state.toplevel)
+  while (entry != &pending_entries)
     {
-      SendLeave ();
+      next = entry->pending_next;
 
-      drag_state.toplevel = None;
-      drag_state.target = None;
-      drag_state.version = 0;
-      drag_state.action = None;
+      if (entry->flags & IsMaskPending)
+	ReadMaskReply (entry);
 
-      /* Clear flags that are specific to each toplevel.  */
-      drag_state.flags &= ~WillAcceptDrop;
-      drag_state.flags &= ~NeedMouseRect;
-      drag_state.flags &= ~PendingPosition;
-      drag_state.flags &= ~PendingDrop;
-      drag_state.flags &= ~WaitingForStatus;
+      if (entry->flags & IsStatePending
+	  && ReadStateReplies (entry))
+	updated = True;
 
-      /* Report the changed state to the source.  */
-      ReportStateToSource ();
+      if (entry->flags & IsShapePending)
+	ReadShapeReplies (entry);
 
-      /* Set the toplevel and target accordingly.  */
-      if (toplevel)
-	{
-	  drag_state.toplevel = toplevel;
-	  drag_state.target = (proxy != None
-			       ? proxy : toplevel);
-	  drag_state.version = version;
+      if (entry->flags & IsPropertyPending
+	  && ReadPropertyReplies (entry))
+	updated = True;
 
-	  /* Then, send XdndEnter followed by XdndPosition, and wait
-	     for an XdndStatus event.  */
-	  SendEnter ();
-	}
+      if (entry->flags & IsWmStatePending
+	  && ReadWmStateReply (entry))
+	updated = True;
+
+      if (!(entry->flags & (IsShapePending | IsPropertyPending
+			    | IsMaskPending | IsStatePending
+			    | IsWmStatePending)))
+	UnlinkPendingEntry (entry);
+
+      /* ReadStateReplies and ReadPropertyReplies can link more
+	 entries onto the end of the list, which is fine.  */
+      entry = next;
     }
 
-  /* Send the position to any attached toplevel, then wait for
-     XdndStatus.  */
-  SendPosition (root_x, root_y);
+  /* If the XDND properties of the drag target, or the state or
+     WM_STATE of a window that might be under the pointer, have been
+     read, update the target.  */
+  if (updated && drag_state.seat
+      && drag_state.flags & TargetPending
+      && !finish_source && !(drag_state.flags & PendingDrop))
+    UpdateDragTarget (drag_state.last_root_x,
+		      drag_state.last_root_y, True);
+
+  return True;
 }
 
 void
@@ -606,7 +606,9 @@ Submit (struct wl_client *client, struct wl_resource *resource, uint32_t id)
 				   DefaultRootWindow (compositor.display),
 				   lease_id, request->noutputs,
 				   request->noutputs, crtcs, outputs);
+  BeginRoundTrip ();
   reply = xcb_randr_create_lease_reply (compositor.conn, cookie, &error);
+  EndRoundTrip ("RRCreateLease");
 
   /* Set the resource implementation now.  */
   wl_resource_set_implementation (lease->resource, &drm_lease_impl,
@@ -914,7 +916,9 @@ AddProvider (RRProvider provider)
   cookie = xcb_dri3_open (compositor.conn,
 			  DefaultRootWindow (compositor.display),
 			  provider);
+  BeginRoundTrip ();
   reply = xcb_dri3_open_reply (compositor.conn, cookie, &error);
+  EndRoundTrip ("DRI3Open");
 
   if (!reply)
     goto error;
@@ -1160,8 +1164,10 @@ BuildProviderTree (void)
 
   /* Now, query for all providers.  */
   cookie = xcb_randr_get_providers (compositor.conn, root);
+  BeginRoundTrip ();
   reply = xcb_randr_get_providers_reply (compositor.conn, cookie,
 					 NULL);
+  EndRoundTrip ("RRGetProviders");
 
   if (!reply)
     abort ();
@@ -1195,6 +1201,10 @@ BuildProviderTree (void)
 					      reply_timestamp);
   noutputs = 0;
 
+  /* The requests were all sent at once, so waiting for their replies
+     counts as a single round trip.  */
+  BeginRoundTrip ();
+
   for (i = 0; i < tree->nproviders; i++)
     {
       error = NULL;
@@ -1208,6 +1218,8 @@ BuildProviderTree (void)
 	noutputs += xcb_randr_get_provider_info_outputs_length (replies[i]);
     }
 
+  EndRoundTrip ("RRGetProviderInfo");
+
   /* Retrieve the output info for each provider.  It is too hard to
      reason about doing this asychronously across providers, so we
      sync at the end of each processing outputs for each provider
@@ -1237,6 +1249,8 @@ BuildProviderTree (void)
 						       outputs[k],
 						       reply_timestamp);
 
+      BeginRoundTrip ();
+
       for (k = 0; k < num_outputs; ++k)
 	{
 	  error = NULL;
@@ -1262,6 +1276,8 @@ BuildProviderTree (void)
 	  *output_info_ptr++ = output_replies[k];
 	}
 
+      EndRoundTrip ("RRGetOutputInfo");
+
       /* Free the provider info.  */
       free (replies[i]);
 
@@ -1660,8 +1676,10 @@ XLInitDrmLease (void)
 
 
   cookie = xcb_randr_query_version (compositor.conn, 1, 6);
+  BeginRoundTrip ();
   reply = xcb_randr_query_version_reply (compositor.conn,
 					 cookie, NULL);
+  EndRoundTrip ("RRQueryVersion");
 
   if (!reply)
     return;
@@ -45,6 +45,7 @@ enum
 typedef enum _EglBufferType EglBufferType;
 
 typedef struct _EglTarget EglTarget;
+typedef struct _EglCompletionCallback EglCompletionCallback;
 typedef struct _EglBuffer EglBuffer;
 
 typedef struct _EglDmaBufBuffer EglDmaBufBuffer;
@@ -53,6 +54,7 @@ typedef struct _EglSinglePixelBuffer EglSinglePixelBuffer;
 typedef struct _FormatInfo FormatInfo;
 
 typedef struct _CompositeProgram CompositeProgram;
+typedef struct _UploadBuffer UploadBuffer;
 
 enum _EglBufferType
   {
@@ -124,6 +126,7 @@ enum
     HasAlpha	       = (1 << 2),
     CanRelease	       = (1 << 3),
     InvertY	       = (1 << 4),
+    IsTextureSpecified = (1 << 5),
   };
 
 struct _EglBuffer
@@ -185,6 +188,26 @@ struct _EglTarget
   int flags;
 };
 
+struct _EglCompletionCallback
+{
+  /* The function to run once rendering completes, and its data.  */
+  RenderCompletionFunc function;
+  void *data;
+
+  /* The fence that is signalled once rendering completes.  */
+  EGLSyncKHR fence;
+
+  /* The file descriptor of the fence and its read callback, if it is
+     a native fence.  */
+  int fd;
+  ReadFd *read_fd;
+
+  /* Otherwise, a timer used to check whether or not the fence has
+     been signalled, and the delay between such checks.  */
+  Timer *timer;
+  struct timespec poll_delay;
+};
+
 struct _CompositeProgram
 {
   /* The name of the program.  */
@@ -209,6 +232,26 @@ struct _CompositeProgram
   GLuint source_color;
 };
 
+enum
+  {
+    /* The number of pixel buffer objects in the upload ring.  */
+    UploadRingSize = 3,
+    /* The smallest upload in bytes made through the upload ring.  */
+    MinRingUpload  = 65536,
+    /* The largest number of pixels between two damaged boxes in the
+       same band that are uploaded to join them.  */
+    SpanMergeArea  = 4096,
+  };
+
+struct _UploadBuffer
+{
+  /* The name of the pixel buffer object, or 0.  */
+  GLuint name;
+
+  /* The size of its storage.  */
+  size_t size;
+};
+
 /* This macro makes column major order easier to reason about for C
    folks.  */
 #define Index(matrix, row, column) ((matrix)[(column) * 3 + (row)])
@@ -352,6 +395,8 @@ static PFNEGLGETSYNCATTRIBKHRPROC IGetSyncAttrib;
 static PFNEGLWAITSYNCKHRPROC IWaitSync;
 static PFNEGLDUPNATIVEFENCEFDANDROIDPROC IDupNativeFenceFD;
 static PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC ISwapBuffersWithDamage;
+static PFNGLMAPBUFFERRANGEEXTPROC IMapBufferRange;
+static PFNGLUNMAPBUFFEROESPROC IUnmapBuffer;
 
 /* The EGL display handle.  */
 static EGLDisplay egl_display;
@@ -410,6 +455,11 @@ static CompositeProgram single_pixel_buffer_program;
 /* Whether or not buffer age is supported.  */
 static Bool have_egl_ext_buffer_age;
 
+/* Ring of pixel buffer objects used to upload shm buffers, and the
+   next one to use.  */
+static UploadBuffer upload_ring[UploadRingSize];
+static int upload_ring_next;
+
 /* EGL and GLES 2-based renderer.  */
 
 #define CheckExtension(name)				\
@@ -550,6 +600,21 @@ EglInitFuncs (void)
 	    "EGL_EXT_swap_buffers_with_damage");
 }
 
+static int
+GetGlesVersion (void)
+{
+  const GLubyte *version;
+  int major;
+
+  version = glGetString (GL_VERSION);
+
+  if (!version
+      || sscanf ((const char *) version, "OpenGL ES %d", &major) != 1)
+    return 2;
+
+  return major;
+}
+
 static void
 EglInitGlFuncs (void)
 {
@@ -559,6 +624,24 @@ EglInitGlFuncs (void)
      server client API also supports GL_OES_EGL_sync.  */
   if (!HaveGlExtension ("GL_OES_EGL_sync"))
     IWaitSync = NULL;
+
+  /* Pixel buffer objects are used to upload shm buffers if they can
+     be mapped.  They are part of GLES 3.0, and drivers usually give
+     us a 3.x context even though only 2.0 is asked for.  */
+  if (GetGlesVersion () >= 3)
+    {
+      IMapBufferRange
+	= (void *) eglGetProcAddress ("glMapBufferRange");
+      IUnmapBuffer = (void *) eglGetProcAddress ("glUnmapBuffer");
+    }
+  else if (HaveGlExtension ("GL_NV_pixel_buffer_object"))
+    {
+      LoadProcGl (MapBufferRange, "EXT", "GL_EXT_map_buffer_range");
+      LoadProcGl (UnmapBuffer, "OES", "GL_OES_mapbuffer");
+    }
+
+  if (!IUnmapBuffer)
+    IMapBufferRange = NULL;
 }
 
 static Visual *
@@ -1399,40 +1482,16 @@ ComputeTransformMatrix (EglBuffer *buffer, DrawParams *params)
 static void EnsureTexture (EglBuffer *);
 
 static void
-Composite (RenderBuffer buffer, RenderTarget target,
-	   Operation op, int src_x, int src_y, int x, int y,
-	   int width, int height, DrawParams *params)
+FillVertices (EglTarget *egl_target, EglBuffer *egl_buffer,
+	      GLfloat *verts, GLfloat *texcoord, int src_x, int src_y,
+	      int x, int y, int width, int height)
 {
-  GLfloat verts[8], texcoord[8];
   GLfloat x1, x2, y1, y2;
-  EglTarget *egl_target;
-  EglBuffer *egl_buffer;
-  CompositeProgram *program;
-  GLenum tex_target;
 
-  egl_target = target.pointer;
-  egl_buffer = buffer.pointer;
-
-  if (egl_buffer->u.type != SinglePixelBuffer)
-    {
-      /* If no texture was generated, upload the buffer contents
-	 now.  */
-      if (!(egl_buffer->flags & IsTextureGenerated))
-	EnsureTexture (egl_buffer);
-
-      /* Get the texturing target.  */
-      tex_target = GetTextureTarget (egl_buffer);
-    }
-  else
-    /* This value is not actually used.  */
-    tex_target = 0;
-
-  /* Find the program to use for compositing.  */
-  program = FindProgram (egl_buffer);
-
-  /* Compute the transformation matrix to use to draw the given
-     buffer.  */
-  ComputeTransformMatrix (egl_buffer, params);
+  /* Fill in the vertices of the two triangles covering a rectangle
+     of width, height at x, y on the target, and the corresponding
+     texture coordinates of src_x, src_y in the buffer.  Each array
+     must have space for 12 elements.  */
 
   /* dest rectangle on target.  */
   x1 = x;
@@ -1453,8 +1512,8 @@ Composite (RenderBuffer buffer, RenderTarget target,
   verts[5] = -1.0f + (egl_target->height - y2) / egl_target->height * 2;
 
   /* Top right.  */
-  verts[6] = -1.0f + x2 / egl_target->width * 2;
-  verts[7] = -1.0f + (egl_target->height - y1) / egl_target->height * 2;
+  verts[10] = -1.0f + x2 / egl_target->width * 2;
+  verts[11] = -1.0f + (egl_target->height - y1) / egl_target->height * 2;
 
   /* source rectangle on buffer.  */
   x1 = src_x;
@@ -1468,8 +1527,48 @@ Composite (RenderBuffer buffer, RenderTarget target,
   texcoord[3] = y1 / egl_buffer->height;
   texcoord[4] = x2 / egl_buffer->width;
   texcoord[5] = y2 / egl_buffer->height;
-  texcoord[6] = x2 / egl_buffer->width;
-  texcoord[7] = y1 / egl_buffer->height;
+  texcoord[10] = x2 / egl_buffer->width;
+  texcoord[11] = y1 / egl_buffer->height;
+
+  /* The second triangle shares the bottom right and top left
+     vertices with the first.  */
+  verts[6] = verts[4];
+  verts[7] = verts[5];
+  verts[8] = verts[2];
+  verts[9] = verts[3];
+  texcoord[6] = texcoord[4];
+  texcoord[7] = texcoord[5];
+  texcoord[8] = texcoord[2];
+  texcoord[9] = texcoord[3];
+}
+
+static void
+DrawVertices (EglBuffer *egl_buffer, Operation op, DrawParams *params,
+	      GLfloat *verts, GLfloat *texcoord, int nvertices)
+{
+  CompositeProgram *program;
+  GLenum tex_target;
+
+  if (egl_buffer->u.type != SinglePixelBuffer)
+    {
+      /* If no texture was generated, upload the buffer contents
+	 now.  */
+      if (!(egl_buffer->flags & IsTextureGenerated))
+	EnsureTexture (egl_buffer);
+
+      /* Get the texturing target.  */
+      tex_target = GetTextureTarget (egl_buffer);
+    }
+  else
+    /* This value is not actually used.  */
+    tex_target = 0;
+
+  /* Find the program to use for compositing.  */
+  program = FindProgram (egl_buffer);
+
+  /* Compute the transformation matrix to use to draw the given
+     buffer.  */
+  ComputeTransformMatrix (egl_buffer, params);
 
   /* Disable blending based on whether or not an alpha channel is
      present.  */
@@ -1514,7 +1613,7 @@ Composite (RenderBuffer buffer, RenderTarget target,
   glEnableVertexAttribArray (program->position);
   glEnableVertexAttribArray (program->texcoord);
 
-  glDrawArrays (GL_TRIANGLE_STRIP, 0, 4);
+  glDrawArrays (GL_TRIANGLES, 0, nvertices);
 
   glDisableVertexAttribArray (program->position);
   glDisableVertexAttribArray (program->texcoord);
@@ -1524,6 +1623,223 @@ Composite (RenderBuffer buffer, RenderTarget target,
     glBindTexture (tex_target, 0);
 }
 
+static void
+Composite (RenderBuffer buffer, RenderTarget target,
+	   Operation op, int src_x, int src_y, int x, int y,
+	   int width, int height, DrawParams *params)
+{
+  GLfloat verts[12], texcoord[12];
+  EglTarget *egl_target;
+  EglBuffer *egl_buffer;
+
+  egl_target = target.pointer;
+  egl_buffer = buffer.pointer;
+
+  FillVertices (egl_target, egl_buffer, verts, texcoord, src_x,
+		src_y, x, y, width, height);
+  DrawVertices (egl_buffer, op, params, verts, texcoord, 6);
+}
+
+static void
+CompositeBoxes (RenderBuffer buffer, RenderTarget target,
+		Operation op, pixman_box32_t *boxes, int nboxes,
+		int src_x, int src_y, int x, int y, DrawParams *params)
+{
+  GLfloat *verts, *texcoord;
+  EglTarget *egl_target;
+  EglBuffer *egl_buffer;
+  int i;
+
+  if (nboxes < 1)
+    return;
+
+  egl_target = target.pointer;
+  egl_buffer = buffer.pointer;
+
+  if (nboxes < 64)
+    {
+      verts = alloca (sizeof *verts * 12 * nboxes);
+      texcoord = alloca (sizeof *texcoord * 12 * nboxes);
+    }
+  else
+    {
+      verts = XLMalloc (sizeof *verts * 12 * nboxes);
+      texcoord = XLMalloc (sizeof *texcoord * 12 * nboxes);
+    }
+
+  /* Build a single vertex array containing every box, and draw it
+     all at once.  */
+  for (i = 0; i < nboxes; ++i)
+    FillVertices (egl_target, egl_buffer, verts + i * 12,
+		  texcoord + i * 12, boxes[i].x1 - src_x,
+		  boxes[i].y1 - src_y, boxes[i].x1 - x,
+		  boxes[i].y1 - y, boxes[i].x2 - boxes[i].x1,
+		  boxes[i].y2 - boxes[i].y1);
+
+  DrawVertices (egl_buffer, op, params, verts, texcoord, nboxes * 6);
+
+  if (nboxes >= 64)
+    {
+      XLFree (verts);
+      XLFree (texcoord);
+    }
+}
+
+static void
+FreeCompletionCallback (EglCompletionCallback *callback)
+{
+  if (callback->read_fd)
+    {
+      XLRemoveReadFd (callback->read_fd);
+      close (callback->fd);
+    }
+
+  if (callback->timer)
+    RemoveTimer (callback->timer);
+
+  if (!IDestroySync (egl_display, callback->fence))
+    /* There is no way to continue without leaking memory, and this
+       shouldn't happen.  */
+    abort ();
+
+  XLFree (callback);
+}
+
+static void
+RunCompletionCallback (EglCompletionCallback *callback)
+{
+  RenderCompletionFunc function;
+  void *data;
+
+  function = callback->function;
+  data = callback->data;
+  FreeCompletionCallback (callback);
+
+  /* EGL provides no information about when the contents were
+     actually presented, so only report that rendering completed.  */
+  function (data, -1, -1);
+}
+
+static void
+HandleCompletionFenceReadable (int fd, void *data, ReadFd *readfd)
+{
+  /* The native fence was signalled.  */
+  RunCompletionCallback (data);
+}
+
+/* Return the longest delay between checks of a fence.  */
+
+static struct timespec
+GetMaxPollDelay (void)
+{
+  static struct timespec max_delay;
+
+  /* This is the frame interval of the slowest output, which is only
+     computed once.  If the refresh rate changes later, fences are
+     still polled often enough to not delay frames by much.  */
+  if (!max_delay.tv_sec && !max_delay.tv_nsec)
+    XLOutputGetMinRefresh (&max_delay);
+
+  return max_delay;
+}
+
+static void
+HandleCompletionTimer (Timer *timer, void *data, struct timespec time)
+{
+  EglCompletionCallback *callback;
+  struct timespec delay, max_delay;
+  EGLint rc;
+
+  callback = data;
+
+  /* See whether or not the fence has been signalled, without
+     waiting.  */
+  rc = IClientWaitSync (egl_display, callback->fence, 0, 0);
+
+  if (rc == EGL_TIMEOUT_EXPIRED_KHR)
+    {
+      /* Wait twice as long before checking again, but no longer
+	 than a frame, so that the compositor is not woken up
+	 constantly while the GPU is busy with a slow frame.  */
+      delay = TimespecAdd (callback->poll_delay, callback->poll_delay);
+      max_delay = GetMaxPollDelay ();
+
+      if (TimespecCmp (delay, max_delay) > 0)
+	delay = max_delay;
+
+      if (TimespecCmp (delay, callback->poll_delay))
+	{
+	  callback->poll_delay = delay;
+	  RemoveTimer (timer);
+	  callback->timer = AddTimer (HandleCompletionTimer, callback,
+				      delay);
+	}
+
+      return;
+    }
+
+  /* The fence was signalled, or waiting for it failed.  Either way,
+     there is nothing more to wait for.  */
+  RunCompletionCallback (callback);
+}
+
+/* Return a completion callback that runs FUNCTION with DATA once all
+   drawing commands made so far complete, or NULL if fences are not
+   supported.  */
+
+static EglCompletionCallback *
+MakeCompletionCallback (RenderCompletionFunc function, void *data)
+{
+  EglCompletionCallback *callback;
+  EGLSyncKHR fence;
+  EGLint attribs, fd;
+
+  if (!ICreateSync)
+    return NULL;
+
+  attribs = EGL_NONE;
+
+  /* Native fences can be polled along with every other file
+     descriptor, so use them if possible.  */
+  fence = ICreateSync (egl_display, (IDupNativeFenceFD
+				     ? EGL_SYNC_NATIVE_FENCE_ANDROID
+				     : EGL_SYNC_FENCE_KHR),
+		       &attribs);
+
+  if (fence == EGL_NO_SYNC_KHR)
+    return NULL;
+
+  /* Submit the drawing commands and the fence, so that it will be
+     signalled without anyone waiting for it.  This is also required
+     before a native fence has a file descriptor.  */
+  glFlush ();
+
+  callback = XLCalloc (1, sizeof *callback);
+  callback->function = function;
+  callback->data = data;
+  callback->fence = fence;
+
+  fd = (IDupNativeFenceFD
+	? IDupNativeFenceFD (egl_display, fence) : -1);
+
+  if (fd != -1)
+    {
+      callback->fd = fd;
+      callback->read_fd = XLAddReadFd (fd, callback,
+				       HandleCompletionFenceReadable);
+    }
+  else
+    {
+      /* Otherwise, check the fence after a millisecond, and then
+	 back off.  */
+      callback->poll_delay = MakeTimespec (0, 1000000);
+      callback->timer = AddTimer (HandleCompletionTimer, callback,
+				  callback->poll_delay);
+    }
+
+  return callback;
+}
+
 static RenderCompletionKey
 FinishRender (RenderTarget target, pixman_region32_t *damage,
 	      RenderCompletionFunc callback, void *data)
@@ -1532,13 +1848,27 @@ FinishRender (RenderTarget target, pixman_region32_t *damage,
   EGLint *rects;
   int nboxes, i;
   pixman_box32_t *boxes;
+  EglCompletionCallback *key;
 
   egl_target = target.pointer;
 
   if (egl_target->flags & IsPixmap)
-    glFinish ();
-  else if (!ISwapBuffersWithDamage || !damage)
-    /* This should also do glFinish.  */
+    {
+      /* EGL pixmap surfaces are single-buffered.  If the caller will
+	 not wait for the rendering to complete, finish it now, since
+	 the contents of the pixmap might be used at any time.  */
+      key = NULL;
+
+      if (callback)
+	key = MakeCompletionCallback (callback, data);
+
+      if (!key)
+	glFinish ();
+
+      return key;
+    }
+
+  if (!ISwapBuffersWithDamage || !damage)
     eglSwapBuffers (egl_display, egl_target->surface);
   else
     {
@@ -1560,9 +1890,22 @@ FinishRender (RenderTarget target, pixman_region32_t *damage,
 			      rects, nboxes);
     }
 
+  /* Swapping buffers does not wait for the drawing to complete.  If
+     the caller wants to know when the frame completes, tell it once
+     a fence placed after the swap is signalled, so that clients are
+     throttled by the GPU instead of the compositor waiting for it.  */
+  if (callback)
+    return MakeCompletionCallback (callback, data);
+
   return NULL;
 }
 
+static void
+CancelCompletionCallback (RenderCompletionKey key)
+{
+  FreeCompletionCallback (key);
+}
+
 static int
 TargetAge (RenderTarget target)
 {
@@ -1698,12 +2041,20 @@ static RenderFuncs egl_render_funcs =
     .fill_boxes_with_transparency = FillBoxesWithTransparency,
     .clear_rectangle = ClearRectangle,
     .composite = Composite,
+    .composite_boxes = CompositeBoxes,
     .finish_render = FinishRender,
+    .cancel_completion_callback = CancelCompletionCallback,
     .target_age = TargetAge,
     .import_fd_fence = ImportFdFence,
     .wait_fence = WaitFence,
     .delete_fence = DeleteFence,
     .get_finish_fence = GetFinishFence,
+    /* All boxes are drawn by a single draw call, so each box only
+       adds six vertices (96 bytes) to the vertex data, and the setup
+       of two triangles.  That costs about as much as shading a 16x16
+       block of fragments.  */
+    .request_cost = 256,
+    .pixel_cost = 1,
     .flags = ImmediateRelease,
   };
 
@@ -2279,179 +2630,298 @@ GetShmParams (EglBuffer *buffer, void **data_ptr, size_t *expected_size)
   *expected_size = (size_t) buffer->u.shm.stride * buffer->height;
 }
 
-static void
-UpdateTexture (EglBuffer *buffer)
+/* Coalesce the NBOXES boxes of a region in BOXES into row spans,
+   which are placed back in BOXES.  Boxes in the same band that are
+   close together are joined, since uploading the few pixels between
+   them costs less than another upload, and spans of the same width
+   in adjacent bands are then joined as well.  Return the number of
+   spans.  */
+
+static int
+CoalesceSpans (pixman_box32_t *boxes, int nboxes)
 {
-  GLenum target;
-  void *data_ptr;
-  size_t expected_data_size;
+  pixman_box32_t span;
+  int i, nspans;
 
-  /* Get the appropriate target for the texture.  */
-  target = GetTextureTarget (buffer);
+  nspans = 0;
 
-  /* Bind the target to the texture.  */
-  glBindTexture (target, buffer->texture);
+  for (i = 0; i < nboxes;)
+    {
+      span = boxes[i++];
+
+      /* Boxes in a band are sorted by X, and share Y1 and Y2.  */
+      while (i < nboxes && boxes[i].y1 == span.y1
+	     && ((boxes[i].x1 - span.x2) * (span.y2 - span.y1)
+		 <= SpanMergeArea))
+	span.x2 = boxes[i++].x2;
+
+      if (nspans && boxes[nspans - 1].y2 == span.y1
+	  && boxes[nspans - 1].x1 == span.x1
+	  && boxes[nspans - 1].x2 == span.x2)
+	boxes[nspans - 1].y2 = span.y2;
+      else
+	boxes[nspans++] = span;
+    }
 
-  /* Set the wrapping mode to CLAMP_TO_EDGE.  */
-  glTexParameteri (target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri (target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  return nspans;
+}
 
-  switch (buffer->u.type)
-    {
-    case DmaBufBuffer:
-      /* This is easy.  Simply bind the EGL image to the target.  */
-      IEGLImageTargetTexture2D (target, buffer->u.dmabuf.image);
-      break;
+/* Try to upload the parts of the data of BUFFER within SPANS to the
+   texture bound to TARGET through the next pixel buffer object in
+   the upload ring.  The rows of each span are copied into the pixel
+   buffer object, and the texture is updated from there, so the GPU
+   can copy the data while compositing continues.  Return whether or
+   not the upload was made.  */
 
-    case ShmBuffer:
-      /* This is much more complicated... First, set the row length to
-	 the stride.  */
-      glPixelStorei (GL_UNPACK_ROW_LENGTH_EXT,
-		     buffer->u.shm.stride / (buffer->u.shm.format->bpp / 8));
-
-      /* Compute the expected data size and data pointer of the
-	 buffer.  This is only valid until the next time ResizePool is
-	 called.  */
-      GetShmParams (buffer, &data_ptr, &expected_data_size);
-
-      /* Next, specify the 2D image.  */
-      glTexImage2D (target, 0, (buffer->u.shm.format->gl_internalformat
-				? buffer->u.shm.format->gl_internalformat
-				: buffer->u.shm.format->gl_format),
-		    buffer->width, buffer->height, 0,
-		    buffer->u.shm.format->gl_format,
-		    buffer->u.shm.format->gl_type, data_ptr);
-
-      /* Unset the row length.  */
-      glPixelStorei (GL_UNPACK_ROW_LENGTH_EXT, 0);
+static Bool
+UploadSpansThroughRing (EglBuffer *buffer, GLenum target, char *data,
+			pixman_box32_t *spans, int nspans)
+{
+  UploadBuffer *upload;
+  size_t total, row_size, offset, bytes_per_pixel, stride;
+  char *map, *row;
+  int i, y;
 
-      /* The buffer's been copied to the texture.  It can now be
-	 released.  */
-      buffer->flags |= CanRelease;
-      break;
+  if (!IMapBufferRange)
+    return False;
 
-    default:
-      break;
-    }
+  bytes_per_pixel = buffer->u.shm.format->bpp / 8;
+  stride = buffer->u.shm.stride;
+  total = 0;
 
-  /* Bind the target to nothing.  */
-  glBindTexture (target, 0);
-}
+  for (i = 0; i < nspans; ++i)
+    total += ((size_t) (spans[i].x2 - spans[i].x1) * bytes_per_pixel
+	      * (spans[i].y2 - spans[i].y1));
 
-static void
-ReverseTransformToBox (DrawParams *params, pixman_box32_t *box)
-{
-  double x_factor, y_factor;
+  /* Small uploads, such as those of text, are not worth mapping a
+     buffer for.  */
+  if (total < MinRingUpload)
+    return False;
 
-  if (!params)
-    return;
+  upload = &upload_ring[upload_ring_next];
+  upload_ring_next = (upload_ring_next + 1) % UploadRingSize;
 
-  /* Apply the inverse of PARAMS to BOX, for use in damage
-     tracking.  */
+  if (!upload->name)
+    glGenBuffers (1, &upload->name);
 
-  if (params->flags & ScaleSet)
+  glBindBuffer (GL_PIXEL_UNPACK_BUFFER_NV, upload->name);
+
+  if (upload->size < total)
     {
-      box->x1 = floor (box->x1 / params->scale);
-      box->y1 = floor (box->y1 / params->scale);
-      box->x2 = ceil (box->x2 / params->scale);
-      box->y2 = ceil (box->y2 / params->scale);
+      glBufferData (GL_PIXEL_UNPACK_BUFFER_NV, total, NULL,
+		    GL_STREAM_DRAW);
+      upload->size = total;
     }
 
-  if (params->flags & OffsetSet)
+  /* Invalidating the buffer lets the driver give us new storage if
+     the GPU is still reading from the last upload made with it.  */
+  map = IMapBufferRange (GL_PIXEL_UNPACK_BUFFER_NV, 0, total,
+			 (GL_MAP_WRITE_BIT_EXT
+			  | GL_MAP_INVALIDATE_BUFFER_BIT_EXT));
+
+  if (!map)
     {
-      /* Since the offset can be a fractional value, also try to
-	 include as much as possible in the box.  */
-      box->x1 = floor (box->x1 + params->off_x);
-      box->y1 = floor (box->y1 + params->off_y);
-      box->x2 = ceil (box->x2 + params->off_x);
-      box->y2 = ceil (box->y2 + params->off_y);
+      /* The buffer could not be allocated or mapped.  Allocate it
+	 again next time.  */
+      upload->size = 0;
+      glBindBuffer (GL_PIXEL_UNPACK_BUFFER_NV, 0);
+      return False;
     }
 
-  if (params->flags & StretchSet)
+  /* Pack the rows of each span tightly.  */
+  offset = 0;
+
+  for (i = 0; i < nspans; ++i)
+    {
+      row_size = (spans[i].x2 - spans[i].x1) * bytes_per_pixel;
+      row = data + spans[i].y1 * stride + spans[i].x1 * bytes_per_pixel;
+
+      if (row_size == stride)
+	{
+	  /* The span covers entire rows, so copy it at once.  */
+	  memcpy (map + offset, row, row_size * (spans[i].y2
+						 - spans[i].y1));
+	  offset += row_size * (spans[i].y2 - spans[i].y1);
+	  continue;
+	}
+
+      for (y = spans[i].y1; y < spans[i].y2; ++y)
+	{
+	  memcpy (map + offset, row, row_size);
+	  offset += row_size;
+	  row += stride;
+	}
+    }
+
+  if (!IUnmapBuffer (GL_PIXEL_UNPACK_BUFFER_NV))
     {
-      x_factor = params->crop_width / params->stretch_width;
-      y_factor = params->crop_height / params->stretch_height;
+      /* The contents of the buffer were lost.  */
+      glBindBuffer (GL_PIXEL_UNPACK_BUFFER_NV, 0);
+      return False;
+    }
+
+  /* Rows are packed without padding, and 24 or 16 bit formats might
+     not be 4 byte aligned.  */
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+  offset = 0;
 
-      box->x1 = floor (box->x1 * x_factor);
-      box->y1 = floor (box->y1 * y_factor);
-      box->x2 = ceil (box->x2 * x_factor);
-      box->y2 = ceil (box->y2 * y_factor);
+  for (i = 0; i < nspans; ++i)
+    {
+      glTexSubImage2D (target, 0, spans[i].x1, spans[i].y1,
+		       spans[i].x2 - spans[i].x1,
+		       spans[i].y2 - spans[i].y1,
+		       buffer->u.shm.format->gl_format,
+		       buffer->u.shm.format->gl_type,
+		       (void *) offset);
+      offset += ((spans[i].x2 - spans[i].x1) * bytes_per_pixel
+		 * (spans[i].y2 - spans[i].y1));
     }
+
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+  glBindBuffer (GL_PIXEL_UNPACK_BUFFER_NV, 0);
+
+  return True;
 }
 
+/* Upload the parts of the data of BUFFER within SPANS to its texture,
+   which must be bound to TARGET.  Each span must lie within the
+   buffer.  */
+
 static void
-UpdateShmBufferIncrementally (EglBuffer *buffer, pixman_region32_t *damage,
-			      DrawParams *params)
+UploadSpans (EglBuffer *buffer, GLenum target, pixman_box32_t *spans,
+	     int nspans)
 {
-  GLenum target;
-  pixman_box32_t *boxes, box;
-  int nboxes, i, width, height;
   void *data_ptr;
-  size_t expected_data_size;
-
-  /* Obtain the rectangles that are part of the damage.  */
-  boxes = pixman_region32_rectangles (damage, &nboxes);
-
-  if (!nboxes)
-    return;
+  char *data;
+  size_t expected_data_size, bytes_per_pixel;
+  int i;
 
   /* Compute the expected data size and data pointer of the buffer.
      This is only valid until the next time ResizePool is called.  */
   GetShmParams (buffer, &data_ptr, &expected_data_size);
+  data = data_ptr;
+  bytes_per_pixel = buffer->u.shm.format->bpp / 8;
+
+  for (i = 0; i < nspans; ++i)
+    RenderNoteUpload ((uint64_t) (spans[i].x2 - spans[i].x1)
+		      * (spans[i].y2 - spans[i].y1) * bytes_per_pixel);
+
+  if (UploadSpansThroughRing (buffer, target, data, spans, nspans))
+    return;
+
+  /* Otherwise, copy straight from the shm data.  Set the length of a
+     single row once, and point to the start of each span instead of
+     setting the number of pixels and rows to skip.  */
+  glPixelStorei (GL_UNPACK_ROW_LENGTH_EXT,
+		 buffer->u.shm.stride / bytes_per_pixel);
+
+  for (i = 0; i < nspans; ++i)
+    glTexSubImage2D (target, 0, spans[i].x1, spans[i].y1,
+		     spans[i].x2 - spans[i].x1,
+		     spans[i].y2 - spans[i].y1,
+		     buffer->u.shm.format->gl_format,
+		     buffer->u.shm.format->gl_type,
+		     (data + spans[i].y1 * buffer->u.shm.stride
+		      + spans[i].x1 * bytes_per_pixel));
+
+  /* Unset the row length.  */
+  glPixelStorei (GL_UNPACK_ROW_LENGTH_EXT, 0);
+}
+
+static void
+UpdateTexture (EglBuffer *buffer)
+{
+  GLenum target;
+  pixman_box32_t box;
 
-  /* Get the texturing target.  */
+  /* Get the appropriate target for the texture.  */
   target = GetTextureTarget (buffer);
 
   /* Bind the target to the texture.  */
   glBindTexture (target, buffer->texture);
 
-  /* And copy from the shm data to the texture according to
-     the damage.  */
-  for (i = 0; i < nboxes; ++i)
+  /* Set the wrapping mode to CLAMP_TO_EDGE.  */
+  glTexParameteri (target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri (target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  switch (buffer->u.type)
     {
-      /* Get a copy of the box.  */
-      box = boxes[i];
+    case DmaBufBuffer:
+      /* This is easy.  Simply bind the EGL image to the target.  */
+      IEGLImageTargetTexture2D (target, buffer->u.dmabuf.image);
+      break;
 
-      /* Transform the box according to any transforms.  */
-      ReverseTransformToBox (params, &box);
+    case ShmBuffer:
+      /* This is much more complicated... First, specify the 2D image
+	 if that has not yet been done.  Its size never changes, so it
+	 is only allocated once.  */
+      if (!(buffer->flags & IsTextureSpecified))
+	{
+	  glTexImage2D (target, 0,
+			(buffer->u.shm.format->gl_internalformat
+			 ? buffer->u.shm.format->gl_internalformat
+			 : buffer->u.shm.format->gl_format),
+			buffer->width, buffer->height, 0,
+			buffer->u.shm.format->gl_format,
+			buffer->u.shm.format->gl_type, NULL);
+	  buffer->flags |= IsTextureSpecified;
+	}
 
-      /* Clip the box X and Y to 0, 0.  */
-      box.x1 = MIN (box.y1, 0);
-      box.y1 = MIN (box.y1, 0);
+      /* Next, upload the entire buffer.  */
+      box.x1 = 0;
+      box.y1 = 0;
+      box.x2 = buffer->width;
+      box.y2 = buffer->height;
+      UploadSpans (buffer, target, &box, 1);
 
-      /* These computations are correct, since box->x2/box->y2 are
-	 actually 1 pixel outside the last pixel in the box.  */
-      width = MIN (box.x2, buffer->width) - box.x1;
-      height = MIN (box.y2, buffer->height) - box.y1;
+      /* The buffer's been copied to the texture.  It can now be
+	 released.  */
+      buffer->flags |= CanRelease;
+      break;
 
-      if (width <= 0 || height <= 0)
-	/* The box is effectively empty because it straddles one of
-	   the corners of the buffer, or is outside of the buffer.  */
-	continue;
+    default:
+      break;
+    }
 
-      /* First, set the length of a single row.  */
-      glPixelStorei (GL_UNPACK_ROW_LENGTH_EXT,
-		     buffer->u.shm.stride / (buffer->u.shm.format->bpp / 8));
+  /* Bind the target to nothing.  */
+  glBindTexture (target, 0);
+}
 
-      /* Next, skip box.x1 pixels of each row.  */
-      glPixelStorei (GL_UNPACK_SKIP_PIXELS_EXT, box.x1);
+static void
+UpdateShmBufferIncrementally (EglBuffer *buffer, pixman_region32_t *damage,
+			      DrawParams *params)
+{
+  GLenum target;
+  pixman_box32_t *spans;
+  pixman_region32_t region;
+  int nboxes, nspans;
+
+  /* Transform the damage into the coordinate space of the buffer,
+     clipped to the buffer.  */
+  pixman_region32_init (&region);
+  ReverseTransformRegion (&region, damage, params, buffer->width,
+			  buffer->height);
+
+  /* Coalesce the boxes of the region into row spans.  The region is
+     not used after that, so its boxes are coalesced in place.  */
+  spans = pixman_region32_rectangles (&region, &nboxes);
+  nspans = CoalesceSpans (spans, nboxes);
+
+  if (nspans)
+    {
+      /* Get the texturing target.  */
+      target = GetTextureTarget (buffer);
 
-      /* And box.y1 rows.  */
-      glPixelStorei (GL_UNPACK_SKIP_ROWS_EXT, box.y1);
+      /* Bind the target to the texture, and copy from the shm data
+	 to the texture according to the damage.  */
+      glBindTexture (target, buffer->texture);
+      UploadSpans (buffer, target, spans, nspans);
 
-      /* Copy the image into the sub-texture.  */
-      glTexSubImage2D (target, 0, box.x1, box.y1, width, height,
-		       buffer->u.shm.format->gl_format,
-		       buffer->u.shm.format->gl_type, data_ptr);
+      /* Unbind from the texturing target.  */
+      glBindTexture (target, 0);
     }
 
-  /* Unspecify pixel sotrage modes.  */
-  glPixelStorei (GL_UNPACK_ROW_LENGTH_EXT, 0);
-  glPixelStorei (GL_UNPACK_SKIP_PIXELS_EXT, 0);
-  glPixelStorei (GL_UNPACK_SKIP_ROWS_EXT, 0);
-
-  /* Unbind from the texturing target.  */
-  glBindTexture (target, 0);
+  pixman_region32_fini (&region);
 
   /* The buffer's been copied to the texture.  It can now be
      released.  */
@@ -2495,7 +2965,7 @@ UpdateBuffer (RenderBuffer buffer, pixman_region32_t *damage,
     /* No texture has been generated, so just create one and maybe
        upload the contents.  */
     EnsureTexture (egl_buffer);
-  else if (!damage || params->flags & TransformSet)
+  else if (!damage)
     /* Upload all the contents to the buffer's texture if the buffer
        type requires manual updates.  Buffers backed by EGLImages do
        not appear to need updates, since updates to the EGLImage are
@@ -35,12 +35,14 @@ GetWmCheckWindow (void)
   Atom actual_type;
 
   tmp_data = NULL;
+  BeginRoundTrip ();
   rc = XGetWindowProperty (compositor.display,
 			   DefaultRootWindow (compositor.display),
 			   _NET_SUPPORTING_WM_CHECK,
 			   0, 1, False, XA_WINDOW, &actual_type,
 			   &actual_format, &actual_size,
 			   &bytes_remaining, &tmp_data);
+  EndRoundTrip ("GetWindowProperty");
 
   if (rc != Success || actual_type != XA_WINDOW
       || actual_format != 32 || actual_size != 1
@@ -100,11 +102,13 @@ XLWmSupportsHint (Atom hint)
   tmp_data = NULL;
 
   CatchXErrors ();
+  BeginRoundTrip ();
   rc = XGetWindowProperty (compositor.display,
 			   DefaultRootWindow (compositor.display),
 			   _NET_SUPPORTED, 0, 4096, False, XA_ATOM,
 			   &actual_type, &actual_format, &actual_size,
 			   &bytes_remaining, &tmp_data);
+  EndRoundTrip ("GetWindowProperty");
   errors = UncatchXErrors (NULL);
 
   if (rc != Success || actual_type != XA_ATOM || errors)
@@ -178,162 +178,176 @@ XIDListPrepend (XIDList *list, XID resource)
 
 /* Hash tables between XIDs and arbitrary data.  */
 
+static int
+AssocHash (XLAssocTable *table, XID x_id)
+{
+  /* XIDs allocated by a client are mostly sequential, and differ only
+     in their low bits.  The low bits of their product with an odd
+     constant still depend only on the low bits of each XID, so use
+     the high bits of the product instead, where every bit of the XID
+     has an effect (Fibonacci hashing).  */
+  return (uint32_t) (x_id * 2654435761u) >> table->shift;
+}
+
+static void
+AllocSlots (XLAssocTable *table, int size)
+{
+  table->slots = XLCalloc (size, sizeof *table->slots);
+  table->size = size;
+  table->count = 0;
+
+  /* SIZE is a power of two; compute 32 - log2 (SIZE).  */
+  table->shift = 32;
+
+  while (size > 1)
+    {
+      size /= 2;
+      table->shift--;
+    }
+}
+
 XLAssocTable *
 XLCreateAssocTable (int size)
 {
   XLAssocTable *table;
-  XLAssoc *buckets;
+  int real_size;
 
-  table = XLMalloc (sizeof *table);
-  buckets = XLCalloc (size, sizeof *buckets);
+  /* SIZE is the number of entries expected to be stored in the table.
+     Keep the table at most half full, and make its size a power of
+     two.  */
+  real_size = 8;
 
-  table->buckets = buckets;
-  table->size = size;
+  while (real_size < size * 2)
+    real_size *= 2;
 
-  while (--size >= 0)
-    {
-      /* Initialize each bucket with the sentinel node. */
-      buckets->prev = buckets;
-      buckets->next = buckets;
-      buckets++;
-    }
+  table = XLMalloc (sizeof *table);
+  AllocSlots (table, real_size);
 
   return table;
 }
 
-static void
-Insque (XLAssoc *velem, XLAssoc *vprev)
+static XLAssoc *
+FindSlot (XLAssocTable *table, XID x_id)
 {
-  XLAssoc *elem, *prev, *next;
+  int i;
 
-  elem = velem;
-  prev = vprev;
-  next = prev->next;
+  /* Return the slot holding X_ID, or the empty slot where it should
+     be inserted.  The table is never full, so this terminates.  */
+  i = AssocHash (table, x_id);
 
-  prev->next = elem;
-  if (next)
-    next->prev = elem;
-  elem->next = next;
-  elem->prev = prev;
+  while (table->slots[i].data && table->slots[i].x_id != x_id)
+    i = (i + 1) & (table->size - 1);
+
+  return &table->slots[i];
 }
 
 static void
-Remque (XLAssoc *velem)
+GrowAssocTable (XLAssocTable *table)
 {
-  XLAssoc *elem, *prev, *next;
+  XLAssoc *old_slots, *slot;
+  int old_size, i;
 
-  elem = velem;
-  next = elem->next;
-  prev = elem->prev;
+  old_slots = table->slots;
+  old_size = table->size;
 
-  if (next)
-    next->prev = prev;
+  AllocSlots (table, old_size * 2);
 
-  if (prev)
-    prev->next = next;
+  /* Reinsert each entry into the new slot array.  */
+  for (i = 0; i < old_size; ++i)
+    {
+      if (!old_slots[i].data)
+	continue;
+
+      slot = FindSlot (table, old_slots[i].x_id);
+      *slot = old_slots[i];
+      table->count++;
+    }
+
+  XLFree (old_slots);
 }
 
 void
 XLMakeAssoc (XLAssocTable *table, XID x_id, void *data)
 {
-  int hash;
-  XLAssoc *bucket, *entry, *new_entry;
-
-  hash = x_id % table->size;
-  bucket = &table->buckets[hash];
-  entry = bucket->next;
+  XLAssoc *slot;
 
-  if (entry != bucket)
+  if (!data)
     {
-      /* Bucket isn't empty, start searching.  */
+      /* Associating NULL is indistinguishable from having no
+	 association at all.  */
+      XLDeleteAssoc (table, x_id);
+      return;
+    }
 
-      for (; entry != bucket; entry = entry->next)
-	{
-	  if (entry->x_id == x_id)
-	    {
-	      entry->data = data;
-	      return;
-	    }
+  slot = FindSlot (table, x_id);
 
-	  if (entry->x_id > x_id)
-	    break;
-	}
+  if (slot->data)
+    {
+      /* Replace the existing association.  */
+      slot->data = data;
+      return;
     }
 
-  /* Insert new_entry immediately before entry.  */
-
-  new_entry = XLMalloc (sizeof *new_entry);
-  new_entry->x_id = x_id;
-  new_entry->data = data;
+  /* Grow the table if it is about to become more than half full.  */
+  if ((table->count + 1) * 2 > table->size)
+    {
+      GrowAssocTable (table);
+      slot = FindSlot (table, x_id);
+    }
 
-  Insque (new_entry, entry->prev);
+  slot->x_id = x_id;
+  slot->data = data;
+  table->count++;
 }
 
 void *
 XLLookUpAssoc (XLAssocTable *table, XID x_id)
 {
-  int hash;
-  XLAssoc *bucket, *entry;
-
-  hash = x_id % table->size;
-  bucket = &table->buckets[hash];
-  entry = bucket->next;
-
-  for (; entry != bucket; entry = entry->next)
-    {
-      if (entry->x_id == x_id)
-	return entry->data;
-
-      if (entry->x_id > x_id)
-	return NULL;
-    }
-
-  return NULL;
+  return FindSlot (table, x_id)->data;
 }
 
 void
 XLDeleteAssoc (XLAssocTable *table, XID x_id)
 {
-  int hash;
-  XLAssoc *bucket, *entry;
+  int i, j, home, mask;
 
-  hash = x_id % table->size;
-  bucket = &table->buckets[hash];
-  entry = bucket->next;
+  mask = table->size - 1;
+  i = FindSlot (table, x_id) - table->slots;
 
-  for (; entry != bucket; entry = entry->next)
-    {
-      if (entry->x_id == x_id)
-	{
-	  Remque (entry);
-	  XLFree (entry);
-	  return;
-	}
+  if (!table->slots[i].data)
+    return;
 
-      if (entry->x_id > x_id)
-	return;
-    }
-}
+  table->count--;
 
-void
-XLDestroyAssocTable (XLAssocTable *table)
-{
-  int i;
-  XLAssoc *bucket, *entry, *entry_next;
+  /* Move subsequent entries in the same run back into the hole, so
+     that no tombstones are required.  An entry can move to the hole
+     at I if its home slot is not cyclically between I (exclusive) and
+     its current slot J (inclusive).  */
+  j = i;
 
-  for (i = 0; i < table->size; i++)
+  while (True)
     {
-      bucket = &table->buckets[i];
+      j = (j + 1) & mask;
+
+      if (!table->slots[j].data)
+	break;
 
-      for (entry = bucket->next; entry != bucket;
-	   entry = entry_next)
+      home = AssocHash (table, table->slots[j].x_id);
+
+      if (((j - home) & mask) >= ((j - i) & mask))
 	{
-	  entry_next = entry->next;
-	  XLFree (entry);
+	  table->slots[i] = table->slots[j];
+	  i = j;
 	}
     }
 
-  XLFree (table->buckets);
+  table->slots[i].data = NULL;
+}
+
+void
+XLDestroyAssocTable (XLAssocTable *table)
+{
+  XLFree (table->slots);
   XLFree (table);
 }
 
@@ -403,6 +417,21 @@ XLExtendRegion (pixman_region32_t *dst, pixman_region32_t *src,
     XLFree (dst_rects);
 }
 
+/* Translate SRC by the possibly fractional X and Y, and put the result
+   in DST.  Each box is widened to include every pixel it partially
+   covers after being translated.  */
+
+void
+XLOffsetRegion (pixman_region32_t *dst, pixman_region32_t *src,
+		double x, double y)
+{
+  pixman_region32_copy (dst, src);
+  pixman_region32_translate (dst, floor (x), floor (y));
+
+  if (floor (x) != x || floor (y) != y)
+    XLExtendRegion (dst, dst, floor (x) != x, floor (y) != y);
+}
+
 void
 XLTransformRegion (pixman_region32_t *dst, pixman_region32_t *src,
 		   BufferTransform transform, int width, int height)
@@ -478,10 +507,12 @@ XLGetServerTimeRoundtrip (void)
 {
   XEvent event;
 
+  BeginRoundTrip ();
   XChangeProperty (compositor.display, selection_transfer_window,
 		   _XL_SERVER_TIME_ATOM, XA_ATOM, 32, PropModeReplace,
 		   (unsigned char *) &_XL_SERVER_TIME_ATOM, 1);
   XIfEvent (compositor.display, &event, ServerTimePredicate, NULL);
+  EndRoundTrip ("GetServerTime");
 
   return event.xproperty.time;
 }
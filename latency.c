@@ -0,0 +1,451 @@
+/* Wayland compositor running on top of an X server.
+
+Copyright (C) 2022 to various contributors.
+
+This file is part of 12to11.
+
+12to11 is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+12to11 is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "compositor.h"
+#include "12to11-debug.h"
+
+/* Commit-to-present latency tracing.  The time at which the contents
+   of each window are committed by the client, composited, flushed to
+   the X server and finally presented is recorded.  Commits to
+   subsurfaces are attributed to their root surface, since that is
+   what is composited.
+
+   The time between the first commit of each frame and its
+   presentation is kept in a histogram belonging to the root surface,
+   which can be read through the debug_manager protocol or printed by
+   sending the compositor SIGUSR1.  In addition, each stage of each
+   frame can be written to a file in the JSON trace event format
+   understood by Perfetto and chrome://tracing, by setting the
+   "latencyTraceFile" resource to the name of that file.  */
+
+enum
+  {
+    /* The number of histogram buckets.  Bucket N counts frames
+       taking between 2 ** N and 2 ** (N + 1) microseconds.  */
+    LatencyBuckets = 24,
+  };
+
+enum
+  {
+    /* The surface was committed, but has not yet been composited.  */
+    TraceCommitted  = 1,
+    /* The surface is being composited or presented.  */
+    TraceComposited = 1 << 1,
+    /* The requests to present the surface have been flushed.  */
+    TraceFlushed    = 1 << 2,
+  };
+
+typedef struct _LatencyTrace LatencyTrace;
+
+struct _LatencyTrace
+{
+  /* The surface being traced.  */
+  Surface *surface;
+
+  /* The next and last traces in the list of all traces.  */
+  LatencyTrace *next, *last;
+
+  /* The next and last traces waiting for requests to be flushed.  */
+  LatencyTrace *flush_next, *flush_last;
+
+  /* The time of the first commit that has not yet been
+     composited.  */
+  struct timespec commit_time;
+
+  /* The time of the first commit of the frame being presented, and
+     the times at which it was composited and flushed.  */
+  struct timespec frame_commit_time, composite_time, flush_time;
+
+  /* Some flags.  */
+  int flags;
+
+  /* The number of frames presented, and the total and maximum
+     latency, in microseconds.  */
+  uint64_t count, total, max;
+
+  /* The histogram.  */
+  uint32_t histogram[LatencyBuckets];
+};
+
+/* List of all traces.  */
+static LatencyTrace all_traces;
+
+/* List of traces waiting for a flush.  */
+static LatencyTrace flush_traces;
+
+/* The trace file, or NULL.  */
+static FILE *trace_file;
+
+static uint64_t
+TimespecToUs (struct timespec timespec)
+{
+  return (timespec.tv_sec * (uint64_t) 1000000
+	  + timespec.tv_nsec / 1000);
+}
+
+static void
+UnlinkFromFlush (LatencyTrace *trace)
+{
+  if (!trace->flush_next)
+    return;
+
+  trace->flush_next->flush_last = trace->flush_last;
+  trace->flush_last->flush_next = trace->flush_next;
+  trace->flush_next = NULL;
+  trace->flush_last = NULL;
+}
+
+static void
+FreeLatencyTrace (void *data)
+{
+  LatencyTrace *trace;
+
+  trace = data;
+
+  /* Unlink the trace.  It is freed by the surface.  */
+  trace->next->last = trace->last;
+  trace->last->next = trace->next;
+  UnlinkFromFlush (trace);
+}
+
+static LatencyTrace *
+GetLatencyTrace (Surface *surface)
+{
+  LatencyTrace *trace;
+
+  trace = XLSurfaceGetClientData (surface, LatencyTraceData,
+				  sizeof *trace, FreeLatencyTrace);
+
+  if (!trace->surface)
+    {
+      /* The trace was just created.  Link it onto the list of all
+	 traces.  */
+      trace->surface = surface;
+      trace->next = all_traces.next;
+      trace->last = &all_traces;
+      all_traces.next->last = trace;
+      all_traces.next = trace;
+    }
+
+  return trace;
+}
+
+static void
+GetSurfaceIds (Surface *surface, uint32_t *pid, uint32_t *id)
+{
+  pid_t client_pid;
+
+  *pid = 0;
+  *id = 0;
+
+  if (!surface->resource)
+    return;
+
+  wl_client_get_credentials (wl_resource_get_client (surface->resource),
+			     &client_pid, NULL, NULL);
+  *pid = client_pid;
+  *id = wl_resource_get_id (surface->resource);
+}
+
+static void
+WriteTraceEvent (const char *name, uint32_t pid, uint32_t id,
+		 struct timespec start, struct timespec end)
+{
+  fprintf (trace_file, "{\"name\":\"%s\",\"cat\":\"latency\",\"ph\":\"X\","
+	   "\"pid\":%"PRIu32",\"tid\":%"PRIu32",\"ts\":%"PRIu64","
+	   "\"dur\":%"PRIu64"},\n", name, pid, id,
+	   TimespecToUs (start),
+	   TimespecToUs (TimespecSub (end, start)));
+}
+
+static void
+WriteTrace (LatencyTrace *trace, struct timespec present_time)
+{
+  uint32_t pid, id;
+
+  GetSurfaceIds (trace->surface, &pid, &id);
+
+  WriteTraceEvent ("commit", pid, id, trace->frame_commit_time,
+		   trace->composite_time);
+
+  if (trace->flags & TraceFlushed)
+    {
+      WriteTraceEvent ("composite", pid, id, trace->composite_time,
+		       trace->flush_time);
+      WriteTraceEvent ("present", pid, id, trace->flush_time,
+		       present_time);
+    }
+  else
+    WriteTraceEvent ("composite", pid, id, trace->composite_time,
+		     present_time);
+}
+
+void
+XLTraceCommit (Surface *surface)
+{
+  LatencyTrace *trace;
+
+  /* Record the time of the first commit since the last composite.  */
+  trace = GetLatencyTrace (XLSubsurfaceGetRoot (surface));
+
+  if (trace->flags & TraceCommitted)
+    return;
+
+  trace->commit_time = CurrentTimespec ();
+  trace->flags |= TraceCommitted;
+}
+
+void
+XLTraceComposite (Surface *surface)
+{
+  LatencyTrace *trace;
+
+  trace = XLSurfaceFindClientData (surface, LatencyTraceData);
+
+  if (!trace || !(trace->flags & TraceCommitted))
+    /* Nothing was committed, so this composite is not the result
+       of a commit.  */
+    return;
+
+  /* If the last frame has not yet been presented, then it is simply
+     superseded by this one.  */
+  trace->frame_commit_time = trace->commit_time;
+  trace->composite_time = CurrentTimespec ();
+  trace->flags &= ~(TraceCommitted | TraceFlushed);
+  trace->flags |= TraceComposited;
+
+  /* Wait for the requests to be flushed.  */
+  if (!trace->flush_next)
+    {
+      trace->flush_next = flush_traces.flush_next;
+      trace->flush_last = &flush_traces;
+      flush_traces.flush_next->flush_last = trace;
+      flush_traces.flush_next = trace;
+    }
+}
+
+void
+XLTraceFlush (void)
+{
+  LatencyTrace *trace;
+  struct timespec now;
+
+  if (flush_traces.flush_next == &flush_traces)
+    return;
+
+  now = CurrentTimespec ();
+
+  while (flush_traces.flush_next != &flush_traces)
+    {
+      trace = flush_traces.flush_next;
+      trace->flush_time = now;
+      trace->flags |= TraceFlushed;
+      UnlinkFromFlush (trace);
+    }
+}
+
+void
+XLTracePresent (Surface *surface)
+{
+  LatencyTrace *trace;
+  struct timespec now;
+  uint64_t usec;
+  int bucket;
+
+  trace = XLSurfaceFindClientData (surface, LatencyTraceData);
+
+  if (!trace || !(trace->flags & TraceComposited))
+    return;
+
+  now = CurrentTimespec ();
+  usec = TimespecToUs (TimespecSub (now, trace->frame_commit_time));
+
+  trace->count++;
+  trace->total += usec;
+
+  if (usec > trace->max)
+    trace->max = usec;
+
+  /* Find the bucket.  */
+  bucket = 0;
+
+  while (bucket < LatencyBuckets - 1
+	 && usec >= ((uint64_t) 2 << bucket))
+    bucket++;
+
+  trace->histogram[bucket]++;
+
+  if (trace_file)
+    WriteTrace (trace, now);
+
+  trace->flags &= ~(TraceComposited | TraceFlushed);
+  UnlinkFromFlush (trace);
+}
+
+void
+XLDumpSurfaceLatencies (void)
+{
+  LatencyTrace *trace;
+  uint32_t pid, id;
+  int i;
+
+  fprintf (stderr, "Commit-to-present latency of each surface:\n");
+
+  for (trace = all_traces.next; trace != &all_traces;
+       trace = trace->next)
+    {
+      if (!trace->count)
+	continue;
+
+      GetSurfaceIds (trace->surface, &pid, &id);
+      fprintf (stderr, "  surface %"PRIu32" of client %"PRIu32": %"PRIu64
+	       " frames, %"PRIu64" us average, %"PRIu64" us max\n",
+	       id, pid, trace->count, trace->total / trace->count,
+	       trace->max);
+
+      for (i = 0; i < LatencyBuckets; ++i)
+	{
+	  if (trace->histogram[i])
+	    fprintf (stderr, "    < %"PRIu64" us: %"PRIu32"\n",
+		     (uint64_t) 2 << i, trace->histogram[i]);
+	}
+    }
+
+  if (trace_file)
+    fflush (trace_file);
+}
+
+void
+XLSendSurfaceLatencies (struct wl_resource *resource)
+{
+  LatencyTrace *trace;
+  struct wl_array histogram;
+  uint32_t *data, pid, id;
+
+  for (trace = all_traces.next; trace != &all_traces;
+       trace = trace->next)
+    {
+      if (!trace->count)
+	continue;
+
+      wl_array_init (&histogram);
+      data = wl_array_add (&histogram, sizeof trace->histogram);
+
+      if (!data)
+	{
+	  wl_array_release (&histogram);
+	  wl_client_post_no_memory (wl_resource_get_client (resource));
+	  return;
+	}
+
+      memcpy (data, trace->histogram, sizeof trace->histogram);
+      GetSurfaceIds (trace->surface, &pid, &id);
+      debug_manager_send_surface_latency (resource, pid, id,
+					  MIN (trace->count, UINT32_MAX),
+					  trace->total >> 32,
+					  trace->total & 0xffffffff,
+					  MIN (trace->max, UINT32_MAX),
+					  &histogram);
+      wl_array_release (&histogram);
+    }
+
+  debug_manager_send_surface_latencies_done (resource);
+}
+
+void
+XLResetSurfaceLatencies (void)
+{
+  LatencyTrace *trace;
+
+  for (trace = all_traces.next; trace != &all_traces;
+       trace = trace->next)
+    {
+      trace->count = 0;
+      trace->total = 0;
+      trace->max = 0;
+      memset (trace->histogram, 0, sizeof trace->histogram);
+    }
+}
+
+static const char *
+ReadTraceFileResource (void)
+{
+  XrmDatabase rdb;
+  XrmName namelist[3];
+  XrmClass classlist[3];
+  XrmValue value;
+  XrmRepresentation type;
+
+  rdb = XrmGetDatabase (compositor.display);
+
+  if (!rdb)
+    return NULL;
+
+  namelist[1] = XrmStringToQuark ("latencyTraceFile");
+  namelist[0] = app_quark;
+  namelist[2] = NULLQUARK;
+
+  classlist[1] = XrmStringToQuark ("LatencyTraceFile");
+  classlist[0] = resource_quark;
+  classlist[2] = NULLQUARK;
+
+  if (XrmQGetResource (rdb, namelist, classlist,
+		       &type, &value)
+      && type == QString)
+    return (const char *) value.addr;
+
+  return NULL;
+}
+
+void
+XLInitLatencyTraces (void)
+{
+  const char *name;
+
+  all_traces.next = &all_traces;
+  all_traces.last = &all_traces;
+  flush_traces.flush_next = &flush_traces;
+  flush_traces.flush_last = &flush_traces;
+
+  name = ReadTraceFileResource ();
+
+  if (!name)
+    return;
+
+  trace_file = fopen (name, "w");
+
+  if (!trace_file)
+    {
+      perror ("fopen");
+      return;
+    }
+
+  /* The compositor is usually stopped by a signal, which does not
+     flush stdio buffers, so write each event as soon as it is
+     complete.  Every event is a single line.  */
+  setvbuf (trace_file, NULL, _IOLBF, 0);
+
+  /* The closing bracket of the array of events is optional, so the
+     file remains valid even though it is never written.  */
+  fputs ("[\n", trace_file);
+}
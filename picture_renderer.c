@@ -39,11 +39,13 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 
 typedef struct _DrmFormatInfo DrmFormatInfo;
 typedef struct _DmaBufRecord DmaBufRecord;
+typedef struct _ShmSegment ShmSegment;
 typedef struct _DrmModifierName DrmModifierName;
 
 typedef struct _BackBuffer BackBuffer;
 
 typedef struct _PictureBuffer PictureBuffer;
+typedef struct _ShmBufferData ShmBufferData;
 typedef struct _PictureTarget PictureTarget;
 typedef struct _PresentRecord PresentRecord;
 
@@ -51,6 +53,8 @@ typedef struct _BufferActivityRecord BufferActivityRecord;
 typedef struct _IdleCallback IdleCallback;
 typedef struct _PresentCompletionCallback PresentCompletionCallback;
 
+typedef enum _ShadowMode ShadowMode;
+
 struct _DrmModifierName
 {
   /* The modifier name.  */
@@ -82,7 +86,7 @@ struct _PresentRecord
 };
 
 /* Structure describing buffer activity.  It is linked onto 3 (!!!)
-   lists.  */
+   lists.  The global list is kept sorted by ID.  */
 
 struct _BufferActivityRecord
 {
@@ -126,6 +130,8 @@ enum
   {
     CanPresent = 1,
     IsOpaque   = (1 << 1),
+    IsShadowed = (1 << 2),
+    CanRelease = (1 << 3),
   };
 
 struct _PictureBuffer
@@ -156,8 +162,72 @@ struct _PictureBuffer
 
   /* Ongoing buffer activity.  */
   BufferActivityRecord activity;
+
+  /* Activity record used for the first target the buffer is drawn
+     onto, to avoid allocating a record in the common case of a
+     buffer that is only drawn to a single target.  It is not in use
+     if its buffer field is NULL.  */
+  BufferActivityRecord embedded_activity;
+
+  /* Information about the shared memory backing this buffer, or NULL
+     if it is not a shared memory buffer.  */
+  ShmBufferData *shm;
 };
 
+/* Structure describing the shared memory backing a buffer.  Such
+   buffers can be "shadowed": their contents are then copied to a
+   pixmap owned by the compositor upon each update, and that pixmap is
+   used for compositing instead of the shared memory itself, so that
+   the client's buffer can be released immediately after commit.  */
+
+struct _ShmBufferData
+{
+  /* Pointer to a pointer to the pool data.  */
+  void **data;
+
+  /* The offset and stride of the buffer within the pool.  */
+  int32_t offset, stride;
+
+  /* The picture format of the buffer.  */
+  XRenderPictFormat *format;
+
+  /* The picture and pixmap backed by the shared memory segment, if
+     the buffer is shadowed.  The buffer's own picture and pixmap are
+     then the shadow picture and pixmap.  */
+  Picture picture;
+  Pixmap pixmap;
+
+  /* The time of the last update to this buffer.  */
+  struct timespec last_update;
+
+  /* The number of consecutive updates that arrived in quick
+     succession.  */
+  int rapid_updates;
+};
+
+enum _ShadowMode
+  {
+    /* Never shadow buffers.  */
+    ShadowNever,
+    /* Shadow all shared memory buffers.  */
+    ShadowAlways,
+    /* Shadow small or frequently updated buffers.  */
+    ShadowAuto,
+  };
+
+/* Shared memory buffers no larger than this many pixels are shadowed
+   in the ShadowAuto mode.  */
+#define ShadowSmallBufferArea		(256 * 256)
+
+/* Two updates closer together than this many nanoseconds are
+   considered to have happened in quick succession.  */
+#define ShadowRapidUpdateInterval	50000000
+
+/* In the ShadowAuto mode, shadow buffers after this many consecutive
+   updates in quick succession, if each only damages a small part of
+   the buffer.  */
+#define ShadowRapidUpdateThreshold	4
+
 enum
   {
     JustPresented  = 1,
@@ -325,6 +395,12 @@ struct _DmaBufRecord
   short width, height;
 };
 
+struct _ShmSegment
+{
+  /* The MIT-SHM segment attached for a shared memory pool.  */
+  xcb_shm_seg_t seg;
+};
+
 /* Number of format modifiers specified by the user.  */
 static int num_specified_modifiers;
 
@@ -463,6 +539,13 @@ static dev_t *render_devices;
 /* The number of device nodes.  */
 static int num_render_devices;
 
+/* Which shared memory buffers are shadowed.  */
+static ShadowMode shadow_mode;
+
+/* Graphics contexts used to upload the contents of shadowed buffers
+   with depths of 24 and 32.  */
+static GC shadow_gc_24, shadow_gc_32;
+
 /* XRender, DRI3 and XPresent-based renderer.  A RenderTarget is just
    a Picture.  Here is a rough explanation of how the buffer release
    machinery works.
@@ -545,21 +628,43 @@ FindBufferActivityRecord (PictureBuffer *buffer, PictureTarget *target)
 {
   BufferActivityRecord *record;
 
-  /* Look through the global activity list for a record matching
-     the given values.  */
-  record = all_activity.global_next;
-  while (record != &all_activity)
+  /* Look through the buffer's activity list for a record matching
+     the given target.  A buffer is seldom drawn onto more than one or
+     two targets, so this is much faster than searching through all
+     activity.  */
+  record = buffer->activity.buffer_next;
+  while (record != &buffer->activity)
     {
-      if (record->buffer == buffer
-	  && record->target == target)
+      if (record->target == target)
 	return record;
 
-      record = record->global_next;
+      record = record->buffer_next;
     }
 
   return NULL;
 }
 
+static void
+LinkActivityRecordLast (BufferActivityRecord *record)
+{
+  /* Link RECORD onto the end of the global list.  Round trip IDs
+     increase monotonically, so this keeps the list sorted.  */
+  record->global_next = &all_activity;
+  record->global_last = all_activity.global_last;
+  all_activity.global_last->global_next = record;
+  all_activity.global_last = record;
+}
+
+static void
+FreeActivityRecord (BufferActivityRecord *record)
+{
+  if (record == &record->buffer->embedded_activity)
+    /* Mark the embedded record as no longer in use.  */
+    record->buffer = NULL;
+  else
+    XLFree (record);
+}
+
 /* Record buffer activity involving the given buffer and target.  */
 
 static void
@@ -573,16 +678,18 @@ RecordBufferActivity (PictureBuffer *buffer, PictureTarget *target,
 
   if (!record)
     {
-      record = XLMalloc (sizeof *record);
+      if (!buffer->embedded_activity.buffer)
+	record = &buffer->embedded_activity;
+      else
+	record = XLMalloc (sizeof *record);
 
       /* Buffer activity is actually linked on 3 different lists:
 
-	 - a global list, which is used to actually look up buffer
-           activity in response to events.  A list is faster than a
-           hash table, as there is not much activity going on at any
-           given time.
+	 - a global list sorted by ID, which is used to actually look
+           up buffer activity in response to events.
 
-	 - a buffer list, which is used to remove buffer activity on
+	 - a buffer list, which is used to look up the record for a
+           given buffer and target, and to remove buffer activity on
            buffer destruction.
 
 	 - a target list, which is used to remove buffer activity on
@@ -591,20 +698,24 @@ RecordBufferActivity (PictureBuffer *buffer, PictureTarget *target,
       record->buffer_last = &buffer->activity;
       record->target_next = target->activity.target_next;
       record->target_last = &target->activity;
-      record->global_next = all_activity.global_next;
-      record->global_last = &all_activity;
       buffer->activity.buffer_next->buffer_last = record;
       buffer->activity.buffer_next = record;
       target->activity.target_next->target_last = record;
       target->activity.target_next = record;
-      all_activity.global_next->global_last = record;
-      all_activity.global_next = record;
 
       /* Set the appropriate values.  */
       record->buffer = buffer;
       record->target = target;
     }
+  else
+    {
+      /* Move the record to the end of the global list, since its ID
+	 is about to become the largest.  */
+      record->global_last->global_next = record->global_next;
+      record->global_next->global_last = record->global_last;
+    }
 
+  LinkActivityRecordLast (record);
   record->id = roundtrip_id;
 }
 
@@ -688,33 +799,31 @@ UnlinkActivityRecord (BufferActivityRecord *record)
 static void
 HandleActivityEvent (uint64_t counter)
 {
-  BufferActivityRecord *record, *last;
+  BufferActivityRecord *record;
+  PictureBuffer *buffer;
+  PictureTarget *target;
 
-  /* Look through the global activity list for a record matching
-     counter.  */
-  record = all_activity.global_next;
-  while (record != &all_activity)
+  /* The global activity list is sorted by ID, so the records that
+     have been completed are all at its start.  */
+  while (all_activity.global_next != &all_activity
+	 && all_activity.global_next->id <= counter)
     {
-      last = record;
-      record = record->global_next;
-
-      if (last->id == counter)
-	{
-	  /* Remove the record.  Then, run any callbacks pertaining to
-	     it.  This code mandates that there only be a single
-	     activity record for each buffer-target combination on the
-	     global list at any given time.  */
-	  UnlinkActivityRecord (last);
-	  MaybeRunIdleCallbacks (last->buffer, last->target);
-
-	  /* Free the record.  */
-	  XLFree (last);
-	}
+      record = all_activity.global_next;
+      buffer = record->buffer;
+      target = record->target;
+
+      /* Remove and free the record.  Then, run any callbacks
+	 pertaining to it.  This code mandates that there only be a
+	 single activity record for each buffer-target combination on
+	 the global list at any given time.  The record must be freed
+	 first, as the idle callbacks can free the buffer containing
+	 it.  */
+      UnlinkActivityRecord (record);
+      FreeActivityRecord (record);
+      MaybeRunIdleCallbacks (buffer, target);
     }
 }
 
-
-
 static void
 FreeBackBuffer (PictureTarget *target, BackBuffer *buffer)
 {
@@ -1431,7 +1540,7 @@ DestroyRenderTarget (RenderTarget target)
       activity_record = activity_record->target_next;
 
       UnlinkActivityRecord (activity_last);
-      XLFree (activity_last);
+      FreeActivityRecord (activity_last);
     }
 
   /* Free all idle callbacks on this target.  */
@@ -1678,6 +1787,27 @@ MaybeApplyTransform (PictureBuffer *buffer, DrawParams *params)
   buffer->params = *params;
 }
 
+static void
+NoteBufferUsed (PictureTarget *picture_target,
+		PictureBuffer *picture_buffer)
+{
+  XLList *tem;
+
+  for (tem = picture_target->buffers_used; tem; tem = tem->next)
+    {
+      /* Return if the buffer is already in the buffers_used list.  */
+
+      if (tem->data == picture_buffer)
+	return;
+    }
+
+  /* Record pending buffer activity; the roundtrip message is then
+     sent later.  */
+
+  picture_target->buffers_used
+    = XLListPrepend (picture_target->buffers_used, picture_buffer);
+}
+
 static void
 Composite (RenderBuffer buffer, RenderTarget target,
 	   Operation op, int src_x, int src_y, int x, int y,
@@ -1685,7 +1815,6 @@ Composite (RenderBuffer buffer, RenderTarget target,
 {
   PictureBuffer *picture_buffer;
   PictureTarget *picture_target;
-  XLList *tem;
 
   picture_buffer = buffer.pointer;
   picture_target = target.pointer;
@@ -1707,19 +1836,94 @@ Composite (RenderBuffer buffer, RenderTarget target,
 		    /* dst-x, dst-y, width, height.  */
 		    x, y, width, height);
 
-  for (tem = picture_target->buffers_used; tem; tem = tem->next)
+  NoteBufferUsed (picture_target, picture_buffer);
+}
+
+static void
+CompositeBoxes (RenderBuffer buffer, RenderTarget target,
+		Operation op, pixman_box32_t *boxes, int nboxes,
+		int src_x, int src_y, int x, int y,
+		DrawParams *draw_params)
+{
+  PictureBuffer *picture_buffer;
+  PictureTarget *picture_target;
+  XRectangle *rects;
+  XRenderPictureAttributes attrs;
+  pixman_box32_t extents;
+  int i;
+
+  if (nboxes < 1)
+    return;
+
+  if (nboxes < 3)
     {
-      /* Return if the buffer is already in the buffers_used list.  */
+      /* Setting and clearing the clip costs two requests, so just
+	 composite a small number of boxes individually.  */
+      for (i = 0; i < nboxes; ++i)
+	Composite (buffer, target, op, boxes[i].x1 - src_x,
+		   boxes[i].y1 - src_y, boxes[i].x1 - x,
+		   boxes[i].y1 - y, BoxWidth (boxes[i]),
+		   BoxHeight (boxes[i]), draw_params);
 
-      if (tem->data == picture_buffer)
-	return;
+      return;
     }
 
-  /* Record pending buffer activity; the roundtrip message is then
-     sent later.  */
+  picture_buffer = buffer.pointer;
+  picture_target = target.pointer;
 
-  picture_target->buffers_used
-    = XLListPrepend (picture_target->buffers_used, picture_buffer);
+  /* Ensure a back buffer is created.  */
+  EnsurePicture (picture_target);
+
+  /* Maybe set the transform if the parameters changed.  */
+  MaybeApplyTransform (picture_buffer, draw_params);
+
+  if (nboxes < 256)
+    rects = alloca (sizeof *rects * nboxes);
+  else
+    rects = XLMalloc (sizeof *rects * nboxes);
+
+  /* Pacify GCC.  */
+  memset (rects, 0, sizeof *rects * nboxes);
+  extents = boxes[0];
+
+  for (i = 0; i < nboxes; ++i)
+    {
+      rects[i].x = BoxStartX (boxes[i]) - x;
+      rects[i].y = BoxStartY (boxes[i]) - y;
+      rects[i].width = BoxWidth (boxes[i]);
+      rects[i].height = BoxHeight (boxes[i]);
+
+      extents.x1 = MIN (extents.x1, boxes[i].x1);
+      extents.y1 = MIN (extents.y1, boxes[i].y1);
+      extents.x2 = MAX (extents.x2, boxes[i].x2);
+      extents.y2 = MAX (extents.y2, boxes[i].y2);
+    }
+
+  /* Clip the target picture to the boxes, and composite their extents
+     in one request.  Since the offset between the source and
+     destination is the same for every box, this draws the same
+     pixels as compositing each box individually.  */
+  XRenderSetPictureClipRectangles (compositor.display,
+				   picture_target->picture, 0, 0,
+				   rects, nboxes);
+  XRenderComposite (compositor.display, ConvertOperation (op),
+		    picture_buffer->picture, None,
+		    picture_target->picture,
+		    /* src-x, src-y, mask-x, mask-y.  */
+		    extents.x1 - src_x, extents.y1 - src_y, 0, 0,
+		    /* dst-x, dst-y, width, height.  */
+		    extents.x1 - x, extents.y1 - y,
+		    BoxWidth (extents), BoxHeight (extents));
+
+  /* Clear the clip again.  */
+  attrs.clip_mask = None;
+  XRenderChangePicture (compositor.display, picture_target->picture,
+			CPClipMask, &attrs);
+
+  if (nboxes >= 256)
+    XLFree (rects);
+
+  NoteBufferUsed (picture_target, picture_buffer);
 }
 
 static RenderCompletionKey
@@ -2035,6 +2239,7 @@ static RenderFuncs picture_render_funcs =
     .fill_boxes_with_transparency = FillBoxesWithTransparency,
     .clear_rectangle = ClearRectangle,
     .composite = Composite,
+    .composite_boxes = CompositeBoxes,
     .finish_render = FinishRender,
     .cancel_completion_callback = CancelCompletionCallback,
     .target_age = TargetAge,
@@ -2045,6 +2250,11 @@ static RenderFuncs picture_render_funcs =
     .present_to_window = PresentToWindow,
     .notify_msc = NotifyMsc,
     .cancel_presentation_callback = CancelPresentationCallback,
+    /* Boxes are composited through a clip list, but the X server
+       still performs a separate compositing operation for each
+       box.  */
+    .request_cost = 1024,
+    .pixel_cost = 1,
   };
 
 static void
@@ -2192,6 +2402,10 @@ FindSupportedModifiers (int *pair_count_return)
   /* Delete the temporary window used to query for modifiers.  */
   XDestroyWindow (compositor.display, check_window);
 
+  /* The requests were all sent at once, so waiting for their replies
+     counts as a single round trip.  */
+  BeginRoundTrip ();
+
   for (i = 0; i < ArrayElements (all_formats); ++i)
     {
       if (!all_formats[i].format)
@@ -2226,6 +2440,8 @@ FindSupportedModifiers (int *pair_count_return)
       free (reply);
     }
 
+  EndRoundTrip ("DRI3GetSupportedModifiers");
+
   *pair_count_return = pair_count;
 }
 
@@ -2367,8 +2583,10 @@ GetRenderDevices (int *num_devices)
   /* Get a list of all providers on the default screen.  */
   cookie = xcb_randr_get_providers (compositor.conn,
 				    root);
+  BeginRoundTrip ();
   reply = xcb_randr_get_providers_reply (compositor.conn,
 					 cookie, NULL);
+  EndRoundTrip ("RRGetProviders");
 
   if (!reply)
     return NULL;
@@ -2393,6 +2611,9 @@ GetRenderDevices (int *num_devices)
   devices = XLCalloc (nproviders + 1, sizeof *devices);
   ndevices = 0;
 
+  /* Likewise, the DRI3Open requests were all sent together.  */
+  BeginRoundTrip ();
+
   for (i = 0; i < nproviders; ++i)
     {
       open_reply = xcb_dri3_open_reply (compositor.conn, open_cookies[i],
@@ -2420,6 +2641,8 @@ GetRenderDevices (int *num_devices)
       ndevices++;
     }
 
+  EndRoundTrip ("DRI3Open");
+
   num_render_devices = ndevices;
   render_devices = devices;
 
@@ -2798,14 +3021,53 @@ PictFormatForFormat (uint32_t format)
     }
 }
 
+static ShmSegment *
+EnsureShmSegment (SharedMemoryAttributes *attributes)
+{
+  ShmSegment *segment;
+  int fd;
+
+  if (*attributes->pool_data)
+    return *attributes->pool_data;
+
+  /* Duplicate the fd, since XCB closes file descriptors after sending
+     them.  */
+  fd = fcntl (attributes->fd, F_DUPFD_CLOEXEC, 0);
+
+  if (fd < 0)
+    return NULL;
+
+  /* Attach a single segment for the whole pool.  Every buffer created
+     from the pool then creates its pixmap inside this segment, and
+     the segment is detached once the pool is resized or destroyed.
+     Pixmaps keep the memory mapped in the server even after the
+     segment is detached.  */
+  segment = XLMalloc (sizeof *segment);
+  segment->seg = xcb_generate_id (compositor.conn);
+  xcb_shm_attach_fd (compositor.conn, segment->seg, fd, false);
+
+  *attributes->pool_data = segment;
+  return segment;
+}
+
+static void
+FreeShmPoolData (void *data)
+{
+  ShmSegment *segment;
+
+  segment = data;
+  xcb_shm_detach (compositor.conn, segment->seg);
+  XLFree (segment);
+}
+
 static RenderBuffer
 BufferFromShm (SharedMemoryAttributes *attributes, Bool *error)
 {
   XRenderPictureAttributes picture_attrs;
-  xcb_shm_seg_t seg;
+  ShmSegment *segment;
   Pixmap pixmap;
   Picture picture;
-  int fd, depth, format, bpp;
+  int depth, format, bpp;
   PictureBuffer *buffer;
   XRenderPictFormat *pict_format;
 
@@ -2818,11 +3080,11 @@ BufferFromShm (SharedMemoryAttributes *attributes, Bool *error)
       return (RenderBuffer) NULL;
     }
 
-  /* Duplicate the fd, since XCB closes file descriptors after sending
-     them.  */
-  fd = fcntl (attributes->fd, F_DUPFD_CLOEXEC, 0);
+  /* Attach the pool's shared memory segment, if that has not yet
+     been done.  */
+  segment = EnsureShmSegment (attributes);
 
-  if (fd < 0)
+  if (!segment)
     {
       *error = True;
       return (RenderBuffer) NULL;
@@ -2832,17 +3094,14 @@ BufferFromShm (SharedMemoryAttributes *attributes, Bool *error)
   pict_format = PictFormatForFormat (format);
   XLAssert (pict_format != NULL);
 
-  /* Now, allocate the XIDs for the shm segment and pixmap.  */
-  seg = xcb_generate_id (compositor.conn);
+  /* Now, allocate the XID for the pixmap.  */
   pixmap = xcb_generate_id (compositor.conn);
 
-  /* Create the segment and attach the pixmap to it.  */
-  xcb_shm_attach_fd (compositor.conn, seg, fd, false);
+  /* Create the pixmap at the buffer's offset into the segment.  */
   xcb_shm_create_pixmap (compositor.conn, pixmap,
 			 DefaultRootWindow (compositor.display),
 			 attributes->width, attributes->height,
-			 depth, seg, attributes->offset);
-  xcb_shm_detach (compositor.conn, seg);
+			 depth, segment->seg, attributes->offset);
 
   /* Create the picture for the pixmap.  */
   picture = XRenderCreatePicture (compositor.display, pixmap,
@@ -2876,6 +3135,14 @@ BufferFromShm (SharedMemoryAttributes *attributes, Bool *error)
   if (!pict_format->direct.alphaMask)
     buffer->flags |= IsOpaque;
 
+  /* Record where the contents of the buffer are, in case it is
+     shadowed later on.  */
+  buffer->shm = XLCalloc (1, sizeof *buffer->shm);
+  buffer->shm->data = attributes->data;
+  buffer->shm->offset = attributes->offset;
+  buffer->shm->stride = attributes->stride;
+  buffer->shm->format = pict_format;
+
   /* Return the picture.  */
   return (RenderBuffer) (void *) buffer;
 }
@@ -3022,7 +3289,7 @@ FreeAnyBuffer (RenderBuffer buffer)
       activity_record = activity_record->buffer_next;
 
       UnlinkActivityRecord (activity_last);
-      XLFree (activity_last);
+      FreeActivityRecord (activity_last);
     }
 
   /* Run and free all idle callbacks.  */
@@ -3050,6 +3317,21 @@ FreeAnyBuffer (RenderBuffer buffer)
 static void
 FreeShmBuffer (RenderBuffer buffer)
 {
+  PictureBuffer *picture_buffer;
+
+  picture_buffer = buffer.pointer;
+
+  /* If the buffer is shadowed, free the picture and pixmap backed by
+     shared memory as well.  */
+  if (picture_buffer->flags & IsShadowed)
+    {
+      XFreePixmap (compositor.display,
+		   picture_buffer->shm->pixmap);
+      XRenderFreePicture (compositor.display,
+			  picture_buffer->shm->picture);
+    }
+
+  XLFree (picture_buffer->shm);
   FreeAnyBuffer (buffer);
 }
 
@@ -3083,8 +3365,10 @@ SetupMitShm (void)
     }
 
   cookie = xcb_shm_query_version (compositor.conn);
+  BeginRoundTrip ();
   reply = xcb_shm_query_version_reply (compositor.conn,
 				       cookie, NULL);
+  EndRoundTrip ("ShmQueryVersion");
 
   if (!reply)
     {
@@ -3119,6 +3403,45 @@ SetupMitShm (void)
     }
 }
 
+static void
+InitShadowMode (void)
+{
+  XrmDatabase rdb;
+  XrmName namelist[3];
+  XrmClass classlist[3];
+  XrmValue value;
+  XrmRepresentation type;
+
+  /* Shadow small or frequently updated buffers by default.  */
+  shadow_mode = ShadowAuto;
+
+  rdb = XrmGetDatabase (compositor.display);
+
+  if (!rdb)
+    return;
+
+  namelist[1] = XrmStringToQuark ("shadowBuffers");
+  namelist[0] = app_quark;
+  namelist[2] = NULLQUARK;
+
+  classlist[1] = XrmStringToQuark ("ShadowBuffers");
+  classlist[0] = resource_quark;
+  classlist[2] = NULLQUARK;
+
+  if (XrmQGetResource (rdb, namelist, classlist,
+		       &type, &value)
+      && type == QString)
+    {
+      if (!strcmp ((const char *) value.addr, "always"))
+	shadow_mode = ShadowAlways;
+      else if (!strcmp ((const char *) value.addr, "never"))
+	shadow_mode = ShadowNever;
+      else if (strcmp ((const char *) value.addr, "auto"))
+	fprintf (stderr, "Unknown value for shadowBuffers: %s\n",
+		 (const char *) value.addr);
+    }
+}
+
 static void
 InitBufferFuncs (void)
 {
@@ -3141,6 +3464,10 @@ InitBufferFuncs (void)
      work.  */
   SetupMitShm ();
 
+  /* Find out which shared memory buffers the user wants
+     shadowed.  */
+  InitShadowMode ();
+
   /* XRender should already have been set up; it is used for things
      other than rendering as well.  */
 
@@ -3150,8 +3477,10 @@ InitBufferFuncs (void)
   if (ext && ext->present)
     {
       cookie = xcb_dri3_query_version (compositor.conn, 1, 2);
+      BeginRoundTrip ();
       reply = xcb_dri3_query_version_reply (compositor.conn, cookie,
 					    NULL);
+      EndRoundTrip ("DRI3QueryVersion");
 
       if (!reply)
 	goto error;
@@ -3175,10 +3504,244 @@ InitBufferFuncs (void)
     free (reply);
 }
 
+static GC
+GetShadowGC (PictureBuffer *buffer)
+{
+  GC *gc;
+
+  if (buffer->depth == 32)
+    gc = &shadow_gc_32;
+  else
+    gc = &shadow_gc_24;
+
+  /* Create the graphics context with the shadow pixmap, which has the
+     right depth, if it does not yet exist.  */
+  if (!*gc)
+    *gc = XCreateGC (compositor.display, buffer->pixmap, 0, NULL);
+
+  return *gc;
+}
+
+static void
+UploadShadowContents (PictureBuffer *buffer, pixman_region32_t *damage)
+{
+  XImage *image;
+  GC gc;
+  pixman_box32_t *boxes, box;
+  int nboxes, i;
+
+  /* Make an image referring to the buffer contents in the shared
+     memory pool.  */
+  image = XCreateImage (compositor.display, NULL, buffer->depth,
+			ZPixmap, 0,
+			((char *) *buffer->shm->data
+			 + buffer->shm->offset),
+			buffer->width, buffer->height, 32,
+			buffer->shm->stride);
+
+  if (!image)
+    return;
+
+  /* Wayland buffer contents are always little-endian.  */
+  image->byte_order = LSBFirst;
+  gc = GetShadowGC (buffer);
+
+  if (!damage)
+    {
+      /* Upload the entire buffer.  */
+      XPutImage (compositor.display, buffer->pixmap, gc, image,
+		 0, 0, 0, 0, buffer->width, buffer->height);
+      RenderNoteUpload ((uint64_t) image->bytes_per_line
+			* buffer->height);
+    }
+  else
+    {
+      boxes = pixman_region32_rectangles (damage, &nboxes);
+
+      for (i = 0; i < nboxes; ++i)
+	{
+	  box = boxes[i];
+
+	  /* Clip the box to the buffer.  */
+	  box.x1 = MAX (box.x1, 0);
+	  box.y1 = MAX (box.y1, 0);
+	  box.x2 = MIN (box.x2, buffer->width);
+	  box.y2 = MIN (box.y2, buffer->height);
+
+	  if (box.x2 <= box.x1 || box.y2 <= box.y1)
+	    continue;
+
+	  XPutImage (compositor.display, buffer->pixmap, gc, image,
+		     box.x1, box.y1, box.x1, box.y1,
+		     box.x2 - box.x1, box.y2 - box.y1);
+	  RenderNoteUpload ((uint64_t) (box.x2 - box.x1)
+			    * (box.y2 - box.y1)
+			    * (image->bits_per_pixel / 8));
+	}
+    }
+
+  /* XPutImage copies the data into the output buffer (or writes it
+     to the display connection) before returning, so the client can
+     reuse its buffer from now on.  */
+  image->data = NULL;
+  XDestroyImage (image);
+}
+
+static void
+ShadowBuffer (PictureBuffer *buffer)
+{
+  XRenderPictureAttributes picture_attrs;
+  Pixmap pixmap;
+  Picture picture;
+
+  /* Create the shadow pixmap and picture.  */
+  pixmap = XCreatePixmap (compositor.display,
+			  DefaultRootWindow (compositor.display),
+			  buffer->width, buffer->height,
+			  buffer->depth);
+  picture = XRenderCreatePicture (compositor.display, pixmap,
+				  buffer->shm->format, 0,
+				  &picture_attrs);
+
+  /* Save the picture and pixmap backed by shared memory, and make the
+     shadow picture and pixmap the buffer's.  */
+  buffer->shm->picture = buffer->picture;
+  buffer->shm->pixmap = buffer->pixmap;
+  buffer->picture = picture;
+  buffer->pixmap = pixmap;
+  buffer->flags |= IsShadowed;
+
+  /* The new picture has the identity transform.  */
+  memset (&buffer->params, 0, sizeof buffer->params);
+
+  /* The shadow pixmap is overwritten by each update, so it cannot be
+     presented.  */
+  buffer->flags &= ~CanPresent;
+
+  /* Upload the entire contents of the buffer.  */
+  UploadShadowContents (buffer, NULL);
+}
+
+static Bool
+ShouldShadowBuffer (PictureBuffer *buffer, pixman_region32_t *damage)
+{
+  struct timespec now, interval;
+  pixman_box32_t *extents;
+  int64_t area, damaged_area;
+
+  switch (shadow_mode)
+    {
+    case ShadowNever:
+      return False;
+
+    case ShadowAlways:
+      return True;
+
+    default:
+      break;
+    }
+
+  area = (int64_t) buffer->width * buffer->height;
+
+  if (area <= ShadowSmallBufferArea)
+    return True;
+
+  /* See whether or not this update arrived in quick succession after
+     the last.  */
+  now = CurrentTimespec ();
+  interval = TimespecSub (now, buffer->shm->last_update);
+  buffer->shm->last_update = now;
+
+  if (interval.tv_sec
+      || interval.tv_nsec > ShadowRapidUpdateInterval)
+    {
+      buffer->shm->rapid_updates = 0;
+      return False;
+    }
+
+  /* Only buffers that are updated piecemeal are worth shadowing, as
+     the damage is uploaded through the display connection.  */
+
+  if (!damage)
+    damaged_area = area;
+  else
+    {
+      extents = pixman_region32_extents (damage);
+      damaged_area = ((int64_t) (extents->x2 - extents->x1)
+		      * (extents->y2 - extents->y1));
+    }
+
+  if (damaged_area > area / 4)
+    {
+      buffer->shm->rapid_updates = 0;
+      return False;
+    }
+
+  return (++buffer->shm->rapid_updates
+	  >= ShadowRapidUpdateThreshold);
+}
+
+static void
+UpdateBufferForDamage (RenderBuffer buffer, pixman_region32_t *damage,
+		       DrawParams *params)
+{
+  PictureBuffer *pict_buffer;
+  pixman_region32_t buffer_damage;
+
+  pict_buffer = buffer.pointer;
+
+  /* Only shared memory buffers can be shadowed.  */
+  if (!pict_buffer->shm)
+    return;
+
+  pixman_region32_init (&buffer_damage);
+
+  if (damage && params->flags)
+    {
+      /* The damage is not in buffer coordinates.  Transform it into
+	 the coordinate space of the buffer.  */
+      ReverseTransformRegion (&buffer_damage, damage, params,
+			      pict_buffer->width, pict_buffer->height);
+      damage = &buffer_damage;
+    }
+
+  if (!(pict_buffer->flags & IsShadowed))
+    {
+      if (!ShouldShadowBuffer (pict_buffer, damage))
+	{
+	  pixman_region32_fini (&buffer_damage);
+	  return;
+	}
+
+      /* Start shadowing the buffer.  This also uploads its entire
+	 contents.  */
+      ShadowBuffer (pict_buffer);
+    }
+  else
+    UploadShadowContents (pict_buffer, damage);
+
+  pixman_region32_fini (&buffer_damage);
+
+  /* The contents were copied to the shadow pixmap.  The buffer can
+     now be released.  */
+  pict_buffer->flags |= CanRelease;
+}
+
 static Bool
 CanReleaseNow (RenderBuffer buffer)
 {
-  return False;
+  PictureBuffer *pict_buffer;
+  Bool rc;
+
+  pict_buffer = buffer.pointer;
+
+  /* Return if the contents were copied to the shadow pixmap.  */
+  rc = (pict_buffer->flags & CanRelease) != 0;
+
+  /* Clear that flag now.  */
+  pict_buffer->flags &= ~CanRelease;
+
+  return rc;
 }
 
 static IdleCallbackKey
@@ -3335,8 +3898,10 @@ static BufferFuncs picture_buffer_funcs =
     .validate_shm_params = ValidateShmParams,
     .buffer_from_single_pixel = BufferFromSinglePixel,
     .free_shm_buffer = FreeShmBuffer,
+    .free_shm_pool_data = FreeShmPoolData,
     .free_dmabuf_buffer = FreeDmabufBuffer,
     .free_single_pixel_buffer = FreeSinglePixelBuffer,
+    .update_buffer_for_damage = UpdateBufferForDamage,
     .can_release_now = CanReleaseNow,
     .add_idle_callback = AddIdleCallback,
     .cancel_idle_callback = CancelIdleCallback,
@@ -1507,9 +1507,11 @@ DrawPointerBarriers (PointerConfinement *confinement,
   else
     {
       /* Obtain the root-window relative coordinates of the window.  */
+      BeginRoundTrip ();
       XTranslateCoordinates (compositor.display, window,
 			     DefaultRootWindow (compositor.display),
 			     0, 0, &root_x, &root_y, &child);
+      EndRoundTrip ("TranslateCoordinates");
 
       if (root_x_return)
 	*root_x_return = root_x;
@@ -1619,9 +1621,11 @@ WarpToHint (PointerConfinement *confinement)
 
   ViewTranslate (confinement->surface->view, 0, 0, &offset_x,
 		 &offset_y);
+  BeginRoundTrip ();
   XTranslateCoordinates (compositor.display, window,
 			 DefaultRootWindow (compositor.display),
 			 0, 0, &root_x, &root_y, &child);
+  EndRoundTrip ("TranslateCoordinates");
 
   /* Warp the pointer to the right position.  */
   XIWarpPointer (compositor.display, device_id, None,
@@ -1746,9 +1750,11 @@ RewarpPointer (PointerConfinement *confinement, int *root_x_return,
   else
     {
       /* Obtain the root-window relative coordinates of the window.  */
+      BeginRoundTrip ();
       XTranslateCoordinates (compositor.display, window,
 			     DefaultRootWindow (compositor.display),
 			     0, 0, &root_x, &root_y, &child);
+      EndRoundTrip ("TranslateCoordinates");
 
       if (root_x_return)
 	*root_x_return = root_x;
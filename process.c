@@ -413,3 +413,29 @@ ProcessPoll (struct pollfd *fds, nfds_t nfds,
 
   return rc;
 }
+
+int
+ProcessEpoll (int epoll_fd, struct epoll_event *events, int maxevents,
+	      struct timespec *timeout)
+{
+  sigset_t oldset;
+  int rc, msec;
+
+  /* epoll_pwait only accepts a timeout in milliseconds.  Round up, so
+     that timers are never run early, and wait indefinitely if the
+     timeout cannot be represented.  */
+  if (timeout->tv_sec >= INT_MAX / 1000 - 1)
+    msec = -1;
+  else
+    msec = (timeout->tv_sec * 1000
+	    + (timeout->tv_nsec + 999999) / 1000000);
+
+  /* Block SIGCHLD in the same manner as ProcessPoll, so that it is
+     only delivered while waiting inside epoll_pwait.  */
+  Block (&oldset);
+  ProcessPendingDescriptions (False);
+  rc = epoll_pwait (epoll_fd, events, maxevents, msec, &oldset);
+  Unblock ();
+
+  return rc;
+}
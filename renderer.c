@@ -54,6 +54,10 @@ static RenderFuncs render_funcs;
 /* Flags of the selected renderer.  */
 int renderer_flags;
 
+/* The number of bytes of buffer contents uploaded by the selected
+   renderer.  */
+static uint64_t upload_count;
+
 static Renderer *
 AllocateRenderer (void)
 {
@@ -164,6 +168,31 @@ RenderComposite (RenderBuffer source, RenderTarget target, Operation op,
 			  width, height, draw_params);
 }
 
+void
+RenderCompositeBoxes (RenderBuffer source, RenderTarget target,
+		      Operation op, pixman_box32_t *boxes, int nboxes,
+		      int src_x, int src_y, int x, int y,
+		      DrawParams *draw_params)
+{
+  int i;
+
+  if (render_funcs.composite_boxes)
+    {
+      render_funcs.composite_boxes (source, target, op, boxes, nboxes,
+				    src_x, src_y, x, y, draw_params);
+      return;
+    }
+
+  /* The renderer cannot composite several boxes at once, so composite
+     each box individually.  */
+  for (i = 0; i < nboxes; ++i)
+    render_funcs.composite (source, target, op,
+			    boxes[i].x1 - src_x, boxes[i].y1 - src_y,
+			    boxes[i].x1 - x, boxes[i].y1 - y,
+			    boxes[i].x2 - boxes[i].x1,
+			    boxes[i].y2 - boxes[i].y1, draw_params);
+}
+
 RenderCompletionKey
 RenderFinishRender (RenderTarget target, pixman_region32_t *damage,
 		    RenderCompletionFunc function, void *data)
@@ -244,6 +273,13 @@ RenderCancelPresentationCallback (PresentCompletionKey key)
   render_funcs.cancel_presentation_callback (key);
 }
 
+void
+RenderGetDamageCosts (int *request_cost, int *pixel_cost)
+{
+  *request_cost = render_funcs.request_cost;
+  *pixel_cost = render_funcs.pixel_cost;
+}
+
 DrmFormat *
 RenderGetDrmFormats (int *n_formats)
 {
@@ -308,6 +344,13 @@ RenderFreeShmBuffer (RenderBuffer buffer)
   return buffer_funcs.free_shm_buffer (buffer);
 }
 
+void
+RenderFreeShmPoolData (void *data)
+{
+  if (buffer_funcs.free_shm_pool_data)
+    buffer_funcs.free_shm_pool_data (data);
+}
+
 void
 RenderFreeDmabufBuffer (RenderBuffer buffer)
 {
@@ -336,6 +379,22 @@ RenderCanReleaseNow (RenderBuffer buffer)
   return buffer_funcs.can_release_now (buffer);
 }
 
+/* Record that BYTES bytes of buffer contents were uploaded.  This is
+   called by renderers, and the total can be read through the
+   debug_manager protocol.  */
+
+void
+RenderNoteUpload (uint64_t bytes)
+{
+  upload_count += bytes;
+}
+
+uint64_t
+RenderGetUploadCount (void)
+{
+  return upload_count;
+}
+
 IdleCallbackKey
 RenderAddIdleCallback (RenderBuffer buffer, RenderTarget target,
 		       BufferIdleFunc function, void *data)
@@ -395,6 +454,58 @@ RegisterStaticRenderer (const char *name,
   renderers = renderer;
 }
 
+static int
+ReadCostResource (const char *name, const char *class, int default_value)
+{
+  XrmDatabase rdb;
+  XrmName namelist[3];
+  XrmClass classlist[3];
+  XrmValue value;
+  XrmRepresentation type;
+  int result;
+
+  rdb = XrmGetDatabase (compositor.display);
+
+  if (!rdb)
+    return default_value;
+
+  namelist[1] = XrmStringToQuark (name);
+  namelist[0] = app_quark;
+  namelist[2] = NULLQUARK;
+
+  classlist[1] = XrmStringToQuark (class);
+  classlist[0] = resource_quark;
+  classlist[2] = NULLQUARK;
+
+  if (XrmQGetResource (rdb, namelist, classlist,
+		       &type, &value)
+      && type == QString)
+    {
+      result = atoi ((char *) value.addr);
+
+      if (result <= 0)
+	return default_value;
+
+      return result;
+    }
+
+  return default_value;
+}
+
+static void
+ReadDamageCosts (void)
+{
+  /* Allow the user to override the cost model of the renderer, which
+     might not be accurate for the X server or graphics hardware in
+     use.  */
+  render_funcs.request_cost
+    = ReadCostResource ("damageRequestCost", "DamageRequestCost",
+			render_funcs.request_cost);
+  render_funcs.pixel_cost
+    = ReadCostResource ("damagePixelCost", "DamagePixelCost",
+			render_funcs.pixel_cost);
+}
+
 static Bool
 InstallRenderer (Renderer *renderer)
 {
@@ -420,6 +531,9 @@ InstallRenderer (Renderer *renderer)
      renderer->render_funcs.  */
   renderer_flags = renderer->render_funcs->flags;
 
+  /* And read the damage cost model.  */
+  ReadDamageCosts ();
+
   return True;
 }
 
@@ -0,0 +1,386 @@
+/* Wayland compositor running on top of an X server.
+
+Copyright (C) 2022 to various contributors.
+
+This file is part of 12to11.
+
+12to11 is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+12to11 is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "compositor.h"
+#include "12to11-debug.h"
+
+/* Round trip accounting.  Each synchronous request made to the X
+   server is bracketed by BeginRoundTrip and EndRoundTrip, which
+   record how long the reply took to arrive in a histogram belonging
+   to the function making the request.  The histograms can be read
+   through the debug_manager protocol, or printed to stderr by sending
+   the compositor SIGUSR1, along with statistics about the cursor
+   cache in seat.c.  */
+
+enum
+  {
+    /* The number of histogram buckets.  Bucket N counts round trips
+       taking between 2 ** N and 2 ** (N + 1) microseconds.  */
+    RoundTripBuckets = 24,
+    /* The maximum depth to which round trips can be nested and still
+       be timed.  */
+    MaxRoundTripDepth = 16,
+  };
+
+typedef struct _RoundTripSite RoundTripSite;
+
+struct _RoundTripSite
+{
+  /* The function and request.  */
+  const char *function, *request;
+
+  /* The number of round trips, and the total and maximum time spent
+     in them, in microseconds.  */
+  uint64_t count, total, max;
+
+  /* The histogram.  */
+  uint32_t histogram[RoundTripBuckets];
+
+  /* The next site.  */
+  RoundTripSite *next;
+};
+
+/* List of all call sites, most recently used first.  */
+static RoundTripSite *all_sites;
+
+/* The times at which each round trip currently in progress started,
+   innermost last.  Round trips can nest, for example when a function
+   making one calls another that makes its own.  */
+static struct timespec round_trip_starts[MaxRoundTripDepth];
+
+/* The number of round trips in progress.  */
+static int round_trip_depth;
+
+/* Whether or not SIGUSR1 was received.  */
+static volatile sig_atomic_t dump_requested;
+
+/* The debug manager global.  */
+static struct wl_global *debug_manager_global;
+
+static RoundTripSite *
+FindSite (const char *function, const char *request)
+{
+  RoundTripSite *site, **prev;
+
+  prev = &all_sites;
+
+  for (site = all_sites; site; site = site->next)
+    {
+      if (!strcmp (site->function, function)
+	  && !strcmp (site->request, request))
+	{
+	  /* Move the site to the front of the list, as the same sites
+	     tend to make requests repeatedly.  */
+	  *prev = site->next;
+	  site->next = all_sites;
+	  all_sites = site;
+
+	  return site;
+	}
+
+      prev = &site->next;
+    }
+
+  site = XLCalloc (1, sizeof *site);
+  site->function = function;
+  site->request = request;
+  site->next = all_sites;
+  all_sites = site;
+
+  return site;
+}
+
+void
+XLBeginRoundTrip (void)
+{
+  if (round_trip_depth < MaxRoundTripDepth)
+    round_trip_starts[round_trip_depth] = CurrentTimespec ();
+
+  round_trip_depth++;
+}
+
+void
+XLEndRoundTrip (const char *function, const char *request)
+{
+  struct timespec elapsed;
+  RoundTripSite *site;
+  uint64_t usec;
+  int bucket;
+
+  XLAssert (round_trip_depth > 0);
+  round_trip_depth--;
+
+  if (round_trip_depth >= MaxRoundTripDepth)
+    /* The round trip was nested too deeply to be timed.  */
+    return;
+
+  elapsed = TimespecSub (CurrentTimespec (),
+			 round_trip_starts[round_trip_depth]);
+  usec = (elapsed.tv_sec * (uint64_t) 1000000
+	  + elapsed.tv_nsec / 1000);
+
+  site = FindSite (function, request);
+  site->count++;
+  site->total += usec;
+
+  if (usec > site->max)
+    site->max = usec;
+
+  /* Find the bucket.  */
+  bucket = 0;
+
+  while (bucket < RoundTripBuckets - 1
+	 && usec >= ((uint64_t) 2 << bucket))
+    bucket++;
+
+  site->histogram[bucket]++;
+}
+
+static void
+ResetRoundTrips (void)
+{
+  RoundTripSite *site, *next;
+
+  site = all_sites;
+  all_sites = NULL;
+
+  while (site)
+    {
+      next = site->next;
+      XLFree (site);
+      site = next;
+    }
+}
+
+static void
+DumpRoundTrips (void)
+{
+  RoundTripSite *site;
+  uint64_t count, total;
+  int i;
+
+  count = 0;
+  total = 0;
+
+  fprintf (stderr, "Synchronous requests made to the X server:\n");
+
+  for (site = all_sites; site; site = site->next)
+    {
+      fprintf (stderr, "  %s (%s): %"PRIu64" requests, %"PRIu64" us total,"
+	       " %"PRIu64" us max\n", site->function, site->request,
+	       site->count, site->total, site->max);
+
+      for (i = 0; i < RoundTripBuckets; ++i)
+	{
+	  if (site->histogram[i])
+	    fprintf (stderr, "    < %"PRIu64" us: %"PRIu32"\n",
+		     (uint64_t) 2 << i, site->histogram[i]);
+	}
+
+      count += site->count;
+      total += site->total;
+    }
+
+  fprintf (stderr, "  Total: %"PRIu64" requests, %"PRIu64" us\n",
+	   count, total);
+}
+
+static void
+DumpCursorCacheStatistics (void)
+{
+  uint64_t hits, misses, evictions;
+
+  XLGetCursorCacheStatistics (&hits, &misses, &evictions);
+  fprintf (stderr, "Cursor cache: %"PRIu64" hits, %"PRIu64" misses,"
+	   " %"PRIu64" evictions\n", hits, misses, evictions);
+}
+
+static void
+HandleUsr1 (int signal)
+{
+  /* Printing is not async-signal safe, so the statistics are printed
+     from RunStep instead.  */
+  dump_requested = 1;
+}
+
+void
+XLMaybeDumpRoundTrips (void)
+{
+  if (!dump_requested)
+    return;
+
+  dump_requested = 0;
+  DumpRoundTrips ();
+  DumpCursorCacheStatistics ();
+  XLDumpSurfaceLatencies ();
+}
+
+static void
+Destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+GetRoundTrips (struct wl_client *client, struct wl_resource *resource)
+{
+  RoundTripSite *site;
+  struct wl_array histogram;
+  uint32_t *data;
+
+  for (site = all_sites; site; site = site->next)
+    {
+      wl_array_init (&histogram);
+      data = wl_array_add (&histogram, sizeof site->histogram);
+
+      if (!data)
+	{
+	  wl_array_release (&histogram);
+	  wl_client_post_no_memory (client);
+	  return;
+	}
+
+      memcpy (data, site->histogram, sizeof site->histogram);
+      debug_manager_send_round_trip_site (resource, site->function,
+					  site->request,
+					  MIN (site->count, UINT32_MAX),
+					  site->total >> 32,
+					  site->total & 0xffffffff,
+					  MIN (site->max, UINT32_MAX),
+					  &histogram);
+      wl_array_release (&histogram);
+    }
+
+  debug_manager_send_round_trips_done (resource);
+}
+
+static void
+ResetRoundTripsRequest (struct wl_client *client,
+			struct wl_resource *resource)
+{
+  ResetRoundTrips ();
+}
+
+static void
+GetCursorCacheStatistics (struct wl_client *client,
+			  struct wl_resource *resource)
+{
+  uint64_t hits, misses, evictions;
+
+  XLGetCursorCacheStatistics (&hits, &misses, &evictions);
+  debug_manager_send_cursor_cache_statistics (resource,
+					      MIN (hits, UINT32_MAX),
+					      MIN (misses, UINT32_MAX),
+					      MIN (evictions, UINT32_MAX));
+}
+
+static void
+GetSurfaceLatencies (struct wl_client *client,
+		     struct wl_resource *resource)
+{
+  XLSendSurfaceLatencies (resource);
+}
+
+static void
+ResetSurfaceLatencies (struct wl_client *client,
+		       struct wl_resource *resource)
+{
+  XLResetSurfaceLatencies ();
+}
+
+static void
+GetRequestCount (struct wl_client *client, struct wl_resource *resource)
+{
+  uint64_t count;
+
+  /* Xlib and XCB share the same request sequence, but requests made
+     through XCB are only noticed by Xlib once it makes a request
+     itself, so this can lag slightly behind.  */
+  count = XNextRequest (compositor.display) - 1;
+  debug_manager_send_request_count (resource, count >> 32,
+				    count & 0xffffffff);
+}
+
+static void
+GetUploadCount (struct wl_client *client, struct wl_resource *resource)
+{
+  uint64_t count;
+
+  count = RenderGetUploadCount ();
+  debug_manager_send_upload_count (resource, count >> 32,
+				   count & 0xffffffff);
+}
+
+static const struct debug_manager_interface debug_manager_impl =
+  {
+    .destroy = Destroy,
+    .get_round_trips = GetRoundTrips,
+    .reset_round_trips = ResetRoundTripsRequest,
+    .get_cursor_cache_statistics = GetCursorCacheStatistics,
+    .get_surface_latencies = GetSurfaceLatencies,
+    .reset_surface_latencies = ResetSurfaceLatencies,
+    .get_request_count = GetRequestCount,
+    .get_upload_count = GetUploadCount,
+  };
+
+static void
+HandleBind (struct wl_client *client, void *data, uint32_t version,
+	    uint32_t id)
+{
+  struct wl_resource *resource;
+
+  resource = wl_resource_create (client, &debug_manager_interface,
+				 version, id);
+
+  if (!resource)
+    {
+      wl_client_post_no_memory (client);
+      return;
+    }
+
+  wl_resource_set_implementation (resource, &debug_manager_impl,
+				  NULL, NULL);
+}
+
+void
+XLInitRoundTrips (void)
+{
+  struct sigaction act;
+
+  debug_manager_global
+    = wl_global_create (compositor.wl_display, &debug_manager_interface,
+			4, NULL, HandleBind);
+
+  /* Print the statistics upon SIGUSR1.  SA_RESTART is not set, so
+     that the signal interrupts the wait for events.  */
+  memset (&act, 0, sizeof act);
+  act.sa_handler = HandleUsr1;
+  sigemptyset (&act.sa_mask);
+
+  if (sigaction (SIGUSR1, &act, NULL))
+    {
+      perror ("sigaction");
+      abort ();
+    }
+}
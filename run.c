@@ -20,16 +20,22 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 #include <sys/param.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <poll.h>
 #include <alloca.h>
 
+#include <sys/epoll.h>
+
 #include "compositor.h"
 
 typedef struct _PollFd PollFd;
 
 struct _PollFd
 {
-  /* The next and last writable fd in this chain.  */
+  /* The next and last records in this chain.  A record is linked
+     onto either the list of file descriptors that could not be
+     registered with epoll, the list of records that have been
+     removed, or nothing at all.  */
   PollFd *next, *last;
 
   /* The file descriptor itself.  */
@@ -44,85 +50,242 @@ struct _PollFd
 
   /* The direction; 1 means write, 0 means read.  */
   int direction;
+
+  /* Whether or not the fd is registered with the epoll instance.  */
+  Bool registered;
+
+  /* Whether or not the callback has been disabled.  A disabled record
+     is neither registered with epoll nor linked onto the list of
+     polled fds, but keeps its memory and callback.  */
+  Bool disabled;
 };
 
-/* Number of file descriptors for which we are waiting for something
-   to be written.  */
+enum
+  {
+    /* The maximum number of events read from the epoll instance at
+       once.  Any remaining events are returned by the next call.  */
+    MaxEpollEvents = 64,
+  };
+
+/* The epoll instance used to wait for events.  */
+static int epoll_fd;
+
+/* Dummy records used to identify the X and Wayland connections in
+   epoll events.  */
+static PollFd x_connection_record, wl_connection_record;
+
+/* Array of records currently registered with epoll, indexed by file
+   descriptor.  This is used to avoid removing the registration of
+   an fd that was closed before its record was removed, and whose
+   number was reused by a subsequent registration.  */
+static PollFd **fd_owners;
+
+/* The number of elements in that array.  */
+static int num_fd_owners;
+
+/* Number of file descriptors that could not be registered with
+   epoll and must be polled separately.  */
 static int num_poll_fd;
 
-/* Linked list of file descriptors and write callbacks.  */
+/* Linked list of file descriptors that could not be registered with
+   epoll, such as regular files.  */
 static PollFd poll_fds;
 
-WriteFd *
-XLAddWriteFd (int fd, void *data, void (*poll_callback) (int, void *,
-							 WriteFd *))
+/* Linked list of records that have been removed, but not yet freed.
+   Records cannot be freed immediately, since the events being
+   dispatched might still refer to them.  */
+static PollFd dead_fds;
+
+static uint32_t
+EpollEventsFor (PollFd *record)
 {
-  WriteFd *record;
+  uint32_t events;
+
+  if (record->direction)
+    events = EPOLLOUT;
+  else
+    /* EPOLLHUP is always reported, so there is no need to ask for
+       it.  */
+    events = EPOLLIN;
+
+  return events;
+}
+
+static void
+SetFdOwner (int fd, PollFd *record)
+{
+  int new_size;
+
+  if (fd >= num_fd_owners)
+    {
+      new_size = MAX (fd + 1, num_fd_owners * 2);
+      fd_owners = XLRealloc (fd_owners, sizeof *fd_owners * new_size);
+      memset (fd_owners + num_fd_owners, 0,
+	      sizeof *fd_owners * (new_size - num_fd_owners));
+      num_fd_owners = new_size;
+    }
+
+  fd_owners[fd] = record;
+}
 
-  record = XLMalloc (sizeof *record);
+static void
+LinkPolledFd (PollFd *record)
+{
   record->next = poll_fds.next;
   record->last = &poll_fds;
-  record->write_fd = fd;
-  record->poll_callback = poll_callback;
-  record->data = data;
-  record->direction = 1;
 
   poll_fds.next->last = record;
   poll_fds.next = record;
 
   num_poll_fd++;
+}
 
-  return record;
+static void
+UnlinkPolledFd (PollFd *record)
+{
+  record->next->last = record->last;
+  record->last->next = record->next;
+
+  num_poll_fd--;
 }
 
-ReadFd *
-XLAddReadFd (int fd, void *data, void (*poll_callback) (int, void *,
-							ReadFd *))
+static void
+RegisterFd (PollFd *record)
 {
-  WriteFd *record;
+  struct epoll_event event;
 
-  record = XLMalloc (sizeof *record);
-  record->next = poll_fds.next;
-  record->last = &poll_fds;
+  event.events = EpollEventsFor (record);
+  event.data.ptr = record;
+
+  if (!epoll_ctl (epoll_fd, EPOLL_CTL_ADD, record->write_fd, &event))
+    {
+      record->registered = True;
+      SetFdOwner (record->write_fd, record);
+
+      return;
+    }
+
+  /* epoll refuses to register regular files, and the same file
+     descriptor cannot be registered twice.  Poll such descriptors
+     separately instead.  */
+  record->registered = False;
+  LinkPolledFd (record);
+}
+
+static void
+UnregisterFd (PollFd *record)
+{
+  if (record->registered)
+    {
+      /* Remove the registration, unless the file descriptor was
+	 closed and its number reused by another record.  */
+      if (fd_owners[record->write_fd] == record)
+	{
+	  epoll_ctl (epoll_fd, EPOLL_CTL_DEL, record->write_fd, NULL);
+	  fd_owners[record->write_fd] = NULL;
+	}
+    }
+  else
+    /* Unlink the record from the list of polled fds.  */
+    UnlinkPolledFd (record);
+}
+
+static PollFd *
+AddFd (int fd, void *data, void (*poll_callback) (int, void *, PollFd *),
+       int direction)
+{
+  PollFd *record;
+
+  record = XLCalloc (1, sizeof *record);
   record->write_fd = fd;
   record->poll_callback = poll_callback;
   record->data = data;
-  record->direction = 0;
+  record->direction = direction;
 
-  poll_fds.next->last = record;
-  poll_fds.next = record;
+  RegisterFd (record);
+  return record;
+}
 
-  num_poll_fd++;
+WriteFd *
+XLAddWriteFd (int fd, void *data, void (*poll_callback) (int, void *,
+							 WriteFd *))
+{
+  return AddFd (fd, data, poll_callback, 1);
+}
 
-  return record;
+ReadFd *
+XLAddReadFd (int fd, void *data, void (*poll_callback) (int, void *,
+							ReadFd *))
+{
+  return AddFd (fd, data, poll_callback, 0);
+}
+
+static void
+RemoveFd (PollFd *fd)
+{
+  /* Disabled records are already unregistered.  */
+  if (!fd->disabled)
+    UnregisterFd (fd);
+
+  /* Mark this record as invalid.  Records cannot safely be freed
+     while the event loop is in progress, so they are freed
+     immediately before waiting for events.  */
+  fd->write_fd = -1;
+  fd->next = dead_fds.next;
+  fd->last = &dead_fds;
+
+  dead_fds.next->last = fd;
+  dead_fds.next = fd;
 }
 
 void
 XLRemoveWriteFd (WriteFd *fd)
 {
-  /* Mark this record as invalid.  Records cannot safely change while
-     the event loop is in progress, so we remove all invalid records
-     immediately before polling.  */
-  fd->write_fd = -1;
+  RemoveFd (fd);
 }
 
 void
 XLRemoveReadFd (ReadFd *fd)
 {
-  /* Mark this record as invalid.  Records cannot safely change while
-     the event loop is in progress, so we remove all invalid records
-     immediately before polling.  */
-  fd->write_fd = -1;
+  RemoveFd (fd);
+}
+
+void
+XLSetFdEnabled (ReadFd *fd, Bool enabled)
+{
+  if (fd->disabled == !enabled)
+    return;
+
+  /* Enabling or disabling a record only changes its registration,
+     which is much cheaper than removing and adding it again each
+     time the caller wants to wait for a different event, and does
+     not change the record itself.  epoll always reports hangups, so
+     the registration must be removed entirely.  */
+  fd->disabled = !enabled;
+
+  if (enabled)
+    RegisterFd (fd);
+  else
+    UnregisterFd (fd);
 }
 
 static void
-RemoveWriteFd (WriteFd *fd)
+FreeDeadFds (void)
 {
-  fd->next->last = fd->last;
-  fd->last->next = fd->next;
+  PollFd *item, *last;
 
-  num_poll_fd--;
-  XLFree (fd);
+  item = dead_fds.next;
+
+  while (item != &dead_fds)
+    {
+      last = item;
+      item = item->next;
+
+      XLFree (last);
+    }
+
+  dead_fds.next = &dead_fds;
+  dead_fds.last = &dead_fds;
 }
 
 static void
@@ -142,6 +305,9 @@ HandleOneXEvent (XEvent *event)
   if (HandleOneXEventForPictureRenderer (event))
     return;
 
+  if (HandleOneXEventForXErrors (event))
+    return;
+
   if (XLHandleXEventForXdgToplevels (event))
     return;
 
@@ -175,105 +341,146 @@ ReadXEvents (void)
 {
   XEvent event;
 
-  while (XPending (compositor.display))
+  do
     {
-      XNextEvent (compositor.display, &event);
+      while (XPending (compositor.display))
+	{
+	  XNextEvent (compositor.display, &event);
 
-      /* We failed to get event data for a generic event, so there's
-	 no point in continuing.  */
-      if (event.type == GenericEvent
-	  && !XGetEventData (compositor.display, &event.xcookie))
-	continue;
+	  /* We failed to get event data for a generic event, so
+	     there's no point in continuing.  */
+	  if (event.type == GenericEvent
+	      && !XGetEventData (compositor.display, &event.xcookie))
+	    continue;
 
-      if (!HookSelectionEvent (&event))
-	HandleOneXEvent (&event);
+	  if (!HookSelectionEvent (&event))
+	    HandleOneXEvent (&event);
 
-      if (event.type == GenericEvent)
-	XFreeEventData (compositor.display, &event.xcookie);
+	  if (event.type == GenericEvent)
+	    XFreeEventData (compositor.display, &event.xcookie);
+	}
     }
+  /* Replies to asynchronous requests made by the drag-and-drop code
+     are read along with events.  Process them, and check for events
+     again if that might have read more from the connection.  */
+  while (XLDndProcessReplies ()
+	 && XPending (compositor.display));
 }
 
-static void
-RunStep (void)
+static int
+PollSeparately (struct epoll_event *events, struct timespec *timeout)
 {
-  int x_connection, wl_connection, rc, i, j;
-  struct timespec timeout;
   struct pollfd *fds;
-  PollFd **pollfds, *item, *last;
+  PollFd **pollfds, *item;
+  int rc, i, j, nevents;
 
-  fds = alloca (sizeof *fds * (num_poll_fd + 2));
-
-  /* This is used as an optimization to not have to loop over the
-     entire descriptor list twice.  */
+  /* Some file descriptors could not be registered with epoll.  Poll
+     them along with the epoll instance itself.  */
+  fds = alloca (sizeof *fds * (num_poll_fd + 1));
   pollfds = alloca (sizeof *pollfds * num_poll_fd);
 
-  /* Run timers.  This, and draining selection transfers, must be done
-     before setting up poll file descriptors, since timer callbacks
-     can change the write fd list.  */
-  timeout = TimerCheck ();
-
-  /* Drain complete selection transfers.  */
-  FinishTransfers ();
-
-  /* Disconnect clients that have experienced out-of-memory
-     errors.  */
-  ProcessPendingDisconnectClients ();
-
-  /* FinishTransfers can potentially send events to Wayland clients
-     and make X requests.  Flush after it is called.  */
-  XFlush (compositor.display);
-  wl_display_flush_clients (compositor.wl_display);
-
-  /* Obtain the connections.  */
-  x_connection = ConnectionNumber (compositor.display);
-  wl_connection = wl_event_loop_get_fd (compositor.wl_event_loop);
-
-  fds[0].fd = x_connection;
-  fds[1].fd = wl_connection;
+  fds[0].fd = epoll_fd;
   fds[0].events = POLLIN;
-  fds[1].events = POLLIN;
   fds[0].revents = 0;
-  fds[1].revents = 0;
 
-  /* Copy valid write file descriptors into the pollfd array, while
-     removing invalid ones.  */
   item = poll_fds.next;
   i = 0;
 
   while (item != &poll_fds)
     {
-      last = item;
+      fds[1 + i].fd = item->write_fd;
+      fds[1 + i].events = POLLOUT;
+      fds[1 + i].revents = 0;
+      pollfds[i] = item;
+
+      if (!item->direction)
+	/* See https://www.greenend.org.uk/rjk/tech/poll.html for why
+	   POLLHUP.  */
+	fds[1 + i].events = POLLIN | POLLHUP;
+
       item = item->next;
+      i += 1;
+    }
+
+  rc = ProcessPoll (fds, 1 + i, timeout);
+
+  if (rc <= 0)
+    return rc;
+
+  nevents = 0;
+
+  /* Obtain any events from the epoll instance without waiting.  */
+  if (fds[0].revents & POLLIN)
+    nevents = epoll_wait (epoll_fd, events, MaxEpollEvents, 0);
+
+  if (nevents < 0)
+    nevents = 0;
+
+  /* Now see how many of the other fds are set.  */
+  for (j = 0; j < i; ++j)
+    {
+      if (nevents == MaxEpollEvents)
+	/* The rest will be handled the next time around.  */
+	break;
 
-      if (last->write_fd == -1)
+      if (fds[1 + j].revents & (POLLOUT | POLLIN | POLLHUP | POLLERR))
 	{
-	  /* Remove this invalid pollfd.  */
-	  RemoveWriteFd (last);
-	  continue;
+	  events[nevents].events = EPOLLIN;
+	  events[nevents].data.ptr = pollfds[j];
+	  nevents++;
 	}
+    }
 
-      /* Otherwise, add the fd and bump i.  */
+  return nevents;
+}
 
-      fds[2 + i].fd = last->write_fd;
-      fds[2 + i].events = POLLOUT;
-      fds[2 + i].revents = 0;
-      pollfds[i] = last;
+static void
+RunStep (void)
+{
+  int rc, i;
+  struct timespec timeout;
+  struct epoll_event events[MaxEpollEvents];
+  PollFd *item;
+  Bool x_readable, wl_readable;
 
-      if (!last->direction)
-	/* See https://www.greenend.org.uk/rjk/tech/poll.html for why
-	   POLLHUP.  */
-	fds[2 + i].events = POLLIN | POLLHUP;
+  /* Free records removed while the last batch of events was being
+     dispatched.  */
+  FreeDeadFds ();
 
-      i += 1;
-    }
+  /* Print round trip statistics if SIGUSR1 was received.  */
+  XLMaybeDumpRoundTrips ();
+
+  /* Run timers.  This, and draining selection transfers, must be done
+     before waiting for events, since timer callbacks can change the
+     write fd list.  */
+  timeout = TimerCheck ();
+
+  /* Drain complete selection transfers.  */
+  FinishTransfers ();
+
+  /* Disconnect clients that have experienced out-of-memory
+     errors.  */
+  ProcessPendingDisconnectClients ();
+
+  /* Complete asynchronous error traps, and make sure those still
+     pending will eventually complete.  */
+  ProcessXErrorTraps ();
+
+  /* FinishTransfers can potentially send events to Wayland clients
+     and make X requests.  Flush after it is called.  */
+  XFlush (compositor.display);
+  XLTraceFlush ();
+  wl_display_flush_clients (compositor.wl_display);
 
   /* Handle any events already in the queue, which can happen if
      something inside ReadXEvents synced.  */
   if (XEventsQueued (compositor.display, QueuedAlready))
     {
       ReadXEvents ();
+      ProcessXErrorTraps ();
 
       XFlush (compositor.display);
+      XLTraceFlush ();
       wl_display_flush_clients (compositor.wl_display);
     }
 
@@ -281,26 +488,48 @@ RunStep (void)
      errors.  */
   ProcessPendingDisconnectClients ();
 
-  rc = ProcessPoll (fds, 2 + i, &timeout);
+  if (num_poll_fd)
+    rc = PollSeparately (events, &timeout);
+  else
+    rc = ProcessEpoll (epoll_fd, events, MaxEpollEvents, &timeout);
 
   if (rc > 0)
     {
-      if (fds[0].revents & POLLIN)
+      x_readable = False;
+      wl_readable = False;
+
+      for (i = 0; i < rc; ++i)
+	{
+	  if (events[i].data.ptr == &x_connection_record)
+	    x_readable = True;
+	  else if (events[i].data.ptr == &wl_connection_record)
+	    wl_readable = True;
+	}
+
+      /* Handle events from the X server and Wayland clients before
+	 any other file descriptors, as they can remove records.  */
+      if (x_readable)
 	ReadXEvents ();
 
-      if (fds[1].revents & POLLIN)
+      if (wl_readable)
 	wl_event_loop_dispatch (compositor.wl_event_loop, -1);
 
-      /* Now see how many write fds are set.  */
-      for (j = 0; j < i; ++j)
+      for (i = 0; i < rc; ++i)
 	{
-	  if (fds[2 + j].revents & (POLLOUT | POLLIN | POLLHUP)
-	      /* Check that pollfds[j] is still valid, and wasn't
-		 removed while handling X events.  */
-	      && pollfds[j]->write_fd != -1)
+	  item = events[i].data.ptr;
+
+	  if (item == &x_connection_record
+	      || item == &wl_connection_record)
+	    continue;
+
+	  if (events[i].events & (EPOLLOUT | EPOLLIN | EPOLLHUP
+				  | EPOLLERR)
+	      /* Check that item is still valid, and wasn't removed
+		 or disabled while handling X events or a previous
+		 callback.  */
+	      && item->write_fd != -1 && !item->disabled)
 	    /* Then call the poll callback.  */
-	    pollfds[j]->poll_callback (pollfds[j]->write_fd,
-				       pollfds[j]->data, pollfds[j]);
+	    item->poll_callback (item->write_fd, item->data, item);
 	}
     }
 
@@ -309,13 +538,45 @@ RunStep (void)
   ProcessPendingDisconnectClients ();
 }
 
+static void
+RegisterConnection (int fd, PollFd *record)
+{
+  struct epoll_event event;
+
+  event.events = EPOLLIN;
+  event.data.ptr = record;
+
+  if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &event))
+    {
+      perror ("epoll_ctl");
+      exit (1);
+    }
+}
+
 void __attribute__ ((noreturn))
 XLRunCompositor (void)
 {
-  /* Set up the sentinel node for file descriptors that are being
-     polled from.  */
+  /* Set up the sentinel nodes for file descriptors that are being
+     polled from and records that have been removed.  */
   poll_fds.next = &poll_fds;
   poll_fds.last = &poll_fds;
+  dead_fds.next = &dead_fds;
+  dead_fds.last = &dead_fds;
+
+  epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+
+  if (epoll_fd == -1)
+    {
+      perror ("epoll_create1");
+      exit (1);
+    }
+
+  /* Register the X and Wayland connections once.  They are never
+     removed.  */
+  RegisterConnection (ConnectionNumber (compositor.display),
+		      &x_connection_record);
+  RegisterConnection (wl_event_loop_get_fd (compositor.wl_event_loop),
+		      &wl_connection_record);
 
   while (True)
     RunStep ();
@@ -121,6 +121,8 @@ typedef struct _DestroyListener DestroyListener;
 typedef struct _DeviceInfo DeviceInfo;
 typedef struct _ModifierChangeCallback ModifierChangeCallback;
 typedef struct _CursorRing CursorRing;
+typedef struct _CursorCacheKey CursorCacheKey;
+typedef struct _CachedCursor CachedCursor;
 
 typedef enum _ResizeEdge ResizeEdge;
 typedef enum _WhatEdge WhatEdge;
@@ -201,6 +203,57 @@ struct _CursorRing
   short used;
 };
 
+/* Cache of cursors created from cursor surfaces.  Toolkits set the
+   same few cursor images over and over again, and animated cursors
+   cycle through a small number of frames, so cursors are looked up
+   here by a hash of the buffer contents, hotspot and scale before
+   being composited and created.  */
+
+#define CursorCacheSize		16
+
+struct _CursorCacheKey
+{
+  /* Hash of the buffer contents.  */
+  uint64_t hash;
+
+  /* The size, stride and format of the buffer.  */
+  unsigned int width, height;
+  int32_t stride;
+  uint32_t format;
+
+  /* The scale factor of the surface.  */
+  double factor;
+
+  /* The size of the cursor image and its hotspot.  */
+  int image_width, image_height, hotspot_x, hotspot_y;
+};
+
+struct _CachedCursor
+{
+  /* The key of this cursor.  */
+  CursorCacheKey key;
+
+  /* The cursor, or None if this entry is empty.  */
+  Cursor cursor;
+
+  /* The number of seat cursors using this cursor.  Cursors that are
+     in use are never evicted.  */
+  int refcount;
+
+  /* When this entry was last used.  */
+  uint64_t last_use;
+};
+
+/* The cursor cache.  */
+static CachedCursor cursor_cache[CursorCacheSize];
+
+/* Counter incremented upon each use of the cursor cache.  */
+static uint64_t cursor_cache_clock;
+
+/* Statistics about the cursor cache.  */
+static uint64_t cursor_cache_hits, cursor_cache_misses;
+static uint64_t cursor_cache_evictions;
+
 struct _DestroyListener
 {
   /* Function called when seat is destroyed.  */
@@ -222,6 +275,10 @@ struct _SeatCursor
   /* The current cursor.  */
   Cursor cursor;
 
+  /* The cache entry holding that cursor, or NULL if it is owned by
+     this seat cursor.  */
+  CachedCursor *cached;
+
   /* The seat this cursor is for.  */
   Seat *seat;
 
@@ -649,21 +706,23 @@ QueryPointer (Seat *seat, Window relative_to, double *x, double *y)
   Bool same_screen;
 
   buttons.mask = NULL;
-  same_screen = False;
 
   /* First, initialize default values in case the pointer is on a
      different screen.  */
   *x = 0;
   *y = 0;
 
-  if (XIQueryPointer (compositor.display, seat->master_pointer,
-		      relative_to, &root, &child, &root_x, &root_y,
-		      &win_x, &win_y, &buttons, &modifiers,
-		      &group))
+  BeginRoundTrip ();
+  same_screen = XIQueryPointer (compositor.display, seat->master_pointer,
+				relative_to, &root, &child, &root_x,
+				&root_y, &win_x, &win_y, &buttons,
+				&modifiers, &group);
+  EndRoundTrip ("XIQueryPointer");
+
+  if (same_screen)
     {
       *x = win_x;
       *y = win_y;
-      same_screen = True;
     }
 
   /* buttons.mask must be freed manually, even if the pointer is on a
@@ -949,6 +1008,20 @@ EndCursorClock (SeatCursor *cursor)
   cursor->holding_cursor_clock = False;
 }
 
+static void
+ReleaseCursor (SeatCursor *cursor)
+{
+  /* Cached cursors are freed upon eviction from the cache, not when
+     they stop being used.  */
+  if (cursor->cached)
+    cursor->cached->refcount--;
+  else if (cursor->cursor != None)
+    XFreeCursor (compositor.display, cursor->cursor);
+
+  cursor->cursor = None;
+  cursor->cached = NULL;
+}
+
 static void
 FreeCursor (SeatCursor *cursor)
 {
@@ -965,9 +1038,7 @@ FreeCursor (SeatCursor *cursor)
   cursor->seat->cursor = NULL;
 
   window = CursorWindow (cursor);
-
-  if (cursor->cursor != None)
-    XFreeCursor (compositor.display, cursor->cursor);
+  ReleaseCursor (cursor);
 
   if (!(cursor->seat->flags & IsInert) && window)
     XIDefineCursor (compositor.display,
@@ -1126,16 +1197,196 @@ ComputeHotspot (SeatCursor *cursor, int min_x, int min_y,
   *y = min_y + hotspot_y - dy;
 }
 
+static uint64_t
+HashCursorContents (void *data, size_t size)
+{
+  uint64_t hash, word;
+  unsigned char *bytes;
+  size_t i;
+
+  /* This is FNV-1a, applied to each 8-byte word of the data and then
+     to each remaining byte.  */
+  hash = 14695981039346656037ull;
+  bytes = data;
+
+  for (i = 0; i + sizeof word <= size; i += sizeof word)
+    {
+      memcpy (&word, bytes + i, sizeof word);
+      hash = (hash ^ word) * 1099511628211ull;
+    }
+
+  for (; i < size; ++i)
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+
+  return hash;
+}
+
+static Bool
+GetCursorCacheKey (SeatCursor *cursor, int width, int height,
+		   int hotspot_x, int hotspot_y, CursorCacheKey *key)
+{
+  Surface *surface;
+  ExtBuffer *buffer;
+  void *data;
+
+  surface = cursor->role.surface;
+
+  /* Only cursors consisting of a single untransformed shared memory
+     buffer are cached, as their appearance is then determined solely
+     by the contents of that buffer and the scale.  */
+  if (!surface || surface->subsurfaces
+      || !surface->current_state.buffer
+      || surface->current_state.transform != Normal
+      || surface->current_state.src_x != -1
+      || surface->current_state.dest_width != -1)
+    return False;
+
+  buffer = surface->current_state.buffer;
+
+  if (!XLGetShmBufferContents (buffer, &data, &key->stride,
+			       &key->format))
+    return False;
+
+  key->width = XLBufferWidth (buffer);
+  key->height = XLBufferHeight (buffer);
+  key->hash = HashCursorContents (data, ((size_t) key->stride
+					 * key->height));
+  key->factor = surface->factor;
+  key->image_width = width;
+  key->image_height = height;
+  key->hotspot_x = hotspot_x;
+  key->hotspot_y = hotspot_y;
+
+  return True;
+}
+
+static Bool
+CursorCacheKeysEqual (CursorCacheKey *a, CursorCacheKey *b)
+{
+  return (a->hash == b->hash
+	  && a->width == b->width
+	  && a->height == b->height
+	  && a->stride == b->stride
+	  && a->format == b->format
+	  && a->factor == b->factor
+	  && a->image_width == b->image_width
+	  && a->image_height == b->image_height
+	  && a->hotspot_x == b->hotspot_x
+	  && a->hotspot_y == b->hotspot_y);
+}
+
+static CachedCursor *
+LookupCachedCursor (CursorCacheKey *key)
+{
+  int i;
+
+  for (i = 0; i < CursorCacheSize; ++i)
+    {
+      if (cursor_cache[i].cursor != None
+	  && CursorCacheKeysEqual (&cursor_cache[i].key, key))
+	{
+	  cursor_cache_hits++;
+	  cursor_cache[i].last_use = ++cursor_cache_clock;
+
+	  return &cursor_cache[i];
+	}
+    }
+
+  cursor_cache_misses++;
+  return NULL;
+}
+
+static void
+CacheCursor (SeatCursor *cursor, CursorCacheKey *key)
+{
+  CachedCursor *entry;
+  int i;
+
+  entry = NULL;
+
+  /* Find an empty entry, or the least recently used entry that is
+     not in use.  */
+  for (i = 0; i < CursorCacheSize; ++i)
+    {
+      if (cursor_cache[i].cursor == None)
+	{
+	  entry = &cursor_cache[i];
+	  break;
+	}
+
+      if (!cursor_cache[i].refcount
+	  && (!entry || cursor_cache[i].last_use < entry->last_use))
+	entry = &cursor_cache[i];
+    }
+
+  if (!entry)
+    /* Every cached cursor is in use.  The seat cursor keeps
+       ownership of its cursor.  */
+    return;
+
+  if (entry->cursor != None)
+    {
+      XFreeCursor (compositor.display, entry->cursor);
+      cursor_cache_evictions++;
+    }
+
+  entry->key = *key;
+  entry->cursor = cursor->cursor;
+  entry->refcount = 1;
+  entry->last_use = ++cursor_cache_clock;
+
+  /* The cursor now belongs to the cache.  */
+  cursor->cached = entry;
+}
+
+static void
+DefineCursor (SeatCursor *cursor)
+{
+  Window window;
+
+  window = CursorWindow (cursor);
+
+  if (!(cursor->seat->flags & IsInert) && window != None)
+    XIDefineCursor (compositor.display,
+		    cursor->seat->master_pointer,
+		    window, cursor->cursor);
+}
+
+static void
+ApplyCachedCursor (SeatCursor *cursor, CachedCursor *entry)
+{
+  /* Reference the entry before releasing the current cursor, which
+     might be the same.  */
+  entry->refcount++;
+  ReleaseCursor (cursor);
+
+  cursor->cursor = entry->cursor;
+  cursor->cached = entry;
+
+  /* No element of the cursor ring backs the current cursor.  */
+  if (cursor->cursor_ring)
+    cursor->cursor_ring->used = -1;
+
+  DefineCursor (cursor);
+}
+
+void
+XLGetCursorCacheStatistics (uint64_t *hits, uint64_t *misses,
+			    uint64_t *evictions)
+{
+  *hits = cursor_cache_hits;
+  *misses = cursor_cache_misses;
+  *evictions = cursor_cache_evictions;
+}
+
 static void
 ApplyCursor (SeatCursor *cursor, RenderTarget target,
 	     int min_x, int min_y)
 {
-  Window window;
   int x, y;
   Picture picture;
 
-  if (cursor->cursor)
-    XFreeCursor (compositor.display, cursor->cursor);
+  ReleaseCursor (cursor);
 
   ComputeHotspot (cursor, min_x, min_y, &x, &y);
 
@@ -1145,12 +1396,7 @@ ApplyCursor (SeatCursor *cursor, RenderTarget target,
 					MAX (0, y));
   RenderFreePictureFromTarget (picture);
 
-  window = CursorWindow (cursor);
-
-  if (!(cursor->seat->flags & IsInert) && window != None)
-    XIDefineCursor (compositor.display,
-		    cursor->seat->master_pointer,
-		    window, cursor->cursor);
+  DefineCursor (cursor);
 }
 
 static void
@@ -1158,8 +1404,10 @@ UpdateCursorFromSubcompositor (SeatCursor *cursor)
 {
   RenderTarget target;
   int min_x, min_y, max_x, max_y, width, height, x, y;
-  Bool need_clear;
+  Bool need_clear, cacheable;
   int index;
+  CursorCacheKey key;
+  CachedCursor *entry;
 
   /* First, compute the bounds of the subcompositor.  */
   SubcompositorBounds (cursor->subcompositor,
@@ -1190,6 +1438,21 @@ UpdateCursorFromSubcompositor (SeatCursor *cursor)
   else
     need_clear = False;
 
+  /* See if an identical cursor was created before.  If so, use it
+     instead of compositing the cursor again.  */
+  cacheable = GetCursorCacheKey (cursor, width, height, x, y, &key);
+
+  if (cacheable)
+    {
+      entry = LookupCachedCursor (&key);
+
+      if (entry)
+	{
+	  ApplyCachedCursor (cursor, entry);
+	  return;
+	}
+    }
+
   if (cursor->cursor_ring)
     /* If the width or height of the cursor ring changed, resize its
        contents.  */
@@ -1227,6 +1490,10 @@ UpdateCursorFromSubcompositor (SeatCursor *cursor)
 
   /* Set it as the cursor being used.  */
   cursor->cursor_ring->used = index;
+
+  /* Save the cursor for later use.  */
+  if (cacheable)
+    CacheCursor (cursor, &key);
 }
 
 static void
@@ -1243,10 +1510,7 @@ ApplyEmptyCursor (SeatCursor *cursor)
 {
   Window window;
 
-  if (cursor->cursor)
-    XFreeCursor (compositor.display, cursor->cursor);
-
-  cursor->cursor = None;
+  ReleaseCursor (cursor);
   window = CursorWindow (cursor);
 
   if (window != None)
@@ -1824,7 +2088,9 @@ MakeSeatForDevicePair (int master_keyboard, int master_pointer,
   /* Now update the seat state from the X server.  */
   CatchXErrors ();
 
+  BeginRoundTrip ();
   XkbGetState (compositor.display, master_keyboard, &state);
+  EndRoundTrip ("XkbGetState");
 
   if (UncatchXErrors (NULL))
     /* If the device was disabled or removed, a HierarchyChange event
@@ -1867,7 +2133,7 @@ MakeSeatForDevicePair (int master_keyboard, int master_pointer,
   XkbSelectEventDetails (compositor.display, master_keyboard,
 			 /* Now enable everything in that mask.  */
 			 XkbStateNotify, mask, mask);
-  UncatchXErrors (NULL);
+  UncatchXErrorsAsync (NULL, NULL);
 
   UpdateValuators (seat, pointer_info);
   RetainSeat (seat);
@@ -1996,8 +2262,10 @@ SetupInitialDevices (void)
   XIDeviceInfo *deviceinfo;
   int ndevices, i;
 
+  BeginRoundTrip ();
   deviceinfo = XIQueryDevice (compositor.display,
 			      XIAllDevices, &ndevices);
+  EndRoundTrip ("XIQueryDevice");
 
   if (!deviceinfo)
     return;
@@ -2301,8 +2569,10 @@ NoticeDeviceEnabled (int deviceid)
   int ndevices;
 
   CatchXErrors ();
+  BeginRoundTrip ();
   info = XIQueryDevice (compositor.display, deviceid,
 			&ndevices);
+  EndRoundTrip ("XIQueryDevice");
   UncatchXErrors (NULL);
 
   if (info && info->use == XIMasterPointer)
@@ -2326,8 +2596,10 @@ NoticeSlaveAttached (int deviceid)
   int ndevices;
 
   CatchXErrors ();
+  BeginRoundTrip ();
   info = XIQueryDevice (compositor.display, deviceid,
 			&ndevices);
+  EndRoundTrip ("XIQueryDevice");
   UncatchXErrors (NULL);
 
   /* A slave device was attached.  Take this opportunity to update its
@@ -2620,8 +2892,10 @@ HandleDeviceChanged (XIDeviceChangedEvent *event)
   /* Now, update scroll valuators from the new device info.  */
 
   CatchXErrors ();
+  BeginRoundTrip ();
   info = XIQueryDevice (compositor.display, event->deviceid,
 			&ndevices);
+  EndRoundTrip ("XIQueryDevice");
   UncatchXErrors (NULL);
 
   if (!info)
@@ -3585,9 +3859,11 @@ TranslateCoordinates (Window source, Window target, double x, double y,
   int_x = (int) x;
   int_y = (int) y;
 
+  BeginRoundTrip ();
   XTranslateCoordinates (compositor.display, source,
 			 target, int_x, int_y, &t1, &t2,
 			 &child_return);
+  EndRoundTrip ("TranslateCoordinates");
 
   /* Add the fractional part back.  */
   *x_out = (x - int_x) + t1;
@@ -4805,28 +5081,43 @@ WriteKeymap (void)
 static void
 AfterMapUpdate (void)
 {
-  if (XkbGetIndicatorMap (compositor.display, ~0, xkb_desc) != Success)
+  Status status;
+
+  BeginRoundTrip ();
+  status = XkbGetIndicatorMap (compositor.display, ~0, xkb_desc);
+  EndRoundTrip ("XkbGetIndicatorMap");
+
+  if (status != Success)
     {
       fprintf (stderr, "Could not load indicator map\n");
       exit (1);
     }
 
-  if (XkbGetControls (compositor.display,
-		      XkbAllControlsMask, xkb_desc) != Success)
+  BeginRoundTrip ();
+  status = XkbGetControls (compositor.display, XkbAllControlsMask, xkb_desc);
+  EndRoundTrip ("XkbGetControls");
+
+  if (status != Success)
     {
       fprintf (stderr, "Could not load keyboard controls\n");
       exit (1);
     }
 
-  if (XkbGetCompatMap (compositor.display,
-		       XkbAllCompatMask, xkb_desc) != Success)
+  BeginRoundTrip ();
+  status = XkbGetCompatMap (compositor.display, XkbAllCompatMask, xkb_desc);
+  EndRoundTrip ("XkbGetCompatMap");
+
+  if (status != Success)
     {
       fprintf (stderr, "Could not load compatibility map\n");
       exit (1);
     }
 
-  if (XkbGetNames (compositor.display,
-		   XkbAllNamesMask, xkb_desc) != Success)
+  BeginRoundTrip ();
+  status = XkbGetNames (compositor.display, XkbAllNamesMask, xkb_desc);
+  EndRoundTrip ("XkbGetNames");
+
+  if (status != Success)
     {
       fprintf (stderr, "Could not load names\n");
       exit (1);
@@ -4878,9 +5169,11 @@ SetupKeymap (void)
       exit (1);
     }
 
+  BeginRoundTrip ();
   xkb_desc = XkbGetMap (compositor.display,
 			XkbAllMapComponentsMask,
 			XkbUseCoreKbd);
+  EndRoundTrip ("XkbGetMap");
 
   if (!xkb_desc)
     {
@@ -4909,9 +5202,11 @@ HandleXkbEvent (XkbEvent *event)
       XkbFreeKeyboard (xkb_desc, XkbAllMapComponentsMask,
 		       True);
 
+      BeginRoundTrip ();
       xkb_desc = XkbGetMap (compositor.display,
 			    XkbAllMapComponentsMask,
 			    XkbUseCoreKbd);
+      EndRoundTrip ("XkbGetMap");
 
       if (!xkb_desc)
 	{
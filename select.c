@@ -80,6 +80,10 @@ enum
     IsFlushed	       = (1 << 8),
   };
 
+/* The maximum number of GetProperty requests that can be outstanding
+   for a single read transfer.  */
+#define MaxPrefetchedReads 4
+
 struct _ReadTransfer
 {
   /* The selection owner.  */
@@ -132,6 +136,15 @@ struct _ReadTransfer
 
   /* A timer that times out after 5 seconds of inactivity.  */
   Timer *timeout;
+
+  /* GetProperty requests made in advance for the rest of the current
+     chunk, in the order in which they were made.  Each reads
+     prefetch_length 4-byte units, starting from read_offset for the
+     first request.  */
+  xcb_get_property_cookie_t prefetched[MaxPrefetchedReads];
+
+  /* The number of such requests, and the length they read.  */
+  int n_prefetched, prefetch_length;
 };
 
 struct _WriteTransfer
@@ -300,7 +313,9 @@ AllocPropAtom (void)
       /* Use XInternAtom instead of InternAtom.  These atoms should
 	 only be interned once, so there is no point allocating memory
 	 in the global atoms table.  */
+      BeginRoundTrip ();
       atom->atom = XInternAtom (compositor.display, name, False);
+      EndRoundTrip ("InternAtom");
       atom->counter = prop_counter;
     }
 
@@ -332,11 +347,27 @@ ReleasePropAtom (PropertyAtom *atom)
      selection data transfers.  */
 }
 
+static void
+DiscardPrefetchedReads (ReadTransfer *transfer)
+{
+  int i;
+
+  for (i = 0; i < transfer->n_prefetched; ++i)
+    xcb_discard_reply (compositor.conn,
+		       transfer->prefetched[i].sequence);
+
+  transfer->n_prefetched = 0;
+}
+
 static void
 FinishReadTransfer (ReadTransfer *transfer, Bool success)
 {
   Bool delay;
 
+  /* Replies to GetProperty requests made in advance are no longer
+     interesting.  */
+  DiscardPrefetchedReads (transfer);
+
   if (transfer->data_finish_func
       /* This means to delay deallocating the transfer for a
 	 while.  */
@@ -374,6 +405,8 @@ HandleTimeout (Timer *timer, void *data, struct timespec time)
 static void
 CancelTransferEarly (ReadTransfer *transfer)
 {
+  DiscardPrefetchedReads (transfer);
+
   /* Delete the data transfer property from the window.  */
   XDeleteProperty (compositor.display,
 		   selection_transfer_window,
@@ -533,6 +566,8 @@ FinishChunk (ReadTransfer *transfer)
 void
 SkipChunk (ReadTransfer *transfer)
 {
+  DiscardPrefetchedReads (transfer);
+
   /* Just delete the property.  */
   XDeleteProperty (compositor.display,
 		   selection_transfer_window,
@@ -542,63 +577,158 @@ SkipChunk (ReadTransfer *transfer)
   FinishChunk (transfer);
 }
 
+static xcb_get_property_cookie_t
+GetPropertyChunk (ReadTransfer *transfer, unsigned long offset,
+		  int long_length)
+{
+  /* Ask for the property data starting at OFFSET.  Do not let the X
+     server delete the property once its last byte is read: that
+     request might have been prefetched, and the owner could then
+     write the next chunk of an INCR transfer before the reply is
+     read and IsWaitingForChunk is set, causing its PropertyNotify
+     event to be ignored.  ReadChunk deletes the property instead.  */
+  return xcb_get_property (compositor.conn, False,
+			   selection_transfer_window,
+			   transfer->property->atom,
+			   XCB_GET_PROPERTY_TYPE_ANY, offset,
+			   long_length);
+}
+
+static void
+PrefetchChunks (ReadTransfer *transfer, int long_length,
+		ptrdiff_t bytes_after)
+{
+  ptrdiff_t remaining;
+  unsigned long offset;
+
+  /* Subtract the data that will be returned by requests already
+     made.  */
+  remaining = (bytes_after - ((ptrdiff_t) transfer->n_prefetched
+			      * long_length * 4));
+
+  /* Request the rest of the property data, so that it arrives while
+     the caller is writing the current chunk.  Never ask for data past
+     the end of the property, since the X server would then generate
+     a BadValue error.  */
+  while (remaining > 0
+	 && transfer->n_prefetched < MaxPrefetchedReads)
+    {
+      offset = (transfer->read_offset
+		+ transfer->n_prefetched * long_length);
+      transfer->prefetched[transfer->n_prefetched++]
+	= GetPropertyChunk (transfer, offset, long_length);
+      remaining -= long_length * 4;
+    }
+}
+
 /* Read a chunk of data from TRANSFER.  LONG_LENGTH gives the length
    of the data to read.  Return a pointer to the data, or NULL if
    reading the data failed, and return the actual length of the data
-   in *NBYTES.  Free the data returned using Xlib functions!  */
+   in *NBYTES.  Free the data returned with XLFree!
+
+   If more data remains in the property, the next few chunks are
+   requested before returning, so that subsequent calls with the same
+   LONG_LENGTH will normally not have to wait for the X server.  */
 
 unsigned char *
 ReadChunk (ReadTransfer *transfer, int long_length, ptrdiff_t *nbytes,
 	   ptrdiff_t *bytes_after_return)
 {
+  xcb_get_property_cookie_t cookie;
+  xcb_get_property_reply_t *reply;
+  xcb_generic_error_t *error;
   unsigned char *prop_data;
-  Atom actual_type;
-  int actual_format, rc;
-  unsigned long nitems, bytes_after;
+  unsigned long i, nitems, bytes_after;
+  uint32_t *value;
 
-  prop_data = NULL;
+  if (transfer->n_prefetched
+      && transfer->prefetch_length == long_length)
+    {
+      /* The data was already requested.  Take the first cookie.  */
+      cookie = transfer->prefetched[0];
+      transfer->n_prefetched--;
+      memmove (transfer->prefetched, transfer->prefetched + 1,
+	       transfer->n_prefetched * sizeof *transfer->prefetched);
+    }
+  else
+    {
+      /* The length changed, so the prefetched data cannot be used.
+	 This does not happen in practice.  */
+      DiscardPrefetchedReads (transfer);
+      cookie = GetPropertyChunk (transfer, transfer->read_offset,
+				 long_length);
+    }
+
+  transfer->prefetch_length = long_length;
 
   /* Now read the actual property data.  */
-  rc = XGetWindowProperty (compositor.display, selection_transfer_window,
-			   transfer->property->atom, transfer->read_offset,
-			   long_length, True, AnyPropertyType, &actual_type,
-			   &actual_format, &nitems, &bytes_after, &prop_data);
+  error = NULL;
+  BeginRoundTrip ();
+  reply = xcb_get_property_reply (compositor.conn, cookie, &error);
+  EndRoundTrip ("GetProperty");
 
   /* Reading the property data failed.  Signal failure by returning
      NULL.  Also, cancel the whole transfer here too.  */
-  if (!prop_data)
+  if (!reply)
     {
+      free (error);
       CancelTransferEarly (transfer);
       return NULL;
     }
 
-  if (actual_type == None
-      || actual_format != transfer->read_format
-      || rc != Success)
+  if (reply->type == XCB_NONE
+      || reply->format != transfer->read_format)
     {
       /* Same goes here.  */
-      if (prop_data)
-	XFree (prop_data);
-
+      free (reply);
       CancelTransferEarly (transfer);
       return NULL;
     }
 
-  if (!bytes_after)
-    /* The property has now been deleted, so finish the chunk.  */
-    FinishChunk (transfer);
+  nitems = reply->value_len;
+  bytes_after = reply->bytes_after;
+
+  /* Copy the data into a buffer laid out the way XGetWindowProperty
+     would return it, with 32-bit items stored in longs and an extra
+     NULL byte at the end.  */
+  *nbytes = nitems * FormatTypeSize (reply->format);
+  prop_data = XLMalloc (*nbytes + 1);
+  prop_data[*nbytes] = '\0';
+
+  if (reply->format == 32)
+    {
+      value = xcb_get_property_value (reply);
+
+      for (i = 0; i < nitems; ++i)
+	((long *) prop_data)[i] = value[i];
+    }
+  else
+    memcpy (prop_data, xcb_get_property_value (reply), *nbytes);
 
-  /* Now return the number of bytes read.  */
-  *nbytes = nitems * FormatTypeSize (actual_format);
+  free (reply);
 
   /* Bump the read offset.  */
   transfer->read_offset += long_length;
 
+  if (!bytes_after)
+    {
+      /* The last of the property data has been read.  Delete the
+	 property, which tells the owner to write the next chunk, and
+	 finish this one.  */
+      XDeleteProperty (compositor.display,
+		       selection_transfer_window,
+		       transfer->property->atom);
+      FinishChunk (transfer);
+    }
+  else
+    /* Request the next chunks in advance.  */
+    PrefetchChunks (transfer, long_length, bytes_after);
+
   /* Return bytes_after to the caller.  */
   if (bytes_after_return)
     {
-      if (actual_format == 32)
-	*bytes_after_return = bytes_after * (sizeof (long) / 4);
+      if (transfer->read_format == 32)
+	*bytes_after_return = bytes_after / 4 * sizeof (long);
       else
 	*bytes_after_return = bytes_after;
     }
@@ -617,10 +747,12 @@ StartSelectionRead (ReadTransfer *transfer)
   prop_data = NULL;
 
   /* First, figure out how big the property data is.  */
+  BeginRoundTrip ();
   rc = XGetWindowProperty (compositor.display, selection_transfer_window,
 			   transfer->property->atom, 0, 0, True, AnyPropertyType,
 			   &actual_type, &actual_format, &nitems, &bytes_after,
 			   &prop_data);
+  EndRoundTrip ("GetWindowProperty");
 
   if (prop_data)
     XFree (prop_data);
@@ -1214,12 +1346,14 @@ ConvertSelectionMultiple (SelectionOwnerInfo *info, XEvent *event,
   /* Try to get the ATOM_PAIRs describing the targets and properties
      from the source.  */
   CatchXErrors ();
+  BeginRoundTrip ();
   rc = XGetWindowProperty (compositor.display,
 			   event->xselectionrequest.requestor,
 			   event->xselectionrequest.property,
 			   0, 65535, False, ATOM_PAIR,
 			   &actual_type, &actual_format,
 			   &nitems, &bytes_after, &prop_data);
+  EndRoundTrip ("GetWindowProperty");
   UncatchXErrors (NULL);
 
   if (rc != Success || actual_format != 32 || nitems % 2
@@ -1241,8 +1375,10 @@ ConvertSelectionMultiple (SelectionOwnerInfo *info, XEvent *event,
       DebugPrint ("Verifying MULTIPLE transfer; target = %lu, property = %lu\n",
 		  atoms[i + 0], atoms[i + 1]);
 
-      if (FindWriteTransfer (event->xselectionrequest.requestor, atoms[1], 0)
-	  || FindQueuedTransfer (event->xselectionrequest.requestor, atoms[1]))
+      if (FindWriteTransfer (event->xselectionrequest.requestor,
+			     atoms[i + 1], 0)
+	  || FindQueuedTransfer (event->xselectionrequest.requestor,
+				 atoms[i + 1]))
 	{
 	  DebugPrint ("Found ongoing selection transfer with same requestor "
 		      "and property; this MULTIPLE request will have to be "
@@ -1250,13 +1386,14 @@ ConvertSelectionMultiple (SelectionOwnerInfo *info, XEvent *event,
 
 	  QueueTransfer (event);
 
-	  if (prop_data)
-	    XLFree (prop_data);
-
+	  XFree (prop_data);
 	  return;
 	}
     }
 
+  /* This seems to be a sufficiently reasonable value.  */
+  quantum = MIN (SelectionQuantum (), 65535 * 2);
+
   record = XLMalloc (sizeof *record);
   record->pending = 0;
   record->event = *notify;
@@ -1271,45 +1408,52 @@ ConvertSelectionMultiple (SelectionOwnerInfo *info, XEvent *event,
 	 make sure the client didn't specify duplicate property names,
 	 as the ICCCM doesn't explicitly specify how programs should
 	 behave in that case.  Things will simply go wrong later on,
-	 and the transfer will time out.  */
+	 and the transfer will time out.
+
+	 Every conversion to a target backed by a data source is
+	 started here, before any data is read, so that the pipes to
+	 the data sources are all drained at the same time by the
+	 event loop.  The SelectionNotify event is sent once each
+	 conversion has either written its data or started an INCR
+	 transfer.  */
 
       DebugPrint ("Starting MULTIPLE transfer; target = %lu, property = %lu\n",
 		  atoms[i + 0], atoms[i + 1]);
 
-      if (atoms[0] == MULTIPLE)
+      if (atoms[i + 0] == MULTIPLE)
 	{
 	  DebugPrint ("Saw nested MULTIPLE transfer; "
 		      "such conversions are not allowed\n");
-	  atoms[0] = None;
+	  atoms[i + 0] = None;
 	  prop_data_changed = True;
 
 	  continue;
 	}
 
-      if (!CanConvertTarget (info, atoms[0]))
+      if (!CanConvertTarget (info, atoms[i + 0]))
 	{
 	  DebugPrint ("Couldn't convert to target for a simple reason;"
 		      " replacing atom with NULL\n");
-	  atoms[0] = None;
+	  atoms[i + 0] = None;
 	  prop_data_changed = True;
 
 	  continue;
 	}
 
-      if (atoms[0] == TARGETS)
+      if (atoms[i + 0] == TARGETS)
 	{
 	  DebugPrint ("Converting to special target TARGETS...\n");
 	  ConvertSelectionTargets1 (info, event->xselectionrequest.requestor,
-				    atoms[1]);
+				    atoms[i + 1]);
 
 	  continue;
 	}
 
-      if (atoms[0] == TIMESTAMP)
+      if (atoms[i + 0] == TIMESTAMP)
 	{
 	  DebugPrint ("Converting to special target TIMESTAMP...\n");
 	  ConvertSelectionTimestamp1 (info, event->xselectionrequest.requestor,
-				      atoms[1]);
+				      atoms[i + 1]);
 
 	  continue;
 	}
@@ -1317,9 +1461,6 @@ ConvertSelectionMultiple (SelectionOwnerInfo *info, XEvent *event,
       /* Create the write transfer and link it onto the list.  */
       transfer = XLCalloc (1, sizeof *transfer);
 
-      /* This seems to be a sufficiently reasonable value.  */
-      quantum = MIN (SelectionQuantum (), 65535 * 2);
-
       transfer->next = write_transfers.next;
       transfer->last = &write_transfers;
       transfer->requestor = event->xselectionrequest.requestor;
@@ -1349,7 +1490,7 @@ ConvertSelectionMultiple (SelectionOwnerInfo *info, XEvent *event,
 	  /* Something failed (most probably, we ran out of fds to
 	     make the pipe).  Cancel the transfer and signal
 	     failure.  */
-	  atoms[0] = None;
+	  atoms[i + 0] = None;
 	  prop_data_changed = True;
 
 	  FreeTransfer (transfer);
@@ -1827,7 +1968,9 @@ OwnSelection (Timestamp time, Atom selection,
 		      time.milliseconds);
 
   /* Check if selection ownership was actually set.  */
+  BeginRoundTrip ();
   owner = XGetSelectionOwner (compositor.display, selection);
+  EndRoundTrip ("GetSelectionOwner");
 
   /* If ownership wasn't successfully set, return.  */
   if (owner != selection_transfer_window)
@@ -49,6 +49,9 @@ typedef struct _Pool
   /* Pointer to the raw data in this pool.  */
   void *data;
 
+  /* Data associated with this pool by the renderer, or NULL.  */
+  void *render_data;
+
   /* The wl_resource corresponding to this pool.  */
   struct wl_resource *resource;
 } Pool;
@@ -64,6 +67,10 @@ typedef struct _Buffer
   /* The width and height of this buffer.  */
   unsigned int width, height;
 
+  /* The offset, stride and format of this buffer.  */
+  int32_t offset, stride;
+  uint32_t format;
+
   /* The wl_resource corresponding to this buffer.  */
   struct wl_resource *resource;
 
@@ -80,12 +87,23 @@ static struct wl_global *global_shm;
 /* The error base of the Render extension.  */
 int render_first_error;
 
+static void
+FreePoolRenderData (Pool *pool)
+{
+  if (!pool->render_data)
+    return;
+
+  RenderFreeShmPoolData (pool->render_data);
+  pool->render_data = NULL;
+}
+
 static void
 DereferencePool (Pool *pool)
 {
   if (--pool->refcount)
     return;
 
+  FreePoolRenderData (pool);
   munmap (pool->data, pool->size);
 
   /* Cancel the busfault trap.  */
@@ -162,6 +180,24 @@ HeightFunc (ExtBuffer *buffer)
   return ((Buffer *) buffer)->height;
 }
 
+Bool
+XLGetShmBufferContents (ExtBuffer *ext_buffer, void **data,
+			int32_t *stride, uint32_t *format)
+{
+  Buffer *buffer;
+
+  /* Return False if this is not a shared memory buffer.  */
+  if (ext_buffer->funcs.get_buffer != GetBufferFunc)
+    return False;
+
+  buffer = (Buffer *) ext_buffer;
+  *data = (char *) buffer->pool->data + buffer->offset;
+  *stride = buffer->stride;
+  *format = buffer->format;
+
+  return True;
+}
+
 static void
 DestroyBuffer (struct wl_client *client, struct wl_resource *resource)
 {
@@ -291,6 +327,10 @@ CreateBuffer (struct wl_client *client, struct wl_resource *resource,
   attrs.data = &pool->data;
   attrs.pool_size = pool->size;
 
+  /* This lets the renderer share resources between every buffer
+     created from the pool.  */
+  attrs.pool_data = &pool->render_data;
+
   /* Now, create the renderer buffer.  */
   failure = False;
   render_buffer = RenderBufferFromShm (&attrs, &failure);
@@ -308,6 +348,9 @@ CreateBuffer (struct wl_client *client, struct wl_resource *resource,
   buffer->render_buffer = render_buffer;
   buffer->width = width;
   buffer->height = height;
+  buffer->offset = offset;
+  buffer->stride = stride;
+  buffer->format = format;
   buffer->pool = pool;
   buffer->refcount = 1;
 
@@ -334,6 +377,10 @@ HandlePoolResourceDestroy (struct wl_resource *resource)
   Pool *pool;
 
   pool = wl_resource_get_user_data (resource);
+
+  /* No more buffers can be created from the pool, so the renderer
+     data is no longer required.  */
+  FreePoolRenderData (pool);
   DereferencePool (pool);
 }
 
@@ -398,6 +445,9 @@ ResizePool (struct wl_client *client, struct wl_resource *resource,
   pool->size = size;
   pool->data = data;
 
+  /* The renderer data was created for the old size of the pool.  */
+  FreePoolRenderData (pool);
+
   /* And add a new handler.  */
   if (pool->size && !(pool->flags & PoolCannotSigbus))
     XLRecordBusfault (pool->data, pool->size);
@@ -135,12 +135,16 @@ enum
     SubcompositorIsTargetAttached  = (1 << 5),
     /* This means the subcompositor is always garbaged.  */
     SubcompositorIsAlwaysGarbaged  = (1 << 6),
+    /* This means that the hit-testing index must be rebuilt before
+       the next lookup.  */
+    SubcompositorIsLookupDirty	   = (1 << 7),
   };
 
 #define IsGarbaged(subcompositor)				\
   ((subcompositor)->state & SubcompositorIsGarbaged)
 #define SetGarbaged(subcompositor)				\
-  ((subcompositor)->state |= SubcompositorIsGarbaged)
+  ((subcompositor)->state |= (SubcompositorIsGarbaged		\
+			      | SubcompositorIsLookupDirty))
 
 #define SetOpaqueDirty(subcompositor)				\
   ((subcompositor)->state |= SubcompositorIsOpaqueDirty)
@@ -148,7 +152,8 @@ enum
   ((subcompositor)->state & SubcompositorIsOpaqueDirty)
 
 #define SetInputDirty(subcompositor)				\
-  ((subcompositor)->state |= SubcompositorIsInputDirty)
+  ((subcompositor)->state |= (SubcompositorIsInputDirty		\
+			      | SubcompositorIsLookupDirty))
 #define IsInputDirty(subcompositor)				\
   ((subcompositor)->state & SubcompositorIsInputDirty)
 
@@ -167,6 +172,11 @@ enum
 #define IsAlwaysGarbaged(subcompositor)				\
   ((subcompositor)->state & SubcompositorIsAlwaysGarbaged)
 
+#define SetLookupDirty(subcompositor)				\
+  ((subcompositor)->state |= SubcompositorIsLookupDirty)
+#define IsLookupDirty(subcompositor)				\
+  ((subcompositor)->state & SubcompositorIsLookupDirty)
+
 enum
   {
     /* This means that the view and all its inferiors should be
@@ -179,6 +189,9 @@ enum
     /* Whether or not damage can be trusted.  When set, non-buffer
        damage cannot be trusted, as the view transform changed.  */
     ViewIsPreviouslyTransformed = 1 << 3,
+    /* Whether or not the cached occlusion region is up to date with
+       the opaque region.  */
+    ViewIsOcclusionValid	= 1 << 4,
   };
 
 #define IsViewUnmapped(view)			\
@@ -195,6 +208,13 @@ enum
 #define ClearViewported(view)			\
   ((view)->flags &= ~ViewIsViewported)		\
 
+#define IsOcclusionValid(view)			\
+  ((view)->flags & ViewIsOcclusionValid)
+#define SetOcclusionValid(view)			\
+  ((view)->flags |= ViewIsOcclusionValid)
+#define ClearOcclusionValid(view)		\
+  ((view)->flags &= ~ViewIsOcclusionValid)
+
 #define IsPreviouslyTransformed(view)			\
   ((view)->flags & ViewIsPreviouslyTransformed)
 #define SetPreviouslyTransformed(view)			\
@@ -216,6 +236,9 @@ struct _List
   View *view;
 };
 
+typedef struct _LookupEntry LookupEntry;
+typedef struct _LookupIndex LookupIndex;
+
 struct _View
 {
   /* Subcompositor this view belongs to.  NULL at first; callers are
@@ -262,6 +285,16 @@ struct _View
   /* Culling data; this is not valid after drawing completes.  */
   pixman_region32_t *cull_region;
 
+  /* Storage for the cull region.  It is kept around between updates
+     so that its rectangles do not have to be reallocated.  */
+  pixman_region32_t cull_storage;
+
+  /* The part of the subcompositor obscured by this view, and the
+     position, size and buffer opacity it was computed for.  */
+  pixman_region32_t occlusion;
+  int occlusion_x, occlusion_y, occlusion_width, occlusion_height;
+  Bool occlusion_opaque;
+
   /* The damaged and opaque regions.  */
   pixman_region32_t damage, opaque;
 
@@ -304,6 +337,49 @@ struct _SubcompositorDestroyCallback
   SubcompositorDestroyCallback *next, *last;
 };
 
+/* The hit-testing index is a uniform grid of LookupGridSize by
+   LookupGridSize cells laid over the extents of every view that can
+   receive input.  Each cell records the views overlapping it, in
+   compositing order, so that a lookup only has to test the handful
+   of views under the cell containing the pointer.  */
+
+enum
+  {
+    LookupGridSize = 16,
+  };
+
+struct _LookupEntry
+{
+  /* The view.  */
+  View *view;
+
+  /* The intersection of its input region with its bounds, in
+     absolute coordinates.  */
+  pixman_box32_t box;
+};
+
+struct _LookupIndex
+{
+  /* Array of every view that can receive input, in compositing
+     order.  */
+  LookupEntry *entries;
+
+  /* Number of entries and allocated size of that array.  */
+  int n_entries, entries_size;
+
+  /* Indices into entries for each cell, stored consecutively.  The
+     indices belonging to cell N start at cell_start[N] and end
+     before cell_start[N + 1].  */
+  int *cells, cells_size;
+  int cell_start[LookupGridSize * LookupGridSize + 1];
+
+  /* The union of the boxes of every entry.  */
+  pixman_box32_t extents;
+
+  /* The size of each cell.  */
+  int cell_width, cell_height;
+};
+
 struct _Subcompositor
 {
   /* List of all inferiors in compositing order.  */
@@ -376,6 +452,10 @@ struct _Subcompositor
 
   /* Various flags describing the state of this subcompositor.  */
   int state;
+
+  /* Index used to look up views by position, or NULL if no lookup
+     has happened yet.  */
+  LookupIndex *lookup_index;
 };
 
 enum
@@ -387,115 +467,181 @@ enum
     DoAll  = 0xf,
   };
 
-/* "Four corners" damage simplification algorithm.  If the number of
-   rectangles in the damage exceeds some preset number, then the
-   damage is considered too complicated to draw efficiently.
+/* Damage simplification.  Drawing each rectangle of the damage has
+   a fixed cost for the renderer, in addition to the cost of each
+   pixel drawn.  When the damage consists of many small rectangles, it
+   can be cheaper to draw a few larger rectangles instead, even though
+   more pixels are then drawn.
 
-   Overcomplicated damage is simplified by splitting the surface into
-   quadrants, and using the extents of its intersection with each of
-   those quadrants instead, which ensures that at most four rectangles
-   are drawn.  Some investigation is needed to determine whether or
-   not sextants are more optimal for damage appearing in the middle of
-   a surface.  */
+   The renderer provides an estimate of both costs, and the damage is
+   replaced by the cheapest of the exact damage, the extents of its
+   intersection with each cell of a grid laid over the damage, and the
+   result of greedily merging neighboring rectangles.  */
 
 #define IsDamageComplicated(damage)		\
-  (pixman_region32_n_rects (damage) >= 10)
+  (pixman_region32_n_rects (damage) >= 4)
+
+/* The largest number of rows or columns in a simplification
+   grid.  */
+#define MaxGridCells 4
+
+/* The number of previously merged rectangles each rectangle will be
+   merged with.  */
+#define MergeWindow 8
+
+#define BoxArea(box)						\
+  ((uint64_t) ((box).x2 - (box).x1) * ((box).y2 - (box).y1))
+
+static uint64_t
+DamageCost (pixman_region32_t *damage, int request_cost,
+	    int pixel_cost)
+{
+  pixman_box32_t *boxes;
+  int nboxes, i;
+  uint64_t area;
+
+  boxes = pixman_region32_rectangles (damage, &nboxes);
+  area = 0;
+
+  for (i = 0; i < nboxes; ++i)
+    area += BoxArea (boxes[i]);
+
+  return (uint64_t) nboxes * request_cost + area * pixel_cost;
+}
 
 static void
-SimplifyDamage (pixman_region32_t *damage, int min_x, int min_y,
-		int max_x, int max_y)
+GridSimplifyDamage (pixman_region32_t *result, pixman_region32_t *damage,
+		    int columns, int rows)
 {
-  Rectangle quadrant_a, quadrant_b, quadrant_c, quadrant_d;
-  pixman_box32_t extents_a, extents_b, extents_c, extents_d;
   pixman_region32_t temp;
-  int width, height;
+  pixman_box32_t bounds, *extents;
+  int i, j, x, y, width, height;
 
-  width = max_x - min_x;
-  height = max_y - min_y;
-
-  /* Split the surface or subcompositor into quadrants:
-
-              +-------------+-------------+
-	      |             |             |
-	      |  Quadrant   |  Quadrant   |
-	      |     A       |     B       |
-	      |             |             |
-	      +-------------+-------------|
-	      |             |             |
-	      |  Quadrant   |  Quadrant   |
-	      |     C       |     D       |
-	      |             |             |
-	      +---------------------------+  */
-
-  quadrant_a.x = min_x;
-  quadrant_a.y = min_y;
-  quadrant_a.width = width / 2;
-  quadrant_a.height = height / 2;
-
-  quadrant_b.x = quadrant_a.x + quadrant_a.width;
-  quadrant_b.y = min_y;
-  quadrant_b.width = width - quadrant_a.width;
-  quadrant_b.height = height / 2;
-
-  quadrant_c.x = min_x;
-  quadrant_c.y = quadrant_a.y + quadrant_a.height;
-  quadrant_c.width = width / 2;
-  quadrant_c.height = height - quadrant_a.height;
-
-  quadrant_d.x = quadrant_a.x + quadrant_a.width;
-  quadrant_d.y = quadrant_a.y + quadrant_a.height;
-  quadrant_d.width = width - quadrant_a.width;
-  quadrant_d.height = height - quadrant_a.height;
-
-  /* Now, compute the intersection of the damage with each of the
-     rectangles.  */
+  /* Split the extents of the damage into COLUMNS by ROWS cells, and
+     set RESULT to the extents of the damage within each cell.  */
+  bounds = *pixman_region32_extents (damage);
+  pixman_region32_clear (result);
   pixman_region32_init (&temp);
 
-  /* A.  */
-  pixman_region32_intersect_rect (&temp, damage, quadrant_a.x,
-				  quadrant_a.y, quadrant_a.width,
-				  quadrant_a.height);
-  extents_a = temp.extents;
-
-  /* B.  */
-  pixman_region32_intersect_rect (&temp, damage, quadrant_b.x,
-				  quadrant_b.y, quadrant_b.width,
-				  quadrant_b.height);
-  extents_b = temp.extents;
-
-  /* C.  */
-  pixman_region32_intersect_rect (&temp, damage, quadrant_c.x,
-				  quadrant_c.y, quadrant_c.width,
-				  quadrant_c.height);
-  extents_c = temp.extents;
-
-  /* D.  */
-  pixman_region32_intersect_rect (&temp, damage, quadrant_d.x,
-				  quadrant_d.y, quadrant_d.width,
-				  quadrant_d.height);
-  extents_d = temp.extents;
+  for (j = 0; j < rows; ++j)
+    {
+      for (i = 0; i < columns; ++i)
+	{
+	  x = bounds.x1 + (bounds.x2 - bounds.x1) * i / columns;
+	  y = bounds.y1 + (bounds.y2 - bounds.y1) * j / rows;
+	  width = (bounds.x1 + (bounds.x2 - bounds.x1) * (i + 1)
+		   / columns) - x;
+	  height = (bounds.y1 + (bounds.y2 - bounds.y1) * (j + 1)
+		    / rows) - y;
+
+	  pixman_region32_intersect_rect (&temp, damage, x, y,
+					  width, height);
+
+	  if (!pixman_region32_not_empty (&temp))
+	    continue;
+
+	  extents = pixman_region32_extents (&temp);
+	  pixman_region32_union_rect (result, result, extents->x1,
+				      extents->y1,
+				      extents->x2 - extents->x1,
+				      extents->y2 - extents->y1);
+	}
+    }
+
   pixman_region32_fini (&temp);
+}
+
+static void
+MergeSimplifyDamage (pixman_region32_t *result, pixman_region32_t *damage,
+		     int request_cost, int pixel_cost)
+{
+  pixman_box32_t *boxes, *merged, box;
+  int nboxes, nmerged, i, j, start;
+  uint64_t separate, combined;
+
+  /* Walk through the rectangles of the damage, which are sorted by
+     band.  Merge each rectangle with a recently merged rectangle if
+     drawing their bounding box costs less than drawing both of them
+     separately.  */
+  boxes = pixman_region32_rectangles (damage, &nboxes);
+  merged = XLMalloc (sizeof *merged * nboxes);
+  nmerged = 0;
+
+  for (i = 0; i < nboxes; ++i)
+    {
+      start = MAX (0, nmerged - MergeWindow);
+
+      for (j = nmerged - 1; j >= start; --j)
+	{
+	  box.x1 = MIN (merged[j].x1, boxes[i].x1);
+	  box.y1 = MIN (merged[j].y1, boxes[i].y1);
+	  box.x2 = MAX (merged[j].x2, boxes[i].x2);
+	  box.y2 = MAX (merged[j].y2, boxes[i].y2);
+
+	  separate = ((BoxArea (merged[j]) + BoxArea (boxes[i]))
+		      * pixel_cost + request_cost);
+	  combined = BoxArea (box) * pixel_cost;
+
+	  if (combined <= separate)
+	    {
+	      merged[j] = box;
+	      break;
+	    }
+	}
+
+      if (j < start)
+	merged[nmerged++] = boxes[i];
+    }
 
-  /* Finally, clear the damage.  */
-  pixman_region32_clear (damage);
-
-  /* Union the damage with each of the extents.  */
-  pixman_region32_union_rect (damage, damage,
-			      extents_a.x1, extents_a.y1,
-			      extents_a.x2 - extents_a.x1,
-			      extents_a.y2 - extents_a.y1);
-  pixman_region32_union_rect (damage, damage,
-			      extents_b.x1, extents_b.y1,
-			      extents_b.x2 - extents_b.x1,
-			      extents_b.y2 - extents_b.y1);
-  pixman_region32_union_rect (damage, damage,
-			      extents_c.x1, extents_c.y1,
-			      extents_c.x2 - extents_c.x1,
-			      extents_c.y2 - extents_c.y1);
-  pixman_region32_union_rect (damage, damage,
-			      extents_d.x1, extents_d.y1,
-			      extents_d.x2 - extents_d.x1,
-			      extents_d.y2 - extents_d.y1);
+  /* The merged rectangles might overlap, but that is handled by
+     pixman.  */
+  pixman_region32_fini (result);
+  pixman_region32_init_rects (result, merged, nmerged);
+  XLFree (merged);
+}
+
+static void
+SimplifyDamage (pixman_region32_t *damage)
+{
+  pixman_region32_t best, candidate;
+  uint64_t best_cost, cost;
+  int request_cost, pixel_cost, columns, rows;
+
+  RenderGetDamageCosts (&request_cost, &pixel_cost);
+
+  pixman_region32_init (&best);
+  pixman_region32_init (&candidate);
+
+  /* Start with the exact damage.  */
+  pixman_region32_copy (&best, damage);
+  best_cost = DamageCost (damage, request_cost, pixel_cost);
+
+  /* Next, try each grid.  */
+  for (rows = 1; rows <= MaxGridCells; ++rows)
+    {
+      for (columns = 1; columns <= MaxGridCells; ++columns)
+	{
+	  GridSimplifyDamage (&candidate, damage, columns, rows);
+	  cost = DamageCost (&candidate, request_cost, pixel_cost);
+
+	  if (cost < best_cost)
+	    {
+	      pixman_region32_copy (&best, &candidate);
+	      best_cost = cost;
+	    }
+	}
+    }
+
+  /* Finally, try merging rectangles.  */
+  MergeSimplifyDamage (&candidate, damage, request_cost, pixel_cost);
+  cost = DamageCost (&candidate, request_cost, pixel_cost);
+
+  if (cost < best_cost)
+    pixman_region32_copy (&best, &candidate);
+
+  pixman_region32_copy (damage, &best);
+  pixman_region32_fini (&best);
+  pixman_region32_fini (&candidate);
 }
 
 
@@ -615,6 +761,8 @@ MakeView (void)
   pixman_region32_init (&view->damage);
   pixman_region32_init (&view->opaque);
   pixman_region32_init (&view->input);
+  pixman_region32_init (&view->cull_storage);
+  pixman_region32_init (&view->occlusion);
 
   view->transform = Normal;
 
@@ -656,6 +804,11 @@ SubcompositorUpdateBounds (Subcompositor *subcompositor, int doflags)
   int min_x, min_y, max_x, max_y;
   int old_min_x, old_min_y;
 
+  /* This is called whenever a view is moved, resized, mapped or
+     unmapped, so the hit-testing index must be rebuilt even if the
+     bounds themselves do not change.  */
+  SetLookupDirty (subcompositor);
+
   /* Updates were optimized out.  */
   if (!doflags)
     return;
@@ -729,6 +882,10 @@ SubcompositorUpdateBoundsForInsert (Subcompositor *subcompositor,
 {
   XLAssert (view->subcompositor == subcompositor);
 
+  /* The stacking order changed, so invalidate the hit-testing
+     index.  */
+  SetLookupDirty (subcompositor);
+
   if (!ViewIsMapped (view))
     /* If the view is unmapped, do nothing.  */
     return;
@@ -1332,6 +1489,9 @@ ViewAfterSizeUpdate (View *view)
   view->width = ViewWidth (view);
   view->height = ViewHeight (view);
 
+  if (view->subcompositor)
+    SetLookupDirty (view->subcompositor);
+
   if (!view->subcompositor || !ViewVisibilityState (view, &mapped)
       || !mapped)
     return;
@@ -1580,6 +1740,9 @@ ViewMap (View *view)
 
   ClearUnmapped (view);
 
+  if (view->subcompositor)
+    SetLookupDirty (view->subcompositor);
+
   if (view->subcompositor
       && (view->link != view->inferior || view->buffer))
     {
@@ -1613,6 +1776,7 @@ ViewUnmap (View *view)
     {
       /* Mark the subcompositor as having unmapped views.  */
       SetPartiallyMapped (view->subcompositor);
+      SetLookupDirty (view->subcompositor);
 
       /* If the link pointer is the inferior pointer and there is no
 	 buffer attached to the view, it is empty.  There is no need
@@ -1656,6 +1820,8 @@ ViewFree (View *view)
   pixman_region32_fini (&view->damage);
   pixman_region32_fini (&view->opaque);
   pixman_region32_fini (&view->input);
+  pixman_region32_fini (&view->cull_storage);
+  pixman_region32_fini (&view->occlusion);
 
   XLFree (view);
 }
@@ -1664,6 +1830,7 @@ ViewFree (View *view)
 
 static void ApplyBufferDamage (View *, pixman_region32_t *);
 static void ApplyUntransformedDamage (View *, pixman_region32_t *);
+static void ViewComputeTransform (View *, DrawParams *, Bool);
 
 void
 ViewDamage (View *view, pixman_region32_t *damage)
@@ -1704,30 +1871,11 @@ BufferHeightAfterTransform (View *view)
   return XLBufferHeight (view->buffer);
 }
 
-static void
-TransformBufferDamage (pixman_region32_t *damage,
-		       pixman_region32_t *source,
-		       View *view)
-{
-  int width, height;
-
-  /* Calculate the width and height of the buffer after the
-     transform.  */
-  width = XLBufferWidth (view->buffer);
-  height = XLBufferHeight (view->buffer);
-
-  /* Transform the damage.  */
-  XLTransformRegion (damage, source, view->transform,
-		     width, height);
-}
-
 void
 ViewDamageBuffer (View *view, pixman_region32_t *damage)
 {
   pixman_region32_t temp;
-  double x_factor, y_factor;
-  double crop_width, stretch_width;
-  double crop_height, stretch_height;
+  DrawParams params;
 
   if (!view->buffer)
     return;
@@ -1739,54 +1887,14 @@ ViewDamageBuffer (View *view, pixman_region32_t *damage)
     ViewDamage (view, damage);
   else
     {
-      /* Otherwise, apply the transform to the view.  */
+      /* Otherwise, apply the transform, scale and viewport to the
+	 damage, in the same manner as they are applied when
+	 drawing.  */
       pixman_region32_init (&temp);
-
-      /* First, apply the content scale.  */
-      x_factor = GetContentScale (view->scale);
-      y_factor = GetContentScale (view->scale);
-
-      if (view->transform != Normal)
-	{
-	  /* Transform the given buffer damage if need be.  */
-	  TransformBufferDamage (&temp, damage, view);
-
-	  /* Scale the region.  */
-	  XLScaleRegion (&temp, &temp, x_factor, y_factor);
-	}
-      else
-	/* Scale the region.  */
-	XLScaleRegion (&temp, damage, x_factor, y_factor);
-
-      /* Next, apply the viewport.  */
-      if (IsViewported (view))
-	{
-	  crop_width = view->crop_width;
-	  crop_height = view->crop_height;
-	  stretch_width = view->dest_width;
-	  stretch_height = view->dest_height;
-
-	  /* Offset the region.  */
-	  if (view->src_x != 1.0 || view->src_y != 1.0)
-	    pixman_region32_translate (&temp, -view->src_x,
-				       -view->src_y);
-
-	  /* If the crop width or height were not specified, use the
-	     current buffer width/height.  */
-	  if (crop_width == -1)
-	    {
-	      crop_width = (BufferWidthAfterTransform (view)
-			    * GetContentScale (view->scale));
-	      crop_height = (BufferHeightAfterTransform (view)
-			     * GetContentScale (view->scale));
-	    }
-
-	  x_factor = stretch_width / crop_width;
-	  y_factor = stretch_height / crop_height;
-
-	  /* Scale the region again.  */
-	  XLScaleRegion (&temp, &temp, x_factor, y_factor);
-	}
+      ViewComputeTransform (view, &params, False);
+      TransformDamageRegion (&temp, damage, &params,
+			     XLBufferWidth (view->buffer),
+			     XLBufferHeight (view->buffer));
 
       /* Damage the view.  */
       pixman_region32_union (&view->damage, &view->damage, &temp);
@@ -1801,6 +1909,7 @@ void
 ViewSetOpaque (View *view, pixman_region32_t *opaque)
 {
   pixman_region32_copy (&view->opaque, opaque);
+  ClearOcclusionValid (view);
 
   if (view->subcompositor)
     SetOpaqueDirty (view->subcompositor);
@@ -2208,9 +2317,12 @@ RenderCompletedCallback (void *data, uint64_t msc, uint64_t ust)
   XLAssert (subcompositor->render_key != NULL);
   subcompositor->render_key = NULL;
 
-  /* Call the frame function if it s still set.  */
+  /* Call the frame function if it s still set.  An msc of -1 means
+     the renderer only knows that rendering completed, not when the
+     contents were presented.  */
   if (subcompositor->note_frame)
-    subcompositor->note_frame (ModePresented,
+    subcompositor->note_frame ((msc == (uint64_t) -1
+				? ModeComplete : ModePresented),
 			       subcompositor->frame_counter,
 			       subcompositor->note_frame_data,
 			       msc, ust);
@@ -2312,23 +2424,66 @@ SubcompositorUpdateAncillary (Subcompositor *subcompositor)
   subcompositor->state &= ~SubcompositorIsInputDirty;
 }
 
-static pixman_region32_t *
-CopyRegion (pixman_region32_t *source)
+static void
+SetCullRegion (View *view, pixman_region32_t *source)
 {
-  pixman_region32_t *region;
-
-  region = XLMalloc (sizeof *region);
-  pixman_region32_init (region);
-  pixman_region32_copy (region, source);
-
-  return region;
+  /* Copying into the storage reuses its rectangles if they are large
+     enough.  */
+  pixman_region32_copy (&view->cull_storage, source);
+  view->cull_region = &view->cull_storage;
 }
 
 static void
-FreeRegion (pixman_region32_t *region)
+ClearCullRegion (View *view)
 {
-  pixman_region32_fini (region);
-  XLFree (region);
+  /* The storage itself is not cleared, as that would free its
+     rectangles.  */
+  view->cull_region = NULL;
+}
+
+static pixman_region32_t *
+ViewOcclusion (View *view, RenderBuffer buffer)
+{
+  Bool opaque;
+
+  opaque = RenderIsBufferOpaque (buffer);
+
+  /* Reuse the occlusion computed during a previous update if neither
+     the opaque region nor the position, size and opacity of the view
+     changed since.  */
+  if (IsOcclusionValid (view)
+      && view->occlusion_x == view->abs_x
+      && view->occlusion_y == view->abs_y
+      && view->occlusion_width == view->width
+      && view->occlusion_height == view->height
+      && view->occlusion_opaque == opaque)
+    return &view->occlusion;
+
+  if (opaque)
+    {
+      /* If the buffer is opaque, we can just ignore its opaque
+	 region.  */
+      pixman_region32_fini (&view->occlusion);
+      pixman_region32_init_rect (&view->occlusion, view->abs_x,
+				 view->abs_y, view->width,
+				 view->height);
+    }
+  else
+    {
+      pixman_region32_intersect_rect (&view->occlusion, &view->opaque,
+				      0, 0, view->width, view->height);
+      pixman_region32_translate (&view->occlusion, view->abs_x,
+				 view->abs_y);
+    }
+
+  view->occlusion_x = view->abs_x;
+  view->occlusion_y = view->abs_y;
+  view->occlusion_width = view->width;
+  view->occlusion_height = view->height;
+  view->occlusion_opaque = opaque;
+  SetOcclusionValid (view);
+
+  return &view->occlusion;
 }
 
 static Bool
@@ -2366,7 +2521,7 @@ DoCull (Subcompositor *subcompositor, pixman_region32_t *damage,
 {
   List *list;
   View *view;
-  pixman_region32_t temp;
+  pixman_region32_t temp, *occlusion;
   RenderBuffer buffer;
 
   view = NULL;
@@ -2412,33 +2567,18 @@ DoCull (Subcompositor *subcompositor, pixman_region32_t *damage,
 
       /* Don't set the cull region if it is empty.  */
       if (pixman_region32_not_empty (&temp))
-	view->cull_region = CopyRegion (&temp);
+	SetCullRegion (view, &temp);
 
       /* Subtract the damage region by the view's opaque region.  */
 
       if (!pixman_region32_not_empty (&view->opaque))
 	goto last;
 
-      if (RenderIsBufferOpaque (buffer))
-	{
-	  /* If the buffer is opaque, we can just ignore its opaque
-	     region.  */
-	  pixman_region32_clear (&temp);
-	  pixman_region32_union_rect (&temp, &temp, view->abs_x,
-				      view->abs_y, view->width,
-				      view->height);
-	}
-      else
-	{
-	  pixman_region32_intersect_rect (&temp, &view->opaque, 0, 0,
-					  view->width, view->height);
-	  pixman_region32_translate (&temp, view->abs_x, view->abs_y);
-	}
-
-      pixman_region32_subtract (damage, damage, &temp);
+      occlusion = ViewOcclusion (view, buffer);
+      pixman_region32_subtract (damage, damage, occlusion);
 
       /* Also subtract the opaque region from the background.  */
-      pixman_region32_subtract (background, background, &temp);
+      pixman_region32_subtract (background, background, occlusion);
 
       /* If damage is already empty, finish early.  */
       if (!pixman_region32_not_empty (damage))
@@ -2475,7 +2615,7 @@ CompositeSingleView (View *view, pixman_region32_t *region,
 		     Operation op, DrawParams *transform)
 {
   pixman_box32_t *boxes;
-  int nboxes, i;
+  int nboxes;
   RenderBuffer buffer;
   int min_x, min_y, tx, ty;
   Subcompositor *subcompositor;
@@ -2489,22 +2629,16 @@ CompositeSingleView (View *view, pixman_region32_t *region,
   boxes = pixman_region32_rectangles (region, &nboxes);
   buffer = XLRenderBufferFromBuffer (view->buffer);
 
-  for (i = 0; i < nboxes; ++i)
-    RenderComposite (buffer, view->subcompositor->target, op,
-		     /* src-x.  */
-		     boxes[i].x1 - view->abs_x,
-		     /* src-y.  */
-		     boxes[i].y1 - view->abs_y,
-		     /* dst-x.  */
-		     boxes[i].x1 - min_x + tx,
-		     /* dst-y.  */
-		     boxes[i].y1 - min_y + ty,
-		     /* width.  */
-		     boxes[i].x2 - boxes[i].x1,
-		     /* height.  */
-		     boxes[i].y2 - boxes[i].y1,
-		     /* draw-params.  */
-		     transform);
+  /* Composite every box at once, so the renderer can batch them into
+     a single drawing operation.  */
+  RenderCompositeBoxes (buffer, view->subcompositor->target, op,
+			boxes, nboxes,
+			/* src-x, src-y.  */
+			view->abs_x, view->abs_y,
+			/* dst-x, dst-y.  */
+			min_x - tx, min_y - ty,
+			/* draw-params.  */
+			transform);
 }
 
 static void
@@ -2619,9 +2753,7 @@ ClearCull (Subcompositor *subcompositor)
     {
       SkipSlug (list, view, next);
 
-      if (view->cull_region)
-	FreeRegion (view->cull_region);
-      view->cull_region = NULL;
+      ClearCullRegion (view);
 
     next:
       list = list->next;
@@ -2747,9 +2879,8 @@ SubcompositorComposite1 (Subcompositor *subcompositor,
 	  CompositeSingleView (view, view->cull_region, op,
 			       &transform);
 
-	  /* And free the cull region.  */
-	  FreeRegion (view->cull_region);
-	  view->cull_region = NULL;
+	  /* And clear the cull region.  */
+	  ClearCullRegion (view);
 
 	  /* Subsequent views should be composited.  */
 	  op = OperationOver;
@@ -2785,9 +2916,8 @@ SubcompositorComposite1 (Subcompositor *subcompositor,
 	   over the presentation callback.  */
 	presented = True;
 
-      /* And free the cull region.  */
-      FreeRegion (view->cull_region);
-      view->cull_region = NULL;
+      /* And clear the cull region.  */
+      ClearCullRegion (view);
     }
 
   /* If a note_frame callback is attached, then this function can pass
@@ -2935,11 +3065,7 @@ SubcompositorComposite (Subcompositor *subcompositor)
 
   /* If the damage is too complicated, simplify it.  */
   if (IsDamageComplicated (&damage))
-    SimplifyDamage (&damage,
-		    subcompositor->min_x,
-		    subcompositor->min_y,
-		    subcompositor->max_x,
-		    subcompositor->max_y);
+    SimplifyDamage (&damage);
 
   /* Add this damage onto the damage ring.  */
   StorePreviousDamage (subcompositor, &temp);
@@ -3168,56 +3294,230 @@ SubcompositorFree (Subcompositor *subcompositor)
   if (subcompositor->render_key)
     RenderCancelCompletionCallback (subcompositor->render_key);
 
+  /* Free the hit-testing index.  */
+  if (subcompositor->lookup_index)
+    {
+      XLFree (subcompositor->lookup_index->entries);
+      XLFree (subcompositor->lookup_index->cells);
+      XLFree (subcompositor->lookup_index);
+    }
+
   XLFree (subcompositor);
 }
 
+static int
+LookupColumn (LookupIndex *index, int x)
+{
+  int column;
+
+  column = (x - index->extents.x1) / index->cell_width;
+  return MAX (0, MIN (LookupGridSize - 1, column));
+}
+
+static int
+LookupRow (LookupIndex *index, int y)
+{
+  int row;
+
+  row = (y - index->extents.y1) / index->cell_height;
+  return MAX (0, MIN (LookupGridSize - 1, row));
+}
+
+static void
+SubcompositorBuildLookupIndex (Subcompositor *subcompositor)
+{
+  LookupIndex *index;
+  LookupEntry *entry;
+  List *list;
+  View *view;
+  pixman_box32_t *extents, box;
+  int i, x, y, x1, y1, x2, y2, cell;
+  int fill[LookupGridSize * LookupGridSize];
+
+  index = subcompositor->lookup_index;
+
+  if (!index)
+    {
+      index = XLCalloc (1, sizeof *index);
+      subcompositor->lookup_index = index;
+    }
+
+  index->n_entries = 0;
+  subcompositor->state &= ~SubcompositorIsLookupDirty;
+
+  /* Record every mapped view with a buffer and a non-empty input
+     region, in compositing order.  */
+  list = subcompositor->inferiors->next;
+
+  while (list != subcompositor->inferiors)
+    {
+      view = list->view;
+
+      if (!view)
+	goto next;
+
+      /* If the view is unmapped, skip past its children.  */
+      if (IsViewUnmapped (view))
+	{
+	  list = view->inferior;
+	  goto next;
+	}
+
+      if (!view->buffer)
+	goto next;
+
+      /* Intersect the input region with the bounds of the view.  */
+      extents = pixman_region32_extents (&view->input);
+      box.x1 = view->abs_x + MAX (0, extents->x1);
+      box.y1 = view->abs_y + MAX (0, extents->y1);
+      box.x2 = view->abs_x + MIN (view->width, extents->x2);
+      box.y2 = view->abs_y + MIN (view->height, extents->y2);
+
+      if (box.x1 >= box.x2 || box.y1 >= box.y2)
+	goto next;
+
+      if (index->n_entries == index->entries_size)
+	{
+	  index->entries_size = MAX (16, index->entries_size * 2);
+	  index->entries
+	    = XLRealloc (index->entries,
+			 sizeof *index->entries * index->entries_size);
+	}
+
+      entry = &index->entries[index->n_entries++];
+      entry->view = view;
+      entry->box = box;
+
+    next:
+      list = list->next;
+    }
+
+  memset (index->cell_start, 0, sizeof index->cell_start);
+
+  if (!index->n_entries)
+    return;
+
+  /* Compute the extents of the grid and the size of each cell.  */
+  index->extents = index->entries[0].box;
+
+  for (i = 1; i < index->n_entries; ++i)
+    {
+      box = index->entries[i].box;
+
+      index->extents.x1 = MIN (index->extents.x1, box.x1);
+      index->extents.y1 = MIN (index->extents.y1, box.y1);
+      index->extents.x2 = MAX (index->extents.x2, box.x2);
+      index->extents.y2 = MAX (index->extents.y2, box.y2);
+    }
+
+  index->cell_width = ((index->extents.x2 - index->extents.x1
+			+ LookupGridSize - 1) / LookupGridSize);
+  index->cell_height = ((index->extents.y2 - index->extents.y1
+			 + LookupGridSize - 1) / LookupGridSize);
+
+  /* Count the entries overlapping each cell.  */
+  for (i = 0; i < index->n_entries; ++i)
+    {
+      box = index->entries[i].box;
+      x1 = LookupColumn (index, box.x1);
+      y1 = LookupRow (index, box.y1);
+      x2 = LookupColumn (index, box.x2 - 1);
+      y2 = LookupRow (index, box.y2 - 1);
+
+      for (y = y1; y <= y2; ++y)
+	{
+	  for (x = x1; x <= x2; ++x)
+	    index->cell_start[y * LookupGridSize + x + 1]++;
+	}
+    }
+
+  /* Turn those counts into offsets.  */
+  for (i = 1; i <= LookupGridSize * LookupGridSize; ++i)
+    index->cell_start[i] += index->cell_start[i - 1];
+
+  if (index->cell_start[i - 1] > index->cells_size)
+    {
+      index->cells_size = index->cell_start[i - 1];
+      index->cells = XLRealloc (index->cells,
+				sizeof *index->cells * index->cells_size);
+    }
+
+  /* And fill in each cell.  Entries are added in compositing order,
+     so each cell stays sorted from bottom to top.  */
+  memcpy (fill, index->cell_start, sizeof fill);
+
+  for (i = 0; i < index->n_entries; ++i)
+    {
+      box = index->entries[i].box;
+      x1 = LookupColumn (index, box.x1);
+      y1 = LookupRow (index, box.y1);
+      x2 = LookupColumn (index, box.x2 - 1);
+      y2 = LookupRow (index, box.y2 - 1);
+
+      for (y = y1; y <= y2; ++y)
+	{
+	  for (x = x1; x <= x2; ++x)
+	    {
+	      cell = y * LookupGridSize + x;
+	      index->cells[fill[cell]++] = i;
+	    }
+	}
+    }
+}
+
 View *
 SubcompositorLookupView (Subcompositor *subcompositor, int x, int y,
 			 int *view_x, int *view_y)
 {
-  List *list;
-  int temp_x, temp_y;
+  LookupIndex *index;
+  LookupEntry *entry;
+  int temp_x, temp_y, cell, i;
   pixman_box32_t box;
 
   x += subcompositor->min_x;
   y += subcompositor->min_y;
 
-  for (list = subcompositor->inferiors->last;
-       list != subcompositor->inferiors;
-       list = list->last)
-    {
-      if (!list->view)
-	continue;
+  /* Rebuild the hit-testing index if the view hierarchy, the position
+     or size of a view, or an input region changed since the last
+     lookup.  */
+  if (!subcompositor->lookup_index || IsLookupDirty (subcompositor))
+    SubcompositorBuildLookupIndex (subcompositor);
 
-      if (IsViewUnmapped (list->view))
-	{
-	  list = list->view->inferior;
-	  continue;
-	}
+  index = subcompositor->lookup_index;
 
-      if (!list->view->buffer)
-	continue;
+  if (!index->n_entries
+      || x < index->extents.x1 || x >= index->extents.x2
+      || y < index->extents.y1 || y >= index->extents.y2)
+    return NULL;
 
-      temp_x = x - list->view->abs_x;
-      temp_y = y - list->view->abs_y;
+  cell = (LookupRow (index, y) * LookupGridSize
+	  + LookupColumn (index, x));
 
-      /* If the coordinates don't fit in the view bounds, skip the
-	 view.  This test is the equivalent to intersecting the view's
-	 input region with the bounds of the view.  */
-      if (temp_x < 0 || temp_y < 0
-	  || temp_x >= list->view->width
-	  || temp_y >= list->view->height)
+  /* Walk through the views overlapping that cell from top to
+     bottom.  */
+  for (i = index->cell_start[cell + 1] - 1;
+       i >= index->cell_start[cell]; --i)
+    {
+      entry = &index->entries[index->cells[i]];
+
+      /* If the coordinates don't fit in the input bounds of the view,
+	 skip the view.  */
+      if (x < entry->box.x1 || x >= entry->box.x2
+	  || y < entry->box.y1 || y >= entry->box.y2)
 	continue;
 
+      temp_x = x - entry->view->abs_x;
+      temp_y = y - entry->view->abs_y;
+
       /* Now see if the input region contains the given
 	 coordinates.  If it does, return the view.  */
-      if (pixman_region32_contains_point (&list->view->input, temp_x,
+      if (pixman_region32_contains_point (&entry->view->input, temp_x,
 					  temp_y, &box))
 	{
-	  *view_x = list->view->abs_x - subcompositor->min_x;
-	  *view_y = list->view->abs_y - subcompositor->min_y;
+	  *view_x = entry->view->abs_x - subcompositor->min_x;
+	  *view_y = entry->view->abs_y - subcompositor->min_y;
 
-	  return list->view;
+	  return entry->view;
 	}
     }
 
@@ -1192,6 +1192,9 @@ Commit (struct wl_client *client, struct wl_resource *resource)
 
   surface = wl_resource_get_user_data (resource);
 
+  /* Record the time of this commit for latency tracing.  */
+  XLTraceCommit (surface);
+
   /* First, clear the acquire fence if it is set.  If a
      synchronization object is attached, the following call will then
      attach any new fence specified.  */
@@ -286,6 +286,9 @@ NoteFrame (FrameMode mode, uint64_t id, void *data,
       /* Record this frame counter as the pending frame.  */
       helper->pending_frame = id;
 
+      if (helper->role->surface)
+	XLTraceComposite (helper->role->surface);
+
       if (helper->flags & FrameStarted)
 	break;
 
@@ -341,6 +344,9 @@ NoteFrame (FrameMode mode, uint64_t id, void *data,
       /* The frame was completed.  */
       if (id == helper->pending_frame)
 	{
+	  if (helper->role->surface)
+	    XLTracePresent (helper->role->surface);
+
 	  /* End the frame if a frame clock was used for
 	     synchronization.  */
 	  if (helper->used == SyncTypeFrameClock)
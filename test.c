@@ -177,7 +177,9 @@ NoteBounds (void *data, int min_x, int min_y, int max_x, int max_y)
       XResizeWindow (compositor.display, test->window,
 		     bounds_width, bounds_height);
       /* Sync with the X server.  */
+      BeginRoundTrip ();
       XSync (compositor.display, False);
+      EndRoundTrip ("Sync");
 
       test->bounds_width = bounds_width;
       test->bounds_height = bounds_height;
@@ -507,6 +509,95 @@ HandleScaleLockResourceDestroy (struct wl_resource *resource)
   XLOutputHandleScaleChange (-1);
 }
 
+
+
+static void
+DestroyDamageTransformer (struct wl_client *client,
+			  struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+TransformDamage (struct wl_client *client, struct wl_resource *resource,
+		 int32_t width, int32_t height, uint32_t flags,
+		 uint32_t transform, wl_fixed_t scale, wl_fixed_t off_x,
+		 wl_fixed_t off_y, wl_fixed_t crop_width,
+		 wl_fixed_t crop_height, wl_fixed_t stretch_width,
+		 wl_fixed_t stretch_height, int32_t x, int32_t y,
+		 int32_t damage_width, int32_t damage_height)
+{
+  DrawParams params;
+  pixman_region32_t damage, view_damage, buffer_damage;
+  pixman_box32_t *extents;
+  Bool contained;
+
+  if (width <= 0 || height <= 0 || damage_width < 0
+      || damage_height < 0 || transform > Flipped270
+      || flags & ~(ScaleSet | TransformSet | OffsetSet | StretchSet)
+      || (flags & ScaleSet && scale <= 0)
+      || (flags & StretchSet && (crop_width <= 0 || crop_height <= 0
+				 || stretch_width <= 0
+				 || stretch_height <= 0)))
+    {
+      wl_resource_post_error (resource,
+			      TEST_MANAGER_ERROR_INVALID_DAMAGE_TRANSFORM,
+			      "invalid damage transform specified");
+      return;
+    }
+
+  params.flags = flags;
+  params.transform = transform;
+  params.scale = wl_fixed_to_double (scale);
+  params.off_x = wl_fixed_to_double (off_x);
+  params.off_y = wl_fixed_to_double (off_y);
+  params.crop_width = wl_fixed_to_double (crop_width);
+  params.crop_height = wl_fixed_to_double (crop_height);
+  params.stretch_width = wl_fixed_to_double (stretch_width);
+  params.stretch_height = wl_fixed_to_double (stretch_height);
+
+  pixman_region32_init_rect (&damage, x, y, damage_width,
+			     damage_height);
+  pixman_region32_init (&view_damage);
+  pixman_region32_init (&buffer_damage);
+
+  /* Transform the damage into the coordinate space of the view, in
+     the same manner as ViewDamageBuffer.  */
+  TransformDamageRegion (&view_damage, &damage, &params, width,
+			 height);
+
+  /* Next, transform it back in the same manner as the renderer.  */
+  ReverseTransformRegion (&buffer_damage, &view_damage, &params,
+			  width, height);
+
+  /* See whether or not every pixel of the buffer in the original
+     damage is included.  */
+  pixman_region32_intersect_rect (&damage, &damage, 0, 0,
+				  width, height);
+  pixman_region32_subtract (&damage, &damage, &buffer_damage);
+  contained = !pixman_region32_not_empty (&damage);
+
+  extents = pixman_region32_extents (&buffer_damage);
+  test_damage_transformer_send_transformed_damage (resource,
+						   extents->x1,
+						   extents->y1,
+						   extents->x2,
+						   extents->y2,
+						   contained);
+
+  pixman_region32_fini (&damage);
+  pixman_region32_fini (&view_damage);
+  pixman_region32_fini (&buffer_damage);
+}
+
+static const struct test_damage_transformer_interface damage_transformer_impl =
+  {
+    .destroy = DestroyDamageTransformer,
+    .transform_damage = TransformDamage,
+  };
+
+
+
 static void
 GetTestSurface (struct wl_client *client, struct wl_resource *resource,
 		uint32_t id, struct wl_resource *surface_resource)
@@ -667,6 +758,26 @@ GetTestSeat (struct wl_client *client, struct wl_resource *resource,
   XLGetTestSeat (client, resource, id);
 }
 
+static void
+GetDamageTransformer (struct wl_client *client,
+		      struct wl_resource *resource, uint32_t id)
+{
+  struct wl_resource *transformer_resource;
+
+  transformer_resource
+    = wl_resource_create (client, &test_damage_transformer_interface,
+			  wl_resource_get_version (resource), id);
+
+  if (!transformer_resource)
+    {
+      wl_resource_post_no_memory (resource);
+      return;
+    }
+
+  wl_resource_set_implementation (transformer_resource,
+				  &damage_transformer_impl, NULL, NULL);
+}
+
 static void
 GetSerial (struct wl_client *client, struct wl_resource *resource)
 {
@@ -696,6 +807,7 @@ static const struct test_manager_interface test_manager_impl =
     .get_test_seat = GetTestSeat,
     .get_serial = GetSerial,
     .set_buffer_label = SetBufferLabel,
+    .get_damage_transformer = GetDamageTransformer,
   };
 
 
@@ -0,0 +1,328 @@
+/* Tests for the Wayland compositor running on the X server.
+
+Copyright (C) 2022 to various contributors.
+
+This file is part of 12to11.
+
+12to11 is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+12to11 is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#include "test_harness.h"
+
+#include <inttypes.h>
+#include <math.h>
+
+#include <sys/param.h>
+
+/* Randomized tests for the transformation of damage into buffer
+   coordinates.  Random buffers, transforms, scales, viewports and
+   damage are generated, and the compositor is asked to transform the
+   damage into the coordinate space of a view of the buffer, and then
+   back into that of the buffer, in the same manner as renderers
+   finding the parts of a buffer to upload.
+
+   The result must contain every pixel of the buffer inside the
+   original damage, lie within the buffer, and not extend further
+   outside the original damage than rounding allows.
+
+   The random seed can be given as the first argument, and is
+   printed upon failure so that failures can be reproduced.  A fixed
+   seed is used otherwise, so that the test checks the same cases
+   every time it is run.  */
+
+/* These must match the flags in the compositor's draw
+   parameters.  */
+#define SCALE_SET	1
+#define TRANSFORM_SET	(1 << 1)
+#define OFFSET_SET	(1 << 2)
+#define STRETCH_SET	(1 << 3)
+
+/* The number of cases to test, and the number to send before waiting
+   for their results.  */
+#define NUM_CASES	20000
+#define BATCH_SIZE	500
+
+/* The seed used if none is given.  */
+#define DEFAULT_SEED	12345
+
+struct damage_case
+{
+  /* The size of the buffer.  */
+  int width, height;
+
+  /* The draw parameters.  */
+  uint32_t flags, transform;
+  wl_fixed_t scale, off_x, off_y;
+  wl_fixed_t crop_width, crop_height, stretch_width, stretch_height;
+
+  /* The damage.  */
+  int x, y, damage_width, damage_height;
+};
+
+/* The display.  */
+static struct test_display *display;
+
+/* The damage transformer.  */
+static struct test_damage_transformer *transformer;
+
+/* The cases in the current batch.  */
+static struct damage_case cases[BATCH_SIZE];
+
+/* The number of results received for the current batch.  */
+static int results_received;
+
+/* The state of the random number generator.  */
+static uint64_t random_state;
+
+/* The seed used.  */
+static uint64_t random_seed;
+
+
+
+static uint32_t
+next_random (void)
+{
+  /* xorshift64*.  */
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+
+  return (random_state * 2685821657736338717ull) >> 32;
+}
+
+/* Return a random integer between MIN and MAX inclusive.  */
+
+static int
+random_between (int min, int max)
+{
+  return min + (int) (next_random () % (uint32_t) (max - min + 1));
+}
+
+/* Return a random fixed point number between MIN and MAX, with a
+   fractional part.  */
+
+static wl_fixed_t
+random_fixed (int min, int max)
+{
+  return (wl_fixed_from_int (random_between (min, max - 1))
+	  + random_between (0, 255));
+}
+
+static void
+make_random_case (struct damage_case *test)
+{
+  memset (test, 0, sizeof *test);
+
+  test->width = random_between (1, 512);
+  test->height = random_between (1, 512);
+  test->flags = random_between (0, 15);
+  test->transform = random_between (0, 7);
+
+  /* The scale is the reciprocal of the buffer scale.  */
+  test->scale = wl_fixed_from_double (1.0 / random_between (1, 4));
+
+  test->off_x = random_fixed (0, test->width);
+  test->off_y = random_fixed (0, test->height);
+  test->crop_width = random_fixed (1, 512);
+  test->crop_height = random_fixed (1, 512);
+  test->stretch_width = random_fixed (1, 1024);
+  test->stretch_height = random_fixed (1, 1024);
+
+  /* Damage can extend outside the buffer.  */
+  test->x = random_between (-16, test->width + 16);
+  test->y = random_between (-16, test->height + 16);
+  test->damage_width = random_between (0, test->width);
+  test->damage_height = random_between (0, test->height);
+}
+
+/* Return how many pixels of the buffer the transformed damage is
+   allowed to extend outside the original damage.  */
+
+static int
+get_margin (struct damage_case *test)
+{
+  double scale, x_factor, y_factor;
+
+  scale = 1.0;
+  x_factor = 1.0;
+  y_factor = 1.0;
+
+  if (test->flags & SCALE_SET)
+    scale = wl_fixed_to_double (test->scale);
+
+  if (test->flags & STRETCH_SET)
+    {
+      x_factor = (wl_fixed_to_double (test->crop_width)
+		  / wl_fixed_to_double (test->stretch_width));
+      y_factor = (wl_fixed_to_double (test->crop_height)
+		  / wl_fixed_to_double (test->stretch_height));
+    }
+
+  /* Scaling, then translating by an integer offset and stretching
+     the damage can each round it outwards by up to a pixel in the
+     coordinate space of the view, and transforming it back can round
+     it outwards by another pixel in the coordinate space of the
+     buffer.  */
+  return ceil ((2.0 + MAX (x_factor, y_factor)) / scale) + 1;
+}
+
+static void __attribute__ ((noreturn))
+report_case_failure (struct damage_case *test, const char *reason,
+		     int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+  report_test_failure ("%s (seed %"PRIu64"): buffer %dx%d, flags %"PRIu32
+		       ", transform %"PRIu32", scale %f, offset %f, %f,"
+		       " crop %fx%f, stretch %fx%f, damage %d, %d, %dx%d,"
+		       " result %"PRIi32", %"PRIi32", %"PRIi32", %"PRIi32,
+		       reason, random_seed, test->width, test->height,
+		       test->flags, test->transform,
+		       wl_fixed_to_double (test->scale),
+		       wl_fixed_to_double (test->off_x),
+		       wl_fixed_to_double (test->off_y),
+		       wl_fixed_to_double (test->crop_width),
+		       wl_fixed_to_double (test->crop_height),
+		       wl_fixed_to_double (test->stretch_width),
+		       wl_fixed_to_double (test->stretch_height),
+		       test->x, test->y, test->damage_width,
+		       test->damage_height, x1, y1, x2, y2);
+}
+
+
+
+static void
+handle_transformed_damage (void *data,
+			   struct test_damage_transformer *transformer,
+			   int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+			   uint32_t contained)
+{
+  struct damage_case *test;
+  int margin, damage_x1, damage_y1, damage_x2, damage_y2;
+
+  test = &cases[results_received++];
+
+  if (!contained)
+    report_case_failure (test, "damage not contained", x1, y1, x2, y2);
+
+  if (x1 >= x2 || y1 >= y2)
+    /* The result is empty.  */
+    return;
+
+  if (x1 < 0 || y1 < 0 || x2 > test->width || y2 > test->height)
+    report_case_failure (test, "damage outside buffer", x1, y1, x2, y2);
+
+  /* Clip the original damage to the buffer.  */
+  damage_x1 = MAX (test->x, 0);
+  damage_y1 = MAX (test->y, 0);
+  damage_x2 = MIN (test->x + test->damage_width, test->width);
+  damage_y2 = MIN (test->y + test->damage_height, test->height);
+
+  if (damage_x1 >= damage_x2 || damage_y1 >= damage_y2)
+    /* Only pixels at the edge of the buffer can be included if the
+       damage lies outside it.  */
+    return;
+
+  margin = get_margin (test);
+
+  if (x1 < damage_x1 - margin || y1 < damage_y1 - margin
+      || x2 > damage_x2 + margin || y2 > damage_y2 + margin)
+    report_case_failure (test, "damage too large", x1, y1, x2, y2);
+}
+
+static const struct test_damage_transformer_listener transformer_listener =
+  {
+    handle_transformed_damage,
+  };
+
+
+
+static void
+run_batch (void)
+{
+  struct damage_case *test;
+  int i;
+
+  results_received = 0;
+
+  for (i = 0; i < BATCH_SIZE; ++i)
+    {
+      test = &cases[i];
+      make_random_case (test);
+
+      test_damage_transformer_transform_damage (transformer,
+						test->width,
+						test->height,
+						test->flags,
+						test->transform,
+						test->scale,
+						test->off_x,
+						test->off_y,
+						test->crop_width,
+						test->crop_height,
+						test->stretch_width,
+						test->stretch_height,
+						test->x, test->y,
+						test->damage_width,
+						test->damage_height);
+    }
+
+  wl_display_roundtrip (display->display);
+
+  if (results_received != BATCH_SIZE)
+    report_test_failure ("received %d results, expected %d",
+			 results_received, BATCH_SIZE);
+}
+
+static void
+run_test (void)
+{
+  int i;
+
+  transformer
+    = test_manager_get_damage_transformer (display->test_manager);
+
+  if (!transformer)
+    report_test_failure ("failed to create damage transformer");
+
+  test_damage_transformer_add_listener (transformer,
+					&transformer_listener, NULL);
+
+  test_log ("testing %d random cases with seed %"PRIu64, NUM_CASES,
+	    random_seed);
+
+  for (i = 0; i < NUM_CASES / BATCH_SIZE; ++i)
+    run_batch ();
+
+  test_damage_transformer_destroy (transformer);
+  test_complete ();
+}
+
+int
+main (int argc, char **argv)
+{
+  test_init ();
+
+  if (argc > 1)
+    random_seed = strtoull (argv[1], NULL, 10);
+  else
+    random_seed = DEFAULT_SEED;
+
+  /* xorshift must not be seeded with 0.  */
+  random_state = random_seed ? random_seed : 1;
+
+  display = open_test_display (NULL, 0);
+
+  if (!display)
+    report_test_failure ("failed to open display");
+
+  run_test ();
+}
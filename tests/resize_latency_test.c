@@ -0,0 +1,741 @@
+/* Tests for the Wayland compositor running on the X server.
+
+Copyright (C) 2022 to various contributors.
+
+This file is part of 12to11.
+
+12to11 is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+12to11 is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#include "test_harness.h"
+#include "xdg-shell.h"
+
+#include <inttypes.h>
+#include <poll.h>
+
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include <X11/extensions/XI2.h>
+
+/* Tests for the input latency of one client while another client's
+   toplevel is being continuously resized.  The compositor must not
+   stop servicing other clients while waiting for the window system
+   to acknowledge a resize.
+
+   Without a window manager, the X server acknowledges each resize
+   immediately.  So the test acts as the window manager itself, and
+   holds each resize until the motion event sent after it has
+   arrived.  */
+
+enum test_kind
+  {
+    MAP_WINDOW_KIND,
+    RESIZE_LATENCY_KIND,
+  };
+
+static const char *test_names[] =
+  {
+    "map_window",
+    "resize_latency",
+  };
+
+#define LAST_TEST	RESIZE_LATENCY_KIND
+
+/* The number of resizes made while measuring latency.  */
+#define NUM_RESIZES	200
+
+/* The maximum acceptable latency of a single motion event, in
+   microseconds.  A compositor that waits for resizes to be
+   acknowledged before servicing other clients takes at least 0.5
+   seconds, when it gives up waiting.  */
+#define MAX_LATENCY	100000
+
+/* How long to wait for the compositor to resize the toplevel, in
+   milliseconds.  */
+#define RESIZE_TIMEOUT	2000
+
+/* The maximum number of ConfigureRequest events held at once.  */
+#define MAX_HELD_REQUESTS	16
+
+/* The display.  */
+static struct test_display *display;
+
+/* Test interfaces.  */
+static struct test_interface test_interfaces[] =
+  {
+    /* No interfaces yet.  */
+  };
+
+/* The test surface and Wayland surface.  */
+static struct test_surface *test_surface;
+static struct wl_surface *wayland_surface;
+
+/* The test surface window.  */
+static Window test_surface_window;
+
+/* The number of motion events received.  */
+static int motion_events_received;
+
+/* ConfigureRequest events held while measuring latency.  */
+static XConfigureRequestEvent held_requests[MAX_HELD_REQUESTS];
+
+/* The number of such events.  */
+static int num_held_requests;
+
+/* Whether or not redirecting the root window failed.  */
+static bool redirect_failed;
+
+/* The second client, which is resized.  */
+
+struct resize_client
+{
+  /* The Wayland display.  */
+  struct wl_display *display;
+
+  /* The registry.  */
+  struct wl_registry *registry;
+
+  /* The compositor, shm and xdg_wm_base globals.  */
+  struct wl_compositor *compositor;
+  struct wl_shm *shm;
+  struct xdg_wm_base *wm_base;
+
+  /* The surface, xdg_surface and toplevel.  */
+  struct wl_surface *surface;
+  struct xdg_surface *xdg_surface;
+  struct xdg_toplevel *toplevel;
+
+  /* Two buffers of different sizes.  */
+  struct wl_buffer *buffers[2];
+
+  /* Whether or not a configure event has been received.  */
+  bool configured;
+};
+
+static struct resize_client resize_client;
+
+/* The dimensions of the two buffers.  */
+static const int buffer_sizes[2][2] =
+  {
+    { 200, 200, },
+    { 300, 250, },
+  };
+
+
+
+/* Get the time in microseconds.  */
+
+static uint64_t
+test_get_time_us (void)
+{
+  struct timespec timespec;
+
+  clock_gettime (CLOCK_MONOTONIC, &timespec);
+
+  return ((uint64_t) timespec.tv_sec * 1000000
+	  + timespec.tv_nsec / 1000);
+}
+
+/* Get the root window.  */
+
+static Window
+test_get_root (void)
+{
+  return DefaultRootWindow (display->x_display);
+}
+
+
+
+static void
+handle_xdg_wm_base_ping (void *data, struct xdg_wm_base *wm_base,
+			 uint32_t serial)
+{
+  xdg_wm_base_pong (wm_base, serial);
+}
+
+static const struct xdg_wm_base_listener xdg_wm_base_listener =
+  {
+    handle_xdg_wm_base_ping,
+  };
+
+static void
+handle_xdg_surface_configure (void *data, struct xdg_surface *xdg_surface,
+			      uint32_t serial)
+{
+  xdg_surface_ack_configure (xdg_surface, serial);
+  resize_client.configured = true;
+}
+
+static const struct xdg_surface_listener xdg_surface_listener =
+  {
+    handle_xdg_surface_configure,
+  };
+
+static void
+handle_xdg_toplevel_configure (void *data, struct xdg_toplevel *toplevel,
+			       int32_t width, int32_t height,
+			       struct wl_array *states)
+{
+  /* The buffer size is chosen by the test, so ignore this.  */
+}
+
+static void
+handle_xdg_toplevel_close (void *data, struct xdg_toplevel *toplevel)
+{
+
+}
+
+static const struct xdg_toplevel_listener xdg_toplevel_listener =
+  {
+    handle_xdg_toplevel_configure,
+    handle_xdg_toplevel_close,
+  };
+
+static void
+handle_resize_registry_global (void *data, struct wl_registry *registry,
+			       uint32_t name, const char *interface,
+			       uint32_t version)
+{
+  if (!strcmp (interface, "wl_compositor"))
+    resize_client.compositor
+      = wl_registry_bind (registry, name, &wl_compositor_interface, 4);
+  else if (!strcmp (interface, "wl_shm"))
+    resize_client.shm
+      = wl_registry_bind (registry, name, &wl_shm_interface, 1);
+  else if (!strcmp (interface, "xdg_wm_base"))
+    resize_client.wm_base
+      = wl_registry_bind (registry, name, &xdg_wm_base_interface, 1);
+}
+
+static void
+handle_resize_registry_global_remove (void *data,
+				      struct wl_registry *registry,
+				      uint32_t name)
+{
+
+}
+
+static const struct wl_registry_listener resize_registry_listener =
+  {
+    handle_resize_registry_global,
+    handle_resize_registry_global_remove,
+  };
+
+static void
+make_resize_buffers (void)
+{
+  size_t size, offset;
+  int fd, i;
+  void *mapping;
+  struct wl_shm_pool *pool;
+
+  size = 0;
+
+  for (i = 0; i < 2; ++i)
+    size += buffer_sizes[i][0] * buffer_sizes[i][1] * 4;
+
+  fd = get_shm_file_descriptor ();
+
+  if (fd < 0)
+    report_test_failure ("failed to obtain shm file descriptor");
+
+  if (ftruncate (fd, size) < 0)
+    report_test_failure ("failed to size shm file");
+
+  /* Fill the buffers with opaque white.  */
+  mapping = mmap (NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (mapping == MAP_FAILED)
+    report_test_failure ("failed to map shm file");
+
+  memset (mapping, 0xff, size);
+  munmap (mapping, size);
+
+  pool = wl_shm_create_pool (resize_client.shm, fd, size);
+  close (fd);
+
+  if (!pool)
+    report_test_failure ("failed to create shm pool");
+
+  offset = 0;
+
+  for (i = 0; i < 2; ++i)
+    {
+      resize_client.buffers[i]
+	= wl_shm_pool_create_buffer (pool, offset, buffer_sizes[i][0],
+				     buffer_sizes[i][1],
+				     buffer_sizes[i][0] * 4,
+				     WL_SHM_FORMAT_XRGB8888);
+
+      if (!resize_client.buffers[i])
+	report_test_failure ("failed to create buffer");
+
+      offset += buffer_sizes[i][0] * buffer_sizes[i][1] * 4;
+    }
+
+  wl_shm_pool_destroy (pool);
+}
+
+static void
+open_resize_client (void)
+{
+  /* Open a second connection to the compositor.  This connection is
+     a separate client, so the compositor cannot process its requests
+     together with those of the test display.  */
+  resize_client.display = wl_display_connect (NULL);
+
+  if (!resize_client.display)
+    report_test_failure ("failed to open second connection");
+
+  resize_client.registry
+    = wl_display_get_registry (resize_client.display);
+  wl_registry_add_listener (resize_client.registry,
+			    &resize_registry_listener, NULL);
+  wl_display_roundtrip (resize_client.display);
+
+  if (!resize_client.compositor || !resize_client.shm
+      || !resize_client.wm_base)
+    report_test_failure ("second connection lacks required globals");
+
+  xdg_wm_base_add_listener (resize_client.wm_base,
+			    &xdg_wm_base_listener, NULL);
+  make_resize_buffers ();
+
+  /* Create the toplevel and wait for the initial configure event.  */
+  resize_client.surface
+    = wl_compositor_create_surface (resize_client.compositor);
+  resize_client.xdg_surface
+    = xdg_wm_base_get_xdg_surface (resize_client.wm_base,
+				   resize_client.surface);
+  xdg_surface_add_listener (resize_client.xdg_surface,
+			    &xdg_surface_listener, NULL);
+  resize_client.toplevel
+    = xdg_surface_get_toplevel (resize_client.xdg_surface);
+  xdg_toplevel_add_listener (resize_client.toplevel,
+			     &xdg_toplevel_listener, NULL);
+  wl_surface_commit (resize_client.surface);
+
+  while (!resize_client.configured)
+    {
+      if (wl_display_dispatch (resize_client.display) == -1)
+	die ("wl_display_dispatch");
+    }
+
+  /* Map the toplevel.  */
+  wl_surface_attach (resize_client.surface, resize_client.buffers[0],
+		     0, 0);
+  wl_surface_damage (resize_client.surface, 0, 0, INT_MAX, INT_MAX);
+  wl_surface_commit (resize_client.surface);
+  wl_display_roundtrip (resize_client.display);
+}
+
+static void
+resize_toplevel (int i)
+{
+  struct wl_buffer *buffer;
+
+  /* Attach a buffer of a different size, which makes the compositor
+     resize the toplevel's window.  */
+  buffer = resize_client.buffers[i % 2];
+  wl_surface_attach (resize_client.surface, buffer, 0, 0);
+  wl_surface_damage (resize_client.surface, 0, 0, INT_MAX, INT_MAX);
+  wl_surface_commit (resize_client.surface);
+
+  if (wl_display_flush (resize_client.display) == -1)
+    die ("wl_display_flush");
+}
+
+
+
+static int
+handle_redirect_error (Display *x_display, XErrorEvent *event)
+{
+  redirect_failed = true;
+  return 0;
+}
+
+static void
+start_redirecting (void)
+{
+  int (*old_handler) (Display *, XErrorEvent *);
+
+  /* Select for SubstructureRedirect on the root window, so that the
+     compositor's resizes are sent to the test as ConfigureRequest
+     events instead of being carried out by the X server.  Only one
+     client can do this, so it fails if a window manager is
+     running.  */
+  old_handler = XSetErrorHandler (handle_redirect_error);
+  XSelectInput (display->x_display, test_get_root (),
+		SubstructureRedirectMask);
+  XSync (display->x_display, False);
+  XSetErrorHandler (old_handler);
+
+  if (redirect_failed)
+    report_test_failure ("failed to redirect the root window;"
+			 " is a window manager running?");
+}
+
+static void
+handle_redirected_event (XEvent *event)
+{
+  switch (event->type)
+    {
+    case ConfigureRequest:
+      if (num_held_requests == MAX_HELD_REQUESTS)
+	report_test_failure ("too many ConfigureRequest events");
+
+      held_requests[num_held_requests++] = event->xconfigurerequest;
+      break;
+
+    case MapRequest:
+      XMapWindow (display->x_display, event->xmaprequest.window);
+      break;
+
+    case CirculateRequest:
+      if (event->xcirculaterequest.place == PlaceOnTop)
+	XRaiseWindow (display->x_display,
+		      event->xcirculaterequest.window);
+      else
+	XLowerWindow (display->x_display,
+		      event->xcirculaterequest.window);
+      break;
+    }
+}
+
+static void
+wait_configure_request (void)
+{
+  XEvent event;
+  struct pollfd fds;
+  uint64_t start, elapsed;
+
+  start = test_get_time_us ();
+
+  /* Wait for the compositor to try to resize the toplevel.  Once it
+     has, it must either be waiting for the resize to be acknowledged,
+     or be servicing other clients.  */
+  while (!num_held_requests)
+    {
+      if (!XPending (display->x_display))
+	{
+	  elapsed = (test_get_time_us () - start) / 1000;
+
+	  if (elapsed >= RESIZE_TIMEOUT)
+	    report_test_failure ("the toplevel was not resized");
+
+	  fds.fd = ConnectionNumber (display->x_display);
+	  fds.events = POLLIN;
+	  fds.revents = 0;
+
+	  if (poll (&fds, 1, RESIZE_TIMEOUT - elapsed) < 0)
+	    die ("poll");
+
+	  continue;
+	}
+
+      XNextEvent (display->x_display, &event);
+      handle_redirected_event (&event);
+    }
+}
+
+static void
+release_configure_requests (void)
+{
+  XConfigureRequestEvent *request;
+  XWindowChanges changes;
+  int i;
+
+  /* Acknowledge the held resizes by carrying them out.  */
+  for (i = 0; i < num_held_requests; ++i)
+    {
+      request = &held_requests[i];
+      changes.x = request->x;
+      changes.y = request->y;
+      changes.width = request->width;
+      changes.height = request->height;
+      changes.border_width = request->border_width;
+      changes.sibling = request->above;
+      changes.stack_mode = request->detail;
+
+      XConfigureWindow (display->x_display, request->window,
+			request->value_mask, &changes);
+    }
+
+  num_held_requests = 0;
+  XFlush (display->x_display);
+}
+
+static void
+wait_motion_event (int expected)
+{
+  while (motion_events_received < expected)
+    {
+      if (wl_display_dispatch (display->display) == -1)
+	die ("wl_display_dispatch");
+    }
+}
+
+static void
+run_latency_test (void)
+{
+  uint64_t start, latency, max_latency, total_latency;
+  int i;
+
+  open_resize_client ();
+
+  test_seat_controller_dispatch_XI_Enter (display->seat->controller,
+					  0, TEST_SOURCE_DEVICE,
+					  XINotifyAncestor,
+					  test_get_root (),
+					  test_surface_window,
+					  None,
+					  wl_fixed_from_double (0.0),
+					  wl_fixed_from_double (0.0),
+					  wl_fixed_from_double (0.0),
+					  wl_fixed_from_double (0.0),
+					  XINotifyNormal,
+					  False, True, NULL, NULL,
+					  NULL);
+  wl_display_roundtrip (display->display);
+  start_redirecting ();
+
+  max_latency = 0;
+  total_latency = 0;
+
+  for (i = 0; i < NUM_RESIZES; ++i)
+    {
+      /* Resize the other client's toplevel, and wait for the
+	 compositor to ask for the window to be resized.  Then, send a
+	 motion event to the test surface, and measure how long it
+	 takes to arrive while the resize is not acknowledged.  */
+      resize_toplevel (i);
+      wait_configure_request ();
+
+      start = test_get_time_us ();
+      test_seat_controller_dispatch_XI_Motion (display->seat->controller,
+					       i, TEST_SOURCE_DEVICE,
+					       0,
+					       test_get_root (),
+					       test_surface_window,
+					       None,
+					       wl_fixed_from_double (i % 50),
+					       wl_fixed_from_double (i % 50),
+					       wl_fixed_from_double (i % 50),
+					       wl_fixed_from_double (i % 50),
+					       0,
+					       NULL, NULL, NULL, NULL);
+      wait_motion_event (i + 1);
+      latency = test_get_time_us () - start;
+
+      max_latency = MAX (max_latency, latency);
+      total_latency += latency;
+
+      /* Now acknowledge the resize.  */
+      release_configure_requests ();
+
+      /* Process the configure events sent to the other client.  */
+      if (wl_display_dispatch_pending (resize_client.display) == -1)
+	die ("wl_display_dispatch_pending");
+    }
+
+  test_log ("motion latency during resize: average %"PRIu64" us,"
+	    " maximum %"PRIu64" us", total_latency / NUM_RESIZES,
+	    max_latency);
+
+  if (max_latency > MAX_LATENCY)
+    report_test_failure ("motion event took %"PRIu64" us to arrive",
+			 max_latency);
+}
+
+static void
+test_single_step (enum test_kind kind)
+{
+  struct wl_buffer *buffer;
+
+  test_log ("running test step: %s", test_names[kind]);
+
+  switch (kind)
+    {
+    case MAP_WINDOW_KIND:
+      buffer = load_png_image (display, "tiny.png");
+
+      if (!buffer)
+	report_test_failure ("failed to load tiny.png");
+
+      wl_surface_attach (wayland_surface, buffer, 0, 0);
+      wl_surface_damage (wayland_surface, 0, 0, INT_MAX, INT_MAX);
+      wl_surface_commit (wayland_surface);
+      wl_buffer_destroy (buffer);
+      break;
+
+    case RESIZE_LATENCY_KIND:
+      run_latency_test ();
+      break;
+    }
+
+  if (kind == LAST_TEST)
+    test_complete ();
+}
+
+
+
+static void
+handle_test_surface_mapped (void *data, struct test_surface *surface,
+			    uint32_t xid, const char *display_string)
+{
+  /* Sleep for 1 second to ensure that the window is exposed and
+     redirected.  */
+  sleep (1);
+
+  test_surface_window = xid;
+  test_single_step (RESIZE_LATENCY_KIND);
+}
+
+static void
+handle_test_surface_committed (void *data, struct test_surface *surface,
+			       uint32_t presentation_hint)
+{
+
+}
+
+static const struct test_surface_listener test_surface_listener =
+  {
+    handle_test_surface_mapped,
+    NULL,
+    handle_test_surface_committed,
+  };
+
+
+
+static void
+handle_pointer_enter (void *data, struct wl_pointer *wl_pointer,
+		      uint32_t serial, struct wl_surface *surface,
+		      wl_fixed_t surface_x, wl_fixed_t surface_y)
+{
+
+}
+
+static void
+handle_pointer_leave (void *data, struct wl_pointer *wl_pointer,
+		      uint32_t serial, struct wl_surface *surface)
+{
+
+}
+
+static void
+handle_pointer_motion (void *data, struct wl_pointer *wl_pointer,
+		       uint32_t time, wl_fixed_t surface_x,
+		       wl_fixed_t surface_y)
+{
+  motion_events_received++;
+}
+
+static void
+handle_pointer_button (void *data, struct wl_pointer *wl_pointer,
+		       uint32_t serial, uint32_t time, uint32_t button,
+		       uint32_t state)
+{
+
+}
+
+static void
+handle_pointer_axis (void *data, struct wl_pointer *wl_pointer,
+		     uint32_t time, uint32_t axis, wl_fixed_t value)
+{
+
+}
+
+static void
+handle_pointer_frame (void *data, struct wl_pointer *wl_pointer)
+{
+
+}
+
+static void
+handle_pointer_axis_source (void *data, struct wl_pointer *wl_pointer,
+			    uint32_t axis_source)
+{
+
+}
+
+static void
+handle_pointer_axis_stop (void *data, struct wl_pointer *wl_pointer,
+			  uint32_t time, uint32_t axis)
+{
+
+}
+
+static void
+handle_pointer_axis_discrete (void *data, struct wl_pointer *wl_pointer,
+			      uint32_t axis, int32_t discrete)
+{
+
+}
+
+static void
+handle_pointer_axis_value120 (void *data, struct wl_pointer *wl_pointer,
+			      uint32_t axis, int32_t value120)
+{
+
+}
+
+static const struct wl_pointer_listener pointer_listener =
+  {
+    handle_pointer_enter,
+    handle_pointer_leave,
+    handle_pointer_motion,
+    handle_pointer_button,
+    handle_pointer_axis,
+    handle_pointer_frame,
+    handle_pointer_axis_source,
+    handle_pointer_axis_stop,
+    handle_pointer_axis_discrete,
+    handle_pointer_axis_value120,
+  };
+
+
+
+static void
+run_test (void)
+{
+  if (!make_test_surface (display, &wayland_surface,
+			  &test_surface))
+    report_test_failure ("failed to create test surface");
+
+  test_surface_add_listener (test_surface, &test_surface_listener,
+			     NULL);
+  wl_pointer_add_listener (display->seat->pointer, &pointer_listener,
+			   NULL);
+  test_single_step (MAP_WINDOW_KIND);
+
+  while (true)
+    {
+      if (wl_display_dispatch (display->display) == -1)
+        die ("wl_display_dispatch");
+    }
+}
+
+int
+main (void)
+{
+  test_init ();
+  display = open_test_display (test_interfaces,
+			       ARRAYELTS (test_interfaces));
+
+  if (!display)
+    report_test_failure ("failed to open display");
+
+  test_init_seat (display);
+  run_test ();
+}
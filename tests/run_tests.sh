@@ -23,7 +23,7 @@ declare -a standard_tests=(
     simple_test damage_test transform_test viewporter_test
     subsurface_test scale_test seat_test dmabuf_test
     xdg_activation_test single_pixel_buffer_test buffer_test
-    tearing_control_test
+    tearing_control_test damage_transform_test
 )
 
 make -C . "${standard_tests[@]}"
@@ -52,11 +52,15 @@ echo "Starting Xvfb at :27"
 Xvfb :27 &
 sleep 1
 exec 4< <(DISPLAY=:27 stdbuf -oL ../12to11 -printsocket)
+COMPOSITOR_PID=$!
 read -u 4 WAYLAND_DISPLAY
 export WAYLAND_DISPLAY
 
+# resize_latency_test acts as the window manager by selecting
+# SubstructureRedirectMask on the root window, so it must not be run
+# on a display that already has one.
 declare -a vfb_tests=(
-    select_test
+    select_test resize_latency_test
 )
 
 make -C . "${vfb_tests[@]}" select_helper select_helper_multiple
@@ -74,6 +78,42 @@ do
     fi
 done
 
+# Run the throughput benchmarks against the same compositor.  Each
+# line is the name of a run followed by its arguments.
+declare -a benchmarks=(
+    "small_full -width 64 -height 64 -damage full"
+    "large_full -width 1024 -height 768 -damage full"
+    "large_partial -width 1024 -height 768 -damage partial"
+    "large_scattered -width 1024 -height 768 -damage scattered"
+    "uhd_full -width 3840 -height 2160 -damage full -frames 120"
+    "subsurfaces -width 256 -height 256 -damage full -depth 8"
+    "fixed_rate -width 512 -height 512 -damage partial -rate 120"
+    "windows -width 256 -height 256 -damage full -windows 8"
+)
+
+make -C . throughput_benchmark
+
+benchmark_output=${BENCHMARK_OUTPUT:-benchmark_results.json}
+separator=""
+echo "[" > "${benchmark_output}"
+
+for benchmark in "${benchmarks[@]}"
+do
+    read -r name args <<< "${benchmark}"
+    echo "Running benchmark ${name}"
+
+    if result=$(COMPOSITOR_PID=${COMPOSITOR_PID} \
+		    ./throughput_benchmark -name ${name} ${args}); then
+	echo "${separator}${result}" >> "${benchmark_output}"
+	separator=","
+    else
+	echo "benchmark ${name} failed; see its output for more details"
+    fi
+done
+
+echo "]" >> "${benchmark_output}"
+echo "Benchmark results written to ${benchmark_output}"
+
 popd
 
 trap 'jobs -p | xargs kill' EXIT
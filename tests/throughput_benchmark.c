@@ -0,0 +1,719 @@
+/* Tests for the Wayland compositor running on the X server.
+
+Copyright (C) 2022 to various contributors.
+
+This file is part of 12to11.
+
+12to11 is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+12to11 is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#include "test_harness.h"
+#include "12to11-debug.h"
+
+#include <inttypes.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/param.h>
+
+/* Throughput benchmark.  One or more test surfaces, the first
+   optionally with a chain of subsurfaces beneath it, commit shared
+   memory buffers of a given size and damage pattern, either as fast
+   as frame callbacks allow, or at a fixed rate.  The number of
+   commits per second, the time between each commit and its frame
+   callback, the CPU time used by the compositor, the number of
+   requests it made to the X server and the number of bytes of buffer
+   contents it uploaded are then printed to stdout as a single JSON
+   object.
+
+   The following options are understood:
+
+     -width N, -height N	the size of each buffer
+     -rate N			commits per second, or 0 to commit
+				upon each frame callback
+     -damage full|partial|scattered
+				the damage applied upon each commit
+     -depth N			the number of nested subsurfaces
+     -frames N			the number of commits to make to
+				each window
+     -windows N			the number of windows committed
+				to at the same time
+     -name NAME			name of this run in the output
+
+   The compositor CPU time is read from /proc, and is only reported
+   if COMPOSITOR_PID is set to the process ID of the compositor.  */
+
+enum damage_pattern
+  {
+    DAMAGE_FULL,
+    DAMAGE_PARTIAL,
+    DAMAGE_SCATTERED,
+  };
+
+static const char *damage_names[] =
+  {
+    "full",
+    "partial",
+    "scattered",
+  };
+
+/* The maximum subsurface depth.  */
+#define MAX_DEPTH	16
+
+/* The maximum number of windows.  */
+#define MAX_WINDOWS	16
+
+/* The size of each partial or scattered damage rectangle.  */
+#define DAMAGE_SIZE	64
+#define SCATTER_SIZE	8
+
+/* The number of scattered damage rectangles.  */
+#define SCATTER_COUNT	16
+
+/* The display.  */
+static struct test_display *display;
+
+/* The subcompositor and debug manager.  */
+static struct wl_subcompositor *subcompositor;
+static struct debug_manager *debug_manager;
+
+/* Test interfaces.  */
+static struct test_interface test_interfaces[] =
+  {
+    { "wl_subcompositor", &subcompositor, &wl_subcompositor_interface, 1, },
+    { "debug_manager", &debug_manager, &debug_manager_interface, 4, },
+  };
+
+/* The test surfaces and Wayland surfaces.  */
+static struct test_surface *test_surfaces[MAX_WINDOWS];
+static struct wl_surface *wayland_surfaces[MAX_WINDOWS];
+
+/* Surfaces in the subsurface chain, and their subsurfaces.  */
+static struct wl_surface *chain_surfaces[MAX_DEPTH];
+static struct wl_subsurface *chain_subsurfaces[MAX_DEPTH];
+
+/* The buffers attached to the test surfaces and to each
+   subsurface.  */
+static struct wl_buffer *buffers[MAX_DEPTH + 1];
+
+/* Parameters of this run.  */
+static int buffer_width = 256, buffer_height = 256;
+static int commit_rate;
+static enum damage_pattern damage_pattern;
+static int subsurface_depth;
+static int num_frames = 500;
+static int num_windows = 1;
+static const char *run_name = "default";
+
+/* The time at which each commit was made, and the latency of its
+   frame callback, both in microseconds.  The commit of frame F to
+   window W is at index F * num_windows + W.  */
+static uint64_t *commit_times, *frame_latencies;
+
+/* The number of frame callbacks received from all windows.  */
+static int frames_received;
+
+/* The number of X requests made by the compositor, and whether or
+   not that has been received.  */
+static uint64_t request_count;
+static bool request_count_received;
+
+/* The number of bytes of buffer contents uploaded by the compositor,
+   and whether or not that has been received.  */
+static uint64_t upload_count;
+static bool upload_count_received;
+
+
+
+static uint64_t
+get_time_us (void)
+{
+  struct timespec timespec;
+
+  clock_gettime (CLOCK_MONOTONIC, &timespec);
+
+  return ((uint64_t) timespec.tv_sec * 1000000
+	  + timespec.tv_nsec / 1000);
+}
+
+/* Return the CPU time used by the compositor in microseconds, or -1
+   if it is unknown.  */
+
+static int64_t
+get_compositor_cpu_time (void)
+{
+  const char *pid;
+  char path[64], *field;
+  char data[1024];
+  unsigned long utime, stime;
+  FILE *file;
+  size_t nread;
+  long ticks;
+
+  pid = getenv ("COMPOSITOR_PID");
+
+  if (!pid)
+    return -1;
+
+  snprintf (path, sizeof path, "/proc/%s/stat", pid);
+  file = fopen (path, "r");
+
+  if (!file)
+    return -1;
+
+  nread = fread (data, 1, sizeof data - 1, file);
+  fclose (file);
+  data[nread] = '\0';
+
+  /* The command name can contain spaces, so start parsing after the
+     closing parenthesis.  utime and stime are the 12th and 13th
+     fields after it.  */
+  field = strrchr (data, ')');
+
+  if (!field
+      || sscanf (field + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u"
+		 " %*u %lu %lu", &utime, &stime) != 2)
+    return -1;
+
+  ticks = sysconf (_SC_CLK_TCK);
+
+  if (ticks <= 0)
+    return -1;
+
+  return (int64_t) (utime + stime) * 1000000 / ticks;
+}
+
+
+
+static void
+handle_round_trip_site (void *data, struct debug_manager *manager,
+			const char *function, const char *request,
+			uint32_t count, uint32_t total_hi,
+			uint32_t total_lo, uint32_t max,
+			struct wl_array *histogram)
+{
+
+}
+
+static void
+handle_round_trips_done (void *data, struct debug_manager *manager)
+{
+
+}
+
+static void
+handle_cursor_cache_statistics (void *data, struct debug_manager *manager,
+				uint32_t hits, uint32_t misses,
+				uint32_t evictions)
+{
+
+}
+
+static void
+handle_surface_latency (void *data, struct debug_manager *manager,
+			uint32_t pid, uint32_t surface, uint32_t count,
+			uint32_t total_hi, uint32_t total_lo, uint32_t max,
+			struct wl_array *histogram)
+{
+
+}
+
+static void
+handle_surface_latencies_done (void *data, struct debug_manager *manager)
+{
+
+}
+
+static void
+handle_request_count (void *data, struct debug_manager *manager,
+		      uint32_t count_hi, uint32_t count_lo)
+{
+  request_count = ((uint64_t) count_hi << 32) | count_lo;
+  request_count_received = true;
+}
+
+static void
+handle_upload_count (void *data, struct debug_manager *manager,
+		     uint32_t count_hi, uint32_t count_lo)
+{
+  upload_count = ((uint64_t) count_hi << 32) | count_lo;
+  upload_count_received = true;
+}
+
+static const struct debug_manager_listener debug_manager_listener =
+  {
+    handle_round_trip_site,
+    handle_round_trips_done,
+    handle_cursor_cache_statistics,
+    handle_surface_latency,
+    handle_surface_latencies_done,
+    handle_request_count,
+    handle_upload_count,
+  };
+
+static uint64_t
+get_request_count (void)
+{
+  request_count_received = false;
+  debug_manager_get_request_count (debug_manager);
+
+  while (!request_count_received)
+    {
+      if (wl_display_dispatch (display->display) == -1)
+	die ("wl_display_dispatch");
+    }
+
+  return request_count;
+}
+
+static uint64_t
+get_upload_count (void)
+{
+  upload_count_received = false;
+  debug_manager_get_upload_count (debug_manager);
+
+  while (!upload_count_received)
+    {
+      if (wl_display_dispatch (display->display) == -1)
+	die ("wl_display_dispatch");
+    }
+
+  return upload_count;
+}
+
+
+
+static void
+handle_frame_callback_done (void *data, struct wl_callback *callback,
+			    uint32_t time)
+{
+  intptr_t index;
+
+  index = (intptr_t) data;
+  frame_latencies[index] = get_time_us () - commit_times[index];
+  frames_received++;
+
+  wl_callback_destroy (callback);
+}
+
+static const struct wl_callback_listener frame_callback_listener =
+  {
+    handle_frame_callback_done,
+  };
+
+static void
+apply_damage (struct wl_surface *surface, int frame)
+{
+  int i, x, y;
+
+  switch (damage_pattern)
+    {
+    case DAMAGE_FULL:
+      wl_surface_damage_buffer (surface, 0, 0, buffer_width,
+				buffer_height);
+      break;
+
+    case DAMAGE_PARTIAL:
+      /* Move a single rectangle diagonally across the buffer.  */
+      x = (frame * 8) % MAX (1, buffer_width - DAMAGE_SIZE);
+      y = (frame * 8) % MAX (1, buffer_height - DAMAGE_SIZE);
+      wl_surface_damage_buffer (surface, x, y, DAMAGE_SIZE,
+				DAMAGE_SIZE);
+      break;
+
+    case DAMAGE_SCATTERED:
+      /* Damage many small rectangles spread over the buffer, like
+	 the updates made when text is typed in several places.  */
+      for (i = 0; i < SCATTER_COUNT; ++i)
+	{
+	  x = ((frame + i) * 37 * SCATTER_SIZE) % buffer_width;
+	  y = ((frame + i * 3) * 23 * SCATTER_SIZE) % buffer_height;
+	  wl_surface_damage_buffer (surface, x, y, SCATTER_SIZE,
+				    SCATTER_SIZE);
+	}
+      break;
+    }
+}
+
+static void
+commit_frame (int frame)
+{
+  struct wl_callback *callback;
+  intptr_t index;
+  int i;
+
+  /* Subsurfaces are synchronized, so commit them from the innermost
+     outwards, and then commit the test surfaces.  */
+  for (i = subsurface_depth - 1; i >= 0; --i)
+    {
+      wl_surface_attach (chain_surfaces[i], buffers[i + 1], 0, 0);
+      apply_damage (chain_surfaces[i], frame);
+      wl_surface_commit (chain_surfaces[i]);
+    }
+
+  /* Commit to every window before flushing, so that the compositor
+     has to present all of them at once.  */
+  for (i = 0; i < num_windows; ++i)
+    {
+      wl_surface_attach (wayland_surfaces[i], buffers[0], 0, 0);
+      apply_damage (wayland_surfaces[i], frame);
+
+      index = frame * num_windows + i;
+      callback = wl_surface_frame (wayland_surfaces[i]);
+      wl_callback_add_listener (callback, &frame_callback_listener,
+				(void *) index);
+
+      commit_times[index] = get_time_us ();
+      wl_surface_commit (wayland_surfaces[i]);
+    }
+
+  if (wl_display_flush (display->display) == -1)
+    die ("wl_display_flush");
+}
+
+static struct wl_buffer *
+make_buffer (void)
+{
+  struct wl_buffer *buffer;
+  char *data;
+  size_t stride;
+  int x, y;
+
+  stride = get_image_stride (display, 24, buffer_width);
+
+  if (!stride)
+    report_test_failure ("unknown stride");
+
+  data = malloc (stride * buffer_height);
+
+  if (!data)
+    report_test_failure ("failed to allocate buffer data");
+
+  /* Fill the buffer with a pattern, so that it is not trivially
+     compressible.  */
+  for (y = 0; y < buffer_height; ++y)
+    {
+      for (x = 0; x < (int) stride; ++x)
+	data[y * stride + x] = x ^ y;
+    }
+
+  buffer = upload_image_data (display, data, buffer_width,
+			      buffer_height, 24);
+  free (data);
+
+  if (!buffer)
+    report_test_failure ("failed to create buffer");
+
+  return buffer;
+}
+
+static void
+make_subsurface_chain (void)
+{
+  struct wl_surface *parent;
+  int i;
+
+  parent = wayland_surfaces[0];
+
+  for (i = 0; i < subsurface_depth; ++i)
+    {
+      chain_surfaces[i]
+	= wl_compositor_create_surface (display->compositor);
+
+      if (!chain_surfaces[i])
+	report_test_failure ("failed to create surface");
+
+      chain_subsurfaces[i]
+	= wl_subcompositor_get_subsurface (subcompositor,
+					   chain_surfaces[i], parent);
+
+      if (!chain_subsurfaces[i])
+	report_test_failure ("failed to create subsurface");
+
+      /* Offset each subsurface slightly from its parent.  */
+      wl_subsurface_set_position (chain_subsurfaces[i], 8, 8);
+      parent = chain_surfaces[i];
+    }
+}
+
+static void
+dispatch_until (uint64_t deadline)
+{
+  struct pollfd pollfd;
+  uint64_t now;
+  int rc;
+
+  while ((now = get_time_us ()) < deadline)
+    {
+      while (wl_display_prepare_read (display->display))
+	{
+	  if (wl_display_dispatch_pending (display->display) == -1)
+	    die ("wl_display_dispatch_pending");
+	}
+
+      if (wl_display_flush (display->display) == -1)
+	die ("wl_display_flush");
+
+      pollfd.fd = wl_display_get_fd (display->display);
+      pollfd.events = POLLIN;
+      pollfd.revents = 0;
+
+      rc = poll (&pollfd, 1, (deadline - now + 999) / 1000);
+
+      if (rc > 0)
+	{
+	  if (wl_display_read_events (display->display) == -1)
+	    die ("wl_display_read_events");
+	}
+      else
+	{
+	  wl_display_cancel_read (display->display);
+
+	  if (rc < 0 && errno != EINTR)
+	    die ("poll");
+	}
+
+      if (wl_display_dispatch_pending (display->display) == -1)
+	die ("wl_display_dispatch_pending");
+    }
+}
+
+static int
+compare_latencies (const void *a, const void *b)
+{
+  uint64_t first, second;
+
+  first = *(const uint64_t *) a;
+  second = *(const uint64_t *) b;
+
+  return (first > second) - (first < second);
+}
+
+static void
+print_json_string (const char *string)
+{
+  const unsigned char *p;
+
+  /* Print STRING as a JSON string literal, escaping quotation marks,
+     backslashes and control characters.  */
+  putchar ('"');
+
+  for (p = (const unsigned char *) string; *p; ++p)
+    {
+      if (*p == '"' || *p == '\\')
+	printf ("\\%c", *p);
+      else if (*p < 0x20)
+	printf ("\\u%04x", *p);
+      else
+	putchar (*p);
+    }
+
+  putchar ('"');
+}
+
+static void
+print_results (uint64_t elapsed, int64_t cpu_time, uint64_t requests,
+	       uint64_t uploaded)
+{
+  uint64_t total;
+  int i, commits;
+
+  total = 0;
+  commits = num_frames * num_windows;
+
+  for (i = 0; i < commits; ++i)
+    total += frame_latencies[i];
+
+  qsort (frame_latencies, commits, sizeof *frame_latencies,
+	 compare_latencies);
+
+  printf ("{\"name\": ");
+  print_json_string (run_name);
+  printf (", \"width\": %d, \"height\": %d,"
+	  " \"rate\": %d, \"damage\": \"%s\", \"depth\": %d,"
+	  " \"windows\": %d, \"frames\": %d, \"elapsed_us\": %"PRIu64","
+	  " \"commits_per_second\": %.2f,"
+	  " \"frame_latency_us\": {\"mean\": %"PRIu64", \"p50\": %"PRIu64","
+	  " \"p99\": %"PRIu64", \"max\": %"PRIu64"},"
+	  " \"x_requests\": %"PRIu64", \"x_requests_per_commit\": %.2f,"
+	  " \"uploaded_bytes_per_commit\": %.2f,",
+	  buffer_width, buffer_height, commit_rate,
+	  damage_names[damage_pattern], subsurface_depth, num_windows,
+	  num_frames, elapsed, commits * 1000000.0 / MAX (1, elapsed),
+	  total / commits, frame_latencies[commits / 2],
+	  frame_latencies[commits * 99 / 100],
+	  frame_latencies[commits - 1], requests,
+	  (double) requests / commits, (double) uploaded / commits);
+
+  if (cpu_time < 0)
+    printf (" \"compositor_cpu_us\": null}\n");
+  else
+    printf (" \"compositor_cpu_us\": %"PRId64"}\n", cpu_time);
+
+  fflush (stdout);
+}
+
+static void
+run_benchmark (void)
+{
+  uint64_t start, elapsed, requests, uploaded, next_commit;
+  int64_t cpu_start, cpu_time;
+  int frame, i;
+
+  for (i = 0; i < num_windows; ++i)
+    {
+      if (!make_test_surface (display, &wayland_surfaces[i],
+			      &test_surfaces[i]))
+	report_test_failure ("failed to create test surface");
+    }
+
+  commit_times = calloc (num_frames * num_windows,
+			 sizeof *commit_times);
+  frame_latencies = calloc (num_frames * num_windows,
+			    sizeof *frame_latencies);
+
+  if (!commit_times || !frame_latencies)
+    report_test_failure ("failed to allocate frame times");
+
+  debug_manager_add_listener (debug_manager, &debug_manager_listener,
+			      NULL);
+
+  for (i = 0; i <= subsurface_depth; ++i)
+    buffers[i] = make_buffer ();
+
+  make_subsurface_chain ();
+
+  /* Map the surfaces and wait for the first frame to be drawn, so
+     that setting up the window is not measured.  */
+  for (i = 0; i < num_windows; ++i)
+    {
+      wl_surface_attach (wayland_surfaces[i], buffers[0], 0, 0);
+      wl_surface_damage_buffer (wayland_surfaces[i], 0, 0, buffer_width,
+				buffer_height);
+      wl_surface_commit (wayland_surfaces[i]);
+    }
+
+  wl_display_roundtrip (display->display);
+
+  requests = get_request_count ();
+  uploaded = get_upload_count ();
+  cpu_start = get_compositor_cpu_time ();
+  start = get_time_us ();
+  next_commit = start;
+
+  for (frame = 0; frame < num_frames; ++frame)
+    {
+      commit_frame (frame);
+
+      if (!commit_rate)
+	{
+	  /* Wait for the frame callbacks of every window before
+	     committing again.  */
+	  while (frames_received < (frame + 1) * num_windows)
+	    {
+	      if (wl_display_dispatch (display->display) == -1)
+		die ("wl_display_dispatch");
+	    }
+	}
+      else
+	{
+	  /* Read frame callbacks until the next commit is due.  */
+	  next_commit += 1000000 / commit_rate;
+	  dispatch_until (next_commit);
+	}
+    }
+
+  /* Wait for the remaining frame callbacks.  */
+  while (frames_received < num_frames * num_windows)
+    {
+      if (wl_display_dispatch (display->display) == -1)
+	die ("wl_display_dispatch");
+    }
+
+  elapsed = get_time_us () - start;
+  requests = get_request_count () - requests;
+  uploaded = get_upload_count () - uploaded;
+  cpu_time = get_compositor_cpu_time ();
+
+  if (cpu_start >= 0 && cpu_time >= 0)
+    cpu_time -= cpu_start;
+  else
+    cpu_time = -1;
+
+  print_results (elapsed, cpu_time, requests, uploaded);
+  test_complete ();
+}
+
+
+
+static void
+parse_options (int argc, char **argv)
+{
+  int i;
+
+  for (i = 1; i < argc; ++i)
+    {
+      if (i + 1 == argc)
+	report_test_failure ("option %s requires an argument", argv[i]);
+
+      if (!strcmp (argv[i], "-width"))
+	buffer_width = atoi (argv[++i]);
+      else if (!strcmp (argv[i], "-height"))
+	buffer_height = atoi (argv[++i]);
+      else if (!strcmp (argv[i], "-rate"))
+	commit_rate = atoi (argv[++i]);
+      else if (!strcmp (argv[i], "-depth"))
+	subsurface_depth = atoi (argv[++i]);
+      else if (!strcmp (argv[i], "-frames"))
+	num_frames = atoi (argv[++i]);
+      else if (!strcmp (argv[i], "-windows"))
+	num_windows = atoi (argv[++i]);
+      else if (!strcmp (argv[i], "-name"))
+	run_name = argv[++i];
+      else if (!strcmp (argv[i], "-damage"))
+	{
+	  ++i;
+
+	  if (!strcmp (argv[i], "full"))
+	    damage_pattern = DAMAGE_FULL;
+	  else if (!strcmp (argv[i], "partial"))
+	    damage_pattern = DAMAGE_PARTIAL;
+	  else if (!strcmp (argv[i], "scattered"))
+	    damage_pattern = DAMAGE_SCATTERED;
+	  else
+	    report_test_failure ("unknown damage pattern: %s", argv[i]);
+	}
+      else
+	report_test_failure ("unknown option: %s", argv[i]);
+    }
+
+  if (buffer_width < 1 || buffer_height < 1 || commit_rate < 0
+      || subsurface_depth < 0 || subsurface_depth > MAX_DEPTH
+      || num_frames < 1 || num_windows < 1
+      || num_windows > MAX_WINDOWS)
+    report_test_failure ("invalid benchmark parameters");
+}
+
+int
+main (int argc, char **argv)
+{
+  test_init ();
+  parse_options (argc, argv);
+  display = open_test_display (test_interfaces,
+			       ARRAYELTS (test_interfaces));
+
+  if (!display)
+    report_test_failure ("failed to open display");
+
+  run_benchmark ();
+}
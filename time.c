@@ -205,7 +205,9 @@ StartAlarms (XSyncCounter counter, XSyncValue current_value)
       alarm_a = XSyncCreateAlarm (compositor.display,
 				  value_mask | XSyncCADelta,
 				  &attributes);
+      BeginRoundTrip ();
       XSync (compositor.display, False);
+      EndRoundTrip ("Sync");
     }
   else
     {
@@ -22,13 +22,15 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 
 #include "compositor.h"
 
-/* Linked list of all timers.  */
-static Timer all_timers;
+/* Timers are kept in a binary min-heap ordered by the time at which
+   they should next run, so that the next deadline can be found
+   without looking at every timer.  */
 
 struct _Timer
 {
-  /* The next and last timers in this list.  */
-  Timer *next, *last;
+  /* The index of this timer in the heap, or -1 if it is not in the
+     heap.  */
+  ptrdiff_t heap_index;
 
   /* The repeat of this timer.  */
   struct timespec repeat;
@@ -41,8 +43,135 @@ struct _Timer
 
   /* User data associated with the timer.  */
   void *timer_data;
+
+  /* Whether or not this timer is waiting to be run by TimerCheck,
+     and whether or not it was removed while waiting.  */
+  Bool pending, removed;
 };
 
+/* The heap of all timers.  */
+static Timer **timer_heap;
+
+/* The number of timers in the heap, and the number of elements
+   allocated for it.  */
+static ptrdiff_t num_timers, timer_heap_size;
+
+/* Array of timers that expired during the current TimerCheck.  */
+static Timer **expired_timers;
+
+/* The number of elements allocated for that array.  */
+static ptrdiff_t expired_timers_size;
+
+static void
+HeapSet (ptrdiff_t index, Timer *timer)
+{
+  timer_heap[index] = timer;
+  timer->heap_index = index;
+}
+
+static void
+SiftUp (ptrdiff_t index)
+{
+  Timer *timer;
+  ptrdiff_t parent;
+
+  timer = timer_heap[index];
+
+  while (index > 0)
+    {
+      parent = (index - 1) / 2;
+
+      if (TimespecCmp (timer_heap[parent]->next_time,
+		       timer->next_time) <= 0)
+	break;
+
+      HeapSet (index, timer_heap[parent]);
+      index = parent;
+    }
+
+  HeapSet (index, timer);
+}
+
+static void
+SiftDown (ptrdiff_t index)
+{
+  Timer *timer;
+  ptrdiff_t child;
+
+  timer = timer_heap[index];
+
+  while (True)
+    {
+      child = index * 2 + 1;
+
+      if (child >= num_timers)
+	break;
+
+      /* Pick the earlier of the two children.  */
+      if (child + 1 < num_timers
+	  && TimespecCmp (timer_heap[child + 1]->next_time,
+			  timer_heap[child]->next_time) < 0)
+	child++;
+
+      if (TimespecCmp (timer->next_time,
+		       timer_heap[child]->next_time) <= 0)
+	break;
+
+      HeapSet (index, timer_heap[child]);
+      index = child;
+    }
+
+  HeapSet (index, timer);
+}
+
+static void
+UpdatePosition (Timer *timer)
+{
+  ptrdiff_t index;
+
+  index = timer->heap_index;
+
+  if (index > 0
+      && TimespecCmp (timer->next_time,
+		      timer_heap[(index - 1) / 2]->next_time) < 0)
+    SiftUp (index);
+  else
+    SiftDown (index);
+}
+
+static void
+InsertTimer (Timer *timer)
+{
+  if (num_timers == timer_heap_size)
+    {
+      timer_heap_size = MAX (16, timer_heap_size * 2);
+      timer_heap = XLRealloc (timer_heap, (sizeof *timer_heap
+					   * timer_heap_size));
+    }
+
+  HeapSet (num_timers, timer);
+  num_timers++;
+  SiftUp (timer->heap_index);
+}
+
+static void
+DeleteTimer (Timer *timer)
+{
+  ptrdiff_t index;
+  Timer *last;
+
+  index = timer->heap_index;
+  last = timer_heap[--num_timers];
+  timer->heap_index = -1;
+
+  if (last == timer)
+    return;
+
+  /* Move the last timer into the hole left by TIMER.  */
+  HeapSet (index, last);
+  UpdatePosition (last);
+}
+
 struct timespec
 CurrentTimespec (void)
 {
@@ -156,23 +285,8 @@ Timer *
 AddTimer (void (*function) (Timer *, void *, struct timespec),
 	  void *data, struct timespec delay)
 {
-  Timer *timer;
-
-  timer = XLMalloc (sizeof *timer);
-  timer->function = function;
-  timer->timer_data = data;
-  timer->repeat = delay;
-  timer->next_time = TimespecAdd (CurrentTimespec (),
-				  delay);
-
-  /* Chain the timer onto our list of timers.  */
-  timer->next = all_timers.next;
-  timer->last = &all_timers;
-
-  all_timers.next->last = timer;
-  all_timers.next = timer;
-
-  return timer;
+  return AddTimerWithBaseTime (function, data, delay,
+			       CurrentTimespec ());
 }
 
 Timer *
@@ -181,18 +295,14 @@ AddTimerWithBaseTime (void (*function) (Timer *, void *, struct timespec),
 {
   Timer *timer;
 
-  timer = XLMalloc (sizeof *timer);
+  timer = XLCalloc (1, sizeof *timer);
   timer->function = function;
   timer->timer_data = data;
   timer->repeat = delay;
   timer->next_time = TimespecAdd (base, delay);
 
-  /* Chain the timer onto our list of timers.  */
-  timer->next = all_timers.next;
-  timer->last = &all_timers;
-
-  all_timers.next->last = timer;
-  all_timers.next = timer;
+  /* Insert the timer into the heap.  */
+  InsertTimer (timer);
 
   return timer;
 }
@@ -200,10 +310,17 @@ AddTimerWithBaseTime (void (*function) (Timer *, void *, struct timespec),
 void
 RemoveTimer (Timer *timer)
 {
-  /* Start by removing the timer from the list of timers.  This is
-     only safe inside a timer callback our outside TimerCheck.  */
-  timer->next->last = timer->last;
-  timer->last->next = timer->next;
+  /* Start by removing the timer from the heap.  This is safe at any
+     time, including inside a timer callback.  */
+  DeleteTimer (timer);
+
+  if (timer->pending)
+    {
+      /* TimerCheck is about to run this timer.  Let it free the
+	 timer instead.  */
+      timer->removed = True;
+      return;
+    }
 
   /* Then, free the timer.  */
   XLFree (timer);
@@ -214,55 +331,87 @@ RetimeTimer (Timer *timer)
 {
   timer->next_time = TimespecAdd (CurrentTimespec (),
 				  timer->repeat);
+  UpdatePosition (timer);
 }
 
 struct timespec
 TimerCheck (void)
 {
-  struct timespec now, wait, temp;
-  Timer *timer, *next;
-  Bool flag;
+  struct timespec now, wait;
+  Timer *timer;
+  ptrdiff_t num_expired, i;
 
   now = CurrentTimespec ();
-  wait = MakeTimespec (TypeMaximum (time_t),
-		       1000000000 - 1);
-  timer = all_timers.next;
-
-  while (timer != &all_timers)
+  num_expired = 0;
+
+  /* First, collect every timer that has expired, and schedule it to
+     run again.  Timers are not run at this point, since the callbacks
+     can add, remove or retime other timers.  This also ensures each
+     timer runs at most once per call.  */
+  while (num_timers
+	 && TimespecCmp (timer_heap[0]->next_time, now) <= 0)
     {
-      /* Move the list forward first, so the timer callback can
-	 safely remove itself from the list.  */
-      next = timer->next;
-      flag = False;
+      timer = timer_heap[0];
+      timer->next_time = TimespecAdd (timer->next_time,
+				      timer->repeat);
+      timer->pending = True;
 
-      if (TimespecCmp (timer->next_time, now) <= 0)
+      if (num_expired == expired_timers_size)
 	{
-	  timer->next_time = TimespecAdd (timer->next_time,
-					  timer->repeat);
-	  flag = True;
+	  expired_timers_size = MAX (16, expired_timers_size * 2);
+	  expired_timers = XLRealloc (expired_timers,
+				      (sizeof *expired_timers
+				       * expired_timers_size));
 	}
 
-      temp = TimespecSub (timer->next_time, now);
+      expired_timers[num_expired++] = timer;
+
+      /* Temporarily take the timer out of the heap, so that it is not
+	 considered again if it is still in the past.  */
+      DeleteTimer (timer);
+    }
+
+  /* Put the timers back into the heap.  */
+  for (i = 0; i < num_expired; ++i)
+    InsertTimer (expired_timers[i]);
 
-      if (TimespecCmp (temp, wait) < 0)
-	/* Wait is the time to wait until the next timer might
-	   fire.  */
-	wait = temp;
+  /* Now, run each timer, unless a previous callback removed it.  */
+  for (i = 0; i < num_expired; ++i)
+    {
+      timer = expired_timers[i];
 
-      if (flag)
-	/* Run this function here instead, since it might remove the
-	   timer from the list.  */
+      if (!timer->removed)
 	timer->function (timer, timer->timer_data, now);
+    }
 
-      timer = next;
+  /* Free timers that were removed, and clear the pending flag of
+     the rest.  This must be done after every callback has run, as a
+     callback might remove a timer that has already been run.  */
+  for (i = 0; i < num_expired; ++i)
+    {
+      timer = expired_timers[i];
+
+      if (timer->removed)
+	XLFree (timer);
+      else
+	timer->pending = False;
     }
 
+  if (!num_timers)
+    return MakeTimespec (TypeMaximum (time_t),
+			 1000000000 - 1);
+
+  /* Wait is the time to wait until the next timer might fire.  */
+  if (TimespecCmp (timer_heap[0]->next_time, now) <= 0)
+    return MakeTimespec (0, 0);
+
+  wait = TimespecSub (timer_heap[0]->next_time, now);
   return wait;
 }
 
 void
 XLInitTimers (void)
 {
-  all_timers.next = &all_timers;
-  all_timers.last = &all_timers;
+  /* The heap is allocated lazily when the first timer is added.  */
+  num_timers = 0;
 }
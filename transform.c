@@ -21,6 +21,7 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 
 #include "compositor.h"
 
@@ -388,3 +389,133 @@ InvertTransform (BufferTransform transform)
       return transform;
     }
 }
+
+static void
+ReverseTransformBox (pixman_box32_t *box, DrawParams *params,
+		     int width, int height)
+{
+  double x1, y1, x2, y2, x_factor, y_factor;
+  int transformed_width, transformed_height;
+
+  /* Apply the inverse of PARAMS to BOX, which is in the coordinate
+     space of the destination, in the reverse order of that in which
+     PARAMS are applied.  Every step is an increasing function, so
+     rounding outwards once at the end includes every pixel of the
+     buffer that is sampled to draw BOX.  */
+  x1 = box->x1;
+  y1 = box->y1;
+  x2 = box->x2;
+  y2 = box->y2;
+
+  if (params->flags & StretchSet)
+    {
+      x_factor = params->crop_width / params->stretch_width;
+      y_factor = params->crop_height / params->stretch_height;
+
+      x1 *= x_factor;
+      y1 *= y_factor;
+      x2 *= x_factor;
+      y2 *= y_factor;
+    }
+
+  if (params->flags & OffsetSet)
+    {
+      x1 += params->off_x;
+      y1 += params->off_y;
+      x2 += params->off_x;
+      y2 += params->off_y;
+    }
+
+  if (params->flags & ScaleSet)
+    {
+      x1 /= params->scale;
+      y1 /= params->scale;
+      x2 /= params->scale;
+      y2 /= params->scale;
+    }
+
+  /* Clip the box to the transformed buffer before converting it back
+     to integers, so that it cannot overflow.  */
+  transformed_width = width;
+  transformed_height = height;
+
+  if (params->flags & TransformSet
+      && RotatesDimensions (params->transform))
+    {
+      transformed_width = height;
+      transformed_height = width;
+    }
+
+  box->x1 = MAX (0.0, floor (x1));
+  box->y1 = MAX (0.0, floor (y1));
+  box->x2 = MIN (transformed_width, ceil (x2));
+  box->y2 = MIN (transformed_height, ceil (y2));
+
+  /* Finally, undo the buffer transform.  The width and height given
+     to TransformBox are those of the transformed buffer.  */
+  if (params->flags & TransformSet
+      && box->x1 < box->x2 && box->y1 < box->y2)
+    TransformBox (box, InvertTransform (params->transform),
+		  transformed_width, transformed_height);
+}
+
+/* Apply PARAMS to SRC, damage to a buffer that is WIDTH by HEIGHT
+   pixels large, and put the damaged area in the coordinate space of
+   the destination in DST, rounding outwards.  This is used to find
+   the damage to a view from the damage to its buffer.  */
+
+void
+TransformDamageRegion (pixman_region32_t *dst, pixman_region32_t *src,
+		       DrawParams *params, int width, int height)
+{
+  if (params->flags & TransformSet)
+    XLTransformRegion (dst, src, params->transform, width, height);
+  else
+    pixman_region32_copy (dst, src);
+
+  if (params->flags & ScaleSet)
+    XLScaleRegion (dst, dst, params->scale, params->scale);
+
+  if (params->flags & OffsetSet
+      && (params->off_x != 0.0 || params->off_y != 0.0))
+    XLOffsetRegion (dst, dst, -params->off_x, -params->off_y);
+
+  if (params->flags & StretchSet)
+    XLScaleRegion (dst, dst,
+		   params->stretch_width / params->crop_width,
+		   params->stretch_height / params->crop_height);
+}
+
+/* Apply the inverse of PARAMS to SRC, damage in the coordinate space
+   of the destination, and put the damaged area of the buffer, which
+   is WIDTH by HEIGHT pixels large, in DST.  This is used by
+   renderers to find the parts of a buffer to upload.  */
+
+void
+ReverseTransformRegion (pixman_region32_t *dst, pixman_region32_t *src,
+			DrawParams *params, int width, int height)
+{
+  int nrects, i;
+  pixman_box32_t *src_rects;
+  pixman_box32_t *dst_rects;
+
+  src_rects = pixman_region32_rectangles (src, &nrects);
+
+  if (nrects < 128)
+    dst_rects = alloca (nrects * sizeof *dst_rects);
+  else
+    dst_rects = XLMalloc (nrects * sizeof *dst_rects);
+
+  for (i = 0; i < nrects; ++i)
+    {
+      dst_rects[i] = src_rects[i];
+      ReverseTransformBox (&dst_rects[i], params, width, height);
+    }
+
+  /* Boxes that were clipped away are ignored.  */
+  pixman_region32_fini (dst);
+  pixman_region32_init_rects (dst, dst_rects, nrects);
+
+  if (nrects >= 128)
+    XLFree (dst_rects);
+}
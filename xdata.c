@@ -28,6 +28,7 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 
 #include <pthread.h>
 #include <iconv.h>
+#include <limits.h>
 
 #include "compositor.h"
 #include "primary-selection-unstable-v1.h"
@@ -125,6 +126,11 @@ struct _TransferInfo
   WriteFd *write_callback;
 };
 
+/* The size of the buffers used to convert text between UTF-8 and
+   Latin-1.  This also bounds the amount of selection data read from
+   the X server at once during such conversions.  */
+#define ConversionBufferSize 65536
+
 struct _ConversionTransferInfo
 {
   /* The file descriptor being written to.  -1 if it was closed.  */
@@ -133,17 +139,20 @@ struct _ConversionTransferInfo
   /* Some flags.  */
   int flags;
 
-  /* Conversion buffer.  */
-  char *buffer, *position;
+  /* The chunk of property data currently being converted.  */
+  unsigned char *chunk;
 
-  /* The bytes remaining in the conversion buffer.  */
-  size_t buffer_size;
+  /* The size of that chunk, the number of bytes into the chunk that
+     have been converted, and the number of bytes in the property
+     after the chunk.  */
+  ptrdiff_t chunk_size, bytes_into, bytes_after;
 
-  /* The output buffer.  */
-  char output_buffer[BUFSIZ];
+  /* Ring buffer holding converted data that has not yet been
+     written.  */
+  char ring[ConversionBufferSize];
 
-  /* And the amount of data used in the output buffer.  */
-  size_t outsize;
+  /* The start of the data in the ring buffer, and its size.  */
+  size_t ring_start, ring_used;
 
   /* Any active file descriptor write callback.  */
   WriteFd *write_callback;
@@ -186,7 +195,7 @@ struct _ConversionWriteInfo
   ReadFd *read_callback;
 
   /* Input buffer for iconv.  */
-  char inbuf[BUFSIZ];
+  char inbuf[ConversionBufferSize];
 
   /* Number of bytes into the input buffer that have been read.  */
   size_t inread;
@@ -511,7 +520,7 @@ NoticeTransferWritable (int fd, void *data, WriteFd *writefd)
 
 	  close (info->fd);
 	  info->fd = -1;
-	  XFree (info->chunk);
+	  XLFree (info->chunk);
 	  info->chunk = NULL;
 
 	  DebugPrint ("EPIPE recieved while reading; cancelling transfer\n");
@@ -537,7 +546,7 @@ NoticeTransferWritable (int fd, void *data, WriteFd *writefd)
 	 new chunk, or cancel the write callback if the chunk was
 	 completely read.  */
 
-      XFree (info->chunk);
+      XLFree (info->chunk);
       info->chunk = NULL;
 
       if (info->bytes_after)
@@ -1030,7 +1039,7 @@ TargetsReadCallback (ReadTransfer *transfer, Atom type, int format,
     data->atoms[old + i] = atoms[i];
 
   /* Use XFree, since this is Xlib-allocated memory.  */
-  XFree (atoms);
+  XLFree (atoms);
 }
 
 static Bool
@@ -1201,18 +1210,21 @@ SelectSelectionInput (Atom selection)
 {
   int mask;
   Time time;
+  Window owner;
 
   /* If the selection already exists, announce it to Wayland clients
      as well.  Use the current time.  */
 
   time = XLGetServerTimeRoundtrip ();
 
-  if (selection == CLIPBOARD
-      && XGetSelectionOwner (compositor.display, CLIPBOARD) != None)
+  BeginRoundTrip ();
+  owner = XGetSelectionOwner (compositor.display, selection);
+  EndRoundTrip ("GetSelectionOwner");
+
+  if (selection == CLIPBOARD && owner != None)
     NoticeClipboardChanged (time);
 
-  if (selection == XA_PRIMARY
-      && XGetSelectionOwner (compositor.display, XA_PRIMARY) != None)
+  if (selection == XA_PRIMARY && owner != None)
     NoticePrimaryChanged (time);
 
   mask = XFixesSetSelectionOwnerNotifyMask;
@@ -1273,7 +1285,10 @@ MimeTypeFromTarget (Atom target, Bool primary)
       return conversion->mime_type;
     }
 
+  BeginRoundTrip ();
   string = XGetAtomName (compositor.display, target);
+  EndRoundTrip ("GetAtomName");
+
   return string;
 }
 
@@ -1324,11 +1339,10 @@ NoticeTransferReadable (int fd, void *data, ReadFd *readfd)
 
   DebugPrint ("Fd %d is now readable...\n", fd);
 
-  /* Now cancel the read callback, and switch from waiting for the
+  /* Now disable the read callback, and switch from waiting for the
      client to send something to waiting for the requestor to read the
-     data.  */
-  XLRemoveReadFd (info->read_callback);
-  info->read_callback = NULL;
+     data.  The callback is enabled again by ClipboardReadFunc.  */
+  XLSetFdEnabled (info->read_callback, False);
 
   /* And tell the selection code to start reading.  */
   StartReading (transfer);
@@ -1367,66 +1381,62 @@ ClipboardReadFunc (WriteTransfer *transfer, unsigned char *buffer,
 
   XLAssert (info != NULL);
 
-  /* By the time this function is entered, the polling callback should
-     be NULL.  */
-  XLAssert (info->read_callback == NULL);
-
   DebugPrint ("ClipboardReadFunc called to read %td bytes\n",
 	      buffer_size);
 
-  /* Try to read buffer_size bytes into buffer.  */
-  size = read (info->fd, buffer, buffer_size);
-
-  /* If EOF, return that, free info, and close the pipe.  */
+  /* Read as much as fits in the buffer, which is as large as the
+     selection quantum allows.  Pipes hold far less than that, so
+     several reads are often needed to fill it, and stopping after the
+     first would mean waiting for the fd to become readable again
+     between each of them.  */
+  *nbytes = 0;
 
-  if (!size)
+  while (*nbytes < buffer_size)
     {
-      DebugPrint ("EOF; completing transfer\n");
+      size = read (info->fd, buffer + *nbytes,
+		   buffer_size - *nbytes);
 
-      if (info->read_callback)
+      /* If EOF, return that, free info, and close the pipe.  */
+
+      if (!size)
 	{
-	  /* Cancel any read callback in progress.  */
+	  DebugPrint ("EOF; completing transfer\n");
+
+	  /* Cancel the read callback.  */
 	  XLRemoveReadFd (info->read_callback);
-	  info->read_callback = NULL;
-	}
+	  close (info->fd);
+	  XLFree (info);
+	  SetWriteTransferData (transfer, NULL);
 
-      close (info->fd);
-      XLFree (info);
-      SetWriteTransferData (transfer, NULL);
+	  return EndOfFile;
+	}
 
-      *nbytes = 0;
-      return EndOfFile;
-    }
+      /* If an error occured, see what it was.  */
 
-  /* If an error occured, see what it was.  */
+      if (size == -1)
+	{
+	  DebugPrint ("read failed with: %s\n", strerror (errno));
 
-  if (size == -1)
-    {
-      DebugPrint ("read failed with: %s\n", strerror (errno));
+	  if (errno == EAGAIN)
+	    /* Nothing more can be read now.  */
+	    break;
 
-      if (errno == EAGAIN)
-	{
-	  /* Start the read callback again.  This might make us
-	     spin.  */
-	  *nbytes = 0;
+	  if (errno == EINTR)
+	    continue;
 
-	  info->read_callback = XLAddReadFd (info->fd, transfer,
-					     NoticeTransferReadable);
-	  return ReadOk;
+	  perror ("read");
+	  exit (1);
 	}
 
-      perror ("write");
-      exit (1);
+      *nbytes += size;
     }
 
-  DebugPrint ("Read %zd bytes, starting the read callback again\n",
-	      size);
+  DebugPrint ("Read %td bytes, enabling the read callback again\n",
+	      *nbytes);
 
-  /* Otherwise, set nbytes to the number of bytes read, and start the
-     write callback again.  */
-  *nbytes = size;
-  info->read_callback = XLAddReadFd (info->fd, transfer,
-				     NoticeTransferReadable);
+  /* Enable the read callback again.  This might make us spin if
+     nothing was read.  */
+  XLSetFdEnabled (info->read_callback, True);
   return ReadOk;
 }
 
@@ -1510,6 +1520,66 @@ GetClipboardCallback (WriteTransfer *transfer, Atom target,
 /* Conversions between UTF-8 and Latin-1.  */
 
 
+/* Convert text from *INBUF to *OUTBUF with CD, like iconv.  ASCII
+   characters are the same in both UTF-8 and Latin-1, so runs of them
+   are copied directly, and only the other characters are given to
+   iconv.  Every byte of a multibyte UTF-8 character has its high bit
+   set, so such characters are never split up.  */
+
+static size_t
+ConvertText (iconv_t cd, char **inbuf, size_t *inbytesleft,
+	     char **outbuf, size_t *outbytesleft)
+{
+  size_t run, limit, left, nconv;
+
+  while (*inbytesleft)
+    {
+      /* Find the run of ASCII characters at the start of the
+	 input.  */
+      limit = MIN (*inbytesleft, *outbytesleft);
+
+      for (run = 0; run < limit; ++run)
+	{
+	  if ((*inbuf)[run] & 0x80)
+	    break;
+	}
+
+      /* Copy it to the output.  */
+      memcpy (*outbuf, *inbuf, run);
+      *inbuf += run;
+      *outbuf += run;
+      *inbytesleft -= run;
+      *outbytesleft -= run;
+
+      if (!*inbytesleft)
+	break;
+
+      if (run == limit)
+	{
+	  /* The output buffer is full.  */
+	  errno = E2BIG;
+	  return (size_t) -1;
+	}
+
+      /* Find the run of other characters that follows, and convert
+	 it with iconv.  */
+      for (run = 0; run < *inbytesleft; ++run)
+	{
+	  if (!((*inbuf)[run] & 0x80))
+	    break;
+	}
+
+      left = run;
+      nconv = iconv (cd, inbuf, &left, outbuf, outbytesleft);
+      *inbytesleft -= run - left;
+
+      if (nconv == (size_t) -1)
+	return nconv;
+    }
+
+  return 0;
+}
+
 static void
 NoticeConversionTransferReadable (int fd, void *data, ReadFd *readfd)
 {
@@ -1527,7 +1597,7 @@ NoticeConversionTransferReadable (int fd, void *data, ReadFd *readfd)
 
   /* Now try to fill the conversion buffer.  */
   nbytes = read (info->fd, info->inbuf + info->inread,
-		 BUFSIZ - info->inread);
+		 ConversionBufferSize - info->inread);
 
   if (nbytes <= 0)
     {
@@ -1536,9 +1606,8 @@ NoticeConversionTransferReadable (int fd, void *data, ReadFd *readfd)
       info->flags |= ReachedEndOfFile;
       DebugPrint ("EOF read from %d\n", fd);
 
-      /* Cancel any read callback in progress.  */
-      XLRemoveReadFd (info->read_callback);
-      info->read_callback = NULL;
+      /* Disable the read callback.  */
+      XLSetFdEnabled (info->read_callback, False);
 
       /* Signal that the selection code should start reading.  */
       StartReading (transfer);
@@ -1552,13 +1621,13 @@ NoticeConversionTransferReadable (int fd, void *data, ReadFd *readfd)
       DebugPrint ("Read %tu bytes\n", info->inread);
 
       /* If the buffer is full, begin converting from it.  */
-      if (info->inread == BUFSIZ)
+      if (info->inread == ConversionBufferSize)
 	{
 	  DebugPrint ("Buffer is now full\n");
 
-	  /* Cancel any read callback in progress.  */
-	  XLRemoveReadFd (info->read_callback);
-	  info->read_callback = NULL;
+	  /* Disable the read callback until the buffer has been
+	     converted.  */
+	  XLSetFdEnabled (info->read_callback, False);
 
 	  /* Signal that the selection code should start reading.  */
 	  StartReading (transfer);
@@ -1604,15 +1673,11 @@ ConversionReadFunc (WriteTransfer *transfer, unsigned char *buffer,
 
   XLAssert (info != NULL);
 
-  /* By the time this function is entered, the polling callback should
-     be NULL.  */
-  XLAssert (info->read_callback == NULL);
-
   /* Convert the appropriate amount of bytes into the output
      buffer.  */
   outsize = buffer_size;
-  nconv = iconv (info->cd, &info->inptr, &info->inread,
-		 (char **) &buffer, &outsize);
+  nconv = ConvertText (info->cd, &info->inptr, &info->inread,
+		       (char **) &buffer, &outsize);
 
   DebugPrint ("iconv returned: %tu\n", nconv);
 
@@ -1666,11 +1731,10 @@ ConversionReadFunc (WriteTransfer *transfer, unsigned char *buffer,
   if (info->flags & ReachedEndOfFile)
     goto eof;
 
-  /* Restore the read callback, and return the number of bytes
+  /* Enable the read callback again, and return the number of bytes
      read.  */
   *nbytes = buffer_size - outsize;
-  info->read_callback = XLAddReadFd (info->fd, transfer,
-				     NoticeConversionTransferReadable);
+  XLSetFdEnabled (info->read_callback, True);
 
   return ReadOk;
 }
@@ -1740,130 +1804,252 @@ GetConversionCallback (WriteTransfer *transfer, Atom target, Atom *type,
 }
 
 static void
-ConversionReadCallback (ReadTransfer *transfer, Atom type, int format,
-			ptrdiff_t size)
+FinishConversionTransfer (ConversionTransferInfo *info)
 {
-  ConversionTransferInfo *info;
-  unsigned char *data;
-
-  /* Read all the data from the chunk now.  */
+  DebugPrint ("Completing conversion transfer...\n");
 
-  data = ReadChunk (transfer, (format == 32 ? size / sizeof (long)
-			       : (size + 3) / 4),
-		    &size, NULL);
+  if (info->chunk)
+    XLFree (info->chunk);
 
-  if (!data)
-    return;
+  iconv_close (info->cd);
 
-  info = GetTransferData (transfer);
+  if (info->write_callback)
+    XLRemoveWriteFd (info->write_callback);
 
-  /* We buffer up all the data from the selection and convert it
-     later.  */
+  if (info->fd != -1)
+    close (info->fd);
 
-  info->buffer = XLRealloc (info->buffer, info->buffer_size + size);
-  memcpy (info->buffer + info->buffer_size, data, size);
-  info->buffer_size += size;
+  XLFree (info);
 }
 
 static void
-FinishConversionTransfer (ReadTransfer *transfer, ConversionTransferInfo *info)
+StopConversionWrites (ReadTransfer *transfer,
+		      ConversionTransferInfo *info)
 {
-  DebugPrint ("Completing conversion transfer...\n");
+  /* Remove the write callback, and complete the transfer if its
+     finish was delayed.  */
 
-  XLFree (info->buffer);
-  iconv_close (info->cd);
+  XLRemoveWriteFd (info->write_callback);
+  info->write_callback = NULL;
 
-  if (info->write_callback)
-    XLRemoveWriteFd (info->write_callback);
+  if (info->flags & NeedDelayedFinish)
+    {
+      DebugPrint ("Completing a delayed conversion transfer.\n");
+      FinishConversionTransfer (info);
+      CompleteDelayedTransfer (transfer);
+    }
+}
 
-  if (info->fd != -1)
-    close (info->fd);
+static Bool
+FillConversionBuffer (ReadTransfer *transfer, ConversionTransferInfo *info)
+{
+  char *inbuf, *outbuf, *start, scratch[MB_LEN_MAX];
+  size_t inbytes, outbytes, tail, nconv, length, first;
+  ptrdiff_t chunk_size, bytes_after;
 
-  XLFree (info);
+  while (info->ring_used < ConversionBufferSize)
+    {
+      if (!info->chunk)
+	{
+	  /* Read another chunk if the property still holds data, or a
+	     new property was set during an INCR transfer.  Nothing is
+	     read while the ring buffer is full, so the selection owner
+	     is made to wait for the client to catch up, and memory use
+	     stays bounded.  */
+	  if (!info->bytes_after && !(info->flags & NeedNewChunk))
+	    return True;
+
+	  info->flags &= ~NeedNewChunk;
+	  info->chunk = ReadChunk (transfer, ConversionBufferSize / 4,
+				   &chunk_size, &bytes_after);
+
+	  /* If the chunk is NULL, the failure callback will be run
+	     soon.  */
+	  if (!info->chunk)
+	    return False;
+
+	  info->chunk_size = chunk_size;
+	  info->bytes_after = bytes_after;
+	  info->bytes_into = 0;
+	}
+
+      /* Convert as much of the chunk as fits in the free space after
+	 the data in the ring buffer.  */
+      tail = ((info->ring_start + info->ring_used)
+	      % ConversionBufferSize);
+      outbytes = (tail >= info->ring_start
+		  ? ConversionBufferSize - tail
+		  : info->ring_start - tail);
+      inbuf = (char *) info->chunk + info->bytes_into;
+      inbytes = info->chunk_size - info->bytes_into;
+
+      if (outbytes < MB_LEN_MAX
+	  && outbytes < ConversionBufferSize - info->ring_used)
+	{
+	  /* Only a few bytes are free before the end of the ring
+	     buffer, and the rest of the free space is at its start.  A
+	     multibyte character might not fit before the end, so
+	     convert into a scratch buffer and copy the result across
+	     the end of the ring buffer.  */
+	  outbytes = MIN (MB_LEN_MAX,
+			  ConversionBufferSize - info->ring_used);
+	  start = outbuf = scratch;
+
+	  nconv = ConvertText (info->cd, &inbuf, &inbytes, &outbuf,
+			       &outbytes);
+
+	  length = outbuf - start;
+	  first = MIN (length, ConversionBufferSize - tail);
+	  memcpy (info->ring + tail, scratch, first);
+	  memcpy (info->ring, scratch + first, length - first);
+	}
+      else
+	{
+	  start = outbuf = info->ring + tail;
+
+	  nconv = ConvertText (info->cd, &inbuf, &inbytes, &outbuf,
+			       &outbytes);
+	}
+
+      info->ring_used += outbuf - start;
+      info->bytes_into = info->chunk_size - inbytes;
+
+      if (nconv == (size_t) -1 && errno != E2BIG)
+	{
+	  /* Latin-1 text can always be converted to UTF-8, so this
+	     should not happen.  */
+	  DebugPrint ("iconv failed with: %s\n", strerror (errno));
+	  return False;
+	}
+
+      if (!inbytes)
+	{
+	  /* The chunk was completely converted.  */
+	  XFree (info->chunk);
+	  info->chunk = NULL;
+	}
+      else if (outbuf == start)
+	/* A character did not fit in the free space of the ring
+	   buffer.  Wait for some data to be written.  */
+	return True;
+    }
 
-  /* Complete the transfer itself.  */
-  CompleteDelayedTransfer (transfer);
+  return True;
 }
 
 static void
 NoticeConversionTransferWritable (int fd, void *data, WriteFd *writefd)
 {
+  ReadTransfer *transfer;
   ConversionTransferInfo *info;
   ssize_t written;
-  size_t outsize, nconv, start;
-  char *outbuf;
+  size_t size;
+
+  transfer = data;
+  info = GetTransferData (transfer);
 
-  /* The pipe is now writable.  First, try to write data from the
-     buffer to the file descriptor.  */
+  /* First, convert as much data as fits into the ring buffer.  */
+  if (!FillConversionBuffer (transfer, info))
+    {
+      DebugPrint ("Read or conversion failed\n");
 
-  info = GetTransferData (data);
+      close (info->fd);
+      info->fd = -1;
 
-  /* Skip the call to write if there is nothing to do.  */
+      StopConversionWrites (transfer, info);
+      return;
+    }
 
-  if (info->outsize)
+  if (!info->ring_used)
     {
-      written = write (info->fd, info->output_buffer,
-		       info->outsize);
+      /* Everything has been written.  Wait for either a new property
+	 to be set, or for ConversionFinishCallback to be called.  */
+      DebugPrint ("Removing conversion write callback\n");
+      StopConversionWrites (transfer, info);
+      return;
+    }
+
+  /* Next, write the contiguous data at the start of the ring
+     buffer.  */
+  size = MIN (info->ring_used,
+	      ConversionBufferSize - info->ring_start);
+  written = write (fd, info->ring + info->ring_start, size);
+
+  if (written < 0)
+    {
+      DebugPrint ("Some bytes could not be written: %s\n",
+		  strerror (errno));
+
+      /* Write failed with EAGAIN.  This might cause us to spin.  */
+      if (errno == EAGAIN)
+	return;
 
-      if (written == -1)
+      if (errno == EPIPE)
 	{
-	  DebugPrint ("write: %s\n", strerror (errno));
+	  /* The client closed the pipe.  Skip the rest of the property
+	     if it was not completely read, and stop writing.  */
+	  if (info->bytes_after || info->flags & NeedNewChunk)
+	    SkipChunk (transfer);
 
-	  if (errno == EAGAIN)
-	    /* Writing the data failed, so return.  This might cause us to
-	       spin.  */
-	    return;
+	  if (info->chunk)
+	    XFree (info->chunk);
 
-	  if (errno != EPIPE)
-	    {
-	      perror ("write");
-	      exit (1);
-	    }
+	  info->chunk = NULL;
+	  info->bytes_after = 0;
+	  info->ring_start = 0;
+	  info->ring_used = 0;
+	  info->flags &= ~NeedNewChunk;
 
-	  /* The other end of the pipe was closed by the client.  Stop
-	     this transfer.  */
-	  FinishConversionTransfer (data, info);
+	  close (info->fd);
+	  info->fd = -1;
+
+	  DebugPrint ("EPIPE recieved while writing converted data\n");
+
+	  StopConversionWrites (transfer, info);
 	  return;
 	}
 
-      /* Writing the data was successful.  Move the written part back to
-	 the start.  */
-      memmove (info->output_buffer, info->output_buffer + written,
-	       info->outsize - written);
-      info->outsize -= written;
+      perror ("write");
+      exit (1);
     }
 
-  /* Now, run iconv if there is still data in the input buffer.  */
-  if (info->buffer_size)
-    {
-      outbuf = info->output_buffer + info->outsize;
-      start = outsize = BUFSIZ - info->outsize;
-      nconv = iconv (info->cd, &info->position, &info->buffer_size,
-		     &outbuf, &outsize);
+  info->ring_start = (info->ring_start + written) % ConversionBufferSize;
+  info->ring_used -= written;
 
-      if (nconv == (size_t) -1 && errno != EINVAL)
-	{
-	  /* iconv failed for various reasons.  */
+  if (!info->ring_used)
+    /* Start filling the ring buffer from its beginning again, so that
+       as much contiguous space as possible is available.  */
+    info->ring_start = 0;
 
-	  if ((errno == E2BIG && outsize == BUFSIZ)
-	      || errno != E2BIG)
-	    {
-	      /* BUFSIZ is either too small to hold the output contents
-		 (which shouldn't happen), or some other error
-		 occured.  Punt.  */
-	      FinishConversionTransfer (data, info);
-	      return;
-	    }
-	}
+  DebugPrint ("%zd bytes were written; ring buffer is now %zu bytes"
+	      " full\n", written, info->ring_used);
+}
+
+static void
+ConversionReadCallback (ReadTransfer *transfer, Atom type, int format,
+			ptrdiff_t size)
+{
+  ConversionTransferInfo *info;
+
+  info = GetTransferData (transfer);
 
-      /* Increase the output buffer size by the amount that was was
-	 written.  */
-      info->outsize += start - outsize;
-      DebugPrint ("Output buffer is now %tu bytes full\n", info->outsize);
+  /* This is the start of a chunk.  If the fd was closed, simply skip
+     the chunk.  */
+  if (info->fd == -1)
+    {
+      SkipChunk (transfer);
+      return;
     }
-  else if (!info->outsize)
-    /* Everything has been written; finish the transfer.  */
-    FinishConversionTransfer (data, info);
+
+  /* Otherwise, read and convert the chunk once the file descriptor
+     becomes writable, and there is space in the ring buffer.  */
+  XLAssert (!(info->flags & NeedNewChunk));
+  info->flags |= NeedNewChunk;
+
+  if (!info->write_callback)
+    info->write_callback
+      = XLAddWriteFd (info->fd, transfer,
+		      NoticeConversionTransferWritable);
 }
 
 static Bool
@@ -1871,17 +2057,25 @@ ConversionFinishCallback (ReadTransfer *transfer, Bool success)
 {
   ConversionTransferInfo *info;
 
-  DebugPrint ("ConversionFinishCallback called; converting data in chunks.\n");
+  info = GetTransferData (transfer);
 
-  /* The conversion is complete.  Start the conversion and write the
-     correct amount of data into the pipe.  */
+  if (info->write_callback)
+    {
+      /* Converted data is still waiting to be written.  Delay
+	 finishing the transfer until it has been.  */
+      DebugPrint ("The conversion transfer finished, but the data was"
+		  " not yet completely written; the finish is being"
+		  " delayed.\n");
+      info->flags |= NeedDelayedFinish;
 
-  info = GetTransferData (transfer);
-  info->position = info->buffer;
+      return False;
+    }
 
-  info->write_callback = XLAddWriteFd (info->fd, transfer,
-				       NoticeConversionTransferWritable);
-  return False;
+  DebugPrint ("The conversion transfer finished %s\n",
+	      success ? "successfully" : "with failure");
+
+  FinishConversionTransfer (info);
+  return True;
 }
 
 static void
@@ -1932,7 +2126,10 @@ DragMimeTypeFromTarget (Atom target)
   if (string)
     XFree (string);
 
+  BeginRoundTrip ();
   string = XGetAtomName (compositor.display, target);
+  EndRoundTrip ("GetAtomName");
+
   return string;
 }
 
@@ -915,9 +915,11 @@ CurrentRootPosition (XdgRole *role, int *root_x, int *root_y)
       return;
     }
 
+  BeginRoundTrip ();
   XTranslateCoordinates (compositor.display, role->window,
 			 DefaultRootWindow (compositor.display),
 			 0, 0, root_x, root_y, &child_return);
+  EndRoundTrip ("TranslateCoordinates");
 }
 
 static void
@@ -77,6 +77,11 @@ enum
     MwmDecorAll		= (1L << 0),
   };
 
+enum
+  {
+    MaxPendingResizeAcks = 16,
+  };
+
 enum _How
   {
     Remove = 0,
@@ -238,6 +243,16 @@ struct _XdgToplevel
      StatePendingConfigureSize is set.  */
   int configure_width, configure_height;
 
+  /* The request serials of the resizes made by the compositor whose
+     ConfigureNotify events have not yet arrived, oldest first, and
+     their number.  */
+  unsigned long resize_ack_serials[MaxPendingResizeAcks];
+  int pending_resize_acks;
+
+  /* Timer that stops waiting for those events if the window system
+     does not send them in time.  */
+  Timer *resize_ack_timer;
+
   /* The number of seats that currently have this surface focused.  */
   int focus_seat_count;
 
@@ -374,6 +389,10 @@ DestroyBacking (XdgToplevel *toplevel)
   if (toplevel->configuration_timer)
     RemoveTimer (toplevel->configuration_timer);
 
+  /* Likewise for the resize acknowledgement timer.  */
+  if (toplevel->resize_ack_timer)
+    RemoveTimer (toplevel->resize_ack_timer);
+
   if (toplevel->parent_callback)
     CancelUnmapCallback (toplevel->parent_callback);
 
@@ -684,11 +703,13 @@ HandleWmStateChange (XdgToplevel *toplevel)
   window = XLWindowFromXdgRole (toplevel->role);
   state = &toplevel->toplevel_state;
 
+  BeginRoundTrip ();
   rc = XGetWindowProperty (compositor.display, window,
 			   _NET_WM_STATE, 0, 65536,
 			   False, XA_ATOM, &actual_type,
 			   &actual_format, &actual_size,
 			   &bytes_remaining, &tmp_data);
+  EndRoundTrip ("GetWindowProperty");
 
   if (rc != Success || !tmp_data
       || actual_type != XA_ATOM || actual_format != 32
@@ -796,11 +817,13 @@ HandleAllowedActionsChange (XdgToplevel *toplevel)
   tmp_data = NULL;
   window = XLWindowFromXdgRole (toplevel->role);
 
+  BeginRoundTrip ();
   rc = XGetWindowProperty (compositor.display, window,
 			   _NET_WM_ALLOWED_ACTIONS, 0, 65536,
 			   False, XA_ATOM, &actual_type,
 			   &actual_format, &actual_size,
 			   &bytes_remaining, &tmp_data);
+  EndRoundTrip ("GetWindowProperty");
 
   if (rc != Success || !tmp_data
       || actual_type != XA_ATOM || actual_format != 32
@@ -1119,9 +1142,10 @@ Attach (Role *role, XdgRoleImplementation *impl)
   XLDndWriteAwarenessProperty (window);
 }
 
-/* Forward declaration.  */
+/* Forward declarations.  */
 
 static void Unmap (XdgToplevel *);
+static void CancelResizeAcks (XdgToplevel *);
 
 static void
 Detach (Role *role, XdgRoleImplementation *impl)
@@ -1136,6 +1160,7 @@ Detach (Role *role, XdgRoleImplementation *impl)
 
   /* Next, undo everything that we changed on the window.  */
   toplevel->role = NULL;
+  CancelResizeAcks (toplevel);
 
   XSetWMProtocols (compositor.display,
 		   XLWindowFromXdgRole (role),
@@ -1188,6 +1213,9 @@ Unmap (XdgToplevel *toplevel)
     RemoveTimer (toplevel->configuration_timer);
   toplevel->configuration_timer = NULL;
 
+  /* Stop waiting for any resize to complete.  */
+  CancelResizeAcks (toplevel);
+
   XLListFree (toplevel->resize_callbacks,
 	      XLSeatCancelResizeCallback);
   toplevel->resize_callbacks = NULL;
@@ -1594,73 +1622,89 @@ HandleConfigureEvent (XdgToplevel *toplevel, XEvent *event)
   return True;
 }
 
-static Bool
-WindowResizedPredicate (Display *display, XEvent *event, XPointer data)
+static void
+CancelResizeAcks (XdgToplevel *toplevel)
 {
-  Role *role;
-  XdgToplevel *toplevel;
-  Window target_window;
+  toplevel->pending_resize_acks = 0;
 
-  toplevel = (XdgToplevel *) data;
-  role = toplevel->role;
-  target_window = XLWindowFromXdgRole (role);
+  if (toplevel->resize_ack_timer)
+    RemoveTimer (toplevel->resize_ack_timer);
+  toplevel->resize_ack_timer = NULL;
+}
 
-  if (event->type == ConfigureNotify
-      && event->xconfigure.window == target_window)
-    /* Extract the event from the event queue.  */
-    return True;
+static void
+NoteResizeAckTimeout (Timer *timer, void *data, struct timespec time)
+{
+  XdgToplevel *toplevel;
 
-  return False;
+  toplevel = data;
+
+  /* The window system did not send a ConfigureNotify event for every
+     resize within the timeout.  Treat subsequent ConfigureNotify
+     events normally.  */
+  CancelResizeAcks (toplevel);
 }
 
-static int
-IfEvent (XEvent *event_return, Bool (*predicate) (Display *,
-						  XEvent *,
-						  XPointer),
-	 XPointer arg, struct timespec timeout)
+static Bool
+IsResizeAck (XdgToplevel *toplevel, XEvent *event)
 {
-  struct timespec current_time, target;
-  int fd;
-  fd_set fds;
-
-  fd = ConnectionNumber (compositor.display);
-  current_time = CurrentTimespec ();
-  target = TimespecAdd (current_time, timeout);
+  /* A ConfigureNotify event is the reply to the oldest outstanding
+     resize if it was generated after the X server processed the
+     ConfigureWindow request for that resize.  The size cannot be
+     compared instead, since the window manager might not respect the
+     size that was asked for.  Events generated earlier (for example,
+     by a window manager move made before the resize) are handled
+     normally.  */
+  return (toplevel->pending_resize_acks
+	  && (event->xconfigure.serial
+	      >= toplevel->resize_ack_serials[0]));
+}
 
-  /* Check if an event is already in the queue.  If it is, avoid
-     syncing.  */
-  if (XCheckIfEvent (compositor.display, event_return,
-		     predicate, arg))
-    return 0;
+static void
+RetireResizeAcks (XdgToplevel *toplevel, unsigned long serial)
+{
+  int i;
 
-  while (true)
+  /* Remove each outstanding resize whose request was processed
+     before the event with SERIAL was generated.  If the window
+     manager handled several resizes at once, only one event will
+     arrive for all of them.  */
+  for (i = 0; i < toplevel->pending_resize_acks; ++i)
     {
-      /* Get events into the queue.  */
-      XSync (compositor.display, False);
+      if (toplevel->resize_ack_serials[i] > serial)
+	break;
+    }
 
-      /* Look for an event again.  */
-      if (XCheckIfEvent (compositor.display, event_return,
-			 predicate, arg))
-	return 0;
+  toplevel->pending_resize_acks -= i;
+  memmove (toplevel->resize_ack_serials,
+	   toplevel->resize_ack_serials + i,
+	   (toplevel->pending_resize_acks
+	    * sizeof *toplevel->resize_ack_serials));
+}
 
-      /* Calculate the timeout.  */
-      current_time = CurrentTimespec ();
-      timeout = TimespecSub (target, current_time);
+static Bool
+HandleResizeAck (XdgToplevel *toplevel, XEvent *event)
+{
+  /* This is the ConfigureNotify event following a resize made by the
+     compositor.  Make toplevel->width and toplevel->height right.  It
+     can happen that the window manager doesn't respect the width and
+     height (the main culprit seems to be height) chosen by us.  */
+  toplevel->width = event->xconfigure.width;
+  toplevel->height = event->xconfigure.height;
 
-      /* If not, wait for some input to show up on the X connection,
-	 or for the timeout to elapse.  */
-      FD_ZERO (&fds);
-      FD_SET (fd, &fds);
+  /* Both of these tell the frame clock about the event as well.  */
+  if (event->xconfigure.send_event)
+    XLXdgRoleNoteConfigure (toplevel->role, event);
+  else
+    XLXdgRoleReconstrain (toplevel->role, event);
+
+  RecordStateSize (toplevel);
+  RetireResizeAcks (toplevel, event->xconfigure.serial);
 
-      /* If this fails due to an IO error, XSync will call the IO
-	 error handler.  */
-      pselect (fd + 1, &fds, NULL, NULL, &timeout, NULL);
+  if (!toplevel->pending_resize_acks)
+    CancelResizeAcks (toplevel);
 
-      /* Timeout elapsed.  */
-      current_time = CurrentTimespec ();
-      if (TimespecCmp (target, current_time) < 0)
-	return 1;
-    }
+  return True;
 }
 
 static void
@@ -1708,38 +1752,33 @@ static void
 NoteWindowResized (Role *role, XdgRoleImplementation *impl,
 		   int width, int height)
 {
-  XEvent event;
-  int rc;
   XdgToplevel *toplevel;
 
   toplevel = ToplevelFromRoleImpl (impl);
 
   /* The window resized.  Don't allow ConfigureNotify events to pile
      up and mess up our view of what the window dimensions are by
-     waiting for the next ConfigureNotify event.  */
-
-  XFlush (compositor.display);
-
-  rc = IfEvent (&event, WindowResizedPredicate, (XPointer) impl,
-		/* Wait at most 0.5 ms in case the window system doesn't
-		   send a reply.  */
-		MakeTimespec (0, 500000000));
-
-  if (!rc)
-    {
-      /* Make these values right.  It can happen that the window
-	 manager doesn't respect the width and height (the main
-	 culprit seems to be height) chosen by us.  */
-      toplevel->width = event.xconfigure.width;
-      toplevel->height = event.xconfigure.height;
-
-      if (event.xconfigure.send_event)
-	XLXdgRoleNoteConfigure (toplevel->role, &event);
-      else
-	XLXdgRoleReconstrain (toplevel->role, &event);
-
-      RecordStateSize (toplevel);
-    }
+     treating the next ConfigureNotify event as the reply to this
+     resize.  That event is handled by HandleResizeAck once it arrives
+     through the event loop, so that other clients continue to be
+     serviced in the meantime.  The caller has just made the
+     ConfigureWindow request, so record its serial to recognize the
+     event.  If too many resizes are outstanding, forget the oldest
+     one.  */
+  if (toplevel->pending_resize_acks == MaxPendingResizeAcks)
+    RetireResizeAcks (toplevel, toplevel->resize_ack_serials[0]);
+
+  toplevel->resize_ack_serials[toplevel->pending_resize_acks++]
+    = NextRequest (compositor.display) - 1;
+
+  if (toplevel->resize_ack_timer)
+    RetimeTimer (toplevel->resize_ack_timer);
+  else
+    toplevel->resize_ack_timer
+      /* Wait at most 0.5 seconds in case the window system doesn't
+	 send a reply.  */
+      = AddTimer (NoteResizeAckTimeout, toplevel,
+		  MakeTimespec (0, 500000000));
 }
 
 static void
@@ -2450,7 +2489,7 @@ Activate (Role *role, XdgRoleImplementation *impl, int deviceid,
       CatchXErrors ();
       XISetFocus (compositor.display, deviceid,
 		  window, time);
-      UncatchXErrors (NULL);
+      UncatchXErrorsAsync (NULL, NULL);
     }
 }
 
@@ -2618,6 +2657,10 @@ XLHandleXEventForXdgToplevels (XEvent *event)
 
       toplevel = ToplevelFromRoleImpl (impl);
 
+      if (toplevel && toplevel->role
+	  && IsResizeAck (toplevel, event))
+	return HandleResizeAck (toplevel, event);
+
       if (toplevel && toplevel->role
 	  && toplevel->role->surface
 	  && toplevel->state & StateIsMapped)
@@ -19,6 +19,7 @@ along with 12to11.  If not, see <https://www.gnu.org/licenses/>.  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "compositor.h"
 
@@ -43,7 +44,33 @@ enum _ClientMemoryCategory
    received XErrorEvent into a provided buffer.
 
    This code is not reentrant since it doesn't have to take care of
-   many complicated scenarios that the Emacs code needs.  */
+   many complicated scenarios that the Emacs code needs.
+
+   Callers that do not need to know about errors immediately should
+   call UncatchXErrorsAsync instead of UncatchXErrors.  That does not
+   sync, but records the range of requests made since CatchXErrors in
+   an "error trap".  Errors generated by those requests are saved in
+   the trap, and once the X server is known to have processed the last
+   request in the range, the callback of the trap is run with the
+   first such error, or NULL if there was none.  */
+
+struct _XErrorTrap
+{
+  /* The first and last requests covered by this trap.  */
+  unsigned long first_request, last_request;
+
+  /* Function run once the trap completes, and its data.  */
+  void (*callback) (XErrorEvent *, void *);
+  void *data;
+
+  /* The first error generated by a request in the trap, if
+     error_caught.  */
+  XErrorEvent error;
+  Bool error_caught;
+
+  /* The next and last traps.  */
+  XErrorTrap *next, *last;
+};
 
 /* First request from which errors should be caught.  -1 if we are not
    currently catching errors.  */
@@ -69,6 +96,15 @@ static Bool inside_bad_alloc_handler;
 /* Clients that are pending disconnect.  */
 static XLList *pending_disconnect_clients;
 
+/* List of pending error traps, sorted by request.  */
+static XErrorTrap error_traps;
+
+/* The last request used to send a marker event to ourselves.  */
+static unsigned long last_marker_request;
+
+/* The window such marker events are sent to, or None.  */
+static Window marker_window;
+
 void
 CatchXErrors (void)
 {
@@ -77,7 +113,7 @@ CatchXErrors (void)
 }
 
 Bool
-UncatchXErrors (XErrorEvent *event)
+UncatchXErrorsAt (const char *caller, XErrorEvent *event)
 {
   /* Try to avoid syncing to obtain errors if we know none could have
      been generated, because either no request has been made, or all
@@ -86,8 +122,12 @@ UncatchXErrors (XErrorEvent *event)
        != XNextRequest (compositor.display) - 1)
       && (NextRequest (compositor.display)
 	  > first_error_req))
-    /* If none of those conditions apply, catch errors now.  */
-    XSync (compositor.display, False);
+    {
+      /* If none of those conditions apply, catch errors now.  */
+      XLBeginRoundTrip ();
+      XSync (compositor.display, False);
+      XLEndRoundTrip (caller, "Sync");
+    }
 
   first_error_req = -1;
 
@@ -101,6 +141,166 @@ UncatchXErrors (XErrorEvent *event)
   return True;
 }
 
+XErrorTrap *
+UncatchXErrorsAsync (void (*callback) (XErrorEvent *, void *),
+		     void *data)
+{
+  XErrorTrap *trap;
+  unsigned long next_request;
+
+  next_request = XNextRequest (compositor.display);
+
+  /* If no request has been made, or all requests have been processed,
+     then every error that could be generated has already been
+     caught.  Run the callback immediately.  */
+  if (next_request <= first_error_req
+      || (LastKnownRequestProcessed (compositor.display)
+	  == next_request - 1))
+    {
+      first_error_req = -1;
+
+      if (callback)
+	callback (error_caught ? &error : NULL, data);
+
+      return NULL;
+    }
+
+  trap = XLMalloc (sizeof *trap);
+  trap->first_request = first_error_req;
+  trap->last_request = next_request - 1;
+  trap->callback = callback;
+  trap->data = data;
+
+  /* Some errors may have been caught already, if something inside
+     the trap synced.  */
+  trap->error = error;
+  trap->error_caught = error_caught;
+
+  /* Link the trap onto the end of the list.  */
+  trap->next = &error_traps;
+  trap->last = error_traps.last;
+  error_traps.last->next = trap;
+  error_traps.last = trap;
+
+  first_error_req = -1;
+  return trap;
+}
+
+void
+CancelXErrorTrap (XErrorTrap *trap)
+{
+  /* The trap must stay around to catch errors until it completes, so
+     just clear its callback.  */
+  trap->callback = NULL;
+}
+
+static Bool
+SaveErrorForTrap (XErrorEvent *event)
+{
+  XErrorTrap *trap;
+
+  trap = error_traps.next;
+
+  while (trap != &error_traps)
+    {
+      /* The list is sorted, so there is no trap for this error if it
+	 precedes this one.  */
+      if (event->serial < trap->first_request)
+	return False;
+
+      if (event->serial <= trap->last_request)
+	{
+	  if (!trap->error_caught)
+	    {
+	      trap->error = *event;
+	      trap->error_caught = True;
+	    }
+
+	  return True;
+	}
+
+      trap = trap->next;
+    }
+
+  return False;
+}
+
+static void
+SendMarkerEvent (void)
+{
+  XSetWindowAttributes attrs;
+  XEvent event;
+
+  if (!marker_window)
+    {
+      /* Create an unmapped, InputOnly window, that is used to
+	 receive marker events.  */
+      attrs.override_redirect = True;
+      marker_window = XCreateWindow (compositor.display,
+				     DefaultRootWindow (compositor.display),
+				     -1, -1, 1, 1, 0, CopyFromParent,
+				     InputOnly, CopyFromParent,
+				     CWOverrideRedirect, &attrs);
+    }
+
+  memset (&event, 0, sizeof event);
+
+  event.xclient.type = ClientMessage;
+  event.xclient.window = marker_window;
+  event.xclient.message_type = _XL_ERROR_TRAP;
+  event.xclient.format = 32;
+
+  /* Receiving this event means that every request made before it was
+     processed, and that any errors they generated were received.  */
+  last_marker_request = XNextRequest (compositor.display);
+  XSendEvent (compositor.display, marker_window, False,
+	      NoEventMask, &event);
+}
+
+void
+ProcessXErrorTraps (void)
+{
+  XErrorTrap *trap;
+  unsigned long processed;
+
+  processed = LastKnownRequestProcessed (compositor.display);
+
+  /* Complete each trap whose last request has been processed.  */
+  while (error_traps.next != &error_traps
+	 && error_traps.next->last_request <= processed)
+    {
+      trap = error_traps.next;
+
+      /* Unlink the trap first, as the callback may make more
+	 traps.  */
+      trap->next->last = trap->last;
+      trap->last->next = trap->next;
+
+      if (trap->callback)
+	trap->callback (trap->error_caught ? &trap->error : NULL,
+			trap->data);
+
+      XLFree (trap);
+    }
+
+  /* If some traps are still pending, make sure the X server sends
+     something back after their last request, so that they complete
+     even if no other events arrive.  */
+  if (error_traps.last != &error_traps
+      && error_traps.last->last_request > last_marker_request)
+    SendMarkerEvent ();
+}
+
+Bool
+HandleOneXEventForXErrors (XEvent *event)
+{
+  /* Marker events need no handling of their own; receiving them
+     updates the last request processed, which is what completes error
+     traps.  */
+  return (event->type == ClientMessage
+	  && event->xclient.message_type == _XL_ERROR_TRAP);
+}
+
 void
 ReleaseClientData (ClientErrorData *data)
 {
@@ -393,6 +593,9 @@ ErrorHandler (Display *display, XErrorEvent *event)
       return 0;
     }
 
+  if (SaveErrorForTrap (event))
+    return 0;
+
   if (HandleErrorForPictureRenderer (event))
     return 0;
 
@@ -432,6 +635,10 @@ InitXErrors (void)
   first_error_req = -1;
   XSetErrorHandler (ErrorHandler);
 
+  /* Initialize the list of error traps.  */
+  error_traps.next = &error_traps;
+  error_traps.last = &error_traps;
+
   /* Allow debugging by setting an environment variable.  */
   if (getenv ("SYNCHRONIZE"))
     XSynchronize (compositor.display, True);
@@ -144,11 +144,13 @@ ReadSettingsData (void)
 
   /* Now read the actual property data.  */
   CatchXErrors ();
+  BeginRoundTrip ();
   rc = XGetWindowProperty (compositor.display, xsettings_window,
 			   _XSETTINGS_SETTINGS, 0, LONG_MAX, False,
 			   _XSETTINGS_SETTINGS, &actual_type,
 			   &actual_format, &nitems_return, &bytes_after,
 			   &prop_data);
+  EndRoundTrip ("GetWindowProperty");
   if (UncatchXErrors (NULL))
     {
       /* An error occured while reading property data.  This means
@@ -395,8 +397,10 @@ XLInitXSettings (void)
 	 exist.  */
       sprintf (buffer, "_XSETTINGS_S%d",
 	       DefaultScreen (compositor.display));
+      BeginRoundTrip ();
       xsettings_atom = XInternAtom (compositor.display, buffer,
 				    False);
+      EndRoundTrip ("InternAtom");
     }
 
   /* Reset the last change serial of all listeners, since the settings
@@ -407,8 +411,10 @@ XLInitXSettings (void)
   /* Grab the server, and get the value of the manager selection.  */
   XGrabServer (compositor.display);
 
+  BeginRoundTrip ();
   xsettings_window = XGetSelectionOwner (compositor.display,
 					 xsettings_atom);
+  EndRoundTrip ("GetSelectionOwner");
 
   /* If the settings window doesn't exist yet, select for MANAGER
      messages on the root window.  */